@@ -0,0 +1,131 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_BENCH_HH
+#define DEVCLIENT_BENCH_HH
+
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <device.hh>
+#include <ftsim.hh>
+
+/* Serial number of the simulated cable the scenarios run against */
+#define BENCH_SERIAL		"BENCH0"
+
+/* Bumped whenever the layout of the JSON results changes */
+#define BENCH_FORMAT		1
+
+struct BenchOptions
+{
+	bool quick = false;	/* smaller workloads, for CI runs */
+	bool skip_dtc = false;	/* skip what needs dtc instead of failing */
+};
+
+struct BenchMetric
+{
+	std::string name;
+	double value;
+	std::string unit;
+};
+
+/* Outcome of one scenario, as written to the results */
+struct BenchRecord
+{
+	std::string name;
+	std::string status;	/* "ok", "skipped" or "failed" */
+	std::string reason;
+	double wall_seconds;
+	double cpu_seconds;
+	std::vector<BenchMetric> metrics;
+};
+
+/* Thrown by Bench::skip() to end a scenario that cannot run here */
+class BenchSkipped: public std::runtime_error
+{
+public:
+	explicit BenchSkipped(const std::string &reason):
+	    std::runtime_error(reason)
+	{
+	}
+};
+
+/*
+ * Runs named scenarios one after another, each against a freshly
+ * attached FtdiSimulator, and collects what they report. Wall clock
+ * and CPU time of the whole process are recorded for every scenario.
+ */
+class Bench
+{
+public:
+	using Run = std::function<void(Bench &)>;
+
+	struct Scenario
+	{
+		std::string name;
+		std::string description;
+		Run run;
+	};
+
+	explicit Bench(const BenchOptions &options);
+
+	void add(const std::string &name, const std::string &description,
+	    const Run &run);
+	const std::vector<Scenario> &scenarios() const;
+
+	/* Scenarios whose name starts with one of filters, all if empty */
+	void run(const std::vector<std::string> &filters);
+	bool failed() const;
+	void write_json(FILE *out) const;
+
+	/* For use by a running scenario */
+	const BenchOptions &options() const;
+	std::shared_ptr<FtdiSimulator> cable() const;
+	Device device() const;
+	void report(const std::string &metric, double value,
+	    const std::string &unit);
+	[[noreturn]] void skip(const std::string &reason);
+
+protected:
+	BenchOptions m_options;
+	std::vector<Scenario> m_scenarios;
+	std::vector<BenchRecord> m_records;
+	std::shared_ptr<FtdiSimulator> m_cable;
+	std::string m_started;
+};
+
+/* Scenario groups, one per source file */
+void bench_eeprom(Bench &bench);
+void bench_uart(Bench &bench);
+void bench_device(Bench &bench);
+void bench_dts(Bench &bench);
+
+#endif //DEVCLIENT_BENCH_HH
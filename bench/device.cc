@@ -0,0 +1,138 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <chrono>
+#include <baudrate.hh>
+#include <device.hh>
+#include <gpio.hh>
+#include "bench.hh"
+
+static double
+seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return (std::chrono::duration<double>(
+	    std::chrono::steady_clock::now() - start).count());
+}
+
+/* One bitbang write per toggle, as the GPIO tab and -g do */
+static void
+gpio_toggle(Bench &bench)
+{
+	std::chrono::steady_clock::time_point start;
+	size_t count = bench.options().quick ? 20000 : 200000;
+	SimChannelStats stats;
+	double elapsed;
+	size_t i;
+
+	Gpio gpio(bench.device());
+
+	gpio.io_state = 0xff;
+	gpio.configure();
+	stats = bench.cable()->stats(INTERFACE_D);
+
+	start = std::chrono::steady_clock::now();
+	for (i = 0; i < count; i++)
+		gpio.set(i & 1);
+
+	elapsed = seconds_since(start);
+
+	if (bench.cable()->pins(INTERFACE_D) != ((count - 1) & 1))
+		throw std::runtime_error("pins do not match the last write");
+
+	bench.report("toggles_per_second", count / elapsed, "1/s");
+	bench.report("usb_writes",
+	    bench.cable()->stats(INTERFACE_D).writes - stats.writes, "count");
+}
+
+/*
+ * Full bus scans as done for every lookup without the registry, then
+ * lookups served from the hotplug registry where libusb allows it.
+ */
+static void
+device_enumerate(Bench &bench)
+{
+	std::chrono::steady_clock::time_point start;
+	size_t scans = bench.options().quick ? 5 : 20;
+	size_t lookups = 1000;
+	size_t found = 0;
+	size_t i;
+
+	start = std::chrono::steady_clock::now();
+	for (i = 0; i < scans; i++)
+		found = DeviceEnumerator::enumerate().size();
+
+	bench.report("scan_time", seconds_since(start) / scans * 1e3, "ms");
+	bench.report("devices", found, "count");
+
+	try {
+		DeviceRegistry::instance().start();
+	} catch (const std::runtime_error &err) {
+		return;
+	}
+
+	start = std::chrono::steady_clock::now();
+	for (i = 0; i < lookups; i++) {
+		if (!DeviceEnumerator::find_by_serial(BENCH_SERIAL))
+			throw std::runtime_error("simulated cable not found");
+	}
+
+	bench.report("cached_lookup_time", seconds_since(start) / lookups * 1e6,
+	    "us");
+	DeviceRegistry::instance().stop();
+}
+
+/* Divisor search for every rate the UART accepts, at a 1 kbaud step */
+static void
+baudrate_compute(Bench &bench)
+{
+	std::chrono::steady_clock::time_point start;
+	size_t count = 0;
+	size_t valid = 0;
+	int rate;
+
+	start = std::chrono::steady_clock::now();
+	for (rate = 300; rate <= BAUDRATE_H_MAX; rate += 1000) {
+		valid += BaudRate::compute(rate).valid();
+		count++;
+	}
+
+	bench.report("compute_time", seconds_since(start) / count * 1e9, "ns");
+	bench.report("rates", count, "count");
+	bench.report("valid_rates", valid, "count");
+}
+
+void
+bench_device(Bench &bench)
+{
+	bench.add("gpio_toggle", "toggle a GPIO pin through bitbang writes",
+	    gpio_toggle);
+	bench.add("device_enumerate", "bus scans and cached device lookups",
+	    device_enumerate);
+	bench.add("baudrate_compute", "baud rate divisor search",
+	    baudrate_compute);
+}
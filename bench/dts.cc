@@ -0,0 +1,731 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+#include <fmt/format.h>
+#include <giomm.h>
+#include <boardimages.hh>
+#include <eeprom/catalogue.hh>
+#include <fdt.hh>
+#include "bench.hh"
+
+/* A board description of the size usually kept in the cable eeprom */
+static const char *board_dts =
+    "/dts-v1/;\n"
+    "\n"
+    "/ {\n"
+    "\tmodel = \"Conclusive KSTR-SAMA5D27\";\n"
+    "\tcompatible = \"conclusive,kstr-sama5d27\", \"atmel,sama5d27\";\n"
+    "\t#address-cells = <1>;\n"
+    "\t#size-cells = <1>;\n"
+    "\n"
+    "\tboard {\n"
+    "\t\tserial-number = \"006/2019\";\n"
+    "\t\trevision = <2>;\n"
+    "\t\tmanufacture-date = \"2019-10-24\";\n"
+    "\t\tmac-address = [00 04 a3 12 34 56];\n"
+    "\t};\n"
+    "\n"
+    "\tmemory@20000000 {\n"
+    "\t\tdevice_type = \"memory\";\n"
+    "\t\treg = <0x20000000 0x10000000>;\n"
+    "\t};\n"
+    "\n"
+    "\tcable {\n"
+    "\t\tuart { baudrate = <115200>; format = \"8N1\"; };\n"
+    "\t\tjtag { speed-khz = <15000>; };\n"
+    "\t\tgpio { names = \"boot0\", \"boot1\", \"reset\", \"power\"; };\n"
+    "\t};\n"
+    "};\n";
+
+/* Sources both engines have to agree on, each with a feature of its own */
+static const struct
+{
+	const char *name;
+	const char *source;
+} bench_sources[] = {
+	{ "board", board_dts },
+
+	/* What the EEPROM tab starts from, then as a programmed cable */
+	{ "eeprom_default",
+	    "/dts-v1/;\n"
+	    "/ {\n"
+	    "\tmodel = \"UNNAMED\";\n"
+	    "\tserial = \"INVALID\";\n"
+	    "\tethaddr-eth0 = [00 00 00 00 00 00];\n"
+	    "};" },
+	{ "eeprom_programmed",
+	    "/dts-v1/;\n"
+	    "/ {\n"
+	    "\tmodel = \"Conclusive KSTR-SAMA5D27\";\n"
+	    "\tserial = \"006/2019\";\n"
+	    "\tethaddr-eth0 = [00 04 a3 12 34 56];\n"
+	    "};\n" },
+	{ "eeprom_blank",
+	    "/dts-v1/;\n"
+	    "/ {\n"
+	    "\tmodel = \"\";\n"
+	    "\tserial = \"\";\n"
+	    "\tethaddr-eth0 = [ff ff ff ff ff ff];\n"
+	    "};\n" },
+
+	{ "labels",
+	    "/dts-v1/;\n"
+	    "top: / {\n"
+	    "\tlabel_model: model = label_value: \"labelled\";\n"
+	    "\tcable: cable {\n"
+	    "\t\tuart: uart { baudrate = <115200>; };\n"
+	    "\t};\n"
+	    "};\n" },
+
+	{ "bits",
+	    "/dts-v1/;\n"
+	    "/ {\n"
+	    "\tbits8 = /bits/ 8 <0x12 0x34 'a' 0xff>;\n"
+	    "\tbits16 = /bits/ 16 <0x1234 0xffff 7>;\n"
+	    "\tbits32 = /bits/ 32 <0xdeadbeef>;\n"
+	    "\tbits64 = /bits/ 64 <0x123456789abcdef0 1>;\n"
+	    "\tmixed = \"str\", /bits/ 8 <1 2>, <3>, [04 05];\n"
+	    "};\n" },
+
+	{ "memreserve",
+	    "/dts-v1/;\n"
+	    "/memreserve/ 0x20000000 0x100000;\n"
+	    "/memreserve/ 0x3ff00000 0x00100000;\n"
+	    "/ {\n"
+	    "\tmodel = \"reserved\";\n"
+	    "};\n" },
+
+	/* Later definitions replace values in place and append the rest */
+	{ "merge",
+	    "/dts-v1/;\n"
+	    "/ {\n"
+	    "\tmodel = \"first\";\n"
+	    "\tserial = \"000/0000\";\n"
+	    "\tboard { revision = <1>; date = \"2019\"; };\n"
+	    "};\n"
+	    "/ {\n"
+	    "\tserial = \"006/2019\";\n"
+	    "\tcompatible = \"conclusive,kstr\";\n"
+	    "\tboard { revision = <2>; lot = <7>; };\n"
+	    "\tcable { jtag { speed-khz = <15000>; }; };\n"
+	    "};\n" },
+};
+
+static uint32_t
+blob_load32(const std::vector<uint8_t> &blob, size_t offset)
+{
+	return (blob.at(offset) << 24 | blob.at(offset + 1) << 16 |
+	    blob.at(offset + 2) << 8 | blob.at(offset + 3));
+}
+
+static void
+blob_store32(std::vector<uint8_t> &blob, size_t offset, uint32_t value)
+{
+	blob.at(offset) = value >> 24;
+	blob.at(offset + 1) = value >> 16;
+	blob.at(offset + 2) = value >> 8;
+	blob.at(offset + 3) = value;
+}
+
+/* How conversions were done before, by running dtc on a file */
+static std::string
+run_dtc(bool compile, const std::string &input)
+{
+	std::string path, output, errors;
+	int status;
+	int fd;
+
+	fd = Glib::file_open_tmp(path, "devclient-bench");
+	if (::write(fd, input.data(), input.size()) !=
+	    static_cast<ssize_t>(input.size())) {
+		::close(fd);
+		::unlink(path.c_str());
+		throw std::runtime_error("cannot write dtc input");
+	}
+
+	::close(fd);
+
+	try {
+		Glib::spawn_sync("/tmp", std::vector<std::string> {
+			"dtc", "-q",
+			"-I", compile ? "dts" : "dtb",
+			"-O", compile ? "dtb" : "dts",
+			path
+		}, Glib::SpawnFlags::SPAWN_SEARCH_PATH, Glib::SlotSpawnChildSetup(),
+		    &output, &errors, &status);
+	} catch (const Glib::Error &err) {
+		::unlink(path.c_str());
+		throw std::runtime_error(err.what());
+	}
+
+	::unlink(path.c_str());
+
+	if (status != 0)
+		throw std::runtime_error(fmt::format("dtc failed: {}", errors));
+
+	return (output);
+}
+
+static std::vector<uint8_t>
+dtc_compile(const std::string &source)
+{
+	std::string blob = run_dtc(true, source);
+
+	return (std::vector<uint8_t>(blob.begin(), blob.end()));
+}
+
+static std::string
+dtc_decompile(const std::vector<uint8_t> &blob)
+{
+	return (run_dtc(false, std::string(blob.begin(), blob.end())));
+}
+
+/* A missing dtc is a failure, unless asked to do without it */
+static void
+need_dtc(Bench &bench)
+{
+	if (bench.options().skip_dtc)
+		bench.skip("dtc scenarios skipped (-D)");
+
+	if (Glib::find_program_in_path("dtc").empty())
+		throw std::runtime_error("dtc not found, install it or run "
+		    "with -D");
+}
+
+static void
+dts_convert(Bench &bench, bool compile, bool external)
+{
+	std::chrono::steady_clock::time_point start;
+	std::vector<uint8_t> blob;
+	std::string source;
+	size_t rounds;
+	size_t i;
+
+	if (external) {
+		need_dtc(bench);
+		rounds = bench.options().quick ? 5 : 50;
+	} else
+		rounds = bench.options().quick ? 1000 : 20000;
+
+	blob = DeviceTree::from_dts(board_dts).to_dtb();
+	start = std::chrono::steady_clock::now();
+
+	for (i = 0; i < rounds; i++) {
+		if (compile && external)
+			blob = dtc_compile(board_dts);
+		else if (compile)
+			blob = DeviceTree::from_dts(board_dts).to_dtb();
+		else if (external)
+			source = dtc_decompile(blob);
+		else
+			source = DeviceTree::from_dtb(blob.data(),
+			    blob.size()).to_dts();
+	}
+
+	bench.report("time", std::chrono::duration<double>(
+	    std::chrono::steady_clock::now() - start).count() / rounds * 1e6,
+	    "us");
+	bench.report("dtb_size", blob.size(), "B");
+}
+
+/*
+ * Blobs both readers have to refuse, each made by breaking one thing
+ * in a good one. The structure block starts with the root node and its
+ * empty name, followed by the first property.
+ */
+static const struct
+{
+	const char *name;
+	std::function<void(std::vector<uint8_t> &)> corrupt;
+} bench_malformed[] = {
+	{ "bad_magic", [](std::vector<uint8_t> &blob) {
+		blob_store32(blob, 0, FDT_MAGIC + 1);
+	} },
+	{ "short_header", [](std::vector<uint8_t> &blob) {
+		blob.resize(FDT_HEADER_SIZE - 4);
+	} },
+	{ "truncated", [](std::vector<uint8_t> &blob) {
+		blob.resize(blob.size() - 4);
+	} },
+	{ "struct_offset", [](std::vector<uint8_t> &blob) {
+		blob_store32(blob, 8, blob.size() + 4);
+	} },
+	{ "strings_offset", [](std::vector<uint8_t> &blob) {
+		blob_store32(blob, 12, blob.size() + 4);
+	} },
+	{ "struct_size", [](std::vector<uint8_t> &blob) {
+		blob_store32(blob, 36, blob.size());
+	} },
+	{ "no_end_token", [](std::vector<uint8_t> &blob) {
+		blob_store32(blob, 36, blob_load32(blob, 36) - 4);
+	} },
+	/* Read from the strings block, which has no all zero entry */
+	{ "rsvmap_unterminated", [](std::vector<uint8_t> &blob) {
+		blob_store32(blob, 16, blob_load32(blob, 12));
+	} },
+	{ "no_root", [](std::vector<uint8_t> &blob) {
+		blob_store32(blob, blob_load32(blob, 8), FDT_END_NODE);
+	} },
+	{ "unknown_token", [](std::vector<uint8_t> &blob) {
+		blob_store32(blob, blob_load32(blob, 8) + 8, 0x7);
+	} },
+	{ "property_overrun", [](std::vector<uint8_t> &blob) {
+		blob_store32(blob, blob_load32(blob, 8) + 12, blob.size());
+	} },
+	{ "name_offset", [](std::vector<uint8_t> &blob) {
+		blob_store32(blob, blob_load32(blob, 8) + 16, blob.size());
+	} },
+};
+
+/*
+ * Both engines have to agree on the blob, and each one's source output
+ * has to compile back to it with the other. The text itself is not
+ * compared, dtc versions differ in how they print cells.
+ */
+static void
+dts_roundtrip_source(const char *name, const std::string &source)
+{
+	std::vector<uint8_t> native, external;
+
+	native = DeviceTree::from_dts(source).to_dtb();
+	external = dtc_compile(source);
+	if (native != external)
+		throw std::runtime_error(fmt::format("{}: compiled blobs differ "
+		    "({} bytes native, {} bytes dtc)", name, native.size(),
+		    external.size()));
+
+	if (dtc_compile(DeviceTree::from_dtb(native.data(),
+	    native.size()).to_dts()) != native)
+		throw std::runtime_error(fmt::format("{}: dtc does not read "
+		    "native DTS output back to the same blob", name));
+
+	if (DeviceTree::from_dts(dtc_decompile(native)).to_dtb() != native)
+		throw std::runtime_error(fmt::format("{}: dtc DTS output does "
+		    "not compile back to the same blob", name));
+}
+
+static bool
+refused(const std::function<void()> &read)
+{
+	try {
+		read();
+	} catch (const std::runtime_error &err) {
+		return (true);
+	}
+
+	return (false);
+}
+
+/* The in process reader has to throw where dtc gives up, not crash */
+static void
+dts_roundtrip_malformed(const std::vector<uint8_t> &good)
+{
+	std::vector<uint8_t> blob;
+
+	for (const auto &i: bench_malformed) {
+		blob = good;
+		i.corrupt(blob);
+
+		if (!refused([&blob] {
+			DeviceTree::from_dtb(blob.data(), blob.size());
+		    }))
+			throw std::runtime_error(fmt::format("{}: malformed "
+			    "blob was read", i.name));
+
+		if (!refused([&blob] { dtc_decompile(blob); }))
+			throw std::runtime_error(fmt::format("{}: dtc reads the "
+			    "blob the in process reader refuses", i.name));
+	}
+}
+
+static void
+dts_roundtrip(Bench &bench)
+{
+	need_dtc(bench);
+
+	for (const auto &i: bench_sources)
+		dts_roundtrip_source(i.name, i.source);
+
+	/* Broken from the EEPROM tab's default */
+	dts_roundtrip_malformed(DeviceTree::from_dts(
+	    bench_sources[1].source).to_dtb());
+
+	bench.report("sources", std::size(bench_sources), "count");
+	bench.report("malformed_blobs", std::size(bench_malformed), "count");
+}
+
+/* Fails unless fn throws a std::runtime_error that mentions what */
+static void
+expect_error(const std::string &check, const std::string &what,
+    const std::function<void()> &fn)
+{
+	try {
+		fn();
+	} catch (const std::runtime_error &err) {
+		if (std::string(err.what()).find(what) == std::string::npos)
+			throw std::runtime_error(fmt::format("{}: '{}' does "
+			    "not say '{}'", check, err.what(), what));
+
+		return;
+	}
+
+	throw std::runtime_error(fmt::format("{}: no error", check));
+}
+
+/* The value of the first "property = ...;" in a source, replaced */
+static void
+replace_value(std::string &source, const std::string &property,
+    const std::string &value)
+{
+	size_t start = source.find(property + " = ");
+	size_t end;
+
+	if (start == std::string::npos)
+		throw std::runtime_error(fmt::format("no {} to replace",
+		    property));
+
+	start += property.size() + 3;
+	end = source.find(';', start);
+	source.replace(start, end - start, value);
+}
+
+/*
+ * Fields in four nodes, of every type, rendered with values shorter
+ * and longer than in the template, each against a full compile.
+ */
+static size_t
+dts_template_sizes()
+{
+	const char *serials[] = { "", "0", "006/201", "006/2019", "0006/2019",
+	    "KSTR-SAMA5D27-006/2019-rev2-longer-than-a-cell" };
+	std::vector<std::vector<uint8_t>> values(5);
+	std::vector<uint8_t> image;
+	std::string source, model, revision, format;
+	DtbTemplate tmpl(DeviceTree::from_dts(board_dts));
+	size_t checks = 0;
+	size_t i, j;
+
+	tmpl.add_field("model");
+	tmpl.add_field("/board/serial-number");
+	tmpl.add_field("/board/mac-address");
+	tmpl.add_field("/board/revision");
+	tmpl.add_field("/cable/uart/format");
+
+	for (i = 0; i < std::size(serials); i++) {
+		model = std::string(i * 7, 'm');
+		revision = i == 0 ? "" : fmt::format("{}", i);
+		for (j = 1; j < i % 4; j++)
+			revision += fmt::format(" {:#x}", i * j);
+
+		format = i % 2 ? "8N1" : "7E1 with a note";
+
+		values[0] = tmpl.encode(0, model);
+		values[1] = tmpl.encode(1, serials[i]);
+		values[2] = tmpl.encode(2, fmt::format("00-04-a3-00-00-{:02x}",
+		    i));
+		values[3] = tmpl.encode(3, revision);
+		values[4] = tmpl.encode(4, format);
+		tmpl.render(values, image);
+
+		source = board_dts;
+		replace_value(source, "model", "\"" + model + "\"");
+		replace_value(source, "serial-number",
+		    fmt::format("\"{}\"", serials[i]));
+		replace_value(source, "mac-address",
+		    fmt::format("[00 04 a3 00 00 {:02x}]", i));
+		replace_value(source, "revision", "<" + revision + ">");
+		replace_value(source, "format", "\"" + format + "\"");
+
+		if (DeviceTree::from_dts(source).to_dtb() != image)
+			throw std::runtime_error(fmt::format("serial '{}': "
+			    "patched image differs from a full compile",
+			    serials[i]));
+
+		checks++;
+	}
+
+	return (checks);
+}
+
+/* Bad values are refused, and source types are kept as written */
+static size_t
+dts_template_errors()
+{
+	std::vector<std::vector<uint8_t>> values(2);
+	std::vector<uint8_t> image;
+	DtbTemplate tmpl(DeviceTree::from_dts(board_dts));
+	DtbTemplate typed(DeviceTree::from_dts(
+	    "/dts-v1/;\n"
+	    "/ {\n"
+	    "\tserial = \"\";\n"
+	    "\tkey = [00 11 22 33 44 55 66 77];\n"
+	    "};\n"));
+	size_t mac, revision, serial;
+	size_t checks = 0;
+
+	mac = tmpl.add_field("/board/mac-address");
+	revision = tmpl.add_field("/board/revision");
+	serial = tmpl.add_field("/board/serial-number");
+
+	expect_error("short MAC", "is not 6 bytes",
+	    [&] { tmpl.encode(mac, "00:04:a3"); });
+	expect_error("long MAC", "is not 6 bytes",
+	    [&] { tmpl.encode(mac, "00:04:a3:12:34:56:78"); });
+	expect_error("MAC digits", "is not hex bytes",
+	    [&] { tmpl.encode(mac, "00:04:a3:12:34:5g"); });
+	expect_error("cell text", "is not a 32-bit cell",
+	    [&] { tmpl.encode(revision, "two"); });
+	expect_error("cell range", "is not a 32-bit cell",
+	    [&] { tmpl.encode(revision, "0x100000000"); });
+	expect_error("string NUL", "cannot contain NUL",
+	    [&] { tmpl.encode(serial, std::string("006\0/2019", 9)); });
+	expect_error("no property", "has no property /board/serial",
+	    [&] { tmpl.add_field("/board/serial"); });
+	expect_error("value count", "3 fields, 2 values",
+	    [&] { tmpl.render(values, image); });
+	checks += 8;
+
+	/* Eight bytes are not cells, nor an empty string a byte */
+	values[0] = typed.encode(typed.add_field("serial"), "006/2019");
+	values[1] = typed.encode(typed.add_field("key"),
+	    "88:99:aa:bb:cc:dd:ee:ff");
+	typed.render(values, image);
+	if (image != DeviceTree::from_dts(
+	    "/dts-v1/;\n"
+	    "/ {\n"
+	    "\tserial = \"006/2019\";\n"
+	    "\tkey = [88 99 aa bb cc dd ee ff];\n"
+	    "};\n").to_dtb())
+		throw std::runtime_error("typed fields: patched image differs "
+		    "from a full compile");
+
+	expect_error("bytes as cells", "is not 8 bytes",
+	    [&] { typed.encode(1, "1 2"); });
+	checks += 2;
+
+	return (checks);
+}
+
+/*
+ * Per-board images from a compiled template, with serials and MACs
+ * patched in. Before timing, images with fields that grow and shrink
+ * are checked against full compiles, and bad values have to be refused.
+ */
+static void
+dts_template(Bench &bench)
+{
+	std::chrono::steady_clock::time_point start;
+	std::vector<std::vector<uint8_t>> values(2);
+	std::vector<uint8_t> image;
+	std::string serial, mac, source;
+	DtbTemplate tmpl(DeviceTree::from_dts(board_dts));
+	size_t rounds = bench.options().quick ? 10000 : 200000;
+	size_t checks;
+	size_t i;
+
+	checks = dts_template_sizes();
+	checks += dts_template_errors();
+
+	tmpl.add_field("/board/serial-number");
+	tmpl.add_field("/board/mac-address");
+	start = std::chrono::steady_clock::now();
+
+	for (i = 0; i < rounds; i++) {
+		serial = fmt::format("{:03}/2019", i % 1000);
+		mac = fmt::format("00:04:a3:{:02x}:{:02x}:{:02x}",
+		    (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+		values[0] = tmpl.encode(0, serial);
+		values[1] = tmpl.encode(1, mac);
+		tmpl.render(values, image);
+	}
+
+	bench.report("images_per_second", rounds /
+	    std::chrono::duration<double>(
+	    std::chrono::steady_clock::now() - start).count(), "1/s");
+
+	source = board_dts;
+	replace_value(source, "serial-number", "\"" + serial + "\"");
+	std::replace(mac.begin(), mac.end(), ':', ' ');
+	replace_value(source, "mac-address", "[" + mac + "]");
+	if (DeviceTree::from_dts(source).to_dtb() != image)
+		throw std::runtime_error("patched image differs from a "
+		    "full compile");
+
+	bench.report("checks", checks + 1, "count");
+	bench.report("dtb_size", image.size(), "B");
+}
+
+/* Images by name, as the command line writes them for a CSV file */
+static std::map<std::string, std::vector<uint8_t>>
+board_images(const DeviceTree &tree, const std::string &csv,
+    const std::string &eeprom = EEPROM_DEFAULT_MODEL)
+{
+	std::map<std::string, std::vector<uint8_t>> ret;
+	std::istringstream in(csv);
+	BoardImages images(tree, EepromModel::find(eeprom));
+
+	images.generate(in, "boards.csv", [&ret](const std::string &name,
+	    const std::vector<uint8_t> &image) {
+		ret[name] = image;
+	});
+
+	return (ret);
+}
+
+/*
+ * The -G/-M path on the EEPROM tab's schema: quoting, file names,
+ * comments, the part size, and errors pointing at the right line.
+ */
+static void
+dts_board_images(Bench &bench)
+{
+	std::map<std::string, std::vector<uint8_t>> images;
+	DeviceTree tree = DeviceTree::from_dts(bench_sources[1].source);
+	std::vector<uint8_t> blob;
+	size_t checks = 0;
+
+	images = board_images(tree,
+	    "serial,model,ethaddr-eth0,image\r\n"
+	    "006/2019,\"KSTR \"\"rev 2\"\", SAMA5D27\",00:04:a3:12:34:56,"
+	    "first.dtb\r\n"
+	    "# not a board\n"
+	    "\n"
+	    "007/2019,plain,00-04-a3-12-34-57,second.dtb\n");
+
+	if (images.size() != 2 || images["first.dtb"] != DeviceTree::from_dts(
+	    "/dts-v1/;\n"
+	    "/ {\n"
+	    "\tmodel = \"KSTR \\\"rev 2\\\", SAMA5D27\";\n"
+	    "\tserial = \"006/2019\";\n"
+	    "\tethaddr-eth0 = [00 04 a3 12 34 56];\n"
+	    "};\n").to_dtb() || images["second.dtb"] != DeviceTree::from_dts(
+	    "/dts-v1/;\n"
+	    "/ {\n"
+	    "\tmodel = \"plain\";\n"
+	    "\tserial = \"007/2019\";\n"
+	    "\tethaddr-eth0 = [00 04 a3 12 34 57];\n"
+	    "};\n").to_dtb())
+		throw std::runtime_error("quoted CSV: images differ from full "
+		    "compiles");
+
+	checks++;
+
+	images = board_images(tree, "serial\n006/2019\n");
+	if (images.count("006_2019.dtb") != 1)
+		throw std::runtime_error("image not named after the serial");
+
+	checks++;
+
+	expect_error("same name", "boards.csv:3: 006_2019.dtb is written "
+	    "for line 2 already", [&] {
+		board_images(tree, "serial\n006/2019\n006_2019\n");
+	    });
+	expect_error("path in name", "boards.csv:2: image name '../x.dtb'",
+	    [&] { board_images(tree, "serial,image\n006/2019,../x.dtb\n"); });
+	expect_error("short row", "boards.csv:4: 2 columns, the header has 3",
+	    [&] {
+		board_images(tree, "serial,model,ethaddr-eth0\n"
+		    "006/2019,m,00:04:a3:12:34:56\n"
+		    "# next\n"
+		    "007/2019,m\n");
+	    });
+	expect_error("long row", "boards.csv:2: 4 columns, the header has 3",
+	    [&] {
+		board_images(tree, "serial,model,ethaddr-eth0\n"
+		    "006/2019,m,00:04:a3:12:34:56,x\n");
+	    });
+	expect_error("open quote", "boards.csv:3: unterminated quote", [&] {
+		board_images(tree, "serial,model\n006/2019,m\n"
+		    "007/2019,\"m\n");
+	});
+	expect_error("bad value", "boards.csv:2: /ethaddr-eth0:", [&] {
+		board_images(tree, "ethaddr-eth0\n00:04:a3\n");
+	});
+	expect_error("part size", "boards.csv:2: 354 bytes do not fit a 24c02",
+	    [&] {
+		board_images(tree, "model\n" + std::string(200, 'm') + "\n",
+		    "24c02");
+	    });
+	expect_error("no property", "boards.csv:1: Template has no property "
+	    "/serial-number", [&] { board_images(tree, "serial-number\n"); });
+	expect_error("column type", "boards.csv:1: serial: type 'text'",
+	    [&] { board_images(tree, "serial:text\n"); });
+	checks += 9;
+
+	/* A compiled template only has guessed types, a column can say */
+	blob = DeviceTree::from_dts(
+	    "/dts-v1/;\n"
+	    "/ {\n"
+	    "\tkey = [00 11 22 33 44 55 66 77];\n"
+	    "};\n").to_dtb();
+	tree = DeviceTree::from_dtb(blob.data(), blob.size());
+
+	images = board_images(tree, "key:bytes,image\n"
+	    "88:99:aa:bb:cc:dd:ee:ff,key.dtb\n");
+	if (images["key.dtb"] != DeviceTree::from_dts(
+	    "/dts-v1/;\n"
+	    "/ {\n"
+	    "\tkey = [88 99 aa bb cc dd ee ff];\n"
+	    "};\n").to_dtb())
+		throw std::runtime_error("typed column: image differs from a "
+		    "full compile");
+
+	expect_error("guessed type", "boards.csv:2: /key: '88:99",
+	    [&] { board_images(tree, "key\n88:99:aa:bb:cc:dd:ee:ff\n"); });
+	checks += 2;
+
+	bench.report("checks", checks, "count");
+}
+
+void
+bench_dts(Bench &bench)
+{
+	bench.add("dts_compile", "board DTS to DTB in process",
+	    [](Bench &bench) { dts_convert(bench, true, false); });
+	bench.add("dts_decompile", "board DTB back to DTS in process",
+	    [](Bench &bench) { dts_convert(bench, false, false); });
+	bench.add("dts_compile_dtc", "board DTS to DTB by running dtc",
+	    [](Bench &bench) { dts_convert(bench, true, true); });
+	bench.add("dts_decompile_dtc", "board DTB back to DTS by running dtc",
+	    [](Bench &bench) { dts_convert(bench, false, true); });
+	bench.add("dts_template", "per-board images patched into a template",
+	    dts_template);
+	bench.add("dts_board_images", "per-board images from a CSV file",
+	    dts_board_images);
+	bench.add("dts_roundtrip", "in process and dtc conversions agree, "
+	    "malformed blobs are refused by both",
+	    dts_roundtrip);
+}
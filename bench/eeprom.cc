@@ -0,0 +1,235 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+#include <fmt/format.h>
+#include <i2c.hh>
+#include <eeprom/24c.hh>
+#include <eeprom/24csim.hh>
+#include <i2crecorder.hh>
+#include "bench.hh"
+
+/*
+ * The simulated bus answers at once, so these measure the host side:
+ * MPSSE batching, ACK polling against the part's real write cycle time
+ * and the number of USB transfers it all takes.
+ */
+static void
+eeprom_4k(Bench &bench, bool write)
+{
+	const EepromModel &model = EepromModel::find(EEPROM_DEFAULT_MODEL);
+	Eeprom24cSim target(model, std::chrono::milliseconds(model.write_cycle));
+	std::chrono::steady_clock::time_point start;
+	std::vector<uint8_t> data(model.size);
+	std::vector<uint8_t> result;
+	SimChannelStats stats;
+	double elapsed;
+	size_t i;
+
+	for (i = 0; i < data.size(); i++)
+		data[i] = i * 7 + (i >> 8);
+
+	bench.cable()->attach_i2c(&target);
+
+	I2C i2c(bench.device(), model.max_clock);
+	Eeprom24c eeprom(i2c, model);
+
+	if (!write)
+		eeprom.write(0, data);
+
+	stats = bench.cable()->stats(INTERFACE_A);
+	start = std::chrono::steady_clock::now();
+
+	if (write)
+		eeprom.write(0, data);
+	else
+		eeprom.read(0, data.size(), result);
+
+	elapsed = std::chrono::duration<double>(
+	    std::chrono::steady_clock::now() - start).count();
+
+	if (write ? target.memory() != data : result != data)
+		throw std::runtime_error("data read back does not match");
+
+	bench.report("seconds", elapsed, "s");
+	bench.report("throughput", data.size() / elapsed, "B/s");
+	bench.report("usb_writes",
+	    bench.cable()->stats(INTERFACE_A).writes - stats.writes, "count");
+	bench.report("usb_reads",
+	    bench.cable()->stats(INTERFACE_A).reads - stats.reads, "count");
+
+	if (write) {
+		bench.report("write_cycles", target.cycles(), "count");
+		bench.report("busy_naks", target.naks(), "count");
+	}
+
+	bench.cable()->attach_i2c(nullptr);
+}
+
+/* Delay the driver used to sleep after every page before ACK polling */
+#define EEPROM_FIXED_PAGE_DELAY	std::chrono::milliseconds(50)
+
+/*
+ * ACK polling against the part's real write cycle time, compared with
+ * the fixed delay it replaced. The fixed delay cost is the measured
+ * transfer time plus one delay per page, which is what the old loop
+ * spent. Polling can never beat the part's write cycle, so the run also
+ * checks that it does not return early.
+ */
+static void
+eeprom_ack_polling(Bench &bench)
+{
+	const EepromModel &model = EepromModel::find(EEPROM_DEFAULT_MODEL);
+	Eeprom24cSim target(model, std::chrono::milliseconds(model.write_cycle));
+	std::chrono::steady_clock::time_point start;
+	std::vector<uint8_t> data(bench.options().quick ? model.size / 4 :
+	    model.size);
+	I2CRecorder recorder(model.max_clock);
+	double elapsed, transfer, minimum, fixed;
+	size_t pages;
+	size_t i;
+
+	for (i = 0; i < data.size(); i++)
+		data[i] = i * 5 + 3;
+
+	recorder.attach(&target);
+	Eeprom24c eeprom(recorder, model);
+	pages = data.size() / model.page_size;
+
+	/* Transfer time alone, against a part that never gets busy */
+	{
+		Eeprom24cSim instant(model, std::chrono::microseconds(0));
+
+		recorder.attach(&instant);
+		start = std::chrono::steady_clock::now();
+		eeprom.write(0, data);
+		transfer = std::chrono::duration<double>(
+		    std::chrono::steady_clock::now() - start).count();
+		recorder.attach(&target);
+	}
+
+	start = std::chrono::steady_clock::now();
+	eeprom.write(0, data);
+	elapsed = std::chrono::duration<double>(
+	    std::chrono::steady_clock::now() - start).count();
+
+	if (target.memory() != data)
+		throw std::runtime_error("data read back does not match");
+
+	minimum = pages * std::chrono::duration<double>(
+	    std::chrono::milliseconds(model.write_cycle)).count();
+	if (elapsed < minimum)
+		throw std::runtime_error(fmt::format("{} pages written in "
+		    "{:.3f} s, faster than the {} ms write cycle allows",
+		    pages, elapsed, model.write_cycle));
+
+	fixed = transfer + pages * std::chrono::duration<double>(
+	    EEPROM_FIXED_PAGE_DELAY).count();
+
+	bench.report("polled_seconds", elapsed, "s");
+	bench.report("fixed_delay_seconds", fixed, "s");
+	bench.report("speedup", fixed / elapsed, "x");
+	bench.report("busy_naks", target.naks(), "count");
+}
+
+/*
+ * Programs a part through I2CRecorder and reads it back byte by byte
+ * the way the pre-transaction code did, which used to need a dummy read
+ * in front of the data. The recorded MPSSE stream is then replayed into
+ * a blank part, which must end up with the same contents and return the
+ * same bytes.
+ */
+static void
+i2c_replay(Bench &bench)
+{
+	const EepromModel &model = EepromModel::find(EEPROM_DEFAULT_MODEL);
+	Eeprom24cSim target(model, std::chrono::microseconds(0));
+	Eeprom24cSim replayed(model, std::chrono::microseconds(0));
+	std::vector<uint8_t> data(3 * model.page_size + 5);
+	std::vector<uint8_t> result, response;
+	I2CRecorder recorder(model.max_clock);
+	MpsseI2CBus bus;
+	size_t i;
+
+	for (i = 0; i < data.size(); i++)
+		data[i] = i * 13 + 1;
+
+	recorder.attach(&target);
+	Eeprom24c eeprom(recorder, model);
+	eeprom.write(7, data);
+
+	recorder.start();
+	recorder.write({ model.address, 0, 7 });
+	recorder.start();
+	recorder.write({ static_cast<uint8_t>(model.address | 0x01) });
+	recorder.read(data.size(), result);
+	recorder.stop();
+
+	if (result != data)
+		throw std::runtime_error("data read back does not match");
+
+	if (recorder.unread() != 0)
+		throw std::runtime_error(fmt::format(
+		    "{} response bytes left unread", recorder.unread()));
+
+	bus.attach(&replayed);
+	bus.feed(recorder.stream().data(), recorder.stream().size());
+	response.resize(bus.pending());
+	bus.take(response.data(), response.size());
+
+	if (replayed.memory() != target.memory())
+		throw std::runtime_error("replayed part contents differ");
+
+	if (response.size() < data.size() ||
+	    !std::equal(data.begin(), data.end(),
+	    response.end() - data.size()))
+		throw std::runtime_error("replayed read returned other data");
+
+	bench.report("stream_bytes", recorder.stream().size(), "B");
+	bench.report("usb_writes", recorder.writes(), "count");
+	bench.report("usb_reads", recorder.reads(), "count");
+}
+
+void
+bench_eeprom(Bench &bench)
+{
+	bench.add("eeprom_write_4k", "write a 4 KiB 24C32 through I2C",
+	    [](Bench &bench) { eeprom_4k(bench, true); });
+
+	bench.add("eeprom_read_4k", "read a 4 KiB 24C32 through I2C",
+	    [](Bench &bench) { eeprom_4k(bench, false); });
+
+	bench.add("eeprom_ack_polling", "4 KiB 24C32 write, ACK polling "
+	    "against a fixed page delay", eeprom_ack_polling);
+
+	bench.add("i2c_recorder_replay", "replay a recorded I2C stream into "
+	    "a blank 24C32", i2c_replay);
+}
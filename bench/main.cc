@@ -0,0 +1,353 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <sysexits.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <fmt/format.h>
+#include <giomm.h>
+#include <log.hh>
+#include <logsink.hh>
+#include "bench.hh"
+
+static const struct option long_options[] = {
+	{ "skip-dtc", no_argument, nullptr, 'D' },
+	{ "help", no_argument, nullptr, 'h' },
+	{ "list", no_argument, nullptr, 'l' },
+	{ "output", required_argument, nullptr, 'o' },
+	{ "quick", no_argument, nullptr, 'q' },
+	{ "log-level", required_argument, nullptr, 'v' },
+	{ nullptr, 0, nullptr, 0}
+};
+
+static std::string
+json_string(const std::string &str)
+{
+	std::string ret = "\"";
+
+	for (char c: str) {
+		if (c == '"' || c == '\\')
+			ret += '\\';
+
+		if (static_cast<unsigned char>(c) < 0x20) {
+			ret += fmt::format("\\u{:04x}", c);
+			continue;
+		}
+
+		ret += c;
+	}
+
+	return (ret + "\"");
+}
+
+/* JSON has no NaN or infinity */
+static std::string
+json_number(double value)
+{
+	if (!std::isfinite(value))
+		return ("null");
+
+	return (fmt::format("{}", value));
+}
+
+static double
+cpu_seconds()
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+	    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6);
+}
+
+Bench::Bench(const BenchOptions &options):
+	m_options(options)
+{
+	char buf[32];
+	time_t now = time(nullptr);
+
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+	m_started = buf;
+}
+
+void
+Bench::add(const std::string &name, const std::string &description,
+    const Run &run)
+{
+	m_scenarios.push_back({ name, description, run });
+}
+
+const std::vector<Bench::Scenario> &
+Bench::scenarios() const
+{
+	return (m_scenarios);
+}
+
+void
+Bench::run(const std::vector<std::string> &filters)
+{
+	std::chrono::steady_clock::time_point start;
+	double cpu;
+	bool selected;
+
+	for (const auto &i: m_scenarios) {
+		selected = filters.empty();
+		for (const auto &j: filters)
+			selected |= i.name.compare(0, j.size(), j) == 0;
+
+		if (!selected)
+			continue;
+
+		fmt::print(stderr, "{}: ", i.name);
+		std::fflush(stderr);
+
+		/* Every scenario starts from a cable in its power-on state */
+		FtdiSimulator::detach(BENCH_SERIAL);
+		m_cable = FtdiSimulator::attach(BENCH_SERIAL);
+		m_records.push_back({ i.name, "ok", "", 0, 0, {} });
+
+		start = std::chrono::steady_clock::now();
+		cpu = cpu_seconds();
+
+		try {
+			i.run(*this);
+		} catch (const BenchSkipped &err) {
+			m_records.back().status = "skipped";
+			m_records.back().reason = err.what();
+		} catch (const std::exception &err) {
+			m_records.back().status = "failed";
+			m_records.back().reason = err.what();
+		}
+
+		m_records.back().cpu_seconds = cpu_seconds() - cpu;
+		m_records.back().wall_seconds = std::chrono::duration<double>(
+		    std::chrono::steady_clock::now() - start).count();
+
+		fmt::print(stderr, "{}{}{} ({:.2f} s)\n", m_records.back().status,
+		    m_records.back().reason.empty() ? "" : ": ",
+		    m_records.back().reason, m_records.back().wall_seconds);
+	}
+
+	m_cable.reset();
+	FtdiSimulator::detach(BENCH_SERIAL);
+}
+
+bool
+Bench::failed() const
+{
+	for (const auto &i: m_records) {
+		if (i.status == "failed")
+			return (true);
+	}
+
+	return (false);
+}
+
+void
+Bench::write_json(FILE *out) const
+{
+	char host[256] = "";
+	size_t i, j;
+
+	gethostname(host, sizeof(host) - 1);
+
+	fmt::print(out, "{{\n");
+	fmt::print(out, "  \"suite\": \"devclient_bench\",\n");
+	fmt::print(out, "  \"format\": {},\n", BENCH_FORMAT);
+	fmt::print(out, "  \"started\": {},\n", json_string(m_started));
+	fmt::print(out, "  \"host\": {},\n", json_string(host));
+	fmt::print(out, "  \"cpus\": {},\n", std::thread::hardware_concurrency());
+	fmt::print(out, "  \"quick\": {},\n", m_options.quick);
+	fmt::print(out, "  \"scenarios\": [");
+
+	for (i = 0; i < m_records.size(); i++) {
+		const BenchRecord &record = m_records[i];
+
+		fmt::print(out, "{}\n    {{\n", i == 0 ? "" : ",");
+		fmt::print(out, "      \"name\": {},\n", json_string(record.name));
+		fmt::print(out, "      \"status\": {},\n",
+		    json_string(record.status));
+		if (!record.reason.empty())
+			fmt::print(out, "      \"reason\": {},\n",
+			    json_string(record.reason));
+
+		fmt::print(out, "      \"wall_seconds\": {},\n",
+		    json_number(record.wall_seconds));
+		fmt::print(out, "      \"cpu_seconds\": {},\n",
+		    json_number(record.cpu_seconds));
+		fmt::print(out, "      \"metrics\": [");
+
+		for (j = 0; j < record.metrics.size(); j++) {
+			const BenchMetric &metric = record.metrics[j];
+
+			fmt::print(out, "{}\n        {{ \"name\": {}, "
+			    "\"value\": {}, \"unit\": {} }}", j == 0 ? "" : ",",
+			    json_string(metric.name), json_number(metric.value),
+			    json_string(metric.unit));
+		}
+
+		fmt::print(out, "{}]\n    }}", record.metrics.empty() ?
+		    "" : "\n      ");
+	}
+
+	fmt::print(out, "\n  ]\n}}\n");
+}
+
+const BenchOptions &
+Bench::options() const
+{
+	return (m_options);
+}
+
+std::shared_ptr<FtdiSimulator>
+Bench::cable() const
+{
+	return (m_cable);
+}
+
+Device
+Bench::device() const
+{
+	return (m_cable->device());
+}
+
+void
+Bench::report(const std::string &metric, double value, const std::string &unit)
+{
+	m_records.back().metrics.push_back({ metric, value, unit });
+}
+
+void
+Bench::skip(const std::string &reason)
+{
+	throw BenchSkipped(reason);
+}
+
+static void
+usage(const std::string &argv0)
+{
+	fmt::print("usage: {:s} [options] [scenario prefix...]\n", argv0);
+	fmt::print("-D:		skip the scenarios that run dtc, they fail without it\n");
+	fmt::print("-h:		this help message\n");
+	fmt::print("-l:		list scenarios\n");
+	fmt::print("-o:		write the JSON results to a file instead of stdout\n");
+	fmt::print("		example: -o bench.json\n");
+	fmt::print("-q:		smaller workloads, for CI runs\n");
+	fmt::print("-v:		log level: debug, info, warning, error or none, default warning\n");
+}
+
+int
+main(int argc, char *const argv[])
+{
+	BenchOptions options;
+	std::vector<std::string> filters;
+	std::string output;
+	bool list = false;
+	FILE *out = stdout;
+	int ch;
+
+	/* Results go to stdout, so keep log messages off it */
+	Logger::add_sink(std::make_shared<StdoutSink>(stderr));
+	Logger::set_level(LogLevel::WARNING);
+
+	for (;;) {
+		ch = getopt_long(argc, argv, "Dhlo:qv:", long_options, nullptr);
+		if (ch == -1)
+			break;
+
+		switch (ch) {
+		case 'D':
+			options.skip_dtc = true;
+			break;
+		case 'l':
+			list = true;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'q':
+			options.quick = true;
+			break;
+		case 'v':
+			try {
+				Logger::set_level(Logger::parse_level(optarg));
+			} catch (const std::runtime_error &err) {
+				Logger::error("{}", err.what());
+				return (EX_USAGE);
+			}
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return (EX_USAGE);
+		}
+	}
+
+	for (int i = optind; i < argc; i++)
+		filters.push_back(argv[i]);
+
+	Gio::init();
+
+	Bench bench(options);
+
+	bench_eeprom(bench);
+	bench_uart(bench);
+	bench_device(bench);
+	bench_dts(bench);
+
+	if (list) {
+		for (const auto &i: bench.scenarios())
+			fmt::print("{:<28} {}\n", i.name, i.description);
+
+		return (0);
+	}
+
+	if (!output.empty()) {
+		out = std::fopen(output.c_str(), "w");
+		if (out == nullptr) {
+			Logger::error("Cannot open {}: {}", output,
+			    strerror(errno));
+			return (EX_CANTCREAT);
+		}
+	}
+
+	bench.run(filters);
+	bench.write_json(out);
+
+	if (out != stdout)
+		std::fclose(out);
+
+	return (bench.failed() ? 1 : 0);
+}
@@ -0,0 +1,498 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <fmt/format.h>
+#include <uart.hh>
+#include "bench.hh"
+
+/* Console clients of a scenario wait this long for the data at most */
+#define BENCH_UART_TIMEOUT	std::chrono::seconds(30)
+
+/*
+ * Telnet clients of the console server, all served by the calling
+ * thread. The greeting each client gets on connect is not counted.
+ */
+class BenchClients
+{
+public:
+	BenchClients(uint16_t port, size_t count, size_t greeting);
+	virtual ~BenchClients();
+
+	/* Reads whatever arrives within the timeout */
+	void poll(std::chrono::milliseconds timeout);
+	void send(size_t client, const uint8_t *buf, size_t len);
+
+	/* Whether every client has had its greeting */
+	bool greeted() const;
+	uint64_t received(size_t client) const;
+	uint64_t least_received() const;
+	uint64_t total_received() const;
+
+protected:
+	std::vector<int> m_fds;
+	std::vector<uint64_t> m_received;
+	std::vector<uint8_t> m_buffer;
+	size_t m_greeting;
+};
+
+BenchClients::BenchClients(uint16_t port, size_t count, size_t greeting):
+	m_received(count, 0),
+	m_buffer(64 * 1024),
+	m_greeting(greeting)
+{
+	struct sockaddr_in addr = {};
+	int one = 1;
+	size_t i;
+	int fd;
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (i = 0; i < count; i++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr *>(
+		    &addr), sizeof(addr)) != 0) {
+			if (fd >= 0)
+				close(fd);
+
+			throw std::runtime_error(fmt::format(
+			    "Cannot connect client {}: {}", i, strerror(errno)));
+		}
+
+		/* Every send is its own segment, like keystrokes are */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		m_fds.push_back(fd);
+	}
+}
+
+BenchClients::~BenchClients()
+{
+	for (int fd: m_fds)
+		close(fd);
+}
+
+void
+BenchClients::poll(std::chrono::milliseconds timeout)
+{
+	std::vector<struct pollfd> fds(m_fds.size());
+	ssize_t ret;
+	size_t i;
+
+	for (i = 0; i < m_fds.size(); i++)
+		fds[i] = { m_fds[i], POLLIN, 0 };
+
+	if (::poll(fds.data(), fds.size(), timeout.count()) <= 0)
+		return;
+
+	for (i = 0; i < fds.size(); i++) {
+		if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+			continue;
+
+		while ((ret = recv(m_fds[i], m_buffer.data(), m_buffer.size(),
+		    0)) > 0)
+			m_received[i] += ret;
+	}
+}
+
+/* Keeps reading while the server holds back input */
+void
+BenchClients::send(size_t client, const uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = ::send(m_fds[client], buf + done, len - done, MSG_NOSIGNAL);
+		if (ret < 0 && errno != EAGAIN)
+			throw std::runtime_error(fmt::format("Cannot send: {}",
+			    strerror(errno)));
+
+		if (ret > 0) {
+			done += ret;
+			continue;
+		}
+
+		poll(std::chrono::milliseconds(1));
+	}
+}
+
+bool
+BenchClients::greeted() const
+{
+	for (uint64_t i: m_received) {
+		if (i < m_greeting)
+			return (false);
+	}
+
+	return (true);
+}
+
+uint64_t
+BenchClients::received(size_t client) const
+{
+	return (m_received[client] - std::min<uint64_t>(m_received[client],
+	    m_greeting));
+}
+
+uint64_t
+BenchClients::least_received() const
+{
+	uint64_t ret = UINT64_MAX;
+	size_t i;
+
+	for (i = 0; i < m_received.size(); i++)
+		ret = std::min(ret, received(i));
+
+	return (ret);
+}
+
+uint64_t
+BenchClients::total_received() const
+{
+	uint64_t ret = 0;
+	size_t i;
+
+	for (i = 0; i < m_received.size(); i++)
+		ret += received(i);
+
+	return (ret);
+}
+
+/* A UART console on the simulated cable with clients connected to it */
+class BenchConsole
+{
+public:
+	BenchConsole(Bench &bench, int baudrate, const UartOptions &options,
+	    size_t clients);
+
+	Uart &uart();
+	BenchClients &clients();
+
+protected:
+	static uint16_t free_port();
+
+	std::unique_ptr<Uart> m_uart;
+	std::unique_ptr<BenchClients> m_clients;
+	std::atomic<size_t> m_connected;
+};
+
+BenchConsole::BenchConsole(Bench &bench, int baudrate,
+    const UartOptions &options, size_t clients):
+	m_connected(0)
+{
+	std::chrono::steady_clock::time_point deadline;
+	Device device = bench.device();
+	uint16_t port = free_port();
+	size_t greeting;
+
+	m_uart = std::make_unique<Uart>(device,
+	    Gio::InetSocketAddress::create(
+	    Gio::InetAddress::create("127.0.0.1"), port),
+	    baudrate, options);
+
+	m_uart->m_connected.connect(
+	    [this](Glib::RefPtr<Gio::SocketAddress>) { m_connected++; });
+
+	m_uart->start();
+
+	/* Telnet negotiation (6 bytes) and the banner, see Uart */
+	greeting = fmt::format("\xFF\xFB\x01\xFF\xFB\x03==> Connected to {} "
+	    "{} <==\r\n", device.description, device.serial).size();
+
+	m_clients = std::make_unique<BenchClients>(port, clients, greeting);
+
+	deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (m_connected < clients || !m_clients->greeted()) {
+		if (std::chrono::steady_clock::now() > deadline)
+			throw std::runtime_error(fmt::format(
+			    "only {} of {} clients were served",
+			    m_connected, clients));
+
+		m_clients->poll(std::chrono::milliseconds(10));
+	}
+}
+
+Uart &
+BenchConsole::uart()
+{
+	return (*m_uart);
+}
+
+BenchClients &
+BenchConsole::clients()
+{
+	return (*m_clients);
+}
+
+uint16_t
+BenchConsole::free_port()
+{
+	struct sockaddr_in addr = {};
+	socklen_t len = sizeof(addr);
+	int fd;
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, reinterpret_cast<struct sockaddr *>(&addr),
+	    sizeof(addr)) != 0 || getsockname(fd,
+	    reinterpret_cast<struct sockaddr *>(&addr), &len) != 0) {
+		if (fd >= 0)
+			close(fd);
+
+		throw std::runtime_error(fmt::format(
+		    "Cannot find a free TCP port: {}", strerror(errno)));
+	}
+
+	close(fd);
+	return (ntohs(addr.sin_port));
+}
+
+static double
+seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return (std::chrono::duration<double>(
+	    std::chrono::steady_clock::now() - start).count());
+}
+
+static double
+cpu_seconds(int who)
+{
+	struct rusage usage;
+
+	getrusage(who, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+	    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6);
+}
+
+/*
+ * Target output at 3 Mbaud fanned out to every client. The line rate
+ * is the ceiling; falling short of it shows that the receive path or
+ * the fan-out cannot keep up, a skipped byte fails the scenario.
+ *
+ * The clients run on this thread, so the CPU time of the UART threads
+ * is that of the process, less this thread, while the data flows.
+ */
+static void
+uart_throughput(Bench &bench, size_t nclients)
+{
+	const int baudrate = 3000000;
+	UartOptions options = UartOptions::for_baudrate(baudrate);
+	std::chrono::steady_clock::time_point start;
+	std::vector<uint8_t> data;
+	double process_cpu, thread_cpu;
+	uint64_t missed;
+	size_t size;
+	double elapsed;
+	size_t i;
+
+	options.scrollback = 0;
+	BenchConsole console(bench, baudrate, options, nclients);
+	BenchClients &clients = console.clients();
+
+	/* 1 s (4 s) worth of output at 8N1 */
+	size = baudrate / 10 * (bench.options().quick ? 1 : 4);
+	data.resize(size);
+	for (i = 0; i < size; i++)
+		data[i] = 0x20 + i % 0x5f;
+
+	start = std::chrono::steady_clock::now();
+	process_cpu = cpu_seconds(RUSAGE_SELF);
+	thread_cpu = cpu_seconds(RUSAGE_THREAD);
+	bench.cable()->uart_inject(data.data(), data.size());
+
+	while (clients.least_received() < size &&
+	    std::chrono::steady_clock::now() - start < BENCH_UART_TIMEOUT)
+		clients.poll(std::chrono::milliseconds(10));
+
+	elapsed = seconds_since(start);
+	process_cpu = cpu_seconds(RUSAGE_SELF) - process_cpu;
+	thread_cpu = cpu_seconds(RUSAGE_THREAD) - thread_cpu;
+	missed = size * nclients -
+	    std::min<uint64_t>(clients.total_received(), size * nclients);
+
+	bench.report("clients", nclients, "count");
+	bench.report("seconds", elapsed, "s");
+	bench.report("throughput_per_client", size / elapsed, "B/s");
+	bench.report("line_rate", baudrate / 10.0, "B/s");
+	bench.report("bytes_missed", missed, "B");
+	bench.report("usb_transfers", console.uart().rx_stats().transfers,
+	    "count");
+	bench.report("uart_cpu_seconds", process_cpu - thread_cpu, "s");
+
+	if (missed != 0)
+		throw std::runtime_error(fmt::format("{} of {} bytes did not "
+		    "reach the clients", missed, size * nclients));
+}
+
+/*
+ * Round trip of single keystrokes through the console server, the
+ * transmit queue and the loopback at 115200 baud, with the other
+ * clients watching the echo.
+ */
+static void
+uart_echo_latency(Bench &bench, size_t nclients)
+{
+	const int baudrate = 115200;
+	UartOptions options = UartOptions::for_baudrate(baudrate);
+	std::chrono::steady_clock::time_point start;
+	std::vector<double> samples;
+	size_t rounds = bench.options().quick ? 100 : 500;
+	uint64_t expect;
+	uint8_t key;
+	size_t i;
+
+	options.scrollback = 0;
+	BenchConsole console(bench, baudrate, options, nclients);
+	BenchClients &clients = console.clients();
+
+	for (i = 0; i < rounds; i++) {
+		key = 'a' + i % 26;
+		expect = clients.received(0) + 1;
+		start = std::chrono::steady_clock::now();
+		clients.send(0, &key, 1);
+
+		while (clients.received(0) < expect) {
+			if (std::chrono::steady_clock::now() - start >
+			    std::chrono::seconds(1))
+				throw std::runtime_error(fmt::format(
+				    "echo {} did not come back", i));
+
+			clients.poll(std::chrono::milliseconds(10));
+		}
+
+		samples.push_back(seconds_since(start) * 1e6);
+	}
+
+	std::sort(samples.begin(), samples.end());
+	bench.report("clients", nclients, "count");
+	bench.report("rounds", rounds, "count");
+	bench.report("latency_p50", samples[samples.size() / 2], "us");
+	bench.report("latency_p99", samples[samples.size() * 99 / 100], "us");
+	bench.report("latency_max", samples.back(), "us");
+}
+
+/*
+ * A client pastes data in short writes, as a terminal does, and reads
+ * the echo back through the loopback. Run with and without transmit
+ * coalescing to compare the number of USB writes it takes.
+ */
+static void
+uart_paste(Bench &bench, int baudrate, size_t size, size_t piece)
+{
+	const char *modes[] = { "coalesced", "uncoalesced" };
+	std::chrono::steady_clock::time_point start;
+	std::vector<uint8_t> data(size);
+	TxQueueStats stats;
+	double elapsed;
+	size_t i, j;
+
+	for (i = 0; i < size; i++)
+		data[i] = 0x20 + i % 0x5f;
+
+	for (j = 0; j < 2; j++) {
+		UartOptions options = UartOptions::for_baudrate(baudrate);
+
+		options.scrollback = 0;
+		if (j == 1)
+			options.tx_flush_delay = std::chrono::microseconds(0);
+
+		BenchConsole console(bench, baudrate, options, 1);
+		BenchClients &clients = console.clients();
+
+		start = std::chrono::steady_clock::now();
+		for (i = 0; i < size; i += piece)
+			clients.send(0, &data[i], std::min(piece, size - i));
+
+		while (clients.received(0) < size &&
+		    std::chrono::steady_clock::now() - start <
+		    BENCH_UART_TIMEOUT)
+			clients.poll(std::chrono::milliseconds(10));
+
+		elapsed = seconds_since(start);
+		stats = console.uart().tx_stats();
+
+		if (clients.received(0) < size)
+			throw std::runtime_error(fmt::format(
+			    "{}: {} of {} bytes came back", modes[j],
+			    clients.received(0), size));
+
+		bench.report(fmt::format("{}_seconds", modes[j]), elapsed, "s");
+		bench.report(fmt::format("{}_throughput", modes[j]),
+		    size / elapsed, "B/s");
+		bench.report(fmt::format("{}_usb_writes", modes[j]),
+		    stats.writes, "count");
+		bench.report(fmt::format("{}_bytes_per_write", modes[j]),
+		    stats.writes ? double(stats.bytes) / stats.writes : 0, "B");
+	}
+}
+
+void
+bench_uart(Bench &bench)
+{
+	for (size_t n: { 1, 10, 100 }) {
+		bench.add(fmt::format("uart_throughput_{}", n), fmt::format(
+		    "3 Mbaud target output to {} client(s)", n),
+		    [n](Bench &bench) { uart_throughput(bench, n); });
+	}
+
+	for (size_t n: { 1, 10 }) {
+		bench.add(fmt::format("uart_echo_latency_{}", n), fmt::format(
+		    "keystroke echo round trip with {} client(s)", n),
+		    [n](Bench &bench) { uart_echo_latency(bench, n); });
+	}
+
+	bench.add("uart_paste_64k", "64 KiB pasted in 64 byte writes, "
+	    "echoed at 921600 baud", [](Bench &bench) {
+		uart_paste(bench, 921600, 64 * 1024, 64);
+	    });
+
+	bench.add("uart_loopback_12m", "client data looped back at 12 Mbaud",
+	    [](Bench &bench) {
+		uart_paste(bench, 12000000, bench.options().quick ?
+		    256 * 1024 : 1024 * 1024, 4096);
+	    });
+}
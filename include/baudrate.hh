@@ -0,0 +1,64 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_BAUDRATE_HH
+#define DEVCLIENT_BAUDRATE_HH
+
+#include <cstdint>
+
+/* Hi-speed parts (FT2232H, FT4232H, FT232H) top out at 120 MHz / 10 */
+#define BAUDRATE_H_CLOCK	120000000
+#define BAUDRATE_H_MAX		(BAUDRATE_H_CLOCK / 10)
+
+/* Legacy 3 MHz base clock, used by H parts for the lowest rates */
+#define BAUDRATE_CLOCK		48000000
+
+/*
+ * Baud rate divisor as programmed by libftdi's ftdi_set_baudrate() on a
+ * hi-speed part, mirroring its arithmetic so that the rate the chip will
+ * actually run at is known before the channel is opened.
+ */
+struct BaudRate
+{
+	int requested;
+	int actual;
+	uint32_t divisor;	/* encoded divisor, value and index bits */
+
+	static BaudRate compute(int rate);
+
+	/* Relative deviation of the actual rate from the requested one */
+	double error() const;
+
+	/*
+	 * Whether libftdi will accept the rate at all, by the same integer
+	 * comparison: from about 4.8% below the requested rate to 5% above
+	 */
+	bool valid() const;
+};
+
+#endif //DEVCLIENT_BAUDRATE_HH
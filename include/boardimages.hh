@@ -0,0 +1,66 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_BOARDIMAGES_HH
+#define DEVCLIENT_BOARDIMAGES_HH
+
+#include <functional>
+#include <istream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <eeprom/catalogue.hh>
+#include <fdt.hh>
+
+/*
+ * EEPROM images for a batch of boards, patched into a compiled template
+ * from a CSV file with one board per row. The header row names the
+ * template properties to set, such as serial or ethaddr-eth0, each
+ * optionally with the type its values are in: "ethaddr-eth0:bytes".
+ * A column called "image" gives the file name, which otherwise comes
+ * from the first column; two rows cannot name the same file. Errors
+ * throw std::runtime_error starting with "<csv>:<line>: ".
+ */
+class BoardImages
+{
+public:
+	using Sink = std::function<void(const std::string &name,
+	    const std::vector<uint8_t> &image)>;
+
+	BoardImages(const DeviceTree &tree, const EepromModel &model);
+
+	/* Calls sink once per board, returns how many there were */
+	size_t generate(std::istream &csv, const std::string &csv_name,
+	    const Sink &sink);
+
+protected:
+	DeviceTree m_tree;
+	EepromModel m_model;
+};
+
+#endif //DEVCLIENT_BOARDIMAGES_HH
@@ -0,0 +1,150 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_CAPTURE_HH
+#define DEVCLIENT_CAPTURE_HH
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <ring.hh>
+
+#define CAPTURE_MAGIC		"DEVCAP01"
+
+/* A seek index entry is written at most this often */
+#define CAPTURE_INDEX_INTERVAL	std::chrono::seconds(1)
+
+/* Largest RX chunk stored as one record */
+#define CAPTURE_CHUNK		(64 * 1024)
+
+enum class CaptureDirection: uint8_t
+{
+	RX = 0,
+	TX = 1
+};
+
+/*
+ * A capture is two append-only files: <path> holds a header followed
+ * by records, each a CaptureRecord and its payload; <path>.idx holds
+ * a CaptureIndexEntry every CAPTURE_INDEX_INTERVAL pointing at the
+ * first record written after it. Times are nanoseconds since the
+ * start field of the header, which is wall clock time since the epoch.
+ * All fields are in host byte order.
+ */
+struct CaptureHeader
+{
+	char magic[8];
+	uint64_t start;
+};
+
+struct CaptureRecord
+{
+	uint64_t time;
+	uint32_t len;
+	uint8_t direction;
+	uint8_t reserved[3];
+};
+
+struct CaptureIndexEntry
+{
+	uint64_t time;
+	uint64_t offset;
+};
+
+/*
+ * Always-on recorder of a UART session: follows the console ring on its
+ * own thread like any other reader, so nothing is lost when no client
+ * is connected and a slow disk never holds up the USB side. Appends to
+ * an existing capture, keeping its time base.
+ */
+class CaptureWriter
+{
+public:
+	CaptureWriter(const std::string &path, ByteRing &ring);
+	virtual ~CaptureWriter();
+
+	void start();
+	void stop();
+
+	/* Records bytes sent to the device, callable from any thread */
+	void write_tx(const uint8_t *buf, size_t len);
+
+	uint64_t bytes() const;
+	uint64_t lost() const;
+
+protected:
+	void append(CaptureDirection direction, const uint8_t *buf,
+	    size_t len);
+	uint64_t now() const;
+	void worker();
+
+	std::string m_path;
+	ByteRing &m_ring;
+	RingReader m_reader;
+	FILE *m_file;
+	FILE *m_index;
+	uint64_t m_base;
+	uint64_t m_next_index;
+	std::chrono::steady_clock::time_point m_session;
+	std::mutex m_lock;
+	std::thread m_thread;
+	std::atomic<bool> m_running;
+	std::atomic<uint64_t> m_bytes;
+	std::atomic<uint64_t> m_lost;
+};
+
+class CaptureReader
+{
+public:
+	explicit CaptureReader(const std::string &path);
+	virtual ~CaptureReader();
+
+	/* Positions the reader at the first record at or after time */
+	void seek(uint64_t time);
+	bool next(CaptureRecord &record, std::vector<uint8_t> &data);
+	uint64_t start() const;
+
+	/*
+	 * Writes records from [from, to) to out as text, each line of
+	 * output prefixed with the time it was received. TX data is
+	 * shown on lines of its own.
+	 */
+	void export_text(uint64_t from, uint64_t to, FILE *out);
+
+protected:
+	std::string m_path;
+	FILE *m_file;
+	CaptureHeader m_header;
+};
+
+#endif //DEVCLIENT_CAPTURE_HH
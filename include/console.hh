@@ -0,0 +1,150 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_CONSOLE_HH
+#define DEVCLIENT_CONSOLE_HH
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/socket.h>
+#include <eventloop.hh>
+#include <metrics.hh>
+#include <ring.hh>
+
+class ConsoleClient
+{
+public:
+	ConsoleClient(ByteRing &ring, size_t scrollback):
+	    m_fd(-1),
+	    m_address_len(0),
+	    m_reader(ring, scrollback),
+	    m_offset(0),
+	    m_blocked(false)
+	{
+	}
+
+	int m_fd;
+	struct sockaddr_storage m_address;
+	socklen_t m_address_len;
+	std::string m_name;
+	RingReader m_reader;
+	/* Greeting, sent ahead of the console output */
+	std::vector<uint8_t> m_pending;
+	size_t m_offset;
+	bool m_blocked;
+	/* Only set when the server has metric labels */
+	std::shared_ptr<MetricCounter> m_bytes_in;
+	std::shared_ptr<MetricCounter> m_bytes_out;
+	std::shared_ptr<MetricCounter> m_bytes_lost;
+};
+
+/*
+ * TCP front end of a console: accepts any number of clients on a single
+ * event loop and streams the ring contents to each of them using
+ * non-blocking sockets. Bytes typed by clients are handed to m_input.
+ */
+class ConsoleServer
+{
+public:
+	using Input = std::function<void(const uint8_t *, size_t)>;
+	using Notify = std::function<void(const ConsoleClient &)>;
+
+	ConsoleServer(EventLoop &loop, ByteRing &ring,
+	    const struct sockaddr *addr, socklen_t addrlen);
+	virtual ~ConsoleServer();
+
+	void start();
+	void stop();
+
+	/* Producer side: new data has been published to the ring */
+	void notify();
+
+	void set_greeting(const std::string &greeting);
+	void set_lag_policy(RingLagPolicy policy);
+
+	/*
+	 * Bytes of earlier output replayed to each new client after the
+	 * greeting, bounded by half the ring size.
+	 */
+	void set_scrollback(size_t bytes);
+	size_t clients() const;
+
+	/*
+	 * Exports the client count and per client byte counters under
+	 * these labels, plus a "client" label with the peer address.
+	 * Call before start().
+	 */
+	void set_metrics(const MetricLabels &labels);
+
+	/*
+	 * Stops (or resumes) reading from client sockets, so that TCP
+	 * flow control pushes back on the senders. Callable from any thread.
+	 */
+	void pause_input(bool paused);
+
+	Input m_input;
+	Notify m_connected;
+	Notify m_disconnected;
+
+protected:
+	void accept_ready(uint32_t events);
+	void client_ready(const std::shared_ptr<ConsoleClient> &client,
+	    uint32_t events);
+	void flush();
+	bool pump(const std::shared_ptr<ConsoleClient> &client);
+	size_t fetch(ConsoleClient &client, const uint8_t *&data,
+	    size_t &skipped);
+	void close_client(const std::shared_ptr<ConsoleClient> &client);
+	uint32_t client_events(const ConsoleClient &client) const;
+	void trim_scrollback(ConsoleClient &client);
+	MetricLabels client_labels(const ConsoleClient &client) const;
+
+	EventLoop &m_loop;
+	ByteRing &m_ring;
+	int m_listen_fd;
+	bool m_started;
+	std::string m_greeting;
+	RingLagPolicy m_lag_policy;
+	size_t m_scrollback;
+	bool m_input_paused;
+	std::unordered_map<int, std::shared_ptr<ConsoleClient>> m_clients;
+	std::atomic<bool> m_flush_pending;
+	std::atomic<size_t> m_count;
+	MetricLabels m_labels;
+	std::shared_ptr<MetricGauge> m_clients_gauge;
+	/* The one checked copy of ring data, at m_send_start, see fetch() */
+	std::vector<uint8_t> m_send_buffer;
+	uint64_t m_send_start;
+	size_t m_send_len;
+};
+
+#endif //DEVCLIENT_CONSOLE_HH
@@ -0,0 +1,149 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_DAEMON_HH
+#define DEVCLIENT_DAEMON_HH
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <giomm.h>
+#include <ucl.h>
+#include <device.hh>
+#include <eventloop.hh>
+#include <jtag.hh>
+#include <metrics.hh>
+#include <tuning.hh>
+#include <uart.hh>
+
+/* Services of one cable, as given by a device { } config block */
+struct DeviceConfig
+{
+	std::string serial;
+
+	/*
+	 * USB tuning of this cable's channels by name, the command line
+	 * (-T) settings overridden by those of the device block
+	 */
+	std::map<std::string, ChannelTuning> tuning;
+
+	bool uart = false;
+	std::string uart_address;
+	uint16_t uart_port = 0;
+	int baudrate = 115200;
+	UartOptions uart_options;
+
+	bool jtag = false;
+	bool pass_through = false;
+	std::string jtag_address;
+	uint16_t gdb_port = 0;
+	uint16_t telnet_port = 0;
+	std::string jtag_script;
+
+	bool gpio = false;
+	uint8_t gpio_value = 0;
+
+	/* Throws std::runtime_error on invalid settings */
+	static DeviceConfig parse(const ucl_object_t *device);
+};
+
+struct DaemonConfig
+{
+	/* Event loop threads, 0 to use one per CPU core */
+	size_t threads = 0;
+	std::vector<DeviceConfig> devices;
+
+	/* Prometheus endpoint, disabled while the port is 0 */
+	std::string metrics_address = "127.0.0.1";
+	uint16_t metrics_port = 0;
+
+	/* Reads every device { } block of a config file */
+	static DaemonConfig load(const std::string &path);
+};
+
+/*
+ * Serves any number of cables from one process. UART consoles, their
+ * clients and their USB receive paths are spread over a fixed pool of
+ * event loops sized to the CPU count rather than to the number of
+ * cables; JTAG servers run off the GLib main loop of the process.
+ * Services of a cable are torn down when it is unplugged and brought
+ * back up when it reappears.
+ */
+class Daemon
+{
+public:
+	explicit Daemon(const DaemonConfig &config);
+	virtual ~Daemon();
+
+	/* A cable that is missing or fails to come up is logged and skipped */
+	void start();
+
+	/* Runs until SIGINT or SIGTERM */
+	void run();
+	void stop();
+
+	size_t running() const;
+
+protected:
+	struct Service
+	{
+		DeviceConfig config;
+		Device device;
+		std::unique_ptr<Uart> uart;
+		std::unique_ptr<JtagServer> jtag;
+		std::shared_ptr<MetricGauge> up_gauge;
+		bool up = false;
+	};
+
+	void start_service(Service &service);
+	void stop_service(Service &service);
+	void device_changed();
+	void start_metrics();
+	std::shared_ptr<EventLoop> next_loop();
+
+	/* Filled on the device registry thread, drained on the main loop */
+	std::mutex m_changes_lock;
+	std::vector<std::pair<Device, bool>> m_changes;
+	Glib::Dispatcher m_changed;
+	int m_listener;
+
+	std::vector<std::shared_ptr<EventLoop>> m_loops;
+	std::vector<std::unique_ptr<Service>> m_services;
+	std::unique_ptr<MetricsServer> m_metrics;
+	std::string m_metrics_address;
+	uint16_t m_metrics_port;
+	Glib::RefPtr<Glib::MainLoop> m_main_loop;
+	size_t m_threads;
+	size_t m_next_loop;
+	size_t m_running;
+};
+
+#endif //DEVCLIENT_DAEMON_HH
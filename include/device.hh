@@ -29,8 +29,20 @@
 #ifndef DEVCLIENT_DEVICE_HH
 #define DEVCLIENT_DEVICE_HH
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <optional>
+#include <string>
+#include <thread>
 #include <vector>
+#include <libusb.h>
+
+/* Rescan interval where libusb has no hotplug support */
+#define DEVREG_POLL_INTERVAL	std::chrono::seconds(2)
 
 struct Device
 {
@@ -38,13 +50,76 @@ struct Device
 	uint16_t pid;
 	std::string serial;
 	std::string description;
+	bool simulated = false;		/* an FtdiSimulator, not a cable */
 };
 
 class DeviceEnumerator
 {
 public:
+	/*
+	 * Served from the DeviceRegistry cache while it is running,
+	 * simulated cables included
+	 */
 	static std::vector<Device> enumerate();
 	static std::optional<Device> find_by_serial(const std::string &serial);
+
+	/* Full USB bus scan */
+	static std::vector<Device> scan();
+};
+
+/*
+ * Up to date list of attached cables, maintained from libusb hotplug
+ * events (or periodic rescans where those are not supported) on a
+ * thread of its own. Listeners are called on that thread whenever a
+ * cable comes or goes.
+ */
+class DeviceRegistry
+{
+public:
+	using Listener = std::function<void(const Device &, bool present)>;
+
+	static DeviceRegistry &instance();
+
+	/* Returns once the cables already attached are known */
+	void start();
+	void stop();
+	bool running() const;
+
+	std::vector<Device> devices();
+	std::optional<Device> find(const std::string &serial);
+
+	int subscribe(const Listener &listener);
+
+	/* The listener is not running, nor called again, once it returns */
+	void unsubscribe(int id);
+
+protected:
+	DeviceRegistry();
+	virtual ~DeviceRegistry();
+
+	static int LIBUSB_CALL hotplug(libusb_context *ctx,
+	    libusb_device *device, libusb_hotplug_event event, void *arg);
+	void process();
+	void arrived(libusb_device *device);
+	void left(libusb_device *device);
+	void rescan();
+	void notify(const Device &device, bool present);
+	void worker();
+
+	libusb_context *m_ctx;
+	libusb_hotplug_callback_handle m_handle;
+	bool m_hotplug;
+	std::thread m_thread;
+	std::atomic<bool> m_running;
+	std::mutex m_lock;
+	/* Held while listeners are called */
+	std::mutex m_notify_lock;
+	std::condition_variable m_cond;
+	std::vector<std::pair<libusb_device *, bool>> m_events;
+	std::map<libusb_device *, Device> m_devices;
+	std::map<std::string, Device> m_scanned;
+	std::map<int, Listener> m_listeners;
+	int m_next_id;
 };
 
 
@@ -29,10 +29,16 @@
 #ifndef DEVCLIENT_DTB_HH
 #define DEVCLIENT_DTB_HH
 
+#include <memory>
 #include <vector>
 #include <string>
-#include <condition_variable>
+#include <sigc++/sigc++.h>
 
+/*
+ * Converts the EEPROM tab text to a blob and back with the in-process
+ * DeviceTree engine. The done slot is called before compile() or
+ * decompile() return, with the output size or the parse errors.
+ */
 class DTB
 {
 public:
@@ -44,19 +50,8 @@ public:
 	void decompile(const SlotDone &done);
 
 protected:
-	void run_dtc(bool compile, const SlotDone &done);
-	void output_ready(Glib::RefPtr<Gio::AsyncResult> &result);
-	void error_ready(Glib::RefPtr<Gio::AsyncResult> &result);
-	void child_exited(Glib::Pid pid, int code);
-
-	Glib::RefPtr<Gio::UnixOutputStream> m_in;
-	Glib::RefPtr<Gio::UnixInputStream> m_out;
-	Glib::RefPtr<Gio::UnixInputStream> m_err;
 	std::shared_ptr<std::vector<uint8_t>> m_dtb;
 	std::shared_ptr<std::string> m_dts;
-	std::string m_errors;
-	SlotDone m_done;
-	bool m_compile;
 };
 
 #endif //DEVCLIENT_DTB_HH
@@ -29,23 +29,122 @@
 #ifndef DEVCLIENT_EEPROM_HH
 #define DEVCLIENT_EEPROM_HH
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+#include <fmt/format.h>
+#include <log.hh>
 #include <i2c.hh>
+#include <metrics.hh>
 #include <eeprom.hh>
 
 class Eeprom
 {
 public:
+	/* Called with bytes done and total, returns false to cancel */
+	using Progress = std::function<bool(size_t, size_t)>;
+
 	Eeprom(I2C &i2c): m_i2c(i2c) {}
 	virtual ~Eeprom() {}
 
+	void set_progress(const Progress &progress)
+	{
+		m_progress = progress;
+	}
+
 	virtual void read(uint16_t offset, size_t length,
 	    std::vector<uint8_t> &data) = 0;
 	virtual void write(uint16_t offset,
 	    const std::vector<uint8_t> &data) = 0;
 	virtual void erase() = 0;
+	virtual size_t page_size() const = 0;
+	virtual size_t size() const = 0;
+
+	/*
+	 * Write only the pages of data that differ from the current
+	 * contents and read them back to verify. The current contents
+	 * are read from the part unless a known image is supplied.
+	 * Returns the number of pages written.
+	 */
+	size_t update(uint16_t offset, const std::vector<uint8_t> &data,
+	    const std::vector<uint8_t> *current = nullptr)
+	{
+		Metrics &metrics = Metrics::instance();
+		auto started = std::chrono::steady_clock::now();
+		std::vector<uint8_t> existing;
+		std::vector<uint8_t> slice;
+		std::vector<uint8_t> check;
+		Progress progress;
+		size_t page = page_size();
+		size_t pages = 0;
+		size_t start;
+		size_t end;
+
+		/* Report whole pages here, not the nested reads and writes */
+		std::swap(progress, m_progress);
+
+		try {
+			if (current == nullptr) {
+				read(offset, data.size(), existing);
+				current = &existing;
+			}
+
+			for (start = 0; start < data.size(); start = end) {
+				/* Chunks never cross a page boundary */
+				end = std::min(data.size(),
+				    start + page - (offset + start) % page);
+
+				if (progress && !progress(end, data.size()))
+					throw std::runtime_error(
+					    "EEPROM operation cancelled");
+
+				if (end <= current->size() &&
+				    std::equal(data.begin() + start,
+				    data.begin() + end, current->begin() + start))
+					continue;
+
+				slice.assign(data.begin() + start,
+				    data.begin() + end);
+				write(offset + start, slice);
+
+				check.clear();
+				read(offset + start, slice.size(), check);
+				if (check != slice) {
+					throw std::runtime_error(fmt::format(
+					    "EEPROM verification failed at "
+					    "offset {:#x}", offset + start));
+				}
+
+				pages++;
+			}
+		} catch (...) {
+			std::swap(progress, m_progress);
+			metrics.counter("devclient_eeprom_update_failures_total",
+			    "EEPROM updates that failed or were cancelled")->add();
+			throw;
+		}
+
+		std::swap(progress, m_progress);
+		metrics.histogram("devclient_eeprom_update_seconds",
+		    "Time to update and verify an EEPROM image",
+		    METRICS_LATENCY_BUCKETS)->observe_since(started);
+		metrics.counter("devclient_eeprom_pages_written_total",
+		    "EEPROM pages written")->add(pages);
+		Logger::debug("EEPROM: {} page(s) of {} bytes written",
+		    pages, data.size());
+		return (pages);
+	}
 
 protected:
+	void report(size_t done, size_t total)
+	{
+		if (m_progress && !m_progress(done, total))
+			throw std::runtime_error("EEPROM operation cancelled");
+	}
+
 	I2C &m_i2c;
+	Progress m_progress;
 };
 
 #endif //DEVCLIENT_EEPROM_HH
@@ -30,51 +30,87 @@
 #define DEVCLIENT_24C_HH
 
 #include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <chrono>
 #include <log.hh>
 #include <eeprom.hh>
+#include <eeprom/catalogue.hh>
 
-#define EEPROM_24C_ADDRESS_RD	0xa1
-#define EEPROM_24C_ADDRESS_WR	0xa0
+/* Read in chunks that each fit a single I2C transaction segment */
+#define EEPROM_24C_READ_CHUNK	(I2C_MAX_RESPONSE - 8)
+
+/* Allow a few write cycles before deciding the part is gone */
+#define EEPROM_24C_POLL_CYCLES	4
 
 class Eeprom24c: public Eeprom
 {
 public:
-	using Eeprom::Eeprom;
+	Eeprom24c(I2C &i2c,
+	    const EepromModel &model = EepromModel::find(EEPROM_DEFAULT_MODEL)):
+	    Eeprom(i2c),
+	    m_model(model),
+	    m_write_timeout(model.write_cycle * EEPROM_24C_POLL_CYCLES),
+	    m_saved_clock(i2c.clock_setup())
+	{
+		m_i2c.set_clock(model.max_clock);
+	}
+
+	/* The bus belongs to the caller, hand it back at its own clock */
+	~Eeprom24c()
+	{
+		try {
+			m_i2c.set_clock(m_saved_clock);
+		} catch (const std::runtime_error &err) {
+			Logger::warning("Cannot restore I2C clock: {}",
+			    err.what());
+		}
+	}
+
+	void set_write_timeout(std::chrono::milliseconds timeout)
+	{
+		m_write_timeout = timeout;
+	}
 
 	void read(uint16_t offset, size_t length, std::vector<uint8_t> &data)
 	{
-		m_i2c.start();
-		m_i2c.write({
-		    EEPROM_24C_ADDRESS_WR,
-		    static_cast<unsigned char>((offset >> 8) & 0xff),
-		    static_cast<unsigned char>(offset & 0xff)
-		});
-
-		m_i2c.start();
-		m_i2c.write({ EEPROM_24C_ADDRESS_RD });
-		m_i2c.read(length, data);
-		m_i2c.stop();
+		size_t done;
+		size_t chunk;
+
+		for (done = 0; done < length; done += chunk) {
+			chunk = std::min(length - done,
+			    static_cast<size_t>(EEPROM_24C_READ_CHUNK));
+			read_chunk(offset + done, chunk, data);
+			report(done + chunk, length);
+		}
 	}
 
 	void write(uint16_t offset, const std::vector<uint8_t> &data)
 	{
-		std::vector<uint8_t> slice;
 		std::vector<uint8_t>::size_type i;
+		std::vector<uint8_t>::size_type end;
 
-		for (i = 0; i < data.size(); i += 32) {
-			Logger::debug("Writing to AT24C at offset {}", offset);
-			m_i2c.start();
-			m_i2c.write({
-			    EEPROM_24C_ADDRESS_WR,
-			    static_cast<unsigned char>((offset >> 8) & 0xff),
-			    static_cast<unsigned char>(offset & 0xff)
-			});
-
-			slice = std::vector<uint8_t>(data.begin() + i, data.begin() + i + 32);
-			m_i2c.write(slice);
-			m_i2c.stop();
-			offset += 32;
-			usleep(50000);
+		for (i = 0; i < data.size(); i = end) {
+			I2CTransaction txn;
+
+			Logger::debug("Writing to {} at offset {}", m_model.name,
+			    offset);
+			end = std::min(data.size(), i + m_model.page_size -
+			    offset % m_model.page_size);
+			txn.start();
+			txn.write(address(offset));
+			txn.write(std::vector<uint8_t>(data.begin() + i,
+			    data.begin() + end));
+			txn.stop();
+			m_i2c.execute(txn);
+
+			if (!txn.acked())
+				throw std::runtime_error(
+				    "EEPROM did not acknowledge write");
+
+			wait_ready(offset);
+			offset += end - i;
+			report(end, data.size());
 		}
 	}
 
@@ -82,6 +118,91 @@ public:
 	{
 
 	}
+
+	size_t page_size() const
+	{
+		return (m_model.page_size);
+	}
+
+	size_t size() const
+	{
+		return (m_model.size);
+	}
+
+	const EepromModel &model() const
+	{
+		return (m_model);
+	}
+
+protected:
+	void read_chunk(uint16_t offset, size_t length,
+	    std::vector<uint8_t> &data)
+	{
+		I2CTransaction txn;
+
+		txn.start();
+		txn.write(address(offset));
+		txn.start();
+		txn.write({ static_cast<uint8_t>(device(offset) | 0x01) });
+		txn.read(length);
+		txn.stop();
+		m_i2c.execute(txn);
+
+		if (!txn.acked())
+			throw std::runtime_error("EEPROM did not acknowledge read");
+
+		data.insert(data.end(), txn.data().begin(), txn.data().end());
+	}
+
+	/*
+	 * Device address for a write to the given offset. Offset bits
+	 * that don't fit into the address bytes go into the block
+	 * select bits.
+	 */
+	uint8_t device(uint16_t offset) const
+	{
+		int high = offset >> (8 * m_model.address_width);
+
+		return (static_cast<uint8_t>(m_model.address |
+		    ((high << 1) & 0x0e)));
+	}
+
+	std::vector<uint8_t> address(uint16_t offset) const
+	{
+		if (m_model.address_width == 1) {
+			return {
+			    device(offset),
+			    static_cast<uint8_t>(offset & 0xff)
+			};
+		}
+
+		return {
+		    device(offset),
+		    static_cast<uint8_t>((offset >> 8) & 0xff),
+		    static_cast<uint8_t>(offset & 0xff)
+		};
+	}
+
+	/*
+	 * The part ignores its address until the internal write cycle
+	 * finishes, so keep addressing it until it ACKs again.
+	 */
+	void wait_ready(uint16_t offset)
+	{
+		auto deadline = std::chrono::steady_clock::now() +
+		    m_write_timeout;
+
+		do {
+			if (m_i2c.poll(device(offset)))
+				return;
+		} while (std::chrono::steady_clock::now() < deadline);
+
+		throw std::runtime_error("EEPROM write cycle timed out");
+	}
+
+	const EepromModel &m_model;
+	std::chrono::milliseconds m_write_timeout;
+	I2CClock m_saved_clock;
 };
 
 #endif /* DEVCLIENT_24C_HH */
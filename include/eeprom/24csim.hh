@@ -0,0 +1,181 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_24CSIM_HH
+#define DEVCLIENT_24CSIM_HH
+
+#include <chrono>
+#include <vector>
+#include <utility>
+#include <i2crecorder.hh>
+#include <eeprom/catalogue.hh>
+
+/*
+ * Behavioural model of a 24C series EEPROM for use with I2CRecorder.
+ * Page writes are latched on STOP and the part then NAKs its address
+ * for the programmed write cycle time, like real silicon does.
+ */
+class Eeprom24cSim: public I2CTarget
+{
+public:
+	Eeprom24cSim(const EepromModel &model,
+	    std::chrono::microseconds write_cycle):
+	    m_memory(model.size, 0xff),
+	    m_page_size(model.page_size),
+	    m_address_width(model.address_width),
+	    m_write_cycle(write_cycle),
+	    m_address(model.address),
+	    m_state(State::IDLE),
+	    m_pointer(0),
+	    m_offset(0),
+	    m_count(0),
+	    m_cycles(0),
+	    m_naks(0)
+	{
+	}
+
+	void start()
+	{
+		m_state = State::DEVICE;
+		m_offset = 0;
+		m_count = 0;
+		m_pending.clear();
+	}
+
+	void stop()
+	{
+		if (m_state == State::DATA && !m_pending.empty()) {
+			for (const auto &i: m_pending)
+				m_memory[i.first] = i.second;
+
+			m_busy_until = std::chrono::steady_clock::now() +
+			    m_write_cycle;
+			m_cycles++;
+		}
+
+		m_pending.clear();
+		m_state = State::IDLE;
+	}
+
+	bool write(uint8_t byte)
+	{
+		size_t blocks = 0;
+		size_t page;
+
+		if (m_address_width == 1)
+			blocks = (m_memory.size() - 1) >> 8;
+
+		switch (m_state) {
+		case State::DEVICE:
+			/* Single address byte parts take block bits here */
+			if (busy() ||
+			    (byte & 0xfe & ~(blocks << 1)) != m_address) {
+				m_naks++;
+				m_state = State::IDLE;
+				return (false);
+			}
+
+			m_offset = (byte >> 1) & blocks;
+			m_state = (byte & 0x01) ? State::READ : State::OFFSET;
+			return (true);
+
+		case State::OFFSET:
+			m_offset = (m_offset << 8) | byte;
+			if (++m_count == m_address_width) {
+				m_pointer = m_offset % m_memory.size();
+				m_state = State::DATA;
+			}
+
+			return (true);
+
+		case State::DATA:
+			/* Writes wrap around within the current page */
+			page = m_pointer - m_pointer % m_page_size;
+			m_pending.emplace_back(page + (m_pointer + m_pending.size()) %
+			    m_page_size, byte);
+			return (true);
+
+		default:
+			return (false);
+		}
+	}
+
+	uint8_t read()
+	{
+		uint8_t byte = m_memory[m_pointer];
+
+		m_pointer = (m_pointer + 1) % m_memory.size();
+		return (byte);
+	}
+
+	bool busy() const
+	{
+		return (std::chrono::steady_clock::now() < m_busy_until);
+	}
+
+	const std::vector<uint8_t> &memory() const
+	{
+		return (m_memory);
+	}
+
+	size_t cycles() const
+	{
+		return (m_cycles);
+	}
+
+	size_t naks() const
+	{
+		return (m_naks);
+	}
+
+protected:
+	enum class State
+	{
+		IDLE,
+		DEVICE,
+		OFFSET,
+		DATA,
+		READ
+	};
+
+	std::vector<uint8_t> m_memory;
+	std::vector<std::pair<size_t, uint8_t>> m_pending;
+	size_t m_page_size;
+	int m_address_width;
+	std::chrono::microseconds m_write_cycle;
+	std::chrono::steady_clock::time_point m_busy_until;
+	uint8_t m_address;
+	State m_state;
+	size_t m_pointer;
+	size_t m_offset;
+	int m_count;
+	size_t m_cycles;
+	size_t m_naks;
+};
+
+#endif /* DEVCLIENT_24CSIM_HH */
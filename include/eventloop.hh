@@ -0,0 +1,95 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_EVENTLOOP_HH
+#define DEVCLIENT_EVENTLOOP_HH
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+#define EVENT_READ	(1 << 0)
+#define EVENT_WRITE	(1 << 1)
+#define EVENT_HANGUP	(1 << 2)
+
+/* Upper bound on events handled per wakeup */
+#define EVENTLOOP_MAX_EVENTS	64
+
+/*
+ * Readiness based event loop running on its own thread. Uses epoll on
+ * Linux and falls back to poll(2) elsewhere. Handlers always run on
+ * the loop thread; add(), modify(), remove() and post() may be called
+ * from any thread.
+ */
+class EventLoop
+{
+public:
+	using Handler = std::function<void(uint32_t events)>;
+
+	EventLoop();
+	virtual ~EventLoop();
+
+	void start();
+	void stop();
+	bool in_loop() const;
+
+	void add(int fd, uint32_t events, const Handler &handler);
+	void modify(int fd, uint32_t events);
+	void remove(int fd);
+
+	/* Runs fn on the loop thread */
+	void post(const std::function<void()> &fn);
+
+	/* Runs fn on the loop thread and waits for it to finish */
+	void invoke(const std::function<void()> &fn);
+
+protected:
+	void run();
+	void wakeup();
+	void drain();
+	void dispatch(int fd, uint32_t events);
+
+	int m_pollfd;
+	int m_wakeup[2];
+	std::thread m_thread;
+	std::atomic<bool> m_running;
+
+	/* Cleared when a handler destroys the loop, only read by run() */
+	std::shared_ptr<bool> m_alive;
+	std::mutex m_lock;
+	std::vector<std::function<void()>> m_posted;
+	std::unordered_map<int, std::shared_ptr<Handler>> m_handlers;
+	std::unordered_map<int, uint32_t> m_events;
+};
+
+#endif //DEVCLIENT_EVENTLOOP_HH
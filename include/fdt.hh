@@ -0,0 +1,184 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_FDT_HH
+#define DEVCLIENT_FDT_HH
+
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstdint>
+
+/* Flattened device tree layout, see the Devicetree Specification */
+#define FDT_MAGIC		0xd00dfeed
+#define FDT_HEADER_SIZE		40
+#define FDT_BEGIN_NODE		0x1
+#define FDT_END_NODE		0x2
+#define FDT_PROP		0x3
+#define FDT_NOP			0x4
+#define FDT_END			0x9
+
+/* Version written, and the oldest version a reader has to understand */
+#define FDT_VERSION		17
+#define FDT_LAST_COMP_VERSION	16
+
+/* How dtc -O dts would print a value, see DeviceTree::guess_type() */
+enum class FdtType
+{
+	EMPTY,
+	STRINGS,
+	CELLS,
+	BYTES
+};
+
+/*
+ * The type is how the value was written in the source, BYTES for /bits/
+ * other than 32 and for a mix of kinds. A DTB does not record it, so
+ * values read from one have it guessed as dtc would.
+ */
+struct FdtProperty
+{
+	std::string name;
+	std::vector<uint8_t> value;
+	FdtType type;
+};
+
+struct FdtNode
+{
+	std::string name;
+	std::vector<FdtProperty> properties;
+	std::vector<FdtNode> children;
+
+	/* nullptr if there is none of that name */
+	FdtProperty *property(const std::string &name);
+	FdtNode *child(const std::string &name);
+};
+
+
+struct FdtReservation
+{
+	uint64_t address;
+	uint64_t size;
+};
+
+/*
+ * A device tree held in memory, converted to and from the flattened
+ * (DTB) and source (DTS) forms without going through dtc. The DTB
+ * output is laid out the way dtc lays it out, so both produce the same
+ * bytes for the same tree. Every conversion throws std::runtime_error
+ * saying where the input went wrong.
+ *
+ * Sources are a subset of what dtc accepts: nodes, properties with
+ * strings, <cells> (optionally /bits/ sized), [bytes] and /memreserve/
+ * entries. Labels are accepted and dropped; label references, /include/,
+ * /delete-*, /plugin/ and arithmetic expressions are not supported.
+ */
+class DeviceTree
+{
+public:
+	FdtNode root;
+	std::vector<FdtReservation> reservations;
+	uint32_t boot_cpu = 0;
+
+	/* Data past the size in the header, such as erased EEPROM, is ignored */
+	static DeviceTree from_dtb(const uint8_t *buf, size_t len);
+	static DeviceTree from_dts(const std::string &source);
+
+	/* Where each property value is in the DTB, by path */
+	struct Span
+	{
+		size_t offset;
+		size_t size;
+		FdtType type;
+	};
+
+	using Layout = std::map<std::string, Span>;
+
+	std::vector<uint8_t> to_dtb() const;
+	std::vector<uint8_t> to_dtb(Layout &layout) const;
+
+	/* Formatted like dtc -O dts, guessing value types the same way */
+	std::string to_dts() const;
+
+	static FdtType guess_type(const std::vector<uint8_t> &value);
+};
+
+/*
+ * A compiled tree with some of its properties marked as fields. Images
+ * for individual boards are made by splicing new field values into a
+ * copy of the template blob, without parsing or flattening anything,
+ * and come out exactly as compiling the tree with those values would.
+ * Fields keep the type their template value was written with, unless
+ * one is given.
+ */
+class DtbTemplate
+{
+public:
+	explicit DtbTemplate(const DeviceTree &tree);
+
+	/*
+	 * Marks a property, "/board/serial" or "serial" for one of the
+	 * root node, as a field. Returns its index.
+	 */
+	size_t add_field(const std::string &path,
+	    std::optional<FdtType> type = std::nullopt);
+	size_t fields() const;
+	const std::string &path(size_t field) const;
+
+	/*
+	 * Value of a field from text: a string, whitespace separated
+	 * cells, or hex bytes (optionally split by ':' or '-'), which
+	 * must be as many as in the template, as a MAC address is.
+	 */
+	std::vector<uint8_t> encode(size_t field, const std::string &text) const;
+
+	/* One value per field, in the order they were added */
+	void render(const std::vector<std::vector<uint8_t>> &values,
+	    std::vector<uint8_t> &image) const;
+
+	const std::vector<uint8_t> &blob() const;
+
+protected:
+	struct Field
+	{
+		std::string path;
+		size_t offset;
+		size_t size;
+		FdtType type;
+	};
+
+	std::vector<uint8_t> m_blob;
+	DeviceTree::Layout m_layout;
+	std::vector<Field> m_fields;
+	/* Field indices by offset, the order they are spliced in */
+	std::vector<size_t> m_order;
+};
+
+#endif //DEVCLIENT_FDT_HH
@@ -35,8 +35,11 @@ template <class T>
 class FormRow: public Gtk::Box
 {
 public:
-	FormRow(const Glib::ustring &label):
+	/* Extra arguments are passed on to the widget constructor */
+	template <typename... Args>
+	FormRow(const Glib::ustring &label, Args&&... args):
 	    Gtk::Box(Gtk::Orientation::ORIENTATION_HORIZONTAL, 10),
+	    m_widget(std::forward<Args>(args)...),
 	    m_label(label)
 	{
 		m_label.set_justify(Gtk::Justification::JUSTIFY_LEFT);
@@ -0,0 +1,220 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_FTSIM_HH
+#define DEVCLIENT_FTSIM_HH
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <device.hh>
+#include <i2crecorder.hh>
+#include <transport.hh>
+
+/* Bytes the chip buffers towards the UART line; writes block beyond it */
+#define FTSIM_TX_FIFO		2048
+
+/* How often the simulated receiver picks up bytes, like a latency timer */
+#define FTSIM_RX_TICK		std::chrono::milliseconds(1)
+
+/* Loopback behaviour of the simulated UART channel */
+struct SimUartTiming
+{
+	/* Delay from a byte leaving TX to it being readable on RX */
+	std::chrono::microseconds latency = std::chrono::microseconds(1000);
+
+	/* Bytes per second on the line, 0 for what baud rate and format give */
+	size_t throughput = 0;
+};
+
+/* USB traffic seen by one simulated channel */
+struct SimChannelStats
+{
+	uint64_t writes;	/* bulk writes */
+	uint64_t reads;		/* reads that returned data */
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+};
+
+/*
+ * Software model of an FT4232H cable, for running devclient without
+ * hardware. Channel A decodes the MPSSE commands of the I2C layer onto
+ * an MpsseI2CBus, channels B and D act as bitbang ports and channel C
+ * is a UART with TX looped back to RX after the configured latency, at
+ * line rate. Simulated cables are registered by serial number and show
+ * up in DeviceEnumerator next to real ones; SimTransport opens them.
+ */
+class FtdiSimulator
+{
+public:
+	explicit FtdiSimulator(const std::string &serial);
+
+	static std::shared_ptr<FtdiSimulator> attach(const std::string &serial);
+	static void detach(const std::string &serial);
+	static std::shared_ptr<FtdiSimulator> find(const std::string &serial);
+	static std::vector<Device> devices();
+
+	Device device() const;
+
+	void set_uart_timing(const SimUartTiming &timing);
+
+	/* Output of the simulated target, queued behind earlier input */
+	void uart_inject(const uint8_t *buf, size_t len);
+
+	/* Device on the I2C bus of channel A, none ACKs everything */
+	void attach_i2c(I2CTarget *target);
+
+	/* Levels of the bitbang pins not driven as outputs */
+	void set_inputs(enum ftdi_interface channel, uint8_t value);
+	uint8_t pins(enum ftdi_interface channel);
+
+	SimChannelStats stats(enum ftdi_interface channel);
+
+protected:
+	friend class SimTransport;
+	friend class SimReceiver;
+
+	using Clock = std::chrono::steady_clock;
+
+	struct Channel
+	{
+		bool open = false;
+		uint8_t mode = BITMODE_RESET;
+		uint8_t direction = 0;
+		uint8_t latch = 0;
+		uint8_t inputs = 0xff;
+		int baudrate = 9600;
+		double frame_bits = 10;
+		int latency = 16;
+		int read_chunk = 4096;
+		int write_chunk = 4096;
+	};
+
+	/* UART input that becomes readable evenly from start to end */
+	struct Burst
+	{
+		Clock::time_point start;
+		Clock::time_point end;
+		std::vector<uint8_t> data;
+		size_t delivered;
+	};
+
+	Channel &channel(enum ftdi_interface channel);
+	uint8_t levels(const Channel &channel) const;
+	double uart_throughput() const;
+	Clock::duration uart_time(size_t len) const;
+	size_t uart_write(const uint8_t *buf, size_t len);
+	size_t uart_collect(uint8_t *buf, size_t len);
+
+	std::string m_serial;
+	std::mutex m_lock;
+	Channel m_channels[4];
+	SimChannelStats m_stats[4];
+	MpsseI2CBus m_i2c;
+	SimUartTiming m_timing;
+	Clock::time_point m_tx_free;
+	Clock::time_point m_rx_free;
+	std::deque<Burst> m_rx;
+};
+
+/* Transport onto one channel of an FtdiSimulator */
+class SimTransport: public Transport
+{
+public:
+	SimTransport();
+	virtual ~SimTransport();
+
+	int open(const Device &device, enum ftdi_interface channel) override;
+	int close() override;
+	int reset() override;
+	int set_bitmode(uint8_t mask, uint8_t mode) override;
+	int bitbang_disable() override;
+	int set_baud_rate(int baudrate) override;
+	int baud_rate() override;
+	int set_line_property(enum ftdi_bits_type bits,
+	    enum ftdi_stopbits_type stop,
+	    enum ftdi_parity_type parity) override;
+	int set_flow_control(int flow, uint8_t xon, uint8_t xoff) override;
+	int set_latency(int latency) override;
+	int latency() override;
+	int set_read_chunk_size(int size) override;
+	int read_chunk_size() override;
+	int set_write_chunk_size(int size) override;
+	int write_chunk_size() override;
+	int write(const uint8_t *buf, size_t len) override;
+	int read(uint8_t *buf, size_t len) override;
+	int read_pins(uint8_t *pins) override;
+	std::string error_string() override;
+	std::unique_ptr<Receiver> receiver(ByteRing &ring, size_t depth,
+	    size_t chunk, EventLoop *loop) override;
+
+protected:
+	int fail(int ret, const std::string &error);
+
+	std::shared_ptr<FtdiSimulator> m_sim;
+	enum ftdi_interface m_channel;
+	std::string m_error;
+};
+
+/*
+ * Collects looped back and injected UART input on a thread of its own
+ * every FTSIM_RX_TICK. An event loop given to the transport is not used.
+ */
+class SimReceiver: public Receiver
+{
+public:
+	SimReceiver(std::shared_ptr<FtdiSimulator> sim, ByteRing &ring,
+	    size_t chunk);
+	virtual ~SimReceiver();
+
+	void start() override;
+	void stop() override;
+	void set_notify(const std::function<void()> &notify) override;
+	UsbReceiverStats stats() const override;
+	uint8_t modem_status() const override;
+
+protected:
+	void worker();
+
+	std::shared_ptr<FtdiSimulator> m_sim;
+	ByteRing &m_ring;
+	std::vector<uint8_t> m_buffer;
+	std::function<void()> m_notify;
+	std::thread m_thread;
+	std::atomic<bool> m_running;
+	std::atomic<uint64_t> m_bytes;
+	std::atomic<uint64_t> m_transfers;
+};
+
+#endif //DEVCLIENT_FTSIM_HH
@@ -29,14 +29,18 @@
 #ifndef DEVCLIENT_GPIO_HH
 #define DEVCLIENT_GPIO_HH
 
+#include <memory>
 #include <ftdi.hpp>
 #include <device.hh>
+#include <transport.hh>
+#include <tuning.hh>
 #include <gtkmm.h>
 
 class Gpio
 {
 public:
-	Gpio(const Device &device);
+	Gpio(const Device &device,
+	    const ChannelTuning &tuning = ChannelTuning::channel("gpio"));
 	virtual ~Gpio();
 
 	uint8_t get();
@@ -44,7 +48,7 @@ public:
 	void configure();
 	uint8_t io_state;		/* 0-input, 1-output */
 	uint8_t io_value;		/* 0-low, 1-high */
-	Ftdi::Context m_context;
+	std::unique_ptr<Transport> m_transport;
 
 protected:
 	bool on_timeout(int costam);
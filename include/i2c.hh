@@ -29,8 +29,14 @@
 #ifndef DEVCLIENT_I2C_HH
 #define DEVCLIENT_I2C_HH
 
+#include <chrono>
 #include <vector>
+#include <memory>
 #include <ftdi.hpp>
+#include <transport.hh>
+#include <device.hh>
+#include <metrics.hh>
+#include <tuning.hh>
 
 #define SCL		(1u << 0)
 #define SDA_OUT		(1u << 1)
@@ -38,22 +44,122 @@
 #define WP		(1u << 4)
 #define OUT_PINS	(SCL | SDA_OUT | WP)
 
+/*
+ * Maximum number of response bytes (ACK bits and data bytes) queued
+ * in the chip before we stop and drain them. The FT4232H has 2 KiB of
+ * buffer per channel, so keep well below that to never stall MPSSE.
+ */
+#define I2C_MAX_RESPONSE	1024
+
+/*
+ * MPSSE clock setup for a requested SCL rate. The FT4232H runs the
+ * MPSSE from a 60 MHz clock, or 12 MHz with the divide-by-5 prescaler
+ * enabled. Two-phase clocking gives SCL = base / (2 * (1 + divisor));
+ * three-phase clocking, which holds SDA valid across the falling edge
+ * as Fast-mode and Fast-mode Plus require, gives base / (3 * (1 + divisor)).
+ */
+struct I2CClock
+{
+	bool div5;
+	bool three_phase;
+	uint16_t divisor;
+	int rate;
+
+	static I2CClock compute(int clock);
+};
+
+/*
+ * Sequence of I2C bus operations compiled into a single MPSSE command
+ * buffer. Nothing is sent until the transaction is passed to
+ * I2C::execute(), which then collects all ACK bits and data bytes
+ * in one bulk read per segment.
+ */
+class I2CTransaction
+{
+public:
+	I2CTransaction();
+
+	void start();
+	void stop();
+	void write(const std::vector<uint8_t> &data);
+	void read(size_t nbytes);
+
+	bool acked() const;
+	bool acked(size_t index) const;
+	const std::vector<uint8_t> &data() const;
+
+protected:
+	friend class I2C;
+
+	struct Segment
+	{
+		size_t end;
+		size_t response;
+	};
+
+	enum class Slot
+	{
+		ACK,
+		DATA
+	};
+
+	void queue(const std::vector<uint8_t> &cmd);
+	void expect(Slot slot);
+	void seal();
+	void complete(const std::vector<uint8_t> &response);
+
+	std::vector<uint8_t> m_commands;
+	std::vector<Segment> m_segments;
+	std::vector<Slot> m_slots;
+	std::vector<bool> m_acks;
+	std::vector<uint8_t> m_data;
+	size_t m_pending;
+};
+
 class I2C
 {
 public:
 	I2C(const Device &device, int clock);
 	virtual ~I2C();
 
+	int clock() const;
+	void set_clock(int clock);
+
+	/* Exact divisor setup, for putting back what another user set */
+	const I2CClock &clock_setup() const;
+	void set_clock(const I2CClock &clock);
+	void execute(I2CTransaction &txn);
 	void start();
 	void stop();
 	void read(size_t nbytes, std::vector<uint8_t> &result);
-	void write(const std::vector<uint8_t> &data);
+	bool write(const std::vector<uint8_t> &data);
+	bool poll(uint8_t address);
+
+	/* Applies USB tuning to the channel */
+	void tune(const ChannelTuning &tuning);
+
+	/*
+	 * One round trip through the MPSSE bad command echo. Without
+	 * immediate, the answer waits for the latency timer.
+	 */
+	std::chrono::nanoseconds ping(bool immediate);
 
 protected:
-	uint8_t read_byte(bool ack);
-	void write_byte(uint8_t byte);
+	explicit I2C(int clock);
+
+	void configure();
+	void apply_clock();
+	virtual void transmit(const uint8_t *buf, size_t len);
+	virtual void receive(uint8_t *buf, size_t len);
+
+	std::unique_ptr<Transport> m_transport;
+	I2CClock m_clock;
 
-	Ftdi::Context m_context;
+	/* Only kept for a real (or simulated) cable */
+	std::shared_ptr<MetricCounter> m_transactions;
+	std::shared_ptr<MetricCounter> m_naks;
+	std::shared_ptr<MetricCounter> m_write_errors;
+	std::shared_ptr<MetricHistogram> m_latency;
 };
 
 #endif //DEVCLIENT_I2C_HH
@@ -0,0 +1,115 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_I2CRECORDER_HH
+#define DEVCLIENT_I2CRECORDER_HH
+
+#include <deque>
+#include <vector>
+#include <i2c.hh>
+
+/*
+ * Simulated device sitting on the recorded bus. write() returns the
+ * ACK the device drives for an address or data byte.
+ */
+class I2CTarget
+{
+public:
+	virtual ~I2CTarget() {}
+
+	virtual void start() = 0;
+	virtual void stop() = 0;
+	virtual bool write(uint8_t byte) = 0;
+	virtual uint8_t read() = 0;
+};
+
+/*
+ * The I2C bus behind an FT4232H MPSSE channel. MPSSE commands are
+ * decoded as they are fed in (partial commands wait for the rest), the
+ * bytes the chip would return are queued for take(). Without an
+ * attached target every address and data byte is ACKed and bus reads
+ * return 0xff; with a target the decoded START/STOP conditions and
+ * bytes are forwarded to it.
+ */
+class MpsseI2CBus
+{
+public:
+	MpsseI2CBus();
+
+	void attach(I2CTarget *target);
+	void feed(const uint8_t *buf, size_t len);
+
+	/* Response bytes waiting to be read */
+	size_t pending() const;
+	size_t take(uint8_t *buf, size_t len);
+	void clear();
+
+protected:
+	size_t command_length(size_t offset) const;
+	void command(const uint8_t *cmd);
+	void pins(uint8_t value, uint8_t direction);
+
+	I2CTarget *m_target;
+	std::vector<uint8_t> m_input;
+	std::deque<uint8_t> m_response;
+	bool m_scl;
+	bool m_sda;
+	bool m_ack;
+};
+
+/*
+ * I2C master that talks to nothing. Every byte the I2C layer would send
+ * to the FT4232H is appended to stream() and run through an MpsseI2CBus,
+ * so that reads are answered with the exact number of bytes the chip
+ * would return.
+ */
+class I2CRecorder: public I2C
+{
+public:
+	explicit I2CRecorder(int clock = 100000);
+
+	void attach(I2CTarget *target);
+	const std::vector<uint8_t> &stream() const;
+	size_t writes() const;
+	size_t reads() const;
+
+	/* Response bytes the chip returned that nobody read */
+	size_t unread() const;
+	void clear();
+
+protected:
+	void transmit(const uint8_t *buf, size_t len) override;
+	void receive(uint8_t *buf, size_t len) override;
+
+	MpsseI2CBus m_bus;
+	std::vector<uint8_t> m_stream;
+	size_t m_writes;
+	size_t m_reads;
+};
+
+#endif //DEVCLIENT_I2CRECORDER_HH
@@ -31,6 +31,7 @@
 
 #include <giomm.h>
 #include <device.hh>
+#include <metrics.hh>
 
 class JtagServer
 {
@@ -63,6 +64,10 @@ protected:
 	Glib::RefPtr<Gio::UnixInputStream> m_out;
 	Glib::RefPtr<Gio::UnixInputStream> m_err;
 	bool m_running;
+	std::shared_ptr<MetricCounter> m_starts;
+	std::shared_ptr<MetricCounter> m_restarts;
+	std::shared_ptr<MetricCounter> m_exits;
+	std::shared_ptr<MetricGauge> m_up;
 };
 
 #endif /* DEVCLIENT_JTAG_HH */
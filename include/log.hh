@@ -29,37 +29,153 @@
 #ifndef DEVCLIENT_LOG_HH
 #define DEVCLIENT_LOG_HH
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 #include <fmt/format.h>
 
+#define LOG_LEVEL_DEBUG		0
+#define LOG_LEVEL_INFO		1
+#define LOG_LEVEL_WARNING	2
+#define LOG_LEVEL_ERROR		3
+#define LOG_LEVEL_NONE		4
+
+/* Calls below this level are compiled out entirely */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL		LOG_LEVEL_DEBUG
+#endif
+
+/* Messages queued for the logging thread, must be a power of two */
+#define LOG_QUEUE_SIZE		1024
+
+/* Longer messages are truncated */
+#define LOG_LINE_MAX		1000
+
+enum class LogLevel
+{
+	DEBUG = LOG_LEVEL_DEBUG,
+	INFO = LOG_LEVEL_INFO,
+	WARNING = LOG_LEVEL_WARNING,
+	ERROR = LOG_LEVEL_ERROR,
+	NONE = LOG_LEVEL_NONE
+};
+
+struct LogRecord
+{
+	std::chrono::system_clock::time_point time;
+	unsigned int thread;
+	LogLevel level;
+	size_t len;
+	char text[LOG_LINE_MAX];
+};
+
+class LogSink;
+
+/*
+ * Messages are only formatted once they pass both the compile time and
+ * the runtime level. Until start() is called they are written to the
+ * sinks right away; afterwards they go through a bounded lock-free queue
+ * to a logging thread, and are dropped (and counted) rather than block
+ * the caller when the queue is full.
+ */
 class Logger
 {
 public:
 	template <typename... Args>
 	static void debug(const char *fmt, const Args &... args)
 	{
-		Logger::log("DEBUG", fmt, fmt::make_format_args(args...));
+		if constexpr (LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG) {
+			if (enabled(LogLevel::DEBUG))
+				Logger::log(LogLevel::DEBUG, fmt,
+				    fmt::make_format_args(args...));
+		}
 	}
 
 	template <typename... Args>
 	static void info(const char *fmt, const Args &... args)
 	{
-		Logger::log("INFO", fmt, fmt::make_format_args(args...));
+		if constexpr (LOG_MIN_LEVEL <= LOG_LEVEL_INFO) {
+			if (enabled(LogLevel::INFO))
+				Logger::log(LogLevel::INFO, fmt,
+				    fmt::make_format_args(args...));
+		}
 	}
 
 	template <typename... Args>
 	static void warning(const char *fmt, const Args &... args)
 	{
-		Logger::log("WARNING", fmt, fmt::make_format_args(args...));
+		if constexpr (LOG_MIN_LEVEL <= LOG_LEVEL_WARNING) {
+			if (enabled(LogLevel::WARNING))
+				Logger::log(LogLevel::WARNING, fmt,
+				    fmt::make_format_args(args...));
+		}
 	}
 
 	template <typename... Args>
 	static void error(const char *fmt, const Args &... args)
 	{
-		Logger::log("ERROR", fmt, fmt::make_format_args(args...));
+		if constexpr (LOG_MIN_LEVEL <= LOG_LEVEL_ERROR) {
+			if (enabled(LogLevel::ERROR))
+				Logger::log(LogLevel::ERROR, fmt,
+				    fmt::make_format_args(args...));
+		}
 	}
 
-	static void log(const char *level, const char *fmt,
+	static bool enabled(LogLevel level)
+	{
+		return (static_cast<int>(level) >= m_level.load(
+		    std::memory_order_relaxed));
+	}
+
+	static void set_level(LogLevel level);
+	static LogLevel level();
+
+	/* "debug", "info", "warning", "error" or "none" */
+	static LogLevel parse_level(const std::string &name);
+	static const char *level_name(LogLevel level);
+
+	static void log(LogLevel level, const char *fmt,
 	    fmt::format_args args);
+
+	/* Sinks are set up before start(), stdout is used if there are none */
+	static void add_sink(const std::shared_ptr<LogSink> &sink);
+	static void clear_sinks();
+
+	static void start();
+	static void stop();
+	static uint64_t dropped();
+
+protected:
+	struct Cell
+	{
+		std::atomic<size_t> seq;
+		LogRecord record;
+	};
+
+	static unsigned int thread_id();
+	static void emit(const LogRecord &record);
+	static bool dequeue();
+	static void worker();
+
+	static std::atomic<int> m_level;
+	static std::atomic<bool> m_async;
+	static std::atomic<bool> m_quit;
+	/* Callers between checking m_async and publishing their cell */
+	static std::atomic<unsigned int> m_writers;
+	static std::atomic<uint64_t> m_dropped;
+	static std::atomic<size_t> m_tail;
+	static size_t m_head;
+	static std::unique_ptr<Cell[]> m_cells;
+	static std::vector<std::shared_ptr<LogSink>> m_sinks;
+	static std::mutex m_sink_lock;
+	static std::mutex m_lock;
+	static std::condition_variable m_cond;
+	static std::thread m_thread;
 };
 
 #endif //DEVCLIENT_LOG_HH
@@ -0,0 +1,98 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_LOGSINK_HH
+#define DEVCLIENT_LOGSINK_HH
+
+#include <cstdio>
+#include <string>
+#include <log.hh>
+
+/* Rotate log files at 10 MiB and keep this many old ones */
+#define LOG_FILE_MAX_SIZE	(10 * 1024 * 1024)
+#define LOG_FILE_KEEP		5
+
+/* Destination of log records, only ever called from one thread at a time */
+class LogSink
+{
+public:
+	virtual ~LogSink() = default;
+	virtual void write(const LogRecord &record) = 0;
+	virtual void flush() {}
+
+	/* "2019-10-24 12:00:00.000 [3] INFO: message" */
+	static std::string format(const LogRecord &record);
+};
+
+/* Standard output, or another stdio stream such as stderr */
+class StdoutSink: public LogSink
+{
+public:
+	explicit StdoutSink(FILE *stream = stdout);
+
+	void write(const LogRecord &record) override;
+	void flush() override;
+
+protected:
+	FILE *m_stream;
+};
+
+class FileSink: public LogSink
+{
+public:
+	FileSink(const std::string &path, size_t max_size = LOG_FILE_MAX_SIZE,
+	    int keep = LOG_FILE_KEEP);
+	~FileSink() override;
+
+	void write(const LogRecord &record) override;
+	void flush() override;
+
+protected:
+	void open();
+	void rotate();
+
+	std::string m_path;
+	size_t m_max_size;
+	int m_keep;
+	size_t m_size;
+	FILE *m_file;
+};
+
+class SyslogSink: public LogSink
+{
+public:
+	explicit SyslogSink(const std::string &ident = "devclient");
+	~SyslogSink() override;
+
+	void write(const LogRecord &record) override;
+
+protected:
+	std::string m_ident;
+};
+
+#endif //DEVCLIENT_LOGSINK_HH
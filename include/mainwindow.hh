@@ -29,6 +29,9 @@
 #ifndef DEVCLIENT_MAINWINDOW_HH
 #define DEVCLIENT_MAINWINDOW_HH
 
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include <gtkmm.h>
 #include <formrow.hh>
 #include <uart.hh>
@@ -36,6 +39,7 @@
 #include <gpio.hh>
 #include <i2c.hh>
 #include <dtb.hh>
+#include <eeprom/catalogue.hh>
 //#include <profile.hh>
 
 class MainWindow;
@@ -80,6 +84,8 @@ protected:
 	FormRow<Gtk::Entry> m_address_row;
 	FormRow<Gtk::Entry> m_port_row;
 	FormRow<Gtk::ComboBoxText> m_baud_row;
+	FormRow<Gtk::ComboBoxText> m_format_row;
+	FormRow<Gtk::ComboBoxText> m_flow_row;
 	FormRow<Gtk::Entry> m_status_row;
 	Gtk::Separator m_separator;
 	Gtk::Label m_label;
@@ -153,13 +159,32 @@ class EepromTab: public Gtk::Box
 {
 public:
 	EepromTab(MainWindow *parent, const Device &dev);
+	virtual ~EepromTab();
+
+	void set_type(std::string type);
 
 protected:
+	enum class Operation
+	{
+		READ,
+		WRITE
+	};
+
 	void read_clicked();
 	void write_clicked();
+	void cancel_clicked();
 	void compile_done(bool ok, int size, const std::string &errors);
 	void decompile_done(bool ok, int size, const std::string &errors);
+	const EepromModel &model();
+
+	/* Worker thread running a single EEPROM operation */
+	void start_worker(Operation op);
+	void worker(Operation op, const EepromModel &model);
+	void worker_progress();
+	void worker_done();
+	void set_busy(bool busy);
 
+	FormRow<Gtk::ComboBoxText> m_model_row;
 	Glib::RefPtr<Gtk::TextBuffer> m_textbuffer;
 	Gtk::ScrolledWindow m_scroll;
 	Gtk::TextView m_textview;
@@ -167,6 +192,18 @@ protected:
 	Gtk::Button m_read;
 	Gtk::Button m_write;
 	Gtk::Button m_save;
+	Gtk::Button m_cancel;
+	Gtk::ProgressBar m_progress;
+	Glib::Dispatcher m_progress_signal;
+	Glib::Dispatcher m_done_signal;
+	std::thread m_worker;
+	std::mutex m_worker_lock;
+	std::atomic<bool> m_cancelled;
+	Operation m_operation;
+	double m_fraction;
+	size_t m_pages;
+	int m_size;
+	std::string m_error;
 	std::shared_ptr<DTB> m_dtb;
 	std::shared_ptr<std::string> m_textual;
 	std::shared_ptr<std::vector<uint8_t>> m_blob;
@@ -219,6 +256,7 @@ public:
 	void set_jtag_gdb_port(std::string port);
 	void set_jtag_ocd_port(std::string port);
 	void set_jtag_script(std::string script);
+	void set_eeprom_type(std::string type);
 	
 protected:
 	Gtk::Notebook m_notebook;
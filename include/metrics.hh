@@ -0,0 +1,220 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_METRICS_HH
+#define DEVCLIENT_METRICS_HH
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/socket.h>
+#include <eventloop.hh>
+
+/* Label name and value pairs of one series, kept sorted by name */
+using MetricLabels = std::map<std::string, std::string>;
+
+/* Upper bounds in seconds for latencies, from 100 us to 30 s */
+#define METRICS_LATENCY_BUCKETS { \
+	0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, \
+	0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30 }
+
+/* Upper bounds in bytes for USB transfer sizes */
+#define METRICS_SIZE_BUCKETS { \
+	0, 64, 256, 512, 1024, 4096, 16384, 65536 }
+
+/* Monotonic count, safe to bump from any thread */
+class MetricCounter
+{
+public:
+	MetricCounter(): m_value(0) {}
+
+	void add(uint64_t n = 1)
+	{
+		m_value.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	uint64_t value() const
+	{
+		return (m_value.load(std::memory_order_relaxed));
+	}
+
+protected:
+	std::atomic<uint64_t> m_value;
+};
+
+/* Current level of something, such as connected clients */
+class MetricGauge
+{
+public:
+	MetricGauge(): m_value(0) {}
+
+	void add(int64_t n = 1)
+	{
+		m_value.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	void set(int64_t n)
+	{
+		m_value.store(n, std::memory_order_relaxed);
+	}
+
+	int64_t value() const
+	{
+		return (m_value.load(std::memory_order_relaxed));
+	}
+
+protected:
+	std::atomic<int64_t> m_value;
+};
+
+/*
+ * Distribution of observed values over fixed buckets. Observing takes
+ * a scan of the bounds and two relaxed atomic increments, no locks, so
+ * it can sit on the USB and I2C paths. A scrape racing with observers
+ * may see counts and sum from slightly different moments.
+ */
+class MetricHistogram
+{
+public:
+	explicit MetricHistogram(const std::vector<double> &bounds);
+
+	void observe(double value);
+
+	/* Observes the time elapsed since start, in seconds */
+	void observe_since(std::chrono::steady_clock::time_point start);
+
+	const std::vector<double> &bounds() const;
+
+	/* Per bucket counts, the last one being the +Inf bucket */
+	std::vector<uint64_t> counts() const;
+	double sum() const;
+
+protected:
+	std::vector<double> m_bounds;
+	std::unique_ptr<std::atomic<uint64_t>[]> m_counts;
+	std::atomic<double> m_sum;
+};
+
+/*
+ * Registry of every counter, gauge and histogram of the process,
+ * rendered in the Prometheus text exposition format. Series are
+ * created on first use and shared by everything asking for the same
+ * name and labels, so instrumented objects can come and go.
+ */
+class Metrics
+{
+public:
+	static Metrics &instance();
+
+	std::shared_ptr<MetricCounter> counter(const std::string &name,
+	    const std::string &help, const MetricLabels &labels = {});
+	std::shared_ptr<MetricGauge> gauge(const std::string &name,
+	    const std::string &help, const MetricLabels &labels = {});
+	std::shared_ptr<MetricHistogram> histogram(const std::string &name,
+	    const std::string &help, const std::vector<double> &bounds,
+	    const MetricLabels &labels = {});
+
+	/* Drops one series, for labels that go away such as clients */
+	void remove(const std::string &name, const MetricLabels &labels);
+
+	std::string render() const;
+
+protected:
+	enum class Type
+	{
+		COUNTER,
+		GAUGE,
+		HISTOGRAM
+	};
+
+	struct Series
+	{
+		std::shared_ptr<MetricCounter> counter;
+		std::shared_ptr<MetricGauge> gauge;
+		std::shared_ptr<MetricHistogram> histogram;
+	};
+
+	struct Family
+	{
+		Type type;
+		std::string help;
+		std::map<MetricLabels, Series> series;
+	};
+
+	Metrics() = default;
+	Series &series(const std::string &name, const std::string &help,
+	    Type type, const MetricLabels &labels);
+
+	mutable std::mutex m_lock;
+	std::map<std::string, Family> m_families;
+};
+
+/*
+ * Minimal HTTP/1.0 server answering GET /metrics with Metrics::render()
+ * so the process can be scraped by Prometheus. One response per
+ * connection, handled on the given event loop.
+ */
+class MetricsServer
+{
+public:
+	MetricsServer(EventLoop &loop, const struct sockaddr *addr,
+	    socklen_t addrlen);
+	virtual ~MetricsServer();
+
+	void start();
+	void stop();
+
+protected:
+	struct Client
+	{
+		int fd;
+		std::string request;
+		std::string response;
+		size_t offset;
+	};
+
+	void accept_ready();
+	void client_ready(const std::shared_ptr<Client> &client,
+	    uint32_t events);
+	void respond(Client &client);
+	bool send(Client &client);
+	void close_client(const std::shared_ptr<Client> &client);
+
+	EventLoop &m_loop;
+	int m_listen_fd;
+	bool m_started;
+	std::map<int, std::shared_ptr<Client>> m_clients;
+};
+
+#endif //DEVCLIENT_METRICS_HH
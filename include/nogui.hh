@@ -1,34 +1,62 @@
 #ifndef NOGUI_HH
 #define NOGUI_HH
 
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <device.hh>
 #include <uart.hh>
 #include <jtag.hh>
 
+/*
+ * Hands the device registry's notifications about one cable over to the
+ * main loop, so the command line services can be stopped when it is
+ * unplugged and brought back up when it returns, as the daemon does.
+ */
+class DeviceWatch
+{
+public:
+	using Callback = std::function<void(const Device &, bool present)>;
+
+	DeviceWatch(const std::string &serial, const Callback &callback);
+	virtual ~DeviceWatch();
+
+private:
+	void changed();
+
+	std::string m_serial;
+	Callback m_callback;
+
+	/* Filled on the device registry thread, drained on the main loop */
+	std::mutex m_changes_lock;
+	std::vector<std::pair<Device, bool>> m_changes;
+	Glib::Dispatcher m_changed;
+	int m_listener;
+	bool m_delivering;
+};
+
 class SerialCmdLine
 {
 public:
-	SerialCmdLine(const Device &device, const Glib::RefPtr<Gio::SocketAddress> &addr, int baudrate);
+	SerialCmdLine(const Device &device, const Glib::RefPtr<Gio::SocketAddress> &addr, int baudrate, const UartOptions &options = UartOptions());
 
 	std::shared_ptr<Uart> m_uart;
-	Glib::RefPtr<Gio::ThreadedSocketService> m_socket_service;
 	sigc::signal<void, Glib::RefPtr<Gio::SocketAddress>> m_connected;
 	sigc::signal<void, Glib::RefPtr<Gio::SocketAddress>> m_disconnected;
 	Glib::RefPtr<Glib::MainLoop> main_loop;
 	void start();
 
 private:
-	bool socket_worker(const Glib::RefPtr<Gio::SocketConnection> &conn, const Glib::RefPtr<Glib::Object> &source);
-	std::vector<UartConnection> m_connections;
-	void usb_worker();
-	void remove_connection(const UartConnection &conn);
+	void open();
+	void device_changed(const Device &device, bool present);
+
 	Device m_device;
-	Ftdi::Context m_context;
-	void client_connected(Glib::RefPtr<Gio::SocketAddress> addr);
-	void client_disconnected(Glib::RefPtr<Gio::SocketAddress> addr);
 	Glib::RefPtr<Gio::SocketAddress> m_addr;
 	int m_baudrate;
-	std::thread m_usb_worker;
-	bool m_running;
+	UartOptions m_options;
+	std::unique_ptr<DeviceWatch> m_watch;
 };
 
 class JtagCmdLine
@@ -40,18 +68,24 @@ public:
 	JtagCmdLine(const Device &device, Glib::RefPtr<Gio::InetAddress> address, uint16_t gdb_port,  uint16_t ocd_port, const std::string &board_script);
 	JtagCmdLine(const Device &device);
 	std::shared_ptr<JtagServer> m_server;
-	void bypass(const Device &device);
+	void bypass(const Device &device,
+	    const ChannelTuning &tuning = ChannelTuning::channel("jtag"));
 	void on_output_ready(const std::string &output);
 	void on_server_start();
 	void on_server_exit();
 
 private:
-	const Device &m_device;
+	void open();
+	void device_changed(const Device &device, bool present);
+
+	/* A copy, the JTAG server keeps a reference to it */
+	Device m_device;
 	Glib::RefPtr<Gio::InetAddress> m_address;
 	uint16_t m_ocd_port;
 	uint16_t m_gdb_port;
 	std::string m_board_script;
 	bool m_running;
+	std::unique_ptr<DeviceWatch> m_watch;
 };
 
 #endif // NOGUI_HH
@@ -0,0 +1,140 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_RING_HH
+#define DEVCLIENT_RING_HH
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <sys/uio.h>
+
+/*
+ * What a reader does once the producer has lapped it and the bytes it
+ * had not consumed yet have been overwritten.
+ */
+enum class RingLagPolicy
+{
+	SKIP,		/* jump ahead to the oldest data still in the ring */
+	DROP		/* give up on the reader */
+};
+
+/*
+ * Single producer, multiple consumer byte ring. The producer publishes
+ * data once and never waits for readers: a reader that falls more than
+ * the ring capacity behind finds out on its next read and loses the
+ * overwritten bytes. Each reader keeps its own cursor, see RingReader.
+ */
+class ByteRing
+{
+public:
+	explicit ByteRing(size_t capacity);
+
+	/* Producer side, must only be called from a single thread */
+	void write(const uint8_t *buf, size_t len);
+
+	/*
+	 * Zero-copy producer side: reserve() returns contiguous space for
+	 * up to len bytes (len is trimmed at the end of the ring), which
+	 * the caller fills and then publishes with commit().
+	 */
+	uint8_t *reserve(size_t &len);
+	void commit(size_t len);
+
+	uint64_t head() const;
+	size_t capacity() const;
+
+	/* Waits until data past the cursor is published or the timeout */
+	bool wait(uint64_t cursor, std::chrono::milliseconds timeout);
+
+	/* Wakes up all waiting readers, eg. on shutdown */
+	void wake();
+
+protected:
+	friend class RingReader;
+
+	std::vector<uint8_t> m_buffer;
+	size_t m_mask;
+	std::atomic<uint64_t> m_head;
+	std::atomic<uint64_t> m_reserve;
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+};
+
+class RingReader
+{
+public:
+	/*
+	 * Starts reading history bytes before the current ring head, as
+	 * far as they are still in the ring (at most half of it).
+	 */
+	explicit RingReader(ByteRing &ring, size_t history = 0);
+
+	/*
+	 * Copies up to len unread bytes into buf and returns the number
+	 * of bytes copied. If the reader has been lapped, skipped is set
+	 * to the number of bytes lost and the cursor moves past them.
+	 */
+	size_t read(uint8_t *buf, size_t len, size_t &skipped);
+
+	/*
+	 * Like read(), but leaves the cursor where it is so that the
+	 * caller can consume() only what it managed to pass on. The copy
+	 * is checked against the producer, it never holds torn bytes.
+	 */
+	size_t copy(uint8_t *buf, size_t len, size_t &skipped);
+
+	/*
+	 * Points iov (two entries) at up to len unread bytes inside the
+	 * ring and returns their count. The producer may overwrite them
+	 * at any time, so this is only fit for looking at the data (eg.
+	 * for a line boundary), never for passing it on. Readers close
+	 * to being lapped are skipped ahead first.
+	 */
+	size_t peek(struct iovec *iov, int &iovcnt, size_t len,
+	    size_t &skipped);
+
+	/* Advances the cursor past bytes taken with copy() or peek() */
+	void consume(size_t len);
+
+	uint64_t cursor() const;
+	uint64_t lost() const;
+
+protected:
+	void skip(uint64_t reserve, size_t &skipped);
+
+	ByteRing &m_ring;
+	uint64_t m_cursor;
+	uint64_t m_lost;
+};
+
+#endif //DEVCLIENT_RING_HH
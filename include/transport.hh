@@ -0,0 +1,119 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_TRANSPORT_HH
+#define DEVCLIENT_TRANSPORT_HH
+
+#include <memory>
+#include <string>
+#include <ftdi.hpp>
+#include <device.hh>
+#include <eventloop.hh>
+#include <ring.hh>
+#include <usbrx.hh>
+
+/*
+ * One channel of an FT4232H, as seen by the classes driving it. The
+ * calls mirror Ftdi::Context and, like it, return 0 (or a byte count)
+ * on success and a negative value on failure, with the reason left in
+ * error_string(). FtdiTransport talks to a real cable through libftdi,
+ * SimTransport to the FtdiSimulator model.
+ */
+class Transport
+{
+public:
+	virtual ~Transport() {}
+
+	virtual int open(const Device &device, enum ftdi_interface channel) = 0;
+	virtual int close() = 0;
+	virtual int reset() = 0;
+
+	virtual int set_bitmode(uint8_t mask, uint8_t mode) = 0;
+	virtual int bitbang_disable() = 0;
+
+	/* baud_rate() is the rate the divisor really produces */
+	virtual int set_baud_rate(int baudrate) = 0;
+	virtual int baud_rate() = 0;
+	virtual int set_line_property(enum ftdi_bits_type bits,
+	    enum ftdi_stopbits_type stop, enum ftdi_parity_type parity) = 0;
+
+	/* One of the SIO_*_HS values, XON/XOFF uses the given characters */
+	virtual int set_flow_control(int flow, uint8_t xon, uint8_t xoff) = 0;
+
+	virtual int set_latency(int latency) = 0;
+	virtual int latency() = 0;
+	virtual int set_read_chunk_size(int size) = 0;
+	virtual int read_chunk_size() = 0;
+	virtual int set_write_chunk_size(int size) = 0;
+	virtual int write_chunk_size() = 0;
+
+	virtual int write(const uint8_t *buf, size_t len) = 0;
+	virtual int read(uint8_t *buf, size_t len) = 0;
+	virtual int read_pins(uint8_t *pins) = 0;
+	virtual std::string error_string() = 0;
+
+	/* Streams the channel's UART input into a ring, see UsbReceiver */
+	virtual std::unique_ptr<Receiver> receiver(ByteRing &ring,
+	    size_t depth, size_t chunk, EventLoop *loop) = 0;
+
+	/* A closed transport suited to the device, simulated or not */
+	static std::unique_ptr<Transport> create(const Device &device);
+};
+
+class FtdiTransport: public Transport
+{
+public:
+	int open(const Device &device, enum ftdi_interface channel) override;
+	int close() override;
+	int reset() override;
+	int set_bitmode(uint8_t mask, uint8_t mode) override;
+	int bitbang_disable() override;
+	int set_baud_rate(int baudrate) override;
+	int baud_rate() override;
+	int set_line_property(enum ftdi_bits_type bits,
+	    enum ftdi_stopbits_type stop,
+	    enum ftdi_parity_type parity) override;
+	int set_flow_control(int flow, uint8_t xon, uint8_t xoff) override;
+	int set_latency(int latency) override;
+	int latency() override;
+	int set_read_chunk_size(int size) override;
+	int read_chunk_size() override;
+	int set_write_chunk_size(int size) override;
+	int write_chunk_size() override;
+	int write(const uint8_t *buf, size_t len) override;
+	int read(uint8_t *buf, size_t len) override;
+	int read_pins(uint8_t *pins) override;
+	std::string error_string() override;
+	std::unique_ptr<Receiver> receiver(ByteRing &ring, size_t depth,
+	    size_t chunk, EventLoop *loop) override;
+
+protected:
+	Ftdi::Context m_context;
+};
+
+#endif //DEVCLIENT_TRANSPORT_HH
@@ -0,0 +1,62 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_TUNING_HH
+#define DEVCLIENT_TUNING_HH
+
+#include <string>
+#include <transport.hh>
+
+/*
+ * USB tuning of a single FTDI channel. Unset values (-1) leave the
+ * libftdi defaults alone: a 16 ms latency timer and 4 KiB chunks.
+ */
+struct ChannelTuning
+{
+	int latency = -1;	/* latency timer in ms, 1 to 255 */
+	int read_chunk = -1;	/* bytes per USB read */
+	int write_chunk = -1;	/* bytes per USB write */
+
+	/* Applies the set values to an open channel, throws on failure */
+	void apply(Transport &transport, const std::string &name) const;
+
+	/* Sets "latency", "read_chunk" or "write_chunk", throws on error */
+	void set(const std::string &key, int value);
+
+	/*
+	 * Settings for a channel by name: "uart", "i2c", "jtag" or "gpio".
+	 * Filled in from the command line at startup and only read
+	 * afterwards. Daemon device blocks start from a copy of these.
+	 */
+	static ChannelTuning &channel(const std::string &name);
+
+	/* Parses "channel:key=value[,key=value...]", throws on error */
+	static void parse(const std::string &spec);
+};
+
+#endif //DEVCLIENT_TUNING_HH
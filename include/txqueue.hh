@@ -0,0 +1,112 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_TXQUEUE_HH
+#define DEVCLIENT_TXQUEUE_HH
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdint>
+
+/* Largest single write, so flow control is rechecked in between */
+#define TXQUEUE_BATCH		4096
+
+/* How often a stopped queue rechecks whether the device is ready */
+#define TXQUEUE_READY_POLL	std::chrono::milliseconds(1)
+
+/* Default coalescing: one high speed bulk packet or one millisecond */
+#define TXQUEUE_FLUSH_SIZE	512
+#define TXQUEUE_FLUSH_DELAY	std::chrono::microseconds(1000)
+
+struct TxQueueStats
+{
+	uint64_t bytes;		/* bytes handed to the writer */
+	uint64_t writes;	/* writer calls, i.e. USB bulk writes */
+};
+
+/*
+ * Transmit queue in front of a blocking writer. Small pushes are held
+ * back until either flush_size bytes are pending or the oldest of them
+ * has waited flush_delay, so that a burst of short socket reads turns
+ * into a few full writes instead of one write each. Producers never block:
+ * instead the pressure callback fires with true once more than the
+ * high watermark is queued and with false once the queue has drained
+ * below the low watermark, so they can stop and resume feeding it.
+ */
+class TxQueue
+{
+public:
+	/* Returns the number of bytes written or a negative error */
+	using Writer = std::function<int(const uint8_t *, size_t)>;
+	using Ready = std::function<bool()>;
+	using Pressure = std::function<void(bool)>;
+
+	TxQueue(const Writer &writer, size_t low, size_t high);
+	virtual ~TxQueue();
+
+	void start();
+	void stop();
+	void push(const uint8_t *buf, size_t len);
+
+	/* Called before each write, writes are held while it is false */
+	void set_ready(const Ready &ready);
+	void set_pressure(const Pressure &pressure);
+
+	/* A zero delay writes out whatever is pending straight away */
+	void set_coalesce(size_t flush_size, std::chrono::microseconds delay);
+
+	size_t pending();
+	TxQueueStats stats() const;
+
+protected:
+	void worker();
+
+	Writer m_writer;
+	Ready m_ready;
+	Pressure m_pressure;
+	std::vector<uint8_t> m_queue;
+	size_t m_low;
+	size_t m_high;
+	size_t m_flush_size;
+	std::chrono::microseconds m_flush_delay;
+	std::chrono::steady_clock::time_point m_oldest;
+	bool m_stalled;
+	bool m_running;
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+	std::thread m_thread;
+	std::atomic<uint64_t> m_written;
+	std::atomic<uint64_t> m_writes;
+};
+
+#endif //DEVCLIENT_TXQUEUE_HH
@@ -32,51 +32,117 @@
 #ifndef DEVCLIENT_UART_HH
 #define DEVCLIENT_UART_HH
 
+#include <atomic>
+#include <memory>
 #include <thread>
-#include <vector>
 #include <giomm.h>
-#include <ftdi.hpp>
 #include <device.hh>
+#include <baudrate.hh>
+#include <capture.hh>
+#include <console.hh>
+#include <eventloop.hh>
+#include <metrics.hh>
+#include <ring.hh>
+#include <transport.hh>
+#include <tuning.hh>
+#include <txqueue.hh>
+#include <usbrx.hh>
 
-class UartConnection
+/* Bytes of console output kept for clients that fall behind */
+#define UART_RING_SIZE		(1024 * 1024)
+
+/* Earlier output replayed to clients when they connect */
+#define UART_SCROLLBACK		(64 * 1024)
+
+/* Seconds of output at line rate the ring should hold at least */
+#define UART_RING_SECONDS	2
+
+/* Typed-in bytes queued towards the chip before clients are paused */
+#define UART_TX_HIGH_WATER	(64 * 1024)
+#define UART_TX_LOW_WATER	(16 * 1024)
+
+/* Software flow control characters (DC1/DC3) */
+#define UART_XON		0x11
+#define UART_XOFF		0x13
+
+/* Tunables for a UART channel, defaults suit an interactive console */
+struct UartOptions
 {
-public:
-	Glib::RefPtr<Gio::SocketAddress> m_address;
-	Glib::RefPtr<Gio::SocketConnection> m_conn;
-	Glib::RefPtr<Gio::OutputStream> m_ostream;
-	Glib::RefPtr<Gio::Cancellable> m_cancel;
-
-	inline bool operator==(const UartConnection &other)
-	{
-		return (m_address.get() == other.m_address.get());
-	}
+	size_t rx_depth = USBRX_DEFAULT_DEPTH;
+	size_t rx_chunk = USBRX_DEFAULT_CHUNK;
+	size_t ring_size = UART_RING_SIZE;
+	size_t scrollback = UART_SCROLLBACK;
+	int latency = 16;
+	int write_chunk = -1;
+	enum ftdi_bits_type data_bits = BITS_8;
+	enum ftdi_parity_type parity = NONE;
+	enum ftdi_stopbits_type stop_bits = STOP_BIT_1;
+	int flow = SIO_DISABLE_FLOW_CTRL;
+	size_t tx_flush_size = TXQUEUE_FLUSH_SIZE;
+	std::chrono::microseconds tx_flush_delay = TXQUEUE_FLUSH_DELAY;
+	/* Session capture file, none if empty, see CaptureWriter */
+	std::string capture_path;
+	bool capture_tx = false;
+
+	/* Line format such as "8N1" or "7E2": data bits, N/O/E/M/S, stop bits */
+	void set_format(const std::string &format);
+
+	/* One of "none", "rtscts", "dtrdsr" or "xonxoff" */
+	void set_flow(const std::string &flow);
+
+	std::string format_name() const;
+	std::string flow_name() const;
+
+	/*
+	 * Buffer sizes and latency timer scaled to the line rate, with
+	 * the given (by default the "uart" ChannelTuning) values taking
+	 * precedence.
+	 */
+	static UartOptions for_baudrate(int baudrate);
+	static UartOptions for_baudrate(int baudrate,
+	    const ChannelTuning &tuning);
 };
 
 class Uart
 {
 public:
+	/* Creates a private event loop unless a shared one is given */
 	Uart(const Device &device, const Glib::RefPtr<Gio::SocketAddress> &addr,
-	    int baudrate);
+	    int baudrate, const UartOptions &options = UartOptions(),
+	    std::shared_ptr<EventLoop> loop = nullptr);
 	virtual ~Uart();
 	void start();
 	void stop();
+	void set_lag_policy(RingLagPolicy policy);
+	UsbReceiverStats rx_stats() const;
+	TxQueueStats tx_stats() const;
+	int actual_baudrate() const;
 
 	sigc::signal<void, Glib::RefPtr<Gio::SocketAddress>> m_connected;
 	sigc::signal<void, Glib::RefPtr<Gio::SocketAddress>> m_disconnected;
 
 protected:
-	void remove_connection(const UartConnection &conn);
-	void usb_worker();
-	bool socket_worker(
-	    const Glib::RefPtr<Gio::SocketConnection> &conn,
-	    const Glib::RefPtr<Glib::Object> &source);
-
-	Ftdi::Context m_context;
-	Glib::RefPtr<Gio::ThreadedSocketService> m_socket_service;
-	std::vector<UartConnection> m_connections;
-	std::thread m_usb_worker;
+	void client_input(const uint8_t *buf, size_t len);
+	void set_flow_control();
+	bool tx_ready() const;
+	int write(const uint8_t *buf, size_t len);
+
+	std::unique_ptr<Transport> m_transport;
+	UartOptions m_options;
+	std::shared_ptr<EventLoop> m_loop;
+	bool m_own_loop;
+	ByteRing m_ring;
+	std::unique_ptr<ConsoleServer> m_server;
+	std::unique_ptr<Receiver> m_receiver;
+	std::unique_ptr<TxQueue> m_tx;
+	std::unique_ptr<CaptureWriter> m_capture;
 	Device m_device;
-	bool m_running;
+	int m_actual_baudrate;
+	std::atomic<bool> m_running;
+	ReceiverMetrics m_rx_metrics;
+	std::shared_ptr<MetricCounter> m_tx_bytes;
+	std::shared_ptr<MetricCounter> m_write_errors;
+	std::shared_ptr<MetricHistogram> m_write_time;
 };
 
 #endif //DEVCLIENT_UART_HH
@@ -0,0 +1,156 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_USBRX_HH
+#define DEVCLIENT_USBRX_HH
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <ftdi.h>
+#include <eventloop.hh>
+#include <metrics.hh>
+#include <ring.hh>
+
+/* Transfers kept in flight and bytes per transfer */
+#define USBRX_DEFAULT_DEPTH	8
+#define USBRX_DEFAULT_CHUNK	(16 * 1024)
+
+/* Modem status bits in the first byte of every FTDI packet */
+#define USBRX_STATUS_CTS	(1 << 4)
+#define USBRX_STATUS_DSR	(1 << 5)
+
+/* Line status bits in the second byte of every FTDI packet */
+#define USBRX_STATUS_OE		(1 << 1)
+
+struct UsbReceiverStats
+{
+	uint64_t bytes;		/* payload bytes published */
+	uint64_t transfers;	/* completed bulk-in transfers */
+	uint64_t overruns;	/* packets flagged with an FTDI FIFO overrun */
+	uint64_t failed;	/* transfers that completed with an error */
+	uint64_t dropped;	/* payload bytes lost with failed transfers */
+};
+
+/* Series a receive path reports into, any of them may be null */
+struct ReceiverMetrics
+{
+	std::shared_ptr<MetricHistogram> read_sizes;	/* payload bytes */
+	std::shared_ptr<MetricCounter> overruns;
+	std::shared_ptr<MetricCounter> dropped;
+};
+
+/* Receive side of a UART channel, whatever carries the data */
+class Receiver
+{
+public:
+	virtual ~Receiver() {}
+
+	/* To be called before start() */
+	void set_metrics(const ReceiverMetrics &metrics)
+	{
+		m_metrics = metrics;
+	}
+
+	virtual void start() = 0;
+	virtual void stop() = 0;
+
+	/* Called on the receive thread after data has been published */
+	virtual void set_notify(const std::function<void()> &notify) = 0;
+
+	virtual UsbReceiverStats stats() const = 0;
+
+	/* Last modem status byte, see USBRX_STATUS_* */
+	virtual uint8_t modem_status() const = 0;
+
+protected:
+	ReceiverMetrics m_metrics;
+};
+
+/*
+ * Receive engine for an FTDI channel that keeps several libusb bulk-in
+ * transfers in flight at all times, so the chip FIFO is drained even
+ * while earlier data is still being handled. Payload bytes, minus the
+ * two modem status bytes FTDI puts in front of each packet, go
+ * straight into a ByteRing.
+ *
+ * Completions are handled on a thread of its own, or, if an event loop
+ * is given, by watching the libusb file descriptors on that loop so
+ * that many receivers can share a few threads.
+ */
+class UsbReceiver: public Receiver
+{
+public:
+	UsbReceiver(struct ftdi_context *ctx, ByteRing &ring,
+	    size_t depth = USBRX_DEFAULT_DEPTH,
+	    size_t chunk = USBRX_DEFAULT_CHUNK, EventLoop *loop = nullptr);
+	virtual ~UsbReceiver();
+
+	void start() override;
+	void stop() override;
+	void set_notify(const std::function<void()> &notify) override;
+	UsbReceiverStats stats() const override;
+	uint8_t modem_status() const override;
+
+protected:
+	static void LIBUSB_CALL transfer_done(struct libusb_transfer *transfer);
+	static void LIBUSB_CALL pollfd_added(int fd, short events, void *arg);
+	static void LIBUSB_CALL pollfd_removed(int fd, void *arg);
+	bool attach();
+	void detach();
+	void watch(int fd, short events);
+	void handle_events();
+	void completed(struct libusb_transfer *transfer);
+	size_t unpack(uint8_t *buf, size_t len);
+	void event_worker();
+
+	struct ftdi_context *m_ctx;
+	ByteRing &m_ring;
+	size_t m_depth;
+	size_t m_chunk;
+	EventLoop *m_loop;
+	bool m_attached;
+	std::function<void()> m_notify;
+	std::vector<struct libusb_transfer *> m_transfers;
+	std::vector<std::vector<uint8_t>> m_buffers;
+	std::thread m_thread;
+	std::atomic<bool> m_running;
+	std::atomic<size_t> m_inflight;
+	std::atomic<uint64_t> m_bytes;
+	std::atomic<uint64_t> m_completed;
+	std::atomic<uint64_t> m_overruns;
+	std::atomic<uint64_t> m_failed;
+	std::atomic<uint64_t> m_dropped;
+	std::atomic<uint8_t> m_modem_status;
+	std::chrono::steady_clock::time_point m_last_warning;
+};
+
+#endif //DEVCLIENT_USBRX_HH
@@ -0,0 +1,114 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <baudrate.hh>
+
+/* Fractional divisor bits in the order the chip expects them */
+static const uint8_t frac_code[8] = { 0, 3, 2, 4, 1, 5, 6, 7 };
+
+static int
+to_clkbits(int rate, int64_t clk, int64_t clk_div, uint32_t &divisor)
+{
+	int64_t best_divisor;
+	int64_t best_rate;
+	int64_t div;
+
+	if (rate >= clk / clk_div) {
+		divisor = 0;
+		return (clk / clk_div);
+	}
+
+	if (rate >= clk / (clk_div + clk_div / 2)) {
+		divisor = 1;
+		return (clk / (clk_div + clk_div / 2));
+	}
+
+	if (rate >= clk / (2 * clk_div)) {
+		divisor = 2;
+		return (clk / (2 * clk_div));
+	}
+
+	/* Three fractional bits plus one for rounding */
+	div = clk * 16 / clk_div / rate;
+	best_divisor = (div & 1) ? div / 2 + 1 : div / 2;
+	if (best_divisor > 0x20000)
+		best_divisor = 0x1ffff;
+
+	best_rate = clk * 16 / clk_div / best_divisor;
+	best_rate = (best_rate & 1) ? best_rate / 2 + 1 : best_rate / 2;
+	divisor = (best_divisor >> 3) | (frac_code[best_divisor & 0x7] << 14);
+	return (best_rate);
+}
+
+BaudRate
+BaudRate::compute(int rate)
+{
+	BaudRate ret;
+
+	ret.requested = rate;
+	ret.divisor = 0;
+
+	if (rate <= 0) {
+		ret.actual = 0;
+		return (ret);
+	}
+
+	if (static_cast<int64_t>(rate) * 10 > BAUDRATE_H_CLOCK / 0x3fff) {
+		ret.actual = to_clkbits(rate, BAUDRATE_H_CLOCK, 10,
+		    ret.divisor);
+		ret.divisor |= 0x20000;
+	} else
+		ret.actual = to_clkbits(rate, BAUDRATE_CLOCK, 16, ret.divisor);
+
+	return (ret);
+}
+
+double
+BaudRate::error() const
+{
+	if (requested <= 0)
+		return (1.0);
+
+	return (static_cast<double>(actual - requested) / requested);
+}
+
+bool
+BaudRate::valid() const
+{
+	int64_t low, high;
+
+	if (requested <= 0 || actual <= 0 ||
+	    static_cast<int64_t>(actual) * 2 < requested)
+		return (false);
+
+	low = std::min(actual, requested);
+	high = std::max(actual, requested);
+	return (low * 21 >= high * 20);
+}
@@ -0,0 +1,212 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <cctype>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <fmt/format.h>
+#include <boardimages.hh>
+
+/* Splits one CSV line, with RFC 4180 quoting; false if a quote is left open */
+static bool
+split_csv(const std::string &line, std::vector<std::string> &fields)
+{
+	std::string field;
+	bool quoted = false;
+	size_t i;
+
+	fields.clear();
+
+	for (i = 0; i < line.size(); i++) {
+		if (quoted && line[i] == '"' && i + 1 < line.size() &&
+		    line[i + 1] == '"') {
+			field += '"';
+			i++;
+		} else if (line[i] == '"')
+			quoted = !quoted;
+		else if (line[i] == ',' && !quoted) {
+			fields.push_back(field);
+			field.clear();
+		} else if (line[i] != '\r' || quoted)
+			field += line[i];
+	}
+
+	fields.push_back(field);
+	return (!quoted);
+}
+
+/*
+ * A header column is a property path, optionally followed by the type
+ * its values are in: "ethaddr-eth0:bytes". Without one, the type it is
+ * written with in the template is kept.
+ */
+static std::optional<FdtType>
+column_type(const std::string &column, std::string &path)
+{
+	size_t colon = column.rfind(':');
+	std::string type;
+
+	path = column.substr(0, colon);
+	if (colon == std::string::npos)
+		return (std::nullopt);
+
+	type = column.substr(colon + 1);
+	if (type == "string")
+		return (FdtType::STRINGS);
+
+	if (type == "cells")
+		return (FdtType::CELLS);
+
+	if (type == "bytes")
+		return (FdtType::BYTES);
+
+	throw std::runtime_error(fmt::format("{}: type '{}' is not string, "
+	    "cells or bytes", path, type));
+}
+
+/* Image file name for a board, from its first field */
+static std::string
+image_name(const std::string &value)
+{
+	std::string ret = value;
+
+	for (auto &c: ret) {
+		if (!std::isalnum(static_cast<unsigned char>(c)) &&
+		    c != '-' && c != '_' && c != '.')
+			c = '_';
+	}
+
+	return (ret + ".dtb");
+}
+
+/* Names from an "image" column stay inside the output directory */
+static void
+check_image_name(const std::string &name)
+{
+	if (name.empty() || name[0] == '.' || image_name(name) != name + ".dtb")
+		throw std::runtime_error(fmt::format("image name '{}' can only "
+		    "have letters, digits, '-', '_' and '.', and cannot start "
+		    "with '.'", name));
+}
+
+BoardImages::BoardImages(const DeviceTree &tree, const EepromModel &model):
+	m_tree(tree),
+	m_model(model)
+{
+}
+
+size_t
+BoardImages::generate(std::istream &csv, const std::string &csv_name,
+    const Sink &sink)
+{
+	std::vector<std::vector<uint8_t>> values;
+	std::map<std::string, size_t> written;
+	std::vector<std::string> header, row;
+	std::vector<uint8_t> image;
+	std::vector<int> columns;
+	std::optional<FdtType> type;
+	DtbTemplate tmpl(m_tree);
+	std::string line, name, path;
+	int image_column = -1;
+	size_t lineno = 1;
+	size_t count = 0;
+	size_t i;
+
+	if (!std::getline(csv, line))
+		throw std::runtime_error(fmt::format(
+		    "Cannot read a header row from {}", csv_name));
+
+	try {
+		if (!split_csv(line, header))
+			throw std::runtime_error("unterminated quote");
+
+		for (i = 0; i < header.size(); i++) {
+			if (header[i] == "image") {
+				image_column = i;
+				continue;
+			}
+
+			columns.push_back(i);
+			type = column_type(header[i], path);
+			tmpl.add_field(path, type);
+		}
+
+		if (columns.empty())
+			throw std::runtime_error("no property columns");
+	} catch (const std::runtime_error &err) {
+		throw std::runtime_error(fmt::format("{}:{}: {}", csv_name,
+		    lineno, err.what()));
+	}
+
+	values.resize(columns.size());
+
+	while (std::getline(csv, line)) {
+		lineno++;
+		if (line.empty() || line == "\r" || line[0] == '#')
+			continue;
+
+		try {
+			if (!split_csv(line, row))
+				throw std::runtime_error("unterminated quote");
+
+			if (row.size() != header.size())
+				throw std::runtime_error(fmt::format(
+				    "{} columns, the header has {}",
+				    row.size(), header.size()));
+
+			for (i = 0; i < columns.size(); i++)
+				values[i] = tmpl.encode(i, row[columns[i]]);
+
+			tmpl.render(values, image);
+			if (image.size() > m_model.size)
+				throw std::runtime_error(fmt::format(
+				    "{} bytes do not fit a {}", image.size(),
+				    m_model.name));
+
+			if (image_column >= 0) {
+				name = row[image_column];
+				check_image_name(name);
+			} else
+				name = image_name(row[columns[0]]);
+
+			if (!written.emplace(name, lineno).second)
+				throw std::runtime_error(fmt::format(
+				    "{} is written for line {} already", name,
+				    written[name]));
+		} catch (const std::runtime_error &err) {
+			throw std::runtime_error(fmt::format("{}:{}: {}",
+			    csv_name, lineno, err.what()));
+		}
+
+		sink(name, image);
+		count++;
+	}
+
+	return (count);
+}
@@ -0,0 +1,469 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <unistd.h>
+#include <fmt/format.h>
+#include <log.hh>
+#include <capture.hh>
+
+static uint64_t
+wall_clock()
+{
+	return (std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+static std::string
+format_time(uint64_t time)
+{
+	std::time_t seconds = time / 1000000000;
+	struct tm tm;
+	char stamp[32];
+
+	::localtime_r(&seconds, &tm);
+	std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	return (fmt::format("{}.{:06d}", stamp, (time / 1000) % 1000000));
+}
+
+/*
+ * A crash can leave the last record of a capture cut short, and index
+ * entries pointing at it. CaptureReader stops at such a record, so
+ * anything appended after it would be lost: cut the file back to the
+ * end of the last complete record first. The scan starts at the last
+ * index entry inside the file, as the data an entry points at always
+ * reaches the file before the entry does. Returns the time of the last
+ * record kept, so that a new session can carry on from there.
+ */
+static uint64_t
+truncate_torn(const std::string &path)
+{
+	std::string index_path = path + ".idx";
+	std::vector<CaptureIndexEntry> entries;
+	CaptureIndexEntry entry;
+	CaptureRecord record;
+	uint64_t last = 0;
+	off_t index_size = 0;
+	off_t end = sizeof(CaptureHeader);
+	off_t size;
+	off_t next;
+	size_t valid;
+	FILE *file;
+	FILE *index;
+
+	index = std::fopen(index_path.c_str(), "rb");
+	if (index != nullptr) {
+		while (std::fread(&entry, sizeof(entry), 1, index) == 1)
+			entries.push_back(entry);
+
+		::fseeko(index, 0, SEEK_END);
+		index_size = ::ftello(index);
+		std::fclose(index);
+	}
+
+	file = std::fopen(path.c_str(), "rb");
+	if (file == nullptr)
+		return (last);
+
+	::fseeko(file, 0, SEEK_END);
+	size = ::ftello(file);
+
+	for (auto i = entries.rbegin(); i != entries.rend(); i++) {
+		if (static_cast<off_t>(i->offset) < size) {
+			end = std::max<off_t>(end, i->offset);
+			last = i->time;
+			break;
+		}
+	}
+
+	::fseeko(file, end, SEEK_SET);
+	while (std::fread(&record, sizeof(record), 1, file) == 1) {
+		next = end + sizeof(record) + record.len;
+		if (next > size)
+			break;
+
+		last = std::max(last, record.time);
+		end = next;
+		::fseeko(file, end, SEEK_SET);
+	}
+
+	std::fclose(file);
+
+	if (end < size) {
+		Logger::warning("Capture: {} ends in a torn record, dropping "
+		    "its last {} bytes", path, size - end);
+
+		if (::truncate(path.c_str(), end) != 0) {
+			throw std::runtime_error(fmt::format(
+			    "Cannot truncate {}: {}", path, strerror(errno)));
+		}
+	}
+
+	/* Entries only ever point at the start of a complete record */
+	for (valid = 0; valid < entries.size(); valid++) {
+		if (static_cast<off_t>(entries[valid].offset) >= end)
+			break;
+	}
+
+	if (static_cast<off_t>(valid * sizeof(entry)) != index_size &&
+	    ::truncate(index_path.c_str(), valid * sizeof(entry)) != 0) {
+		throw std::runtime_error(fmt::format("Cannot truncate {}: {}",
+		    index_path, strerror(errno)));
+	}
+
+	return (last);
+}
+
+CaptureWriter::CaptureWriter(const std::string &path, ByteRing &ring):
+	m_path(path),
+	m_ring(ring),
+	m_reader(ring),
+	m_file(nullptr),
+	m_index(nullptr),
+	m_next_index(0),
+	m_running(false),
+	m_bytes(0),
+	m_lost(0)
+{
+	CaptureHeader header;
+	uint64_t last = 0;
+	uint64_t wall;
+	FILE *existing;
+
+	/* Keep the time base of an earlier session in the same file */
+	existing = std::fopen(path.c_str(), "rb");
+	if (existing != nullptr) {
+		if (std::fread(&header, sizeof(header), 1, existing) != 1 ||
+		    std::memcmp(header.magic, CAPTURE_MAGIC,
+		    sizeof(header.magic)) != 0) {
+			std::fclose(existing);
+			throw std::runtime_error(fmt::format(
+			    "{} is not a capture file", path));
+		}
+
+		std::fclose(existing);
+		last = truncate_torn(path);
+	} else {
+		std::memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+		header.start = wall_clock();
+	}
+
+	m_file = std::fopen(path.c_str(), "ab");
+	if (m_file == nullptr) {
+		throw std::runtime_error(fmt::format("Cannot open {}: {}",
+		    path, strerror(errno)));
+	}
+
+	if (existing == nullptr &&
+	    std::fwrite(&header, sizeof(header), 1, m_file) != 1) {
+		std::fclose(m_file);
+		throw std::runtime_error(fmt::format("Cannot write {}: {}",
+		    path, strerror(errno)));
+	}
+
+	m_index = std::fopen((path + ".idx").c_str(), "ab");
+	if (m_index == nullptr) {
+		std::fclose(m_file);
+		throw std::runtime_error(fmt::format("Cannot open {}.idx: {}",
+		    path, strerror(errno)));
+	}
+
+	/*
+	 * Record times must keep increasing across sessions for seek()'s
+	 * binary search, so a wall clock that went back since the last one
+	 * (or to before the file was started) only moves the base up to
+	 * where that session stopped.
+	 */
+	wall = wall_clock();
+	m_base = std::max(wall > header.start ? wall - header.start : 0, last);
+	m_session = std::chrono::steady_clock::now();
+	Logger::info("Capture: recording to {}", path);
+}
+
+CaptureWriter::~CaptureWriter()
+{
+	stop();
+	std::fclose(m_index);
+	std::fclose(m_file);
+}
+
+void
+CaptureWriter::start()
+{
+	if (m_running)
+		return;
+
+	m_running = true;
+	m_thread = std::thread(&CaptureWriter::worker, this);
+}
+
+void
+CaptureWriter::stop()
+{
+	if (!m_running)
+		return;
+
+	m_running = false;
+	m_ring.wake();
+	m_thread.join();
+
+	std::lock_guard<std::mutex> lock(m_lock);
+	std::fflush(m_file);
+	std::fflush(m_index);
+}
+
+void
+CaptureWriter::write_tx(const uint8_t *buf, size_t len)
+{
+	append(CaptureDirection::TX, buf, len);
+}
+
+uint64_t
+CaptureWriter::bytes() const
+{
+	return (m_bytes);
+}
+
+uint64_t
+CaptureWriter::lost() const
+{
+	return (m_lost);
+}
+
+uint64_t
+CaptureWriter::now() const
+{
+	/* Monotonic within a session, even if the wall clock jumps */
+	return (m_base + std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    std::chrono::steady_clock::now() - m_session).count());
+}
+
+void
+CaptureWriter::append(CaptureDirection direction, const uint8_t *buf,
+    size_t len)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	CaptureIndexEntry entry;
+	CaptureRecord record;
+
+	std::memset(&record, 0, sizeof(record));
+	record.time = now();
+	record.len = len;
+	record.direction = static_cast<uint8_t>(direction);
+	entry.time = record.time;
+	entry.offset = ::ftello(m_file);
+
+	if (std::fwrite(&record, sizeof(record), 1, m_file) != 1 ||
+	    std::fwrite(buf, 1, len, m_file) != len) {
+		Logger::error("Capture: cannot write {}: {}", m_path,
+		    strerror(errno));
+		return;
+	}
+
+	m_bytes += len;
+
+	/* The data an index entry points at always hits the file first */
+	if (record.time >= m_next_index) {
+		std::fflush(m_file);
+		std::fwrite(&entry, sizeof(entry), 1, m_index);
+		std::fflush(m_index);
+		m_next_index = record.time +
+		    std::chrono::duration_cast<std::chrono::nanoseconds>(
+		    CAPTURE_INDEX_INTERVAL).count();
+	}
+}
+
+void
+CaptureWriter::worker()
+{
+	std::vector<uint8_t> buffer(CAPTURE_CHUNK);
+	size_t skipped;
+	size_t len;
+
+	for (;;) {
+		len = m_reader.read(buffer.data(), buffer.size(), skipped);
+		if (skipped > 0) {
+			m_lost += skipped;
+			Logger::warning("Capture: fell behind, {} bytes lost",
+			    skipped);
+		}
+
+		if (len > 0) {
+			append(CaptureDirection::RX, buffer.data(), len);
+			continue;
+		}
+
+		if (!m_running)
+			break;
+
+		/* Idle, push what we have to the disk */
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			std::fflush(m_file);
+		}
+
+		m_ring.wait(m_reader.cursor(), std::chrono::milliseconds(100));
+	}
+}
+
+CaptureReader::CaptureReader(const std::string &path):
+	m_path(path)
+{
+	m_file = std::fopen(path.c_str(), "rb");
+	if (m_file == nullptr) {
+		throw std::runtime_error(fmt::format("Cannot open {}: {}",
+		    path, strerror(errno)));
+	}
+
+	if (std::fread(&m_header, sizeof(m_header), 1, m_file) != 1 ||
+	    std::memcmp(m_header.magic, CAPTURE_MAGIC,
+	    sizeof(m_header.magic)) != 0) {
+		std::fclose(m_file);
+		throw std::runtime_error(fmt::format(
+		    "{} is not a capture file", path));
+	}
+}
+
+CaptureReader::~CaptureReader()
+{
+	std::fclose(m_file);
+}
+
+/*
+ * Binary search of the index for the last entry at or before time, so
+ * that at most CAPTURE_INDEX_INTERVAL worth of records has to be read
+ * through. Without an index the whole capture is scanned.
+ */
+void
+CaptureReader::seek(uint64_t time)
+{
+	CaptureIndexEntry entry;
+	off_t offset = sizeof(CaptureHeader);
+	off_t low = 0;
+	off_t high;
+	off_t mid;
+	FILE *index;
+
+	index = std::fopen((m_path + ".idx").c_str(), "rb");
+	if (index != nullptr) {
+		::fseeko(index, 0, SEEK_END);
+		high = ::ftello(index) / sizeof(entry);
+
+		while (low < high) {
+			mid = (low + high) / 2;
+			::fseeko(index, mid * sizeof(entry), SEEK_SET);
+			if (std::fread(&entry, sizeof(entry), 1, index) != 1)
+				break;
+
+			if (entry.time <= time) {
+				offset = entry.offset;
+				low = mid + 1;
+			} else
+				high = mid;
+		}
+
+		std::fclose(index);
+	}
+
+	::fseeko(m_file, offset, SEEK_SET);
+}
+
+bool
+CaptureReader::next(CaptureRecord &record, std::vector<uint8_t> &data)
+{
+	/* A record cut short by a crash ends the capture */
+	if (std::fread(&record, sizeof(record), 1, m_file) != 1)
+		return (false);
+
+	data.resize(record.len);
+	if (std::fread(data.data(), 1, record.len, m_file) != record.len)
+		return (false);
+
+	return (true);
+}
+
+uint64_t
+CaptureReader::start() const
+{
+	return (m_header.start);
+}
+
+void
+CaptureReader::export_text(uint64_t from, uint64_t to, FILE *out)
+{
+	std::vector<uint8_t> data;
+	CaptureRecord record;
+	bool line_start = true;
+	bool tx;
+
+	seek(from);
+
+	while (next(record, data)) {
+		if (record.time < from)
+			continue;
+
+		if (record.time >= to)
+			break;
+
+		/* Sent bytes get lines of their own */
+		tx = record.direction == static_cast<uint8_t>(CaptureDirection::TX);
+		if (tx && !line_start) {
+			std::fputc('\n', out);
+			line_start = true;
+		}
+
+		for (uint8_t ch: data) {
+			if (line_start) {
+				fmt::print(out, "[{}] {}", format_time(
+				    m_header.start + record.time),
+				    tx ? ">> " : "");
+				line_start = false;
+			}
+
+			if (ch == '\n') {
+				std::fputc('\n', out);
+				line_start = true;
+			} else if (ch == '\t' || (ch >= 0x20 && ch < 0x7f))
+				std::fputc(ch, out);
+			else if (ch != '\r')
+				fmt::print(out, "\\x{:02x}", ch);
+		}
+
+		if (tx && !line_start) {
+			std::fputc('\n', out);
+			line_start = true;
+		}
+	}
+
+	if (!line_start)
+		std::fputc('\n', out);
+}
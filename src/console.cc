@@ -0,0 +1,527 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fmt/format.h>
+#include <log.hh>
+#include <console.hh>
+
+#define BUFSIZE		4096
+
+/* Upper bound on a single send to one client */
+#define CONSOLE_SEND_MAX	(64 * 1024)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+static void
+set_nonblocking(int fd)
+{
+	::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+	::fcntl(fd, F_SETFD, FD_CLOEXEC);
+#if defined(SO_NOSIGPIPE)
+	int one = 1;
+
+	::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+static std::string
+address_name(const struct sockaddr *addr, socklen_t addrlen)
+{
+	char host[NI_MAXHOST];
+	char port[NI_MAXSERV];
+
+	if (::getnameinfo(addr, addrlen, host, sizeof(host), port,
+	    sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+		return ("unknown");
+
+	if (addr->sa_family == AF_INET6)
+		return (fmt::format("[{}]:{}", host, port));
+
+	return (fmt::format("{}:{}", host, port));
+}
+
+ConsoleServer::ConsoleServer(EventLoop &loop, ByteRing &ring,
+    const struct sockaddr *addr, socklen_t addrlen):
+	m_loop(loop),
+	m_ring(ring),
+	m_started(false),
+	m_lag_policy(RingLagPolicy::SKIP),
+	m_scrollback(0),
+	m_input_paused(false),
+	m_flush_pending(false),
+	m_count(0),
+	m_send_buffer(CONSOLE_SEND_MAX),
+	m_send_start(0),
+	m_send_len(0)
+{
+	int one = 1;
+
+	m_listen_fd = ::socket(addr->sa_family, SOCK_STREAM, 0);
+	if (m_listen_fd < 0) {
+		throw std::runtime_error(fmt::format(
+		    "Cannot create socket: {}", strerror(errno)));
+	}
+
+	::setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	set_nonblocking(m_listen_fd);
+
+	if (::bind(m_listen_fd, addr, addrlen) != 0 ||
+	    ::listen(m_listen_fd, SOMAXCONN) != 0) {
+		std::string err = fmt::format("Cannot listen on {}: {}",
+		    address_name(addr, addrlen), strerror(errno));
+
+		::close(m_listen_fd);
+		throw std::runtime_error(err);
+	}
+}
+
+ConsoleServer::~ConsoleServer()
+{
+	stop();
+	::close(m_listen_fd);
+}
+
+void
+ConsoleServer::start()
+{
+	if (m_started)
+		return;
+
+	m_loop.add(m_listen_fd, EVENT_READ, [this](uint32_t events) {
+		accept_ready(events);
+	});
+
+	m_started = true;
+}
+
+void
+ConsoleServer::stop()
+{
+	if (!m_started)
+		return;
+
+	m_loop.invoke([this] {
+		m_loop.remove(m_listen_fd);
+
+		while (!m_clients.empty())
+			close_client(m_clients.begin()->second);
+	});
+
+	m_started = false;
+}
+
+void
+ConsoleServer::notify()
+{
+	/* Coalesce wakeups until the loop gets around to flushing */
+	if (m_flush_pending.exchange(true))
+		return;
+
+	m_loop.post([this] { flush(); });
+}
+
+void
+ConsoleServer::set_greeting(const std::string &greeting)
+{
+	m_greeting = greeting;
+}
+
+void
+ConsoleServer::set_lag_policy(RingLagPolicy policy)
+{
+	m_lag_policy = policy;
+}
+
+void
+ConsoleServer::set_scrollback(size_t bytes)
+{
+	m_scrollback = bytes;
+}
+
+size_t
+ConsoleServer::clients() const
+{
+	return (m_count);
+}
+
+void
+ConsoleServer::set_metrics(const MetricLabels &labels)
+{
+	m_labels = labels;
+	m_clients_gauge = Metrics::instance().gauge("devclient_uart_clients",
+	    "Clients connected to a UART console", m_labels);
+}
+
+void
+ConsoleServer::pause_input(bool paused)
+{
+	if (!m_loop.in_loop()) {
+		m_loop.post([this, paused] { pause_input(paused); });
+		return;
+	}
+
+	if (m_input_paused == paused)
+		return;
+
+	m_input_paused = paused;
+
+	for (auto &i: m_clients)
+		m_loop.modify(i.first, client_events(*i.second));
+}
+
+void
+ConsoleServer::accept_ready(uint32_t events)
+{
+	std::shared_ptr<ConsoleClient> client;
+	int fd;
+
+	for (;;) {
+		/* The scrollback goes out through pump() like live data */
+		client = std::make_shared<ConsoleClient>(m_ring, m_scrollback);
+		client->m_address_len = sizeof(client->m_address);
+
+		fd = ::accept(m_listen_fd,
+		    reinterpret_cast<struct sockaddr *>(&client->m_address),
+		    &client->m_address_len);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				Logger::warning("Console: accept failed: {}",
+				    strerror(errno));
+			return;
+		}
+
+		set_nonblocking(fd);
+		client->m_fd = fd;
+		client->m_name = address_name(
+		    reinterpret_cast<struct sockaddr *>(&client->m_address),
+		    client->m_address_len);
+		client->m_pending.assign(m_greeting.begin(), m_greeting.end());
+		trim_scrollback(*client);
+
+		if (m_clients_gauge) {
+			Metrics &metrics = Metrics::instance();
+
+			client->m_bytes_in = metrics.counter(
+			    "devclient_uart_client_received_bytes_total",
+			    "Bytes typed by a UART client",
+			    client_labels(*client));
+			client->m_bytes_out = metrics.counter(
+			    "devclient_uart_client_sent_bytes_total",
+			    "Bytes sent to a UART client, greeting included",
+			    client_labels(*client));
+			client->m_bytes_lost = metrics.counter(
+			    "devclient_uart_client_lost_bytes_total",
+			    "Console output a lagging UART client missed",
+			    client_labels(*client));
+			m_clients_gauge->add(1);
+		}
+
+		m_clients[fd] = client;
+		m_count = m_clients.size();
+		m_loop.add(fd, client_events(*client), [this, client](uint32_t events) {
+			client_ready(client, events);
+		});
+
+		Logger::info("Console: accepted connection from {}",
+		    client->m_name);
+
+		if (m_connected)
+			m_connected(*client);
+
+		if (!pump(client))
+			close_client(client);
+	}
+}
+
+void
+ConsoleServer::client_ready(const std::shared_ptr<ConsoleClient> &client,
+    uint32_t events)
+{
+	uint8_t buffer[BUFSIZE];
+	ssize_t ret;
+
+	if (events & EVENT_WRITE) {
+		if (!pump(client)) {
+			close_client(client);
+			return;
+		}
+	}
+
+	/* Hangups are still handled while input is paused */
+	if (events & (EVENT_READ | EVENT_HANGUP)) {
+		for (;;) {
+			ret = ::recv(client->m_fd, buffer, sizeof(buffer), 0);
+			if (ret > 0) {
+				Logger::debug("Console: read {} bytes from {}",
+				    ret, client->m_name);
+
+				if (client->m_bytes_in)
+					client->m_bytes_in->add(ret);
+
+				if (m_input)
+					m_input(buffer, ret);
+
+				/* The consumer may have asked us to back off */
+				if (m_input_paused)
+					break;
+
+				continue;
+			}
+
+			if (ret < 0 && errno == EINTR)
+				continue;
+
+			if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+
+			if (ret < 0)
+				Logger::warning("Console: I/O error on {}: {}",
+				    client->m_name, strerror(errno));
+
+			close_client(client);
+			return;
+		}
+	}
+}
+
+void
+ConsoleServer::flush()
+{
+	std::vector<std::shared_ptr<ConsoleClient>> failed;
+
+	m_flush_pending = false;
+
+	for (auto &i: m_clients) {
+		/* Blocked clients resume once the socket is writable */
+		if (i.second->m_blocked)
+			continue;
+
+		if (!pump(i.second))
+			failed.push_back(i.second);
+	}
+
+	for (auto &i: failed)
+		close_client(i);
+}
+
+/*
+ * Sends as much as the client socket takes. Ring data goes out of the
+ * copy fetch() keeps, never straight out of ring memory the producer may
+ * be overwriting. Returns false if the client should be disconnected.
+ */
+bool
+ConsoleServer::pump(const std::shared_ptr<ConsoleClient> &client)
+{
+	const uint8_t *data;
+	size_t skipped;
+	size_t len;
+	ssize_t ret;
+
+	for (;;) {
+		if (client->m_offset < client->m_pending.size()) {
+			/* Greeting, sent before any console output */
+			data = &client->m_pending[client->m_offset];
+			len = client->m_pending.size() - client->m_offset;
+		} else {
+			len = fetch(*client, data, skipped);
+
+			if (skipped > 0) {
+				Logger::warning(
+				    "Console: client {} lagging, {} bytes lost",
+				    client->m_name, skipped);
+
+				if (client->m_bytes_lost)
+					client->m_bytes_lost->add(skipped);
+
+				if (m_lag_policy == RingLagPolicy::DROP)
+					return (false);
+			}
+
+			if (len == 0)
+				break;
+		}
+
+		ret = ::send(client->m_fd, data, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (!client->m_blocked) {
+					client->m_blocked = true;
+					m_loop.modify(client->m_fd,
+					    client_events(*client));
+				}
+
+				return (true);
+			}
+
+			Logger::warning("Console: error sending data to {}: {}",
+			    client->m_name, strerror(errno));
+			return (false);
+		}
+
+		if (client->m_bytes_out)
+			client->m_bytes_out->add(ret);
+
+		if (client->m_offset < client->m_pending.size()) {
+			client->m_offset += ret;
+			continue;
+		}
+
+		client->m_reader.consume(ret);
+	}
+
+	if (client->m_blocked) {
+		client->m_blocked = false;
+		m_loop.modify(client->m_fd, client_events(*client));
+	}
+
+	return (true);
+}
+
+/*
+ * Unread output for a client. Output is copied out of the ring once per
+ * chunk of up to CONSOLE_SEND_MAX bytes, into a single buffer: clients
+ * normally sit at the same place in the ring, so the copy made for the
+ * first one is handed to the others as long as their cursor falls
+ * inside it, and bytes at a given position never change once they are
+ * checked. A client elsewhere in the ring replaces the copy with its
+ * own, so clients spread over the ring cost one copy each.
+ */
+size_t
+ConsoleServer::fetch(ConsoleClient &client, const uint8_t *&data,
+    size_t &skipped)
+{
+	uint64_t cursor = client.m_reader.cursor();
+
+	skipped = 0;
+
+	if (cursor < m_send_start || cursor >= m_send_start + m_send_len) {
+		m_send_len = client.m_reader.copy(m_send_buffer.data(),
+		    m_send_buffer.size(), skipped);
+		m_send_start = client.m_reader.cursor();
+		cursor = m_send_start;
+	}
+
+	data = &m_send_buffer[cursor - m_send_start];
+	return (m_send_start + m_send_len - cursor);
+}
+
+void
+ConsoleServer::close_client(const std::shared_ptr<ConsoleClient> &client)
+{
+	if (m_clients.erase(client->m_fd) == 0)
+		return;
+
+	m_count = m_clients.size();
+	m_loop.remove(client->m_fd);
+	::close(client->m_fd);
+
+	Logger::info("Console: connection from {} ended", client->m_name);
+
+	/* Client addresses don't come back, so neither do their series */
+	if (m_clients_gauge) {
+		Metrics &metrics = Metrics::instance();
+
+		metrics.remove("devclient_uart_client_received_bytes_total",
+		    client_labels(*client));
+		metrics.remove("devclient_uart_client_sent_bytes_total",
+		    client_labels(*client));
+		metrics.remove("devclient_uart_client_lost_bytes_total",
+		    client_labels(*client));
+		m_clients_gauge->add(-1);
+	}
+
+	if (m_disconnected)
+		m_disconnected(*client);
+}
+
+uint32_t
+ConsoleServer::client_events(const ConsoleClient &client) const
+{
+	uint32_t events = 0;
+
+	if (!m_input_paused)
+		events |= EVENT_READ;
+
+	if (client.m_blocked)
+		events |= EVENT_WRITE;
+
+	return (events);
+}
+
+/* Starts the replay at a line boundary rather than halfway through one */
+void
+ConsoleServer::trim_scrollback(ConsoleClient &client)
+{
+	struct iovec iov[2];
+	const uint8_t *newline;
+	size_t skipped;
+	size_t offset = 0;
+	size_t len;
+	int iovcnt;
+
+	if (m_scrollback == 0)
+		return;
+
+	len = client.m_reader.peek(iov, iovcnt, m_scrollback, skipped);
+
+	for (int i = 0; i < iovcnt && offset < len; i++) {
+		newline = static_cast<const uint8_t *>(std::memchr(
+		    iov[i].iov_base, '\n', iov[i].iov_len));
+		if (newline != nullptr) {
+			offset += newline -
+			    static_cast<const uint8_t *>(iov[i].iov_base) + 1;
+			client.m_reader.consume(offset);
+			return;
+		}
+
+		offset += iov[i].iov_len;
+	}
+}
+
+MetricLabels
+ConsoleServer::client_labels(const ConsoleClient &client) const
+{
+	MetricLabels ret = m_labels;
+
+	ret["client"] = client.m_name;
+	return (ret);
+}
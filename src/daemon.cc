@@ -0,0 +1,551 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <algorithm>
+#include <csignal>
+#include <stdexcept>
+#include <glib-unix.h>
+#include <fmt/format.h>
+#include <log.hh>
+#include <baudrate.hh>
+#include <gpio.hh>
+#include <nogui.hh>
+#include <tuning.hh>
+#include <daemon.hh>
+
+static void
+parse_channel_tuning(const ucl_object_t *obj, const std::string &name,
+    ChannelTuning &tuning)
+{
+	const ucl_object_t *latency, *read_chunk, *write_chunk;
+
+	if (obj == NULL)
+		return;
+
+	latency = ucl_object_lookup(obj, "latency_timer");
+	read_chunk = ucl_object_lookup(obj, "read_chunk_size");
+	write_chunk = ucl_object_lookup(obj, "write_chunk_size");
+
+	/* UART reads are the queued bulk-in transfers, sized by one key */
+	if (read_chunk != NULL && name == "uart")
+		throw std::runtime_error("read_chunk_size is not used for "
+		    "the UART, set rx_chunk_size instead");
+
+	if (latency != NULL)
+		tuning.set("latency", ucl_object_toint(latency));
+
+	if (read_chunk != NULL)
+		tuning.set("read_chunk", ucl_object_toint(read_chunk));
+
+	if (write_chunk != NULL)
+		tuning.set("write_chunk", ucl_object_toint(write_chunk));
+}
+
+static void
+parse_uart(const ucl_object_t *uart, DeviceConfig &config)
+{
+	const ucl_object_t *baud, *uart_ip, *uart_port, *rx_depth, *rx_chunk;
+	const ucl_object_t *line_format, *flow_control, *flush_size, *flush_delay;
+	const ucl_object_t *capture_file, *capture_tx, *scrollback;
+	UartOptions &options = config.uart_options;
+	BaudRate rate;
+
+	baud = ucl_object_lookup(uart, "baudrate");
+	uart_ip = ucl_object_lookup(uart, "listen_ip");
+	uart_port = ucl_object_lookup(uart, "listen_port");
+
+	if (uart_port == NULL)
+		throw std::runtime_error("uart: listen_port is missing");
+
+	if (baud != NULL)
+		config.baudrate = ucl_object_toint(baud);
+
+	rate = BaudRate::compute(config.baudrate);
+	if (!rate.valid()) {
+		throw std::runtime_error(fmt::format(
+		    "uart: improper baud rate value {} (nearest possible: {})",
+		    config.baudrate, rate.actual));
+	}
+
+	config.uart = true;
+	config.uart_address = uart_ip != NULL ?
+	    ucl_object_tostring(uart_ip) : "0.0.0.0";
+	config.uart_port = ucl_object_toint(uart_port);
+	options = UartOptions::for_baudrate(config.baudrate,
+	    config.tuning.at("uart"));
+
+	rx_depth = ucl_object_lookup(uart, "rx_queue_depth");
+	rx_chunk = ucl_object_lookup(uart, "rx_chunk_size");
+
+	if (rx_depth != NULL)
+		options.rx_depth = ucl_object_toint(rx_depth);
+
+	if (rx_chunk != NULL)
+		options.rx_chunk = ucl_object_toint(rx_chunk);
+
+	flush_size = ucl_object_lookup(uart, "tx_flush_size");
+	flush_delay = ucl_object_lookup(uart, "tx_flush_delay_us");
+
+	if (flush_size != NULL)
+		options.tx_flush_size = ucl_object_toint(flush_size);
+
+	if (flush_delay != NULL)
+		options.tx_flush_delay = std::chrono::microseconds(
+		    ucl_object_toint(flush_delay));
+
+	scrollback = ucl_object_lookup(uart, "scrollback");
+	if (scrollback != NULL)
+		options.scrollback = ucl_object_toint(scrollback);
+
+	capture_file = ucl_object_lookup(uart, "capture_file");
+	capture_tx = ucl_object_lookup(uart, "capture_tx");
+
+	if (capture_file != NULL)
+		options.capture_path = ucl_object_tostring(capture_file);
+
+	if (capture_tx != NULL)
+		options.capture_tx = ucl_object_toboolean(capture_tx);
+
+	line_format = ucl_object_lookup(uart, "line_format");
+	flow_control = ucl_object_lookup(uart, "flow_control");
+
+	try {
+		if (line_format != NULL)
+			options.set_format(ucl_object_tostring(line_format));
+
+		if (flow_control != NULL)
+			options.set_flow(ucl_object_tostring(flow_control));
+	} catch (const std::runtime_error &err) {
+		throw std::runtime_error(fmt::format("uart: {}", err.what()));
+	}
+}
+
+static void
+parse_jtag(const ucl_object_t *jtag, DeviceConfig &config)
+{
+	const ucl_object_t *jtag_ip, *gdb_port, *telnet_port, *pass_through;
+	const ucl_object_t *jtag_script;
+
+	jtag_ip = ucl_object_lookup(jtag, "listen_ip");
+	gdb_port = ucl_object_lookup(jtag, "gdb_port");
+	telnet_port = ucl_object_lookup(jtag, "telnet_port");
+	pass_through = ucl_object_lookup(jtag, "pass_through");
+	jtag_script = ucl_object_lookup(jtag, "script");
+
+	config.pass_through = pass_through != NULL &&
+	    ucl_object_toint(pass_through);
+
+	if (config.pass_through) {
+		if (jtag_ip != NULL)
+			throw std::runtime_error("JTAG server and pass through "
+			    "mode cannot be used together");
+
+		return;
+	}
+
+	if (jtag_ip == NULL)
+		return;
+
+	if (gdb_port == NULL || telnet_port == NULL || jtag_script == NULL)
+		throw std::runtime_error("jtag: gdb_port, telnet_port and "
+		    "script are required");
+
+	config.jtag = true;
+	config.jtag_address = ucl_object_tostring(jtag_ip);
+	config.gdb_port = ucl_object_toint(gdb_port);
+	config.telnet_port = ucl_object_toint(telnet_port);
+	config.jtag_script = ucl_object_tostring(jtag_script);
+}
+
+static void
+parse_metrics(const ucl_object_t *metrics, DaemonConfig &config)
+{
+	const ucl_object_t *listen_ip, *listen_port;
+
+	listen_ip = ucl_object_lookup(metrics, "listen_ip");
+	listen_port = ucl_object_lookup(metrics, "listen_port");
+
+	if (listen_port == NULL)
+		throw std::runtime_error("metrics: listen_port is missing");
+
+	if (listen_ip != NULL)
+		config.metrics_address = ucl_object_tostring(listen_ip);
+
+	config.metrics_port = ucl_object_toint(listen_port);
+}
+
+DeviceConfig
+DeviceConfig::parse(const ucl_object_t *device)
+{
+	const char *channels[] = { "uart", "i2c", "jtag", "gpio" };
+	const ucl_object_t *serial, *uart, *jtag, *gpio, *value;
+	DeviceConfig ret;
+
+	serial = ucl_object_lookup(device, "serial");
+	if (serial == NULL)
+		throw std::runtime_error("device block without a serial");
+
+	ret.serial = ucl_object_tostring(serial);
+
+	for (const char *name: channels) {
+		ret.tuning[name] = ChannelTuning::channel(name);
+
+		try {
+			parse_channel_tuning(ucl_object_lookup(device, name),
+			    name, ret.tuning[name]);
+		} catch (const std::runtime_error &err) {
+			throw std::runtime_error(fmt::format("{}: {}", name,
+			    err.what()));
+		}
+	}
+
+	uart = ucl_object_lookup(device, "uart");
+	if (uart != NULL)
+		parse_uart(uart, ret);
+
+	jtag = ucl_object_lookup(device, "jtag");
+	if (jtag != NULL)
+		parse_jtag(jtag, ret);
+
+	gpio = ucl_object_lookup(device, "gpio");
+	value = ucl_object_lookup(gpio, "value");
+	if (value != NULL) {
+		ret.gpio = true;
+		ret.gpio_value = ucl_object_toint(value);
+	}
+
+	return (ret);
+}
+
+DaemonConfig
+DaemonConfig::load(const std::string &path)
+{
+	const ucl_object_t *devices, *device, *threads, *metrics;
+	ucl_object_iter_t it = NULL;
+	ucl_parser *parser;
+	ucl_object_t *root;
+	DaemonConfig ret;
+
+	parser = ucl_parser_new(0);
+	if (!ucl_parser_add_file(parser, path.c_str())) {
+		std::string err = fmt::format("Cannot load {}: {}", path,
+		    ucl_parser_get_error(parser));
+
+		ucl_parser_free(parser);
+		throw std::runtime_error(err);
+	}
+
+	root = ucl_parser_get_object(parser);
+	ucl_parser_free(parser);
+
+	try {
+		threads = ucl_object_lookup(root, "threads");
+		if (threads != NULL)
+			ret.threads = ucl_object_toint(threads);
+
+		metrics = ucl_object_lookup(root, "metrics");
+		if (metrics != NULL)
+			parse_metrics(metrics, ret);
+
+		/* Repeated device blocks form an implicit array */
+		devices = ucl_object_lookup(root, "device");
+		while ((device = ucl_object_iterate(devices, &it, false)) != NULL) {
+			try {
+				ret.devices.push_back(DeviceConfig::parse(device));
+			} catch (const std::runtime_error &err) {
+				throw std::runtime_error(fmt::format(
+				    "device #{}: {}", ret.devices.size() + 1,
+				    err.what()));
+			}
+		}
+	} catch (...) {
+		ucl_object_unref(root);
+		throw;
+	}
+
+	ucl_object_unref(root);
+
+	if (ret.devices.empty())
+		throw std::runtime_error(fmt::format(
+		    "No device blocks in {}", path));
+
+	return (ret);
+}
+
+static gboolean
+quit_main_loop(gpointer data)
+{
+	g_main_loop_quit(static_cast<GMainLoop *>(data));
+	return (G_SOURCE_CONTINUE);
+}
+
+Daemon::Daemon(const DaemonConfig &config):
+	m_listener(-1),
+	m_metrics_address(config.metrics_address),
+	m_metrics_port(config.metrics_port),
+	m_threads(config.threads),
+	m_next_loop(0),
+	m_running(0)
+{
+	if (m_threads == 0)
+		m_threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	for (const auto &i: config.devices) {
+		m_services.push_back(std::make_unique<Service>());
+		m_services.back()->config = i;
+		m_services.back()->up_gauge = Metrics::instance().gauge(
+		    "devclient_device_up", "Whether the services of a "
+		    "configured cable are running", { { "serial", i.serial } });
+	}
+
+	m_changed.connect(sigc::mem_fun(*this, &Daemon::device_changed));
+}
+
+Daemon::~Daemon()
+{
+	stop();
+}
+
+void
+Daemon::start()
+{
+	DeviceRegistry &registry = DeviceRegistry::instance();
+
+	try {
+		registry.start();
+	} catch (const std::runtime_error &err) {
+		Logger::warning("Daemon: {}, replugged devices will not be "
+		    "restarted", err.what());
+	}
+
+	m_listener = registry.subscribe([this](const Device &device,
+	    bool present) {
+		std::lock_guard<std::mutex> lock(m_changes_lock);
+
+		m_changes.emplace_back(device, present);
+		m_changed.emit();
+	});
+
+	if (m_metrics_port != 0)
+		start_metrics();
+
+	for (auto &i: m_services) {
+		try {
+			start_service(*i);
+		} catch (const std::exception &err) {
+			Logger::error("Device {}: {}", i->config.serial,
+			    err.what());
+			stop_service(*i);
+		}
+	}
+
+	Logger::info("Daemon: {} of {} devices running on {} event loops",
+	    m_running, m_services.size(), m_loops.size());
+}
+
+void
+Daemon::run()
+{
+	m_main_loop = Glib::MainLoop::create();
+	g_unix_signal_add(SIGINT, quit_main_loop, m_main_loop->gobj());
+	g_unix_signal_add(SIGTERM, quit_main_loop, m_main_loop->gobj());
+	m_main_loop->run();
+	Logger::info("Daemon: shutting down");
+}
+
+void
+Daemon::stop()
+{
+	if (m_listener != -1) {
+		DeviceRegistry::instance().unsubscribe(m_listener);
+		m_listener = -1;
+	}
+
+	for (auto &i: m_services)
+		stop_service(*i);
+
+	m_metrics.reset();
+
+	for (auto &i: m_loops)
+		i->stop();
+
+	m_loops.clear();
+}
+
+size_t
+Daemon::running() const
+{
+	return (m_running);
+}
+
+void
+Daemon::start_service(Service &service)
+{
+	const DeviceConfig &config = service.config;
+	std::optional<Device> device;
+	Glib::RefPtr<Gio::SocketAddress> addr;
+
+	device = DeviceEnumerator::find_by_serial(config.serial);
+	if (!device)
+		throw std::runtime_error("not connected");
+
+	/* JtagServer keeps a reference to the device */
+	service.device = *device;
+
+	if (config.gpio) {
+		Gpio gpio(service.device, config.tuning.at("gpio"));
+
+		gpio.set(config.gpio_value);
+	}
+
+	if (config.uart) {
+		addr = Gio::InetSocketAddress::create(
+		    Gio::InetAddress::create(config.uart_address),
+		    config.uart_port);
+
+		service.uart = std::make_unique<Uart>(service.device, addr,
+		    config.baudrate, config.uart_options, next_loop());
+		service.uart->start();
+	}
+
+	if (config.pass_through) {
+		JtagCmdLine jtag(service.device);
+
+		jtag.bypass(service.device, config.tuning.at("jtag"));
+	} else if (config.jtag) {
+		service.jtag = std::make_unique<JtagServer>(service.device,
+		    Gio::InetAddress::create(config.jtag_address),
+		    config.gdb_port, config.telnet_port, config.jtag_script);
+
+		service.jtag->on_output_produced.connect(
+		    [serial = config.serial](const std::string &output) {
+			Logger::info("JTAG {}: {}", serial, output.substr(0,
+			    output.find_last_not_of("\r\n") + 1));
+		    });
+
+		service.jtag->start();
+	}
+
+	service.up = true;
+	service.up_gauge->set(1);
+	m_running++;
+}
+
+void
+Daemon::stop_service(Service &service)
+{
+	service.uart.reset();
+	service.jtag.reset();
+
+	if (service.up) {
+		service.up = false;
+		service.up_gauge->set(0);
+		m_running--;
+	}
+}
+
+/* Runs on the main loop, so JTAG servers are handled on their own thread */
+void
+Daemon::device_changed()
+{
+	std::vector<std::pair<Device, bool>> changes;
+
+	{
+		std::lock_guard<std::mutex> lock(m_changes_lock);
+
+		changes.swap(m_changes);
+	}
+
+	for (const auto &change: changes) {
+		for (auto &i: m_services) {
+			if (i->config.serial != change.first.serial)
+				continue;
+
+			if (!change.second && i->up) {
+				Logger::warning("Device {}: disconnected, "
+				    "stopping its services", i->config.serial);
+				stop_service(*i);
+			} else if (change.second && !i->up) {
+				Logger::info("Device {}: connected, starting "
+				    "its services", i->config.serial);
+
+				try {
+					start_service(*i);
+				} catch (const std::exception &err) {
+					Logger::error("Device {}: {}",
+					    i->config.serial, err.what());
+					stop_service(*i);
+				}
+			}
+		}
+	}
+}
+
+/* A metrics endpoint that cannot listen is not worth giving up cables for */
+void
+Daemon::start_metrics()
+{
+	Glib::RefPtr<Gio::SocketAddress> addr;
+	struct sockaddr_storage native;
+
+	try {
+		addr = Gio::InetSocketAddress::create(
+		    Gio::InetAddress::create(m_metrics_address), m_metrics_port);
+		addr->to_native(&native, sizeof(native));
+
+		m_metrics = std::make_unique<MetricsServer>(*next_loop(),
+		    reinterpret_cast<struct sockaddr *>(&native),
+		    addr->get_native_size());
+		m_metrics->start();
+	} catch (const Glib::Exception &err) {
+		Logger::error("Daemon: metrics endpoint: {}", err.what());
+		return;
+	} catch (const std::runtime_error &err) {
+		Logger::error("Daemon: metrics endpoint: {}", err.what());
+		return;
+	}
+
+	Logger::info("Daemon: serving metrics on http://{}/metrics",
+	    addr->to_string());
+}
+
+/* Event loops are added up to the thread limit, then shared round robin */
+std::shared_ptr<EventLoop>
+Daemon::next_loop()
+{
+	std::shared_ptr<EventLoop> loop;
+
+	if (m_loops.size() < m_threads) {
+		loop = std::make_shared<EventLoop>();
+		loop->start();
+		m_loops.push_back(loop);
+		return (loop);
+	}
+
+	return (m_loops[m_next_loop++ % m_loops.size()]);
+}
@@ -27,8 +27,11 @@
  */
 
 #include <optional>
+#include <stdexcept>
 #include <ftdi.hpp>
+#include <log.hh>
 #include <device.hh>
+#include <ftsim.hh>
 #include <fmt/format.h>
 
 #define USB_VID		0x0403
@@ -36,6 +39,34 @@
 
 std::vector<Device>
 DeviceEnumerator::enumerate()
+{
+	std::vector<Device> ret;
+
+	if (DeviceRegistry::instance().running())
+		ret = DeviceRegistry::instance().devices();
+	else
+		ret = scan();
+
+	for (const auto &i: FtdiSimulator::devices())
+		ret.push_back(i);
+
+	return (ret);
+}
+
+
+std::optional<Device>
+DeviceEnumerator::find_by_serial(const std::string &serial)
+{
+	for (const auto &i: enumerate()) {
+		if (i.serial == serial)
+			return (i);
+	}
+
+	return (std::nullopt);
+}
+
+std::vector<Device>
+DeviceEnumerator::scan()
 {
 	Ftdi::Context ctx;
 	Ftdi::List *devices = Ftdi::List::find_all(ctx, USB_VID, USB_PID);
@@ -54,14 +85,327 @@ DeviceEnumerator::enumerate()
 	return (result);
 }
 
+DeviceRegistry &
+DeviceRegistry::instance()
+{
+	static DeviceRegistry registry;
+
+	return (registry);
+}
+
+DeviceRegistry::DeviceRegistry():
+	m_ctx(nullptr),
+	m_handle(0),
+	m_hotplug(false),
+	m_running(false),
+	m_next_id(0)
+{
+}
+
+DeviceRegistry::~DeviceRegistry()
+{
+	stop();
+}
+
+void
+DeviceRegistry::start()
+{
+	int ret;
+
+	if (m_running)
+		return;
+
+	ret = libusb_init(&m_ctx);
+	if (ret != LIBUSB_SUCCESS) {
+		throw std::runtime_error(fmt::format(
+		    "Cannot initialize libusb: {}", libusb_error_name(ret)));
+	}
+
+	m_hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+	    libusb_hotplug_register_callback(m_ctx,
+	    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+	    LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE,
+	    USB_VID, USB_PID, LIBUSB_HOTPLUG_MATCH_ANY,
+	    &DeviceRegistry::hotplug, this, &m_handle) == LIBUSB_SUCCESS;
+
+	/* With LIBUSB_HOTPLUG_ENUMERATE, attached cables are queued already */
+	if (m_hotplug)
+		process();
+	else
+		rescan();
+
+	m_running = true;
+	m_thread = std::thread(&DeviceRegistry::worker, this);
+
+	Logger::info("Device registry: {} devices attached, {}",
+	    devices().size(),
+	    m_hotplug ? "watching hotplug events" : "polling for changes");
+}
+
+void
+DeviceRegistry::stop()
+{
+	if (!m_running)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		m_running = false;
+	}
+
+	m_cond.notify_all();
+	m_thread.join();
+
+	if (m_hotplug)
+		libusb_hotplug_deregister_callback(m_ctx, m_handle);
+
+	for (auto &i: m_events)
+		libusb_unref_device(i.first);
+
+	for (auto &i: m_devices)
+		libusb_unref_device(i.first);
+
+	m_events.clear();
+	m_devices.clear();
+	m_scanned.clear();
+	libusb_exit(m_ctx);
+	m_ctx = nullptr;
+}
+
+bool
+DeviceRegistry::running() const
+{
+	return (m_running);
+}
+
+std::vector<Device>
+DeviceRegistry::devices()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	std::vector<Device> ret;
+
+	if (m_hotplug) {
+		for (const auto &i: m_devices)
+			ret.push_back(i.second);
+	} else {
+		for (const auto &i: m_scanned)
+			ret.push_back(i.second);
+	}
+
+	return (ret);
+}
 
 std::optional<Device>
-DeviceEnumerator::find_by_serial(const std::string &serial)
+DeviceRegistry::find(const std::string &serial)
 {
-	for (const auto &i: enumerate()) {
+	for (const auto &i: devices()) {
 		if (i.serial == serial)
 			return (i);
 	}
 
 	return (std::nullopt);
 }
+
+int
+DeviceRegistry::subscribe(const Listener &listener)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	m_listeners[m_next_id] = listener;
+	return (m_next_id++);
+}
+
+/* Waits for a call already in flight, unless made from one */
+void
+DeviceRegistry::unsubscribe(int id)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		m_listeners.erase(id);
+	}
+
+	if (std::this_thread::get_id() != m_thread.get_id()) {
+		std::lock_guard<std::mutex> notifying(m_notify_lock);
+	}
+}
+
+/* No USB I/O is allowed in here, the device is looked at later */
+int LIBUSB_CALL
+DeviceRegistry::hotplug(libusb_context *ctx, libusb_device *device,
+    libusb_hotplug_event event, void *arg)
+{
+	DeviceRegistry *self = static_cast<DeviceRegistry *>(arg);
+	std::lock_guard<std::mutex> lock(self->m_lock);
+
+	self->m_events.emplace_back(libusb_ref_device(device),
+	    event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+	return (0);
+}
+
+void
+DeviceRegistry::process()
+{
+	std::vector<std::pair<libusb_device *, bool>> events;
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		events.swap(m_events);
+	}
+
+	for (auto &i: events) {
+		if (i.second)
+			arrived(i.first);
+		else
+			left(i.first);
+	}
+}
+
+void
+DeviceRegistry::arrived(libusb_device *device)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device_handle *handle;
+	unsigned char serial[128] = { 0 };
+	unsigned char product[128] = { 0 };
+	Device entry;
+
+	if (libusb_get_device_descriptor(device, &desc) != LIBUSB_SUCCESS ||
+	    libusb_open(device, &handle) != LIBUSB_SUCCESS) {
+		Logger::warning("Device registry: cannot open new device");
+		libusb_unref_device(device);
+		return;
+	}
+
+	if (desc.iSerialNumber != 0)
+		libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+		    serial, sizeof(serial));
+
+	if (desc.iProduct != 0)
+		libusb_get_string_descriptor_ascii(handle, desc.iProduct,
+		    product, sizeof(product));
+
+	libusb_close(handle);
+
+	entry.vid = desc.idVendor;
+	entry.pid = desc.idProduct;
+	entry.serial = reinterpret_cast<char *>(serial);
+	entry.description = reinterpret_cast<char *>(product);
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		/* Enumerated and reported as arrived at the same time */
+		if (m_devices.count(device) != 0) {
+			libusb_unref_device(device);
+			return;
+		}
+
+		m_devices[device] = entry;
+	}
+
+	notify(entry, true);
+}
+
+void
+DeviceRegistry::left(libusb_device *device)
+{
+	Device entry;
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		auto it = m_devices.find(device);
+
+		if (it == m_devices.end()) {
+			libusb_unref_device(device);
+			return;
+		}
+
+		entry = it->second;
+		m_devices.erase(it);
+	}
+
+	/* Once for the registry entry and once for this event */
+	libusb_unref_device(device);
+	libusb_unref_device(device);
+	notify(entry, false);
+}
+
+void
+DeviceRegistry::rescan()
+{
+	std::map<std::string, Device> current;
+	std::vector<std::pair<Device, bool>> changes;
+
+	for (const auto &i: DeviceEnumerator::scan())
+		current[i.serial] = i;
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		for (const auto &i: current) {
+			if (m_scanned.count(i.first) == 0)
+				changes.emplace_back(i.second, true);
+		}
+
+		for (const auto &i: m_scanned) {
+			if (current.count(i.first) == 0)
+				changes.emplace_back(i.second, false);
+		}
+
+		m_scanned.swap(current);
+	}
+
+	for (const auto &i: changes)
+		notify(i.first, i.second);
+}
+
+void
+DeviceRegistry::notify(const Device &device, bool present)
+{
+	std::vector<Listener> listeners;
+
+	Logger::info("Device registry: {} {} {}", device.description,
+	    device.serial, present ? "connected" : "disconnected");
+
+	/* Taken first, so a listener removed meanwhile is not called */
+	std::lock_guard<std::mutex> notifying(m_notify_lock);
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		for (const auto &i: m_listeners)
+			listeners.push_back(i.second);
+	}
+
+	for (const auto &i: listeners)
+		i(device, present);
+}
+
+void
+DeviceRegistry::worker()
+{
+	std::unique_lock<std::mutex> lock(m_lock, std::defer_lock);
+	struct timeval tv;
+
+	while (m_running) {
+		if (m_hotplug) {
+			tv.tv_sec = 0;
+			tv.tv_usec = 100000;
+			libusb_handle_events_timeout_completed(m_ctx, &tv,
+			    nullptr);
+			process();
+			continue;
+		}
+
+		lock.lock();
+		m_cond.wait_for(lock, DEVREG_POLL_INTERVAL,
+		    [this] { return (!m_running); });
+		lock.unlock();
+
+		if (m_running)
+			rescan();
+	}
+}
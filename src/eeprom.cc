@@ -0,0 +1,67 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+#include <fmt/format.h>
+#include <eeprom/catalogue.hh>
+
+static const std::vector<EepromModel> models = {
+	/* name, size, page, address bytes, tWR, address, max SCL */
+	{ "24c02", 256, 8, 1, 5, 0xa0, 400000 },
+	{ "24c04", 512, 16, 1, 5, 0xa0, 400000 },
+	{ "24c08", 1024, 16, 1, 5, 0xa0, 400000 },
+	{ "24c16", 2048, 16, 1, 5, 0xa0, 400000 },
+	{ "24c32", 4096, 32, 2, 5, 0xa0, 400000 },
+	{ "24c64", 8192, 32, 2, 5, 0xa0, 400000 },
+	{ "24c128", 16384, 64, 2, 5, 0xa0, 1000000 },
+	{ "24c256", 32768, 64, 2, 5, 0xa0, 1000000 },
+	{ "24c512", 65536, 128, 2, 5, 0xa0, 1000000 },
+};
+
+const std::vector<EepromModel> &
+EepromModel::all()
+{
+	return (models);
+}
+
+const EepromModel &
+EepromModel::find(const std::string &name)
+{
+	std::string lower(name);
+
+	std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+	for (const auto &i: models) {
+		if (i.name == lower)
+			return (i);
+	}
+
+	throw std::runtime_error(fmt::format("Unknown EEPROM type: {}", name));
+}
@@ -0,0 +1,418 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <future>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
+#include <fmt/format.h>
+#include <log.hh>
+#include <eventloop.hh>
+
+#if defined(__linux__)
+static uint32_t
+to_native(uint32_t events)
+{
+	uint32_t ret = 0;
+
+	if (events & EVENT_READ)
+		ret |= EPOLLIN | EPOLLRDHUP;
+
+	if (events & EVENT_WRITE)
+		ret |= EPOLLOUT;
+
+	return (ret);
+}
+
+static uint32_t
+from_native(uint32_t events)
+{
+	uint32_t ret = 0;
+
+	if (events & EPOLLIN)
+		ret |= EVENT_READ;
+
+	if (events & EPOLLOUT)
+		ret |= EVENT_WRITE;
+
+	if (events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+		ret |= EVENT_HANGUP;
+
+	return (ret);
+}
+#endif
+
+EventLoop::EventLoop():
+	m_running(false),
+	m_alive(std::make_shared<bool>(true))
+{
+	if (::pipe(m_wakeup) != 0) {
+		throw std::runtime_error(fmt::format(
+		    "Cannot create event loop pipe: {}", strerror(errno)));
+	}
+
+	::fcntl(m_wakeup[0], F_SETFL, O_NONBLOCK);
+	::fcntl(m_wakeup[1], F_SETFL, O_NONBLOCK);
+	::fcntl(m_wakeup[0], F_SETFD, FD_CLOEXEC);
+	::fcntl(m_wakeup[1], F_SETFD, FD_CLOEXEC);
+
+#if defined(__linux__)
+	struct epoll_event event;
+
+	m_pollfd = ::epoll_create1(EPOLL_CLOEXEC);
+	if (m_pollfd < 0) {
+		throw std::runtime_error(fmt::format(
+		    "Cannot create epoll instance: {}", strerror(errno)));
+	}
+
+	event.events = EPOLLIN;
+	event.data.fd = m_wakeup[0];
+	::epoll_ctl(m_pollfd, EPOLL_CTL_ADD, m_wakeup[0], &event);
+#else
+	m_pollfd = -1;
+#endif
+}
+
+EventLoop::~EventLoop()
+{
+	stop();
+
+	/*
+	 * Destroyed by one of its own handlers, so the thread cannot be
+	 * joined. It leaves run() as soon as that handler returns,
+	 * without touching the loop again.
+	 */
+	if (m_thread.joinable()) {
+		*m_alive = false;
+		m_thread.detach();
+	}
+
+	if (m_pollfd >= 0)
+		::close(m_pollfd);
+
+	::close(m_wakeup[0]);
+	::close(m_wakeup[1]);
+}
+
+void
+EventLoop::start()
+{
+	if (m_running)
+		return;
+
+	/* Restarted by a handler before run() got to notice the stop */
+	if (in_loop()) {
+		m_running = true;
+		return;
+	}
+
+	if (m_thread.joinable())
+		m_thread.join();
+
+	m_running = true;
+	m_thread = std::thread(&EventLoop::run, this);
+}
+
+void
+EventLoop::stop()
+{
+	if (m_running) {
+		m_running = false;
+		wakeup();
+	}
+
+	/*
+	 * A handler cannot join its own thread. The thread exits once
+	 * the handler returns and the next stop(), start() or the
+	 * destructor reaps it.
+	 */
+	if (m_thread.joinable() && !in_loop())
+		m_thread.join();
+}
+
+bool
+EventLoop::in_loop() const
+{
+	return (m_thread.get_id() == std::this_thread::get_id());
+}
+
+void
+EventLoop::add(int fd, uint32_t events, const Handler &handler)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+#if defined(__linux__)
+	struct epoll_event event;
+
+	event.events = to_native(events);
+	event.data.fd = fd;
+
+	if (::epoll_ctl(m_pollfd, EPOLL_CTL_ADD, fd, &event) != 0) {
+		throw std::runtime_error(fmt::format(
+		    "Cannot add fd {} to event loop: {}", fd,
+		    strerror(errno)));
+	}
+#endif
+
+	m_handlers[fd] = std::make_shared<Handler>(handler);
+	m_events[fd] = events;
+	wakeup();
+}
+
+void
+EventLoop::modify(int fd, uint32_t events)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	if (m_events.count(fd) == 0 || m_events[fd] == events)
+		return;
+
+#if defined(__linux__)
+	struct epoll_event event;
+
+	event.events = to_native(events);
+	event.data.fd = fd;
+	::epoll_ctl(m_pollfd, EPOLL_CTL_MOD, fd, &event);
+#endif
+
+	m_events[fd] = events;
+	wakeup();
+}
+
+void
+EventLoop::remove(int fd)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	if (m_handlers.erase(fd) == 0)
+		return;
+
+#if defined(__linux__)
+	::epoll_ctl(m_pollfd, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+
+	m_events.erase(fd);
+}
+
+void
+EventLoop::post(const std::function<void()> &fn)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	m_posted.push_back(fn);
+	wakeup();
+}
+
+void
+EventLoop::invoke(const std::function<void()> &fn)
+{
+	std::promise<void> done;
+	std::future<void> result = done.get_future();
+
+	if (in_loop() || !m_running) {
+		fn();
+		return;
+	}
+
+	post([&] {
+		try {
+			fn();
+			done.set_value();
+		} catch (...) {
+			done.set_exception(std::current_exception());
+		}
+	});
+
+	result.get();
+}
+
+void
+EventLoop::wakeup()
+{
+	uint8_t byte = 0;
+
+	/* A full pipe already means a wakeup is pending */
+	(void)::write(m_wakeup[1], &byte, sizeof(byte));
+}
+
+void
+EventLoop::drain()
+{
+	std::shared_ptr<bool> alive = m_alive;
+	std::vector<std::function<void()>> posted;
+	uint8_t buffer[64];
+
+	while (::read(m_wakeup[0], buffer, sizeof(buffer)) > 0)
+		continue;
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		posted.swap(m_posted);
+	}
+
+	for (auto &fn: posted) {
+		fn();
+		if (!*alive)
+			return;
+	}
+}
+
+void
+EventLoop::dispatch(int fd, uint32_t events)
+{
+	std::shared_ptr<Handler> handler;
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		auto it = m_handlers.find(fd);
+
+		/* Removed by an earlier handler in this batch */
+		if (it == m_handlers.end())
+			return;
+
+		handler = it->second;
+	}
+
+	(*handler)(events);
+}
+
+#if defined(__linux__)
+void
+EventLoop::run()
+{
+	std::shared_ptr<bool> alive = m_alive;
+	struct epoll_event events[EVENTLOOP_MAX_EVENTS];
+	int nevents;
+	int i;
+
+	Logger::debug("Event loop started");
+
+	while (m_running) {
+		nevents = ::epoll_wait(m_pollfd, events, EVENTLOOP_MAX_EVENTS,
+		    -1);
+		if (nevents < 0) {
+			if (errno == EINTR)
+				continue;
+
+			Logger::error("Event loop: epoll_wait failed: {}",
+			    strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < nevents; i++) {
+			if (events[i].data.fd == m_wakeup[0])
+				drain();
+			else
+				dispatch(events[i].data.fd,
+				    from_native(events[i].events));
+
+			/* A handler destroyed the loop */
+			if (!*alive)
+				return;
+		}
+	}
+
+	drain();
+	Logger::debug("Event loop stopped");
+}
+#else
+void
+EventLoop::run()
+{
+	std::shared_ptr<bool> alive = m_alive;
+	std::vector<struct pollfd> fds;
+	struct pollfd pfd;
+	uint32_t events;
+
+	Logger::debug("Event loop started");
+
+	while (m_running) {
+		fds.clear();
+		pfd.fd = m_wakeup[0];
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		fds.push_back(pfd);
+
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+
+			for (const auto &i: m_events) {
+				pfd.fd = i.first;
+				pfd.events = 0;
+				if (i.second & EVENT_READ)
+					pfd.events |= POLLIN;
+				if (i.second & EVENT_WRITE)
+					pfd.events |= POLLOUT;
+				fds.push_back(pfd);
+			}
+		}
+
+		if (::poll(fds.data(), fds.size(), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			Logger::error("Event loop: poll failed: {}",
+			    strerror(errno));
+			break;
+		}
+
+		if (fds[0].revents != 0)
+			drain();
+
+		if (!*alive)
+			return;
+
+		for (const auto &i: fds) {
+			if (i.fd == m_wakeup[0] || i.revents == 0)
+				continue;
+
+			events = 0;
+			if (i.revents & POLLIN)
+				events |= EVENT_READ;
+			if (i.revents & POLLOUT)
+				events |= EVENT_WRITE;
+			if (i.revents & (POLLHUP | POLLERR | POLLNVAL))
+				events |= EVENT_HANGUP;
+
+			dispatch(i.fd, events);
+			if (!*alive)
+				return;
+		}
+	}
+
+	drain();
+	Logger::debug("Event loop stopped");
+}
+#endif
@@ -0,0 +1,1144 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <algorithm>
+#include <stdexcept>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fmt/format.h>
+#include <fdt.hh>
+
+/* Nesting beyond this is a corrupt blob rather than a real tree */
+#define FDT_MAX_DEPTH		64
+
+static uint32_t
+load32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | p[3]);
+}
+
+static uint64_t
+load64(const uint8_t *p)
+{
+	return ((uint64_t)load32(p) << 32 | load32(p + 4));
+}
+
+static void
+store(std::vector<uint8_t> &out, uint64_t value, int bytes)
+{
+	int i;
+
+	for (i = bytes - 1; i >= 0; i--)
+		out.push_back(value >> (i * 8));
+}
+
+static void
+store32(std::vector<uint8_t> &out, uint32_t value)
+{
+	store(out, value, 4);
+}
+
+static void
+patch32(std::vector<uint8_t> &out, size_t offset, uint32_t value)
+{
+	out[offset] = value >> 24;
+	out[offset + 1] = value >> 16;
+	out[offset + 2] = value >> 8;
+	out[offset + 3] = value;
+}
+
+static void
+align4(std::vector<uint8_t> &out)
+{
+	while (out.size() % 4)
+		out.push_back(0);
+}
+
+FdtProperty *
+FdtNode::property(const std::string &name)
+{
+	for (auto &i: properties) {
+		if (i.name == name)
+			return (&i);
+	}
+
+	return (nullptr);
+}
+
+FdtNode *
+FdtNode::child(const std::string &name)
+{
+	for (auto &i: children) {
+		if (i.name == name)
+			return (&i);
+	}
+
+	return (nullptr);
+}
+
+/* NUL terminated string at offset, which must end before limit */
+static std::string
+dtb_string(const uint8_t *buf, size_t offset, size_t limit, const char *what)
+{
+	const void *nul;
+
+	if (offset >= limit)
+		throw std::runtime_error(fmt::format(
+		    "DTB: {} at {:#x} is out of bounds", what, offset));
+
+	nul = std::memchr(buf + offset, '\0', limit - offset);
+	if (nul == nullptr)
+		throw std::runtime_error(fmt::format(
+		    "DTB: {} at {:#x} is not terminated", what, offset));
+
+	return (std::string(reinterpret_cast<const char *>(buf + offset),
+	    static_cast<const uint8_t *>(nul) - (buf + offset)));
+}
+
+DeviceTree
+DeviceTree::from_dtb(const uint8_t *buf, size_t len)
+{
+	std::vector<FdtNode *> stack;
+	FdtProperty prop;
+	DeviceTree ret;
+	uint32_t totalsize, version, last_comp;
+	uint32_t off_struct, off_strings, off_rsvmap;
+	uint32_t size_struct, size_strings;
+	uint32_t token, value_len, nameoff;
+	size_t pos, end, rsv;
+	bool root = false;
+
+	if (len < FDT_HEADER_SIZE)
+		throw std::runtime_error(fmt::format(
+		    "DTB: {} bytes are too short for a header", len));
+
+	if (load32(buf) != FDT_MAGIC)
+		throw std::runtime_error(fmt::format(
+		    "DTB: bad magic {:#010x}", load32(buf)));
+
+	totalsize = load32(buf + 4);
+	off_struct = load32(buf + 8);
+	off_strings = load32(buf + 12);
+	off_rsvmap = load32(buf + 16);
+	version = load32(buf + 20);
+	last_comp = load32(buf + 24);
+	ret.boot_cpu = load32(buf + 28);
+	size_strings = load32(buf + 32);
+	size_struct = load32(buf + 36);
+
+	if (version < FDT_LAST_COMP_VERSION || last_comp > FDT_VERSION)
+		throw std::runtime_error(fmt::format(
+		    "DTB: version {} is not supported", version));
+
+	if (totalsize < FDT_HEADER_SIZE || totalsize > len)
+		throw std::runtime_error(fmt::format(
+		    "DTB: total size {} does not fit the {} bytes given",
+		    totalsize, len));
+
+	/* Version 16 has no struct block size */
+	if (version < 17)
+		size_struct = totalsize - std::min(off_struct, totalsize);
+
+	if (off_struct > totalsize || size_struct > totalsize - off_struct ||
+	    off_strings > totalsize || size_strings > totalsize - off_strings ||
+	    off_rsvmap > totalsize)
+		throw std::runtime_error("DTB: blocks exceed the total size");
+
+	for (rsv = off_rsvmap;; rsv += 16) {
+		if (rsv + 16 > totalsize)
+			throw std::runtime_error(
+			    "DTB: memory reservation map is not terminated");
+
+		if (load64(buf + rsv) == 0 && load64(buf + rsv + 8) == 0)
+			break;
+
+		ret.reservations.push_back({ load64(buf + rsv),
+		    load64(buf + rsv + 8) });
+	}
+
+	pos = off_struct;
+	end = off_struct + size_struct;
+
+	for (;;) {
+		if (pos + 4 > end)
+			throw std::runtime_error(
+			    "DTB: structure block ends without FDT_END");
+
+		token = load32(buf + pos);
+		pos += 4;
+
+		switch (token) {
+		case FDT_BEGIN_NODE:
+			if (stack.empty() && root)
+				throw std::runtime_error(fmt::format(
+				    "DTB: second root node at {:#x}", pos - 4));
+
+			if (stack.size() == FDT_MAX_DEPTH)
+				throw std::runtime_error(
+				    "DTB: nodes nested too deep");
+
+			if (stack.empty()) {
+				root = true;
+				stack.push_back(&ret.root);
+			} else {
+				stack.back()->children.emplace_back();
+				stack.push_back(&stack.back()->children.back());
+			}
+
+			stack.back()->name = dtb_string(buf, pos, end,
+			    "node name");
+			pos += stack.back()->name.size() + 1;
+			pos = (pos + 3) & ~3ul;
+			break;
+
+		case FDT_END_NODE:
+			if (stack.empty())
+				throw std::runtime_error(fmt::format(
+				    "DTB: unbalanced FDT_END_NODE at {:#x}",
+				    pos - 4));
+
+			stack.pop_back();
+			break;
+
+		case FDT_PROP:
+			if (stack.empty() || pos + 8 > end)
+				throw std::runtime_error(fmt::format(
+				    "DTB: stray property at {:#x}", pos - 4));
+
+			value_len = load32(buf + pos);
+			nameoff = load32(buf + pos + 4);
+			pos += 8;
+
+			if (value_len > end - pos)
+				throw std::runtime_error(fmt::format(
+				    "DTB: property at {:#x} overruns the "
+				    "structure block", pos - 12));
+
+			prop.name = dtb_string(buf + off_strings, nameoff,
+			    size_strings, "property name");
+			prop.value.assign(buf + pos, buf + pos + value_len);
+			prop.type = guess_type(prop.value);
+			stack.back()->properties.push_back(prop);
+			pos = (pos + value_len + 3) & ~3ul;
+			break;
+
+		case FDT_NOP:
+			break;
+
+		case FDT_END:
+			if (!stack.empty() || !root)
+				throw std::runtime_error(
+				    "DTB: FDT_END inside an open node");
+
+			return (ret);
+
+		default:
+			throw std::runtime_error(fmt::format(
+			    "DTB: unknown token {:#x} at {:#x}", token,
+			    pos - 4));
+		}
+	}
+}
+
+/* Shares any existing string, suffixes included, as dtc does */
+static uint32_t
+string_offset(std::vector<uint8_t> &strings, const std::string &name)
+{
+	size_t i;
+
+	for (i = 0; i < strings.size(); i++) {
+		if (std::strcmp(reinterpret_cast<const char *>(&strings[i]),
+		    name.c_str()) == 0)
+			return (i);
+	}
+
+	strings.insert(strings.end(), name.begin(), name.end());
+	strings.push_back('\0');
+	return (i);
+}
+
+/* Value offsets go into layout relative to the structure block */
+static void
+flatten(const FdtNode &node, const std::string &path,
+    std::vector<uint8_t> &structure, std::vector<uint8_t> &strings,
+    DeviceTree::Layout *layout)
+{
+	std::string prefix = path == "/" ? path : path + "/";
+
+	store32(structure, FDT_BEGIN_NODE);
+	structure.insert(structure.end(), node.name.begin(), node.name.end());
+	structure.push_back('\0');
+	align4(structure);
+
+	for (const auto &i: node.properties) {
+		store32(structure, FDT_PROP);
+		store32(structure, i.value.size());
+		store32(structure, string_offset(strings, i.name));
+
+		if (layout != nullptr)
+			(*layout)[prefix + i.name] = { structure.size(),
+			    i.value.size(), i.type };
+
+		structure.insert(structure.end(), i.value.begin(),
+		    i.value.end());
+		align4(structure);
+	}
+
+	for (const auto &i: node.children)
+		flatten(i, prefix + i.name, structure, strings, layout);
+
+	store32(structure, FDT_END_NODE);
+}
+
+std::vector<uint8_t>
+DeviceTree::to_dtb() const
+{
+	Layout layout;
+
+	return (to_dtb(layout));
+}
+
+std::vector<uint8_t>
+DeviceTree::to_dtb(Layout &layout) const
+{
+	std::vector<uint8_t> structure;
+	std::vector<uint8_t> strings;
+	std::vector<uint8_t> ret;
+	size_t off_struct, off_strings;
+
+	layout.clear();
+	flatten(root, "/", structure, strings, &layout);
+	store32(structure, FDT_END);
+
+	off_struct = FDT_HEADER_SIZE + (reservations.size() + 1) * 16;
+	off_strings = off_struct + structure.size();
+
+	for (auto &i: layout)
+		i.second.offset += off_struct;
+
+	store32(ret, FDT_MAGIC);
+	store32(ret, off_strings + strings.size());
+	store32(ret, off_struct);
+	store32(ret, off_strings);
+	store32(ret, FDT_HEADER_SIZE);
+	store32(ret, FDT_VERSION);
+	store32(ret, FDT_LAST_COMP_VERSION);
+	store32(ret, boot_cpu);
+	store32(ret, strings.size());
+	store32(ret, structure.size());
+
+	for (const auto &i: reservations) {
+		store(ret, i.address, 8);
+		store(ret, i.size, 8);
+	}
+
+	store(ret, 0, 8);
+	store(ret, 0, 8);
+	ret.insert(ret.end(), structure.begin(), structure.end());
+	ret.insert(ret.end(), strings.begin(), strings.end());
+	return (ret);
+}
+
+static bool
+is_string_char(uint8_t c)
+{
+	return (std::isprint(c) || c == '\0' ||
+	    (c != '\0' && std::strchr("\a\b\t\n\v\f\r", c) != nullptr));
+}
+
+static std::string
+format_strings(const std::vector<uint8_t> &value)
+{
+	std::string ret = "\"";
+	size_t i;
+
+	for (i = 0; i < value.size(); i++) {
+		switch (value[i]) {
+		case '\a': ret += "\\a"; break;
+		case '\b': ret += "\\b"; break;
+		case '\t': ret += "\\t"; break;
+		case '\n': ret += "\\n"; break;
+		case '\v': ret += "\\v"; break;
+		case '\f': ret += "\\f"; break;
+		case '\r': ret += "\\r"; break;
+		case '\\': ret += "\\\\"; break;
+		case '"': ret += "\\\""; break;
+		case '\0':
+			ret += i + 1 < value.size() ? "\", \"" : "\"";
+			break;
+		default:
+			if (std::isprint(value[i]))
+				ret += value[i];
+			else
+				ret += fmt::format("\\x{:02x}", value[i]);
+		}
+	}
+
+	return (ret);
+}
+
+/* dtc's guess: strings, else 32-bit cells, else bytes */
+FdtType
+DeviceTree::guess_type(const std::vector<uint8_t> &value)
+{
+	size_t nul;
+
+	if (value.empty())
+		return (FdtType::EMPTY);
+
+	nul = std::count(value.begin(), value.end(), '\0');
+
+	if (value.back() == '\0' && nul <= value.size() - nul &&
+	    std::all_of(value.begin(), value.end(), is_string_char))
+		return (FdtType::STRINGS);
+
+	if (value.size() % 4 == 0)
+		return (FdtType::CELLS);
+
+	return (FdtType::BYTES);
+}
+
+static std::string
+format_value(const std::vector<uint8_t> &value)
+{
+	std::string ret;
+	size_t i;
+
+	switch (DeviceTree::guess_type(value)) {
+	case FdtType::EMPTY:
+		return ("");
+
+	case FdtType::STRINGS:
+		return (format_strings(value));
+
+	case FdtType::CELLS:
+		for (i = 0; i < value.size(); i += 4)
+			ret += fmt::format("{}0x{:02x}", i ? " " : "<",
+			    load32(&value[i]));
+
+		return (ret + ">");
+
+	case FdtType::BYTES:
+		break;
+	}
+
+	for (i = 0; i < value.size(); i++)
+		ret += fmt::format("{}{:02x}", i ? " " : "[", value[i]);
+
+	return (ret + "]");
+}
+
+static void
+write_node(const FdtNode &node, int depth, std::string &out)
+{
+	std::string indent(depth, '\t');
+
+	out += indent + (node.name.empty() ? "/" : node.name) + " {\n";
+
+	for (const auto &i: node.properties) {
+		out += indent + "\t" + i.name;
+		out += i.value.empty() ? ";\n" :
+		    " = " + format_value(i.value) + ";\n";
+	}
+
+	for (const auto &i: node.children) {
+		out += "\n";
+		write_node(i, depth + 1, out);
+	}
+
+	out += indent + "};\n";
+}
+
+std::string
+DeviceTree::to_dts() const
+{
+	std::string ret = "/dts-v1/;\n\n";
+
+	for (const auto &i: reservations)
+		ret += fmt::format("/memreserve/\t{:#018x} {:#018x};\n",
+		    i.address, i.size);
+
+	write_node(root, 0, ret);
+	return (ret);
+}
+
+/* Recursive descent over the DTS subset described in fdt.hh */
+class DtsParser
+{
+public:
+	explicit DtsParser(const std::string &source):
+	    m_source(source),
+	    m_pos(0)
+	{
+	}
+
+	DeviceTree parse();
+
+protected:
+	[[noreturn]] void fail(const std::string &message) const;
+	bool at_end() const;
+	char peek() const;
+	void skip();
+	bool accept(char c);
+	bool accept(const char *keyword);
+	void expect(char c);
+	void labels();
+	std::string name();
+	void node(FdtNode &node, int depth);
+	std::vector<uint8_t> value(FdtType &type);
+	void string(std::vector<uint8_t> &out);
+	void cells(std::vector<uint8_t> &out, int bits);
+	void bytes(std::vector<uint8_t> &out);
+	uint64_t integer();
+	uint8_t escape();
+
+	const std::string &m_source;
+	size_t m_pos;
+};
+
+void
+DtsParser::fail(const std::string &message) const
+{
+	size_t line = 1;
+	size_t start = 0;
+	size_t i;
+
+	for (i = 0; i < m_pos && i < m_source.size(); i++) {
+		if (m_source[i] == '\n') {
+			line++;
+			start = i + 1;
+		}
+	}
+
+	throw std::runtime_error(fmt::format("DTS line {}, column {}: {}",
+	    line, m_pos - start + 1, message));
+}
+
+bool
+DtsParser::at_end() const
+{
+	return (m_pos >= m_source.size());
+}
+
+char
+DtsParser::peek() const
+{
+	return (at_end() ? '\0' : m_source[m_pos]);
+}
+
+/* Whitespace and comments */
+void
+DtsParser::skip()
+{
+	size_t end;
+
+	while (!at_end()) {
+		if (std::isspace(static_cast<unsigned char>(peek()))) {
+			m_pos++;
+		} else if (m_source.compare(m_pos, 2, "//") == 0) {
+			end = m_source.find('\n', m_pos);
+			m_pos = end == std::string::npos ? m_source.size() : end;
+		} else if (m_source.compare(m_pos, 2, "/*") == 0) {
+			end = m_source.find("*/", m_pos + 2);
+			if (end == std::string::npos)
+				fail("unterminated comment");
+
+			m_pos = end + 2;
+		} else
+			break;
+	}
+}
+
+bool
+DtsParser::accept(char c)
+{
+	skip();
+	if (peek() != c)
+		return (false);
+
+	m_pos++;
+	return (true);
+}
+
+bool
+DtsParser::accept(const char *keyword)
+{
+	size_t len = std::strlen(keyword);
+
+	skip();
+	if (m_source.compare(m_pos, len, keyword) != 0)
+		return (false);
+
+	m_pos += len;
+	return (true);
+}
+
+void
+DtsParser::expect(char c)
+{
+	if (!accept(c))
+		fail(at_end() ? fmt::format("expected '{}' at end of input", c) :
+		    fmt::format("expected '{}', found '{}'", c, peek()));
+}
+
+/* "label:" in front of nodes and properties, of no use in a DTB */
+void
+DtsParser::labels()
+{
+	size_t start;
+
+	for (;;) {
+		skip();
+		start = m_pos;
+
+		if (!std::isalpha(static_cast<unsigned char>(peek())) &&
+		    peek() != '_')
+			return;
+
+		while (std::isalnum(static_cast<unsigned char>(peek())) ||
+		    peek() == '_')
+			m_pos++;
+
+		if (peek() != ':') {
+			m_pos = start;
+			return;
+		}
+
+		m_pos++;
+	}
+}
+
+std::string
+DtsParser::name()
+{
+	size_t start;
+
+	skip();
+	start = m_pos;
+
+	while (std::isalnum(static_cast<unsigned char>(peek())) ||
+	    std::strchr(",._+*#?@-", peek()) != nullptr) {
+		if (peek() == '\0')
+			break;
+
+		m_pos++;
+	}
+
+	return (m_source.substr(start, m_pos - start));
+}
+
+DeviceTree
+DtsParser::parse()
+{
+	DeviceTree ret;
+	FdtReservation reservation;
+	bool root = false;
+
+	if (!accept("/dts-v1/"))
+		fail("missing /dts-v1/ tag");
+
+	expect(';');
+
+	for (;;) {
+		skip();
+		if (at_end())
+			break;
+
+		if (accept("/memreserve/")) {
+			reservation.address = integer();
+			reservation.size = integer();
+			expect(';');
+			ret.reservations.push_back(reservation);
+			continue;
+		}
+
+		if (accept("/plugin/") || accept("/include/"))
+			fail("overlays and includes are not supported");
+
+		labels();
+
+		if (peek() == '&')
+			fail("references to labels are not supported");
+
+		/* Repeated root nodes are merged, later values win */
+		expect('/');
+		node(ret.root, 0);
+		expect(';');
+		root = true;
+	}
+
+	if (!root)
+		fail("no root node");
+
+	return (ret);
+}
+
+void
+DtsParser::node(FdtNode &node, int depth)
+{
+	std::vector<std::string> defined;
+	std::vector<uint8_t> data;
+	FdtType type;
+	FdtProperty *prop;
+	FdtNode *child;
+	bool subnodes = false;
+	std::string id;
+
+	if (depth == FDT_MAX_DEPTH)
+		fail("nodes nested too deep");
+
+	expect('{');
+
+	for (;;) {
+		if (accept('}'))
+			return;
+
+		if (at_end())
+			fail(fmt::format("node '{}' is not closed",
+			    node.name.empty() ? "/" : node.name));
+
+		if (accept("/delete-node/") || accept("/delete-property/"))
+			fail("deleting nodes or properties is not supported");
+
+		labels();
+		id = name();
+		if (id.empty())
+			fail(fmt::format("expected a property or node name, "
+			    "found '{}'", peek()));
+
+		if (std::find(defined.begin(), defined.end(), id) !=
+		    defined.end())
+			fail(fmt::format("duplicate name '{}'", id));
+
+		defined.push_back(id);
+
+		skip();
+		if (peek() == '{') {
+			child = node.child(id);
+			if (child == nullptr) {
+				node.children.emplace_back();
+				node.children.back().name = id;
+				child = &node.children.back();
+			}
+
+			this->node(*child, depth + 1);
+			expect(';');
+			subnodes = true;
+			continue;
+		}
+
+		if (subnodes)
+			fail(fmt::format("property '{}' follows a subnode, "
+			    "properties must come first", id));
+
+		data.clear();
+		type = FdtType::EMPTY;
+		if (accept('='))
+			data = value(type);
+
+		expect(';');
+
+		prop = node.property(id);
+		if (prop != nullptr) {
+			prop->value = data;
+			prop->type = type;
+		} else
+			node.properties.push_back({ id, data, type });
+	}
+}
+
+/*
+ * Comma separated strings, cells and byte strings, concatenated. The
+ * type is that of the parts, BYTES if they differ.
+ */
+std::vector<uint8_t>
+DtsParser::value(FdtType &type)
+{
+	std::vector<uint8_t> ret;
+	FdtType part;
+	uint64_t bits;
+	bool first = true;
+
+	do {
+		labels();
+
+		if (peek() == '"') {
+			string(ret);
+			part = FdtType::STRINGS;
+		} else if (peek() == '<') {
+			cells(ret, 32);
+			part = FdtType::CELLS;
+		} else if (peek() == '[') {
+			bytes(ret);
+			part = FdtType::BYTES;
+		} else if (accept("/bits/")) {
+			bits = integer();
+			if (bits != 8 && bits != 16 && bits != 32 && bits != 64)
+				fail(fmt::format("/bits/ {} is not 8, 16, 32 "
+				    "or 64", bits));
+
+			skip();
+			cells(ret, bits);
+			part = bits == 32 ? FdtType::CELLS : FdtType::BYTES;
+		} else if (peek() == '&')
+			fail("references to labels are not supported");
+		else
+			fail("expected a \"string\", <cells> or [bytes]");
+
+		type = first || part == type ? part : FdtType::BYTES;
+		first = false;
+	} while (accept(','));
+
+	return (ret);
+}
+
+void
+DtsParser::string(std::vector<uint8_t> &out)
+{
+	expect('"');
+
+	for (;;) {
+		if (at_end() || peek() == '\n')
+			fail("unterminated string");
+
+		if (peek() == '"')
+			break;
+
+		if (peek() == '\\')
+			out.push_back(escape());
+		else
+			out.push_back(m_source[m_pos++]);
+	}
+
+	m_pos++;
+	out.push_back('\0');
+}
+
+void
+DtsParser::cells(std::vector<uint8_t> &out, int bits)
+{
+	uint64_t value;
+
+	expect('<');
+
+	for (;;) {
+		if (accept('>'))
+			return;
+
+		skip();
+		if (peek() == '&')
+			fail("references to labels are not supported");
+
+		if (peek() == '(')
+			fail("expressions are not supported");
+
+		if (peek() == '\'') {
+			m_pos++;
+			value = peek() == '\\' ? escape() :
+			    static_cast<uint8_t>(m_source[m_pos++]);
+			if (peek() != '\'')
+				fail("unterminated character literal");
+
+			m_pos++;
+		} else
+			value = integer();
+
+		if (bits < 64 && value >> bits)
+			fail(fmt::format("{:#x} does not fit in {} bits",
+			    value, bits));
+
+		store(out, value, bits / 8);
+	}
+}
+
+void
+DtsParser::bytes(std::vector<uint8_t> &out)
+{
+	char digits[3] = {};
+
+	expect('[');
+
+	for (;;) {
+		if (accept(']'))
+			return;
+
+		if (m_pos + 1 >= m_source.size() ||
+		    !std::isxdigit(static_cast<unsigned char>(m_source[m_pos])) ||
+		    !std::isxdigit(static_cast<unsigned char>(m_source[m_pos + 1])))
+			fail("expected two hex digits per byte");
+
+		digits[0] = m_source[m_pos];
+		digits[1] = m_source[m_pos + 1];
+		out.push_back(std::strtoul(digits, nullptr, 16));
+		m_pos += 2;
+	}
+}
+
+/* Decimal, 0x hex or 0 octal, with C integer suffixes, as dtc reads them */
+uint64_t
+DtsParser::integer()
+{
+	std::string digits;
+	uint64_t ret;
+	char *end;
+
+	skip();
+	while (std::isalnum(static_cast<unsigned char>(peek())))
+		digits += m_source[m_pos++];
+
+	while (!digits.empty() && std::strchr("uUlL", digits.back()))
+		digits.pop_back();
+
+	if (digits.empty() || !std::isdigit(
+	    static_cast<unsigned char>(digits[0])))
+		fail("expected a number");
+
+	errno = 0;
+	ret = std::strtoull(digits.c_str(), &end, 0);
+	if (*end != '\0' || errno == ERANGE)
+		fail(fmt::format("invalid number '{}'", digits));
+
+	return (ret);
+}
+
+/* Backslash sequence in a string or character literal */
+uint8_t
+DtsParser::escape()
+{
+	const char *simple = "a\ab\bt\tn\nv\vf\fr\r";
+	const char *match;
+	size_t start;
+	int base;
+	char c;
+
+	m_pos++;
+	if (at_end())
+		fail("unterminated escape sequence");
+
+	c = m_source[m_pos++];
+	match = std::strchr(simple, c);
+	if (c != '\0' && match != nullptr && (match - simple) % 2 == 0)
+		return (match[1]);
+
+	if (c == 'x' || (c >= '0' && c <= '7')) {
+		base = c == 'x' ? 16 : 8;
+		start = c == 'x' ? m_pos : m_pos - 1;
+
+		while (m_pos < start + (base == 16 ? 2 : 3) && !at_end() &&
+		    (base == 16 ? std::isxdigit(static_cast<unsigned char>(peek())) :
+		    (peek() >= '0' && peek() <= '7')))
+			m_pos++;
+
+		if (m_pos == start)
+			fail("\\x needs at least one hex digit");
+
+		return (std::strtoul(m_source.substr(start, m_pos - start)
+		    .c_str(), nullptr, base));
+	}
+
+	/* \\, \", \' and anything else stand for themselves */
+	return (c);
+}
+
+DeviceTree
+DeviceTree::from_dts(const std::string &source)
+{
+	DtsParser parser(source);
+
+	return (parser.parse());
+}
+
+DtbTemplate::DtbTemplate(const DeviceTree &tree)
+{
+	m_blob = tree.to_dtb(m_layout);
+}
+
+size_t
+DtbTemplate::add_field(const std::string &path, std::optional<FdtType> type)
+{
+	std::string full = path.empty() || path[0] != '/' ? "/" + path : path;
+	Field field;
+	size_t i;
+
+	for (i = 0; i < m_fields.size(); i++) {
+		if (m_fields[i].path == full)
+			return (i);
+	}
+
+	auto it = m_layout.find(full);
+	if (it == m_layout.end())
+		throw std::runtime_error(fmt::format(
+		    "Template has no property {}", full));
+
+	field.path = full;
+	field.offset = it->second.offset;
+	field.size = it->second.size;
+	field.type = type ? *type : it->second.type;
+
+	m_fields.push_back(field);
+	m_order.push_back(m_fields.size() - 1);
+	std::sort(m_order.begin(), m_order.end(), [this](size_t a, size_t b) {
+		return (m_fields[a].offset < m_fields[b].offset);
+	});
+
+	return (m_fields.size() - 1);
+}
+
+size_t
+DtbTemplate::fields() const
+{
+	return (m_fields.size());
+}
+
+const std::string &
+DtbTemplate::path(size_t field) const
+{
+	return (m_fields.at(field).path);
+}
+
+std::vector<uint8_t>
+DtbTemplate::encode(size_t field, const std::string &text) const
+{
+	const Field &f = m_fields.at(field);
+	std::vector<uint8_t> ret;
+	std::string digits;
+	uint64_t cell;
+	size_t start, end;
+	char *stop;
+
+	switch (f.type) {
+	case FdtType::STRINGS:
+		if (text.find('\0') != std::string::npos)
+			throw std::runtime_error(fmt::format(
+			    "{}: strings cannot contain NUL", f.path));
+
+		ret.assign(text.begin(), text.end());
+		ret.push_back('\0');
+		return (ret);
+
+	case FdtType::CELLS:
+		for (start = 0; start < text.size(); start = end) {
+			start = text.find_first_not_of(" \t,", start);
+			if (start == std::string::npos)
+				break;
+
+			end = text.find_first_of(" \t,", start);
+			if (end == std::string::npos)
+				end = text.size();
+
+			digits = text.substr(start, end - start);
+			errno = 0;
+			cell = std::strtoull(digits.c_str(), &stop, 0);
+			if (*stop != '\0' || errno == ERANGE || cell >> 32)
+				throw std::runtime_error(fmt::format(
+				    "{}: '{}' is not a 32-bit cell", f.path,
+				    digits));
+
+			store32(ret, cell);
+		}
+
+		return (ret);
+
+	case FdtType::EMPTY:
+	case FdtType::BYTES:
+		break;
+	}
+
+	for (char c: text) {
+		if (c == ':' || c == '-' || c == ' ')
+			continue;
+
+		if (!std::isxdigit(static_cast<unsigned char>(c)))
+			throw std::runtime_error(fmt::format(
+			    "{}: '{}' is not hex bytes", f.path, text));
+
+		digits += c;
+	}
+
+	if (digits.size() != f.size * 2)
+		throw std::runtime_error(fmt::format(
+		    "{}: '{}' is not {} bytes", f.path, text, f.size));
+
+	for (start = 0; start < digits.size(); start += 2)
+		ret.push_back(std::strtoul(digits.substr(start, 2).c_str(),
+		    nullptr, 16));
+
+	return (ret);
+}
+
+/*
+ * Copies the blob up to each field, puts in the new length and value,
+ * then fixes up the header for the change in size. Every field lives
+ * in the structure block, which comes before the strings block.
+ */
+void
+DtbTemplate::render(const std::vector<std::vector<uint8_t>> &values,
+    std::vector<uint8_t> &image) const
+{
+	const uint8_t *blob = m_blob.data();
+	size_t pos = 0;
+	int64_t growth;
+
+	if (values.size() != m_fields.size())
+		throw std::runtime_error(fmt::format(
+		    "Template has {} fields, {} values given",
+		    m_fields.size(), values.size()));
+
+	image.clear();
+	image.reserve(m_blob.size() + 256);
+
+	for (size_t i: m_order) {
+		const Field &field = m_fields[i];
+		const std::vector<uint8_t> &value = values[i];
+
+		image.insert(image.end(), blob + pos, blob + field.offset);
+		patch32(image, image.size() - 8, value.size());
+		image.insert(image.end(), value.begin(), value.end());
+		align4(image);
+		pos = field.offset + ((field.size + 3) & ~3ul);
+	}
+
+	image.insert(image.end(), blob + pos, blob + m_blob.size());
+
+	growth = static_cast<int64_t>(image.size()) - m_blob.size();
+	if (growth == 0)
+		return;
+
+	patch32(image, 4, load32(blob + 4) + growth);
+	patch32(image, 12, load32(blob + 12) + growth);
+	patch32(image, 36, load32(blob + 36) + growth);
+}
+
+const std::vector<uint8_t> &
+DtbTemplate::blob() const
+{
+	return (m_blob);
+}
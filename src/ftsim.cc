@@ -0,0 +1,673 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <baudrate.hh>
+#include <ftsim.hh>
+
+static std::mutex simulators_lock;
+static std::map<std::string, std::shared_ptr<FtdiSimulator>> simulators;
+
+/* INTERFACE_ANY opens the first channel, like libftdi does */
+static size_t
+channel_index(enum ftdi_interface channel)
+{
+	return (channel == INTERFACE_ANY ? 0 : channel - 1);
+}
+
+FtdiSimulator::FtdiSimulator(const std::string &serial):
+	m_serial(serial),
+	m_stats(),
+	m_tx_free(Clock::now()),
+	m_rx_free(Clock::now())
+{
+}
+
+std::shared_ptr<FtdiSimulator>
+FtdiSimulator::attach(const std::string &serial)
+{
+	std::lock_guard<std::mutex> lock(simulators_lock);
+	std::shared_ptr<FtdiSimulator> &sim = simulators[serial];
+
+	if (!sim)
+		sim = std::make_shared<FtdiSimulator>(serial);
+
+	return (sim);
+}
+
+/* Transports still open keep their simulator until they are closed */
+void
+FtdiSimulator::detach(const std::string &serial)
+{
+	std::lock_guard<std::mutex> lock(simulators_lock);
+
+	simulators.erase(serial);
+}
+
+std::shared_ptr<FtdiSimulator>
+FtdiSimulator::find(const std::string &serial)
+{
+	std::lock_guard<std::mutex> lock(simulators_lock);
+	auto it = simulators.find(serial);
+
+	if (it == simulators.end())
+		return (nullptr);
+
+	return (it->second);
+}
+
+std::vector<Device>
+FtdiSimulator::devices()
+{
+	std::lock_guard<std::mutex> lock(simulators_lock);
+	std::vector<Device> ret;
+
+	for (const auto &i: simulators)
+		ret.push_back(i.second->device());
+
+	return (ret);
+}
+
+Device
+FtdiSimulator::device() const
+{
+	/* Reported with the IDs of a stock FT4232H */
+	return (Device { 0x0403, 0x6011, m_serial, "FT4232H simulator",
+	    true });
+}
+
+void
+FtdiSimulator::set_uart_timing(const SimUartTiming &timing)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	m_timing = timing;
+}
+
+void
+FtdiSimulator::uart_inject(const uint8_t *buf, size_t len)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	Clock::time_point start = std::max(Clock::now(), m_rx_free);
+
+	m_rx_free = start + uart_time(len);
+	m_rx.push_back({ start, m_rx_free,
+	    std::vector<uint8_t>(buf, buf + len), 0 });
+}
+
+void
+FtdiSimulator::attach_i2c(I2CTarget *target)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	m_i2c.attach(target);
+}
+
+void
+FtdiSimulator::set_inputs(enum ftdi_interface channel, uint8_t value)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	this->channel(channel).inputs = value;
+}
+
+uint8_t
+FtdiSimulator::pins(enum ftdi_interface channel)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	return (levels(this->channel(channel)));
+}
+
+SimChannelStats
+FtdiSimulator::stats(enum ftdi_interface channel)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	return (m_stats[channel_index(channel)]);
+}
+
+FtdiSimulator::Channel &
+FtdiSimulator::channel(enum ftdi_interface channel)
+{
+	return (m_channels[channel_index(channel)]);
+}
+
+uint8_t
+FtdiSimulator::levels(const Channel &channel) const
+{
+	return ((channel.latch & channel.direction) |
+	    (channel.inputs & ~channel.direction));
+}
+
+double
+FtdiSimulator::uart_throughput() const
+{
+	const Channel &uart = m_channels[INTERFACE_C - 1];
+
+	if (m_timing.throughput != 0)
+		return (m_timing.throughput);
+
+	return (uart.baudrate / uart.frame_bits);
+}
+
+FtdiSimulator::Clock::duration
+FtdiSimulator::uart_time(size_t len) const
+{
+	return (std::chrono::duration_cast<Clock::duration>(
+	    std::chrono::duration<double>(len / uart_throughput())));
+}
+
+/*
+ * Puts as much of buf on the line as the chip FIFO takes and returns
+ * how much that was, 0 while the FIFO is full.
+ */
+size_t
+FtdiSimulator::uart_write(const uint8_t *buf, size_t len)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	Clock::time_point now = Clock::now();
+	Clock::time_point start = std::max(now, m_tx_free);
+	double backlog;
+	size_t room;
+
+	backlog = std::chrono::duration<double>(start - now).count() *
+	    uart_throughput();
+	if (backlog >= FTSIM_TX_FIFO)
+		return (0);
+
+	room = std::min(len, FTSIM_TX_FIFO - static_cast<size_t>(backlog));
+	m_tx_free = start + uart_time(room);
+	m_rx.push_back({ start + m_timing.latency, m_tx_free + m_timing.latency,
+	    std::vector<uint8_t>(buf, buf + room), 0 });
+
+	return (room);
+}
+
+/* Takes the UART input that has arrived by now, in order */
+size_t
+FtdiSimulator::uart_collect(uint8_t *buf, size_t len)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	Clock::time_point now = Clock::now();
+	size_t done = 0;
+	size_t due;
+	size_t n;
+
+	while (done < len && !m_rx.empty()) {
+		Burst &burst = m_rx.front();
+
+		if (now >= burst.end)
+			due = burst.data.size();
+		else if (now <= burst.start)
+			due = 0;
+		else
+			due = burst.data.size() * (now - burst.start) /
+			    (burst.end - burst.start);
+
+		n = std::min(due - burst.delivered, len - done);
+		std::memcpy(buf + done, &burst.data[burst.delivered], n);
+		burst.delivered += n;
+		done += n;
+
+		if (burst.delivered < burst.data.size())
+			break;
+
+		m_rx.pop_front();
+	}
+
+	return (done);
+}
+
+SimTransport::SimTransport():
+	m_channel(INTERFACE_ANY)
+{
+}
+
+SimTransport::~SimTransport()
+{
+	close();
+}
+
+int
+SimTransport::fail(int ret, const std::string &error)
+{
+	m_error = error;
+	return (ret);
+}
+
+int
+SimTransport::open(const Device &device, enum ftdi_interface channel)
+{
+	std::shared_ptr<FtdiSimulator> sim;
+	uint8_t inputs;
+
+	sim = FtdiSimulator::find(device.serial);
+	if (!sim)
+		return (fail(-3, "device not found"));
+
+	std::lock_guard<std::mutex> lock(sim->m_lock);
+	FtdiSimulator::Channel &state = sim->channel(channel);
+
+	if (state.open)
+		return (fail(-5, "unable to claim usb device"));
+
+	/* Pin levels are the outside world's and survive reopening */
+	inputs = state.inputs;
+	state = FtdiSimulator::Channel();
+	state.inputs = inputs;
+	state.open = true;
+
+	m_sim = sim;
+	m_channel = channel;
+	return (0);
+}
+
+int
+SimTransport::close()
+{
+	if (!m_sim)
+		return (0);
+
+	{
+		std::lock_guard<std::mutex> lock(m_sim->m_lock);
+
+		m_sim->channel(m_channel).open = false;
+	}
+
+	m_sim.reset();
+	return (0);
+}
+
+int
+SimTransport::reset()
+{
+	if (!m_sim)
+		return (fail(-2, "USB device unavailable"));
+
+	std::lock_guard<std::mutex> lock(m_sim->m_lock);
+
+	if (m_channel == INTERFACE_A)
+		m_sim->m_i2c.clear();
+
+	if (m_channel == INTERFACE_C) {
+		m_sim->m_rx.clear();
+		m_sim->m_tx_free = FtdiSimulator::Clock::now();
+	}
+
+	return (0);
+}
+
+int
+SimTransport::set_bitmode(uint8_t mask, uint8_t mode)
+{
+	if (!m_sim)
+		return (fail(-2, "USB device unavailable"));
+
+	std::lock_guard<std::mutex> lock(m_sim->m_lock);
+	FtdiSimulator::Channel &state = m_sim->channel(m_channel);
+
+	state.mode = mode;
+	state.direction = mode == BITMODE_RESET ? 0 : mask;
+	return (0);
+}
+
+int
+SimTransport::bitbang_disable()
+{
+	return (set_bitmode(0, BITMODE_RESET));
+}
+
+int
+SimTransport::set_baud_rate(int baudrate)
+{
+	BaudRate rate = BaudRate::compute(baudrate);
+
+	if (!m_sim)
+		return (fail(-3, "USB device unavailable"));
+
+	if (!rate.valid())
+		return (fail(-1, "Unsupported baudrate. Note: bitbang "
+		    "baudrates are automatically multiplied by 4"));
+
+	std::lock_guard<std::mutex> lock(m_sim->m_lock);
+
+	m_sim->channel(m_channel).baudrate = rate.actual;
+	return (0);
+}
+
+int
+SimTransport::baud_rate()
+{
+	if (!m_sim)
+		return (fail(-3, "USB device unavailable"));
+
+	std::lock_guard<std::mutex> lock(m_sim->m_lock);
+
+	return (m_sim->channel(m_channel).baudrate);
+}
+
+int
+SimTransport::set_line_property(enum ftdi_bits_type bits,
+    enum ftdi_stopbits_type stop, enum ftdi_parity_type parity)
+{
+	double frame;
+
+	if (!m_sim)
+		return (fail(-2, "USB device unavailable"));
+
+	/* Start bit, data bits, parity bit and stop bits */
+	frame = 1 + (bits == BITS_7 ? 7 : 8) + (parity == NONE ? 0 : 1);
+	frame += stop == STOP_BIT_1 ? 1 : stop == STOP_BIT_15 ? 1.5 : 2;
+
+	std::lock_guard<std::mutex> lock(m_sim->m_lock);
+
+	m_sim->channel(m_channel).frame_bits = frame;
+	return (0);
+}
+
+/* The loopback never deasserts CTS or DSR, so the setting has no effect */
+int
+SimTransport::set_flow_control(int flow, uint8_t xon, uint8_t xoff)
+{
+	if (!m_sim)
+		return (fail(-2, "USB device unavailable"));
+
+	return (0);
+}
+
+int
+SimTransport::set_latency(int latency)
+{
+	if (!m_sim)
+		return (fail(-3, "USB device unavailable"));
+
+	if (latency < 1)
+		return (fail(-1, "latency out of range. Only valid for 1-255"));
+
+	std::lock_guard<std::mutex> lock(m_sim->m_lock);
+
+	m_sim->channel(m_channel).latency = latency;
+	return (0);
+}
+
+int
+SimTransport::latency()
+{
+	if (!m_sim)
+		return (fail(-3, "USB device unavailable"));
+
+	std::lock_guard<std::mutex> lock(m_sim->m_lock);
+
+	return (m_sim->channel(m_channel).latency);
+}
+
+int
+SimTransport::set_read_chunk_size(int size)
+{
+	if (!m_sim)
+		return (fail(-1, "USB device unavailable"));
+
+	std::lock_guard<std::mutex> lock(m_sim->m_lock);
+
+	m_sim->channel(m_channel).read_chunk = size;
+	return (0);
+}
+
+int
+SimTransport::read_chunk_size()
+{
+	if (!m_sim)
+		return (fail(-1, "USB device unavailable"));
+
+	std::lock_guard<std::mutex> lock(m_sim->m_lock);
+
+	return (m_sim->channel(m_channel).read_chunk);
+}
+
+int
+SimTransport::set_write_chunk_size(int size)
+{
+	if (!m_sim)
+		return (fail(-1, "USB device unavailable"));
+
+	std::lock_guard<std::mutex> lock(m_sim->m_lock);
+
+	m_sim->channel(m_channel).write_chunk = size;
+	return (0);
+}
+
+int
+SimTransport::write_chunk_size()
+{
+	if (!m_sim)
+		return (fail(-1, "USB device unavailable"));
+
+	std::lock_guard<std::mutex> lock(m_sim->m_lock);
+
+	return (m_sim->channel(m_channel).write_chunk);
+}
+
+int
+SimTransport::write(const uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+	size_t ret;
+
+	if (!m_sim)
+		return (fail(-666, "USB device unavailable"));
+
+	{
+		std::lock_guard<std::mutex> lock(m_sim->m_lock);
+		FtdiSimulator::Channel &state = m_sim->channel(m_channel);
+		SimChannelStats &stats = m_sim->m_stats[channel_index(m_channel)];
+
+		stats.writes++;
+		stats.bytes_out += len;
+
+		if (state.mode == BITMODE_MPSSE) {
+			/* Only the I2C bus of channel A is modelled */
+			if (m_channel == INTERFACE_A)
+				m_sim->m_i2c.feed(buf, len);
+
+			return (len);
+		}
+
+		if (state.mode != BITMODE_RESET) {
+			if (len > 0)
+				state.latch = buf[len - 1];
+
+			return (len);
+		}
+
+		if (m_channel != INTERFACE_C)
+			return (len);
+	}
+
+	/* Blocks while the line drains the FIFO, like a bulk write would */
+	while (done < len) {
+		ret = m_sim->uart_write(buf + done, len - done);
+		if (ret == 0) {
+			std::this_thread::sleep_for(FTSIM_RX_TICK);
+			continue;
+		}
+
+		done += ret;
+	}
+
+	return (len);
+}
+
+int
+SimTransport::read(uint8_t *buf, size_t len)
+{
+	bool uart = false;
+	size_t ret = 0;
+
+	if (!m_sim)
+		return (fail(-666, "USB device unavailable"));
+
+	{
+		std::lock_guard<std::mutex> lock(m_sim->m_lock);
+		FtdiSimulator::Channel &state = m_sim->channel(m_channel);
+
+		if (state.mode == BITMODE_RESET)
+			uart = m_channel == INTERFACE_C;
+		else if (state.mode == BITMODE_MPSSE) {
+			if (m_channel == INTERFACE_A)
+				ret = m_sim->m_i2c.take(buf, len);
+		} else {
+			std::memset(buf, m_sim->levels(state), len);
+			ret = len;
+		}
+	}
+
+	if (uart)
+		ret = m_sim->uart_collect(buf, len);
+
+	if (ret > 0) {
+		std::lock_guard<std::mutex> lock(m_sim->m_lock);
+		SimChannelStats &stats = m_sim->m_stats[channel_index(m_channel)];
+
+		stats.reads++;
+		stats.bytes_in += ret;
+	}
+
+	return (ret);
+}
+
+int
+SimTransport::read_pins(uint8_t *pins)
+{
+	if (!m_sim)
+		return (fail(-2, "USB device unavailable"));
+
+	*pins = m_sim->pins(m_channel);
+	return (0);
+}
+
+std::string
+SimTransport::error_string()
+{
+	return (m_error);
+}
+
+std::unique_ptr<Receiver>
+SimTransport::receiver(ByteRing &ring, size_t depth, size_t chunk,
+    EventLoop *loop)
+{
+	return (std::make_unique<SimReceiver>(m_sim, ring, chunk));
+}
+
+SimReceiver::SimReceiver(std::shared_ptr<FtdiSimulator> sim, ByteRing &ring,
+    size_t chunk):
+	m_sim(sim),
+	m_ring(ring),
+	m_buffer(chunk),
+	m_running(false),
+	m_bytes(0),
+	m_transfers(0)
+{
+}
+
+SimReceiver::~SimReceiver()
+{
+	stop();
+}
+
+void
+SimReceiver::start()
+{
+	if (m_running)
+		return;
+
+	m_running = true;
+	m_thread = std::thread(&SimReceiver::worker, this);
+}
+
+void
+SimReceiver::stop()
+{
+	if (!m_running)
+		return;
+
+	m_running = false;
+	m_thread.join();
+}
+
+void
+SimReceiver::set_notify(const std::function<void()> &notify)
+{
+	m_notify = notify;
+}
+
+UsbReceiverStats
+SimReceiver::stats() const
+{
+	UsbReceiverStats ret = {};
+
+	ret.bytes = m_bytes;
+	ret.transfers = m_transfers;
+	return (ret);
+}
+
+/* The loopback plug ties RTS to CTS and DTR to DSR */
+uint8_t
+SimReceiver::modem_status() const
+{
+	return (USBRX_STATUS_CTS | USBRX_STATUS_DSR);
+}
+
+void
+SimReceiver::worker()
+{
+	size_t len;
+
+	while (m_running) {
+		len = m_sim->uart_collect(m_buffer.data(), m_buffer.size());
+		if (len > 0) {
+			if (m_metrics.read_sizes)
+				m_metrics.read_sizes->observe(len);
+
+			m_ring.write(m_buffer.data(), len);
+			m_bytes += len;
+			m_transfers++;
+
+			if (m_notify)
+				m_notify();
+
+			/* More may be waiting already */
+			if (len == m_buffer.size())
+				continue;
+		}
+
+		std::this_thread::sleep_for(FTSIM_RX_TICK);
+	}
+}
@@ -30,28 +30,29 @@
 #include <ftdi.hpp>
 #include <device.hh>
 #include <gpio.hh>
+#include <tuning.hh>
 #include <gtkmm.h>
 
-Gpio::Gpio(const Device &device)
+Gpio::Gpio(const Device &device, const ChannelTuning &tuning)
 {
 	/* set all the GPIO to input - clear all the bits */
 	io_state = 0x00;
 
-	m_context.set_interface(INTERFACE_D);
+	m_transport = Transport::create(device);
 
-	if (m_context.open(device.vid, device.pid, device.description,
-	    device.serial) != 0) {
+	if (m_transport->open(device, INTERFACE_D) != 0) {
 		throw std::runtime_error(fmt::format(
 		    "Failed to open device: {}",
-		    m_context.error_string()));
+		    m_transport->error_string()));
 	}
 
+	tuning.apply(*m_transport, "GPIO");
 	configure();
 }
 
 Gpio::~Gpio()
 {
-	m_context.close();
+	m_transport->close();
 }
 
 uint8_t
@@ -59,24 +60,24 @@ Gpio::get()
 {
 	uint8_t rd;
 
-	m_context.read(&rd, 1);
+	m_transport->read(&rd, 1);
 	return (rd);
 }
 
 void
 Gpio::set(uint8_t mask)
 {
-	m_context.write(&mask, 1);
+	m_transport->write(&mask, 1);
 }
 
 
 void
 Gpio::configure()
 {
-	if (m_context.set_bitmode(0xff, BITMODE_RESET) != 0)
+	if (m_transport->set_bitmode(0xff, BITMODE_RESET) != 0)
 		throw std::runtime_error("Failed to set bitmode");
 
-	if (m_context.set_bitmode(io_state, BITMODE_BITBANG) != 0)
+	if (m_transport->set_bitmode(io_state, BITMODE_BITBANG) != 0)
 		throw std::runtime_error("Failed to set bitmode");
 }
 
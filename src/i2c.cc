@@ -26,21 +26,279 @@
  *
  */
 
+#include <algorithm>
+#include <stdexcept>
 #include <ftdi.hpp>
 #include <log.hh>
 #include <device.hh>
 #include <i2c.hh>
 
+#define I2C_READ_RETRIES	100
+#define MPSSE_BASE_CLOCK	60000000
+#define MPSSE_DIV5_CLOCK	(MPSSE_BASE_CLOCK / 5)
+#define I2C_STANDARD_MODE	100000
+
+I2CClock
+I2CClock::compute(int clock)
+{
+	I2CClock result;
+	int64_t phases;
+	int64_t base;
+	int64_t div;
+
+	if (clock <= 0)
+		throw std::runtime_error(fmt::format(
+		    "Invalid I2C clock rate: {}", clock));
+
+	/* Anything above Standard-mode needs the SDA hold time */
+	result.three_phase = clock > I2C_STANDARD_MODE;
+	phases = result.three_phase ? 3 : 2;
+
+	/* Round the divisor up so the bus never runs faster than asked */
+	result.div5 = false;
+	base = MPSSE_BASE_CLOCK;
+	div = (base + phases * clock - 1) / (phases * clock) - 1;
+
+	if (div > 0xffff) {
+		result.div5 = true;
+		base = MPSSE_DIV5_CLOCK;
+		div = (base + phases * clock - 1) / (phases * clock) - 1;
+	}
+
+	result.divisor = static_cast<uint16_t>(std::clamp<int64_t>(div, 0, 0xffff));
+	result.rate = static_cast<int>(base / (phases * (result.divisor + 1)));
+	return (result);
+}
+
+I2CTransaction::I2CTransaction():
+    m_pending(0)
+{
+}
+
+void
+I2CTransaction::start()
+{
+	queue({
+	    /* SCL high, SDA high, repeat 4 times */
+	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
+	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
+	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
+	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
+	    /* SCL high, SDA low, repeat 4 times */
+	    SET_BITS_LOW, SCL, OUT_PINS,
+	    SET_BITS_LOW, SCL, OUT_PINS,
+	    SET_BITS_LOW, SCL, OUT_PINS,
+	    SET_BITS_LOW, SCL, OUT_PINS,
+	    /* SCL low, SDA low */
+	    SET_BITS_LOW, 0, OUT_PINS
+	});
+}
+
+void
+I2CTransaction::stop()
+{
+	queue({
+	    /* SCL high, SDA low, repeat 4 times */
+	    SET_BITS_LOW, SCL, OUT_PINS,
+	    SET_BITS_LOW, SCL, OUT_PINS,
+	    SET_BITS_LOW, SCL, OUT_PINS,
+	    SET_BITS_LOW, SCL, OUT_PINS,
+	    /* SCL high, SDA high, repeat 4 times */
+	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
+	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
+	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
+	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
+	    /* Tristate SDA and SCL pins */
+	    SET_BITS_LOW, 0, WP
+	});
+}
+
+void
+I2CTransaction::write(const std::vector<uint8_t> &data)
+{
+	for (const auto &i: data) {
+		queue({
+		    MPSSE_DO_WRITE | MPSSE_WRITE_NEG, 0, 0, i,
+		    /* Release SDA and clock in the ACK bit */
+		    SET_BITS_LOW, 0, SCL | WP,
+		    MPSSE_DO_READ | MPSSE_BITMODE, 0,
+		    SET_BITS_LOW, 0, OUT_PINS
+		});
+
+		expect(Slot::ACK);
+	}
+}
+
+void
+I2CTransaction::read(size_t nbytes)
+{
+	size_t i;
+
+	for (i = 0; i < nbytes; i++) {
+		/* ACK every byte except the last one */
+		uint8_t ackbyte = static_cast<uint8_t>(
+		    i != nbytes - 1 ? 0 : 0xff);
+
+		queue({
+		    SET_BITS_LOW, 0, SCL | WP,
+		    MPSSE_DO_READ | MPSSE_READ_NEG, 0, 0,
+		    SET_BITS_LOW, 0, OUT_PINS,
+		    MPSSE_DO_WRITE | MPSSE_WRITE_NEG | MPSSE_BITMODE, 0, ackbyte,
+		    SET_BITS_LOW, 0, OUT_PINS
+		});
+
+		expect(Slot::DATA);
+	}
+}
+
+bool
+I2CTransaction::acked() const
+{
+	for (const auto &i: m_acks) {
+		if (!i)
+			return (false);
+	}
+
+	return (true);
+}
+
+bool
+I2CTransaction::acked(size_t index) const
+{
+	return (m_acks.at(index));
+}
+
+const std::vector<uint8_t> &
+I2CTransaction::data() const
+{
+	return (m_data);
+}
+
+void
+I2CTransaction::queue(const std::vector<uint8_t> &cmd)
+{
+	m_commands.insert(m_commands.end(), cmd.begin(), cmd.end());
+}
+
+void
+I2CTransaction::expect(Slot slot)
+{
+	m_slots.push_back(slot);
+
+	if (++m_pending == I2C_MAX_RESPONSE)
+		seal();
+}
+
+void
+I2CTransaction::seal()
+{
+	size_t end = m_segments.empty() ? 0 : m_segments.back().end;
+
+	if (m_commands.size() == end)
+		return;
+
+	m_commands.push_back(SEND_IMMEDIATE);
+	m_segments.push_back({ m_commands.size(), m_pending });
+	m_pending = 0;
+}
+
+void
+I2CTransaction::complete(const std::vector<uint8_t> &response)
+{
+	size_t i;
+
+	m_acks.clear();
+	m_data.clear();
+
+	for (i = 0; i < m_slots.size(); i++) {
+		if (m_slots[i] == Slot::ACK) {
+			/* ACK is SDA pulled low, clocked into bit 0 */
+			m_acks.push_back((response[i] & 0x01) == 0);
+			continue;
+		}
+
+		m_data.push_back(response[i]);
+	}
+}
+
 I2C::I2C(const Device &device, int clock)
+{
+	Metrics &metrics = Metrics::instance();
+	MetricLabels labels = { { "serial", device.serial } };
+
+	m_transport = Transport::create(device);
+	m_transactions = metrics.counter("devclient_i2c_transactions_total",
+	    "I2C transactions executed", labels);
+	m_naks = metrics.counter("devclient_i2c_naks_total",
+	    "Bytes an I2C target did not acknowledge", labels);
+	m_latency = metrics.histogram("devclient_i2c_transaction_seconds",
+	    "Time to execute one I2C transaction", METRICS_LATENCY_BUCKETS,
+	    labels);
+
+	labels["channel"] = "i2c";
+	m_write_errors = metrics.counter("devclient_usb_write_errors_total",
+	    "USB writes that failed or came up short", labels);
+
+	if (m_transport->open(device, INTERFACE_A) != 0) {
+		throw std::runtime_error(fmt::format(
+		    "Failed to open device: {}",
+		    m_transport->error_string()));
+	}
+
+	if (m_transport->set_bitmode(0xff, BITMODE_RESET) != 0)
+		throw std::runtime_error("Failed to set bitmode");
+
+	if (m_transport->set_bitmode(0xff, BITMODE_MPSSE) != 0)
+		throw std::runtime_error("Failed to set bitmode");
+
+	tune(ChannelTuning::channel("i2c"));
+	m_clock = I2CClock::compute(clock);
+	configure();
+}
+
+I2C::I2C(int clock):
+    m_clock(I2CClock::compute(clock))
+{
+}
+
+I2C::~I2C()
+{
+
+}
+
+void
+I2C::tune(const ChannelTuning &tuning)
+{
+	tuning.apply(*m_transport, "I2C");
+}
+
+std::chrono::nanoseconds
+I2C::ping(bool immediate)
+{
+	const uint8_t cmd[] = { 0xaa, SEND_IMMEDIATE };
+	std::chrono::steady_clock::time_point start;
+	uint8_t rd[2];
+
+	start = std::chrono::steady_clock::now();
+	transmit(cmd, immediate ? 2 : 1);
+	receive(rd, sizeof(rd));
+
+	if (rd[0] != 0xfa || rd[1] != 0xaa) {
+		throw std::runtime_error(fmt::format(
+		    "Unexpected MPSSE echo {:#04x} {:#04x}", rd[0], rd[1]));
+	}
+
+	return (std::chrono::steady_clock::now() - start);
+}
+
+void
+I2C::configure()
 {
 	const uint8_t sync[] = { 0xaa };
 	uint8_t rd[2];
 	const uint8_t cmd[] = {
-	    DIS_DIV_5,
 	    DIS_ADAPTIVE,
-	    DIS_3_PHASE,
-	    SET_BITS_LOW, SDA_OUT | SCL, OUT_PINS,
-	    TCK_DIVISOR, 0xc8, 0x00,
+	    SET_BITS_LOW, SDA_OUT | SCL, OUT_PINS
 	};
 	const uint8_t cmd2[] = {
 	    LOOPBACK_END,
@@ -48,148 +306,194 @@ I2C::I2C(const Device &device, int clock)
 	    SET_BITS_LOW, 0, WP
 	};
 
-	m_context.set_interface(INTERFACE_A);
+	transmit(sync, sizeof(sync));
 
-	if (m_context.open(device.vid, device.pid, device.description,
-	    device.serial) != 0) {
-		throw std::runtime_error(fmt::format(
-		    "Failed to open device: {}",
-		    m_context.error_string()));
+	for (;;) {
+		receive(rd, sizeof(rd));
+		if (rd[0] == 0xfa && rd[1] == 0xaa)
+			break;
 	}
 
-	if (m_context.set_bitmode(0xff, BITMODE_RESET) != 0)
-		throw std::runtime_error("Failed to set bitmode");
+	transmit(cmd, sizeof(cmd));
+	apply_clock();
+	transmit(cmd2, sizeof(cmd2));
+}
 
-	if (m_context.set_bitmode(0xff, BITMODE_MPSSE) != 0)
-		throw std::runtime_error("Failed to set bitmode");
+void
+I2C::apply_clock()
+{
+	const uint8_t cmd[] = {
+	    static_cast<uint8_t>(m_clock.div5 ? EN_DIV_5 : DIS_DIV_5),
+	    static_cast<uint8_t>(m_clock.three_phase ? EN_3_PHASE : DIS_3_PHASE),
+	    TCK_DIVISOR,
+	    static_cast<uint8_t>(m_clock.divisor & 0xff),
+	    static_cast<uint8_t>((m_clock.divisor >> 8) & 0xff)
+	};
 
-	m_context.write(sync, sizeof(sync));
+	transmit(cmd, sizeof(cmd));
+	Logger::info("I2C: SCL running at {} Hz (divisor {}{}{})",
+	    m_clock.rate, m_clock.divisor,
+	    m_clock.div5 ? ", divide-by-5" : "",
+	    m_clock.three_phase ? ", 3-phase" : "");
+}
 
-	for (;;) {
-		if (m_context.read(rd, sizeof(rd)) != sizeof(rd))
-			throw std::runtime_error("Failed to synchronize");
+int
+I2C::clock() const
+{
+	return (m_clock.rate);
+}
 
-		if (rd[0] == 0xfa && rd[1] == 0xaa)
-			break;
-	}
+void
+I2C::set_clock(int clock)
+{
+	set_clock(I2CClock::compute(clock));
+}
 
-	m_context.write(cmd, sizeof(cmd));
-	m_context.write(cmd2, sizeof(cmd2));
+const I2CClock &
+I2C::clock_setup() const
+{
+	return (m_clock);
 }
 
-I2C::~I2C()
+void
+I2C::set_clock(const I2CClock &clock)
 {
+	if (clock.divisor == m_clock.divisor && clock.div5 == m_clock.div5 &&
+	    clock.three_phase == m_clock.three_phase)
+		return;
 
+	m_clock = clock;
+	apply_clock();
 }
 
 void
-I2C::read(size_t nbytes, std::vector<uint8_t> &result)
+I2C::execute(I2CTransaction &txn)
 {
-	size_t i;
-	uint8_t rd;
+	std::vector<uint8_t> response(txn.m_slots.size());
+	std::chrono::steady_clock::time_point start;
+	size_t offset = 0;
+	size_t received = 0;
 
-	/*
-	 * Don't know why this is needed, but we're ending up with one
-	 * extra byte in front of the read buffer after read
-	 */
-	m_context.read(&rd, 1);
+	txn.seal();
 
-	for (i = 0; i < nbytes; i++)
-		result.push_back(read_byte(i != nbytes - 1));
+	Logger::debug("I2C: executing {} command bytes, {} response bytes",
+	    txn.m_commands.size(), response.size());
+
+	start = std::chrono::steady_clock::now();
+
+	for (const auto &i: txn.m_segments) {
+		transmit(&txn.m_commands[offset], i.end - offset);
+		receive(response.data() + received, i.response);
+		offset = i.end;
+		received += i.response;
+	}
+
+	txn.complete(response);
+
+	if (m_transactions) {
+		m_latency->observe_since(start);
+		m_transactions->add();
+		m_naks->add(std::count(txn.m_acks.begin(), txn.m_acks.end(),
+		    false));
+	}
 }
 
 void
+I2C::read(size_t nbytes, std::vector<uint8_t> &result)
+{
+	I2CTransaction txn;
+
+	txn.read(nbytes);
+	execute(txn);
+	result.insert(result.end(), txn.data().begin(), txn.data().end());
+}
+
+bool
 I2C::write(const std::vector<uint8_t> &data)
 {
-	for (const auto &i: data)
-		write_byte(i);
+	I2CTransaction txn;
+
+	txn.write(data);
+	execute(txn);
+	return (txn.acked());
+}
+
+bool
+I2C::poll(uint8_t address)
+{
+	I2CTransaction txn;
+
+	/*
+	 * Address the device and see if it answers. Used to detect the
+	 * end of an EEPROM write cycle, during which the part NAKs.
+	 */
+	txn.start();
+	txn.write({ address });
+	txn.stop();
+	execute(txn);
+	return (txn.acked(0));
 }
 
 void
 I2C::start()
 {
-	const uint8_t cmd[] = {
-	    /* SCL high, SDA high, repeat 4 times */
-	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
-	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
-	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
-	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
-	    /* SCL high, SDA low, repeat 4 times */
-	    SET_BITS_LOW, SCL, OUT_PINS,
-	    SET_BITS_LOW, SCL, OUT_PINS,
-	    SET_BITS_LOW, SCL, OUT_PINS,
-	    SET_BITS_LOW, SCL, OUT_PINS,
-	    /* SCL low, SDA low */
-	    SET_BITS_LOW, 0, OUT_PINS,
-	    SEND_IMMEDIATE
-	};
+	I2CTransaction txn;
 
-	Logger::debug("I2C: start");
-	m_context.write(cmd, sizeof(cmd));
+	txn.start();
+	execute(txn);
 }
 
 void
 I2C::stop()
 {
-	const uint8_t cmd[] = {
-	    /* SCL high, SDA low, repeat 4 times */
-	    SET_BITS_LOW, SCL, OUT_PINS,
-	    SET_BITS_LOW, SCL, OUT_PINS,
-	    SET_BITS_LOW, SCL, OUT_PINS,
-	    SET_BITS_LOW, SCL, OUT_PINS,
-	    /* SCL high, SDA high, repeat 4 times */
-	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
-	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
-	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
-	    SET_BITS_LOW, SCL | SDA_OUT, OUT_PINS,
-	    /* Tristate SDA and SCL pins */
-	    SEND_IMMEDIATE,
-	};
+	I2CTransaction txn;
 
-	const uint8_t cmd2[] = {
-	    SET_BITS_LOW, 0, WP,
-	    SEND_IMMEDIATE
-	};
-
-	Logger::debug("I2C: stop");
-	m_context.write(cmd, sizeof(cmd));
-	m_context.write(cmd2, sizeof(cmd2));
+	txn.stop();
+	execute(txn);
 }
 
-uint8_t
-I2C::read_byte(bool ack)
+void
+I2C::transmit(const uint8_t *buf, size_t len)
 {
-	uint8_t rd;
-	uint8_t ackbyte = static_cast<uint8_t>(ack ? 0 : 0xff);
-	const uint8_t cmd[] = {
-	    SET_BITS_LOW, 0, SCL | WP,
-	    MPSSE_DO_READ | MPSSE_READ_NEG, 0, 0,
-	    SET_BITS_LOW, 0, OUT_PINS,
-	    MPSSE_DO_WRITE | MPSSE_WRITE_NEG | MPSSE_BITMODE, 0, ackbyte,
-	    SET_BITS_LOW, 0, OUT_PINS,
-	    SEND_IMMEDIATE
-	};
+	if (m_transport->write(buf, len) != static_cast<int>(len)) {
+		if (m_write_errors)
+			m_write_errors->add();
 
-	m_context.write(cmd, sizeof(cmd));
-	m_context.read(&rd, 1);
-	return (rd);
+		throw std::runtime_error(fmt::format(
+		    "I2C: failed to write to device: {}",
+		    m_transport->error_string()));
+	}
 }
 
 void
-I2C::write_byte(uint8_t byte)
+I2C::receive(uint8_t *buf, size_t len)
 {
-	uint8_t rd;
-	const uint8_t cmd[] = {
-	    MPSSE_DO_WRITE | MPSSE_WRITE_NEG, 0, 0, byte,
-	    SET_BITS_LOW, 0, SCL | WP,
-	    MPSSE_DO_READ | MPSSE_BITMODE, 0,
-	    SEND_IMMEDIATE,
-	};
-	const uint8_t cmd2[] = {
-	    SET_BITS_LOW, 0, OUT_PINS
-	};
+	size_t done = 0;
+	int retries = 0;
+	int ret;
+
+	/*
+	 * libftdi returns as soon as a USB packet arrives (or the
+	 * latency timer expires), so keep reading until the whole
+	 * response has been collected.
+	 */
+	while (done < len) {
+		ret = m_transport->read(buf + done, len - done);
+		if (ret < 0) {
+			throw std::runtime_error(fmt::format(
+			    "I2C: failed to read from device: {}",
+			    m_transport->error_string()));
+		}
 
-	m_context.write(cmd, sizeof(cmd));
-	m_context.read(&rd, 1);
-	m_context.write(cmd2, sizeof(cmd2));
+		if (ret == 0) {
+			if (++retries == I2C_READ_RETRIES)
+				throw std::runtime_error(
+				    "I2C: timed out waiting for response");
+
+			continue;
+		}
+
+		retries = 0;
+		done += ret;
+	}
 }
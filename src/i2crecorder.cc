@@ -0,0 +1,289 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdexcept>
+#include <ftdi.hpp>
+#include <i2crecorder.hh>
+
+MpsseI2CBus::MpsseI2CBus():
+    m_target(nullptr),
+    m_scl(true),
+    m_sda(true),
+    m_ack(true)
+{
+}
+
+void
+MpsseI2CBus::attach(I2CTarget *target)
+{
+	m_target = target;
+}
+
+void
+MpsseI2CBus::feed(const uint8_t *buf, size_t len)
+{
+	size_t decoded = 0;
+	size_t cmdlen;
+
+	m_input.insert(m_input.end(), buf, buf + len);
+
+	while (decoded < m_input.size()) {
+		cmdlen = command_length(decoded);
+		if (cmdlen == 0)
+			break;
+
+		command(&m_input[decoded]);
+		decoded += cmdlen;
+	}
+
+	m_input.erase(m_input.begin(), m_input.begin() + decoded);
+}
+
+size_t
+MpsseI2CBus::pending() const
+{
+	return (m_response.size());
+}
+
+size_t
+MpsseI2CBus::take(uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && !m_response.empty(); i++) {
+		buf[i] = m_response.front();
+		m_response.pop_front();
+	}
+
+	return (i);
+}
+
+void
+MpsseI2CBus::clear()
+{
+	m_input.clear();
+	m_response.clear();
+}
+
+I2CRecorder::I2CRecorder(int clock):
+    I2C(clock),
+    m_writes(0),
+    m_reads(0)
+{
+	configure();
+}
+
+void
+I2CRecorder::attach(I2CTarget *target)
+{
+	m_bus.attach(target);
+}
+
+const std::vector<uint8_t> &
+I2CRecorder::stream() const
+{
+	return (m_stream);
+}
+
+size_t
+I2CRecorder::writes() const
+{
+	return (m_writes);
+}
+
+size_t
+I2CRecorder::reads() const
+{
+	return (m_reads);
+}
+
+size_t
+I2CRecorder::unread() const
+{
+	return (m_bus.pending());
+}
+
+void
+I2CRecorder::clear()
+{
+	m_stream.clear();
+	m_bus.clear();
+	m_writes = 0;
+	m_reads = 0;
+}
+
+void
+I2CRecorder::transmit(const uint8_t *buf, size_t len)
+{
+	m_stream.insert(m_stream.end(), buf, buf + len);
+	m_bus.feed(buf, len);
+	m_writes++;
+}
+
+void
+I2CRecorder::receive(uint8_t *buf, size_t len)
+{
+	if (len == 0)
+		return;
+
+	if (m_bus.pending() < len)
+		throw std::runtime_error("I2C: timed out waiting for response");
+
+	m_bus.take(buf, len);
+	m_reads++;
+}
+
+size_t
+MpsseI2CBus::command_length(size_t offset) const
+{
+	size_t avail = m_input.size() - offset;
+	uint8_t op = m_input[offset];
+	size_t len;
+
+	if ((op & 0x80) == 0) {
+		/* Data shifting command */
+		if (op & MPSSE_BITMODE) {
+			len = (op & (MPSSE_DO_WRITE | MPSSE_WRITE_TMS)) ? 3 : 2;
+			return (avail >= len ? len : 0);
+		}
+
+		if (avail < 3)
+			return (0);
+
+		len = 3;
+		if (op & MPSSE_DO_WRITE)
+			len += (m_input[offset + 1] | m_input[offset + 2] << 8) + 1;
+
+		return (avail >= len ? len : 0);
+	}
+
+	switch (op) {
+	case SET_BITS_LOW:
+	case SET_BITS_HIGH:
+	case TCK_DIVISOR:
+	case CLK_BYTES:
+		len = 3;
+		break;
+
+	case CLK_BITS:
+		len = 2;
+		break;
+
+	default:
+		len = 1;
+		break;
+	}
+
+	return (avail >= len ? len : 0);
+}
+
+void
+MpsseI2CBus::command(const uint8_t *cmd)
+{
+	uint8_t op = cmd[0];
+	size_t i;
+	size_t n;
+
+	if ((op & 0x80) == 0) {
+		/*
+		 * Single bit reads sample the device's ACK, single bit
+		 * writes are the master's ACK and need no response.
+		 */
+		if (op & MPSSE_BITMODE) {
+			if (op & MPSSE_DO_READ)
+				m_response.push_back(m_ack ? 0x00 : 0x01);
+
+			return;
+		}
+
+		n = (cmd[1] | cmd[2] << 8) + 1;
+
+		if (op & MPSSE_DO_WRITE) {
+			for (i = 0; i < n; i++)
+				m_ack = m_target ? m_target->write(cmd[3 + i]) : true;
+		}
+
+		if (op & MPSSE_DO_READ) {
+			/* Idle bus reads as all ones */
+			for (i = 0; i < n; i++)
+				m_response.push_back(m_target ? m_target->read() : 0xff);
+		}
+
+		return;
+	}
+
+	switch (op) {
+	case SET_BITS_LOW:
+		pins(cmd[1], cmd[2]);
+		break;
+
+	case SET_BITS_HIGH:
+	case LOOPBACK_START:
+	case LOOPBACK_END:
+	case TCK_DIVISOR:
+	case SEND_IMMEDIATE:
+	case DIS_DIV_5:
+	case EN_DIV_5:
+	case EN_3_PHASE:
+	case DIS_3_PHASE:
+	case CLK_BITS:
+	case CLK_BYTES:
+	case EN_ADAPTIVE:
+	case DIS_ADAPTIVE:
+		break;
+
+	case GET_BITS_LOW:
+	case GET_BITS_HIGH:
+		m_response.push_back(0xff);
+		break;
+
+	default:
+		/* Bad command: echo 0xfa followed by the opcode */
+		m_response.push_back(0xfa);
+		m_response.push_back(op);
+		break;
+	}
+}
+
+void
+MpsseI2CBus::pins(uint8_t value, uint8_t direction)
+{
+	/* Lines not driven by the master are pulled up */
+	bool scl = (direction & SCL) ? (value & SCL) != 0 : true;
+	bool sda = (direction & SDA_OUT) ? (value & SDA_OUT) != 0 : true;
+
+	if (m_target && m_scl && scl) {
+		if (m_sda && !sda)
+			m_target->start();
+		else if (!m_sda && sda)
+			m_target->stop();
+	}
+
+	m_scl = scl;
+	m_sda = sda;
+}
@@ -34,6 +34,8 @@
 #include <jtag.hh>
 #include <utils.hh>
 #include <filesystem.hh>
+#include <transport.hh>
+#include <tuning.hh>
 #if defined(__linux__)
 #include <sys/prctl.h>
 #endif
@@ -51,6 +53,17 @@ JtagServer::JtagServer(const Device &device,
     m_board_script(board_script),
     m_running(false)
 {
+	Metrics &metrics = Metrics::instance();
+	MetricLabels labels = { { "serial", device.serial } };
+
+	m_starts = metrics.counter("devclient_jtag_server_starts_total",
+	    "OpenOCD instances started", labels);
+	m_restarts = metrics.counter("devclient_jtag_server_restarts_total",
+	    "OpenOCD instances started after the first one", labels);
+	m_exits = metrics.counter("devclient_jtag_server_exits_total",
+	    "OpenOCD instances that exited", labels);
+	m_up = metrics.gauge("devclient_jtag_server_up",
+	    "Whether OpenOCD is running", labels);
 }
 
 JtagServer::~JtagServer()
@@ -111,6 +124,12 @@ JtagServer::start()
 
 	setpgid(m_pid, getpid());
 
+	/* Counted per cable, so restarts survive the server object */
+	if (m_starts->value() > 0)
+		m_restarts->add();
+
+	m_starts->add();
+	m_up->set(1);
 	m_running = true;
 
 	on_server_start.emit();
@@ -126,34 +145,38 @@ JtagServer::stop()
 
 	/* Crappy, there should be a better way to do this */
 	while (m_running)
-		Gtk::Main::iteration();
+		Glib::MainContext::get_default()->iteration(true);
 }
 
 
 void
 JtagServer::bypass(const Device &device)
 {
-	Ftdi::Context context;
-
-	context.set_interface(INTERFACE_B);
+	std::unique_ptr<Transport> transport = Transport::create(device);
 
-	if (context.open(device.vid, device.pid, device.description,
-	    device.serial) != 0) {
+	if (transport->open(device, INTERFACE_B) != 0) {
 		show_centered_dialog("Failed to open device.");
 		return;
 	}
 
-	if (context.reset() != 0) {
+	if (transport->reset() != 0) {
 		show_centered_dialog("Failed to reset channel");
 		return;
 	}
 
-	if (context.set_bitmode(0xff, BITMODE_RESET) != 0) {
+	try {
+		ChannelTuning::channel("jtag").apply(*transport, "JTAG");
+	} catch (const std::runtime_error &err) {
+		show_centered_dialog(err.what());
+		return;
+	}
+
+	if (transport->set_bitmode(0xff, BITMODE_RESET) != 0) {
 		show_centered_dialog("Failed to set BITMODE_RESET");
 		return;
 	}
 
-	if (context.set_bitmode(0, BITMODE_BITBANG) != 0)
+	if (transport->set_bitmode(0, BITMODE_BITBANG) != 0)
 	{
 		show_centered_dialog("Failed to set BITMODE_BITBANG");
 		return;
@@ -162,49 +185,53 @@ JtagServer::bypass(const Device &device)
 	Logger::info("Bypass mode enabled.");
 	show_centered_dialog("Bypass mode enabled.");
 
-	context.close();
+	transport->close();
 }
 
 void
 JtagServer::reset(const Device &device)
 {
-	Ftdi::Context context;
+	std::unique_ptr<Transport> transport = Transport::create(device);
 	uint8_t data[] = { RESET_MASK, 0x00, RESET_MASK };
 
-	context.set_interface(INTERFACE_B);
-
-	if (context.open(device.vid, device.pid, device.description,
-	    device.serial) != 0) {
+	if (transport->open(device, INTERFACE_B) != 0) {
 		show_centered_dialog("Failed to open device");
 		return;
 	}
 
-	if (context.reset() != 0) {
+	if (transport->reset() != 0) {
 		show_centered_dialog("Failed to reset channel");
 		return;
 	}
 
-	if (context.set_bitmode(0x0, BITMODE_RESET) != 0) {
+	try {
+		ChannelTuning::channel("jtag").apply(*transport, "JTAG");
+	} catch (const std::runtime_error &err) {
+		show_centered_dialog(err.what());
+		return;
+	}
+
+	if (transport->set_bitmode(0x0, BITMODE_RESET) != 0) {
 		show_centered_dialog("Failed to set bitmode");
 		return;
 	}
 
-	if (context.set_bitmode(0x20, BITMODE_BITBANG) != 0) {
+	if (transport->set_bitmode(0x20, BITMODE_BITBANG) != 0) {
 		show_centered_dialog("Failed to set bitmode");
 		return;
 	}
 
-	if (context.write(data, sizeof(data)) != sizeof(data)) {
+	if (transport->write(data, sizeof(data)) != sizeof(data)) {
 		show_centered_dialog("Failed to write reset mask");
 		return;
 	}
 
-	if (context.set_bitmode(0, BITMODE_BITBANG) != 0) {
+	if (transport->set_bitmode(0, BITMODE_BITBANG) != 0) {
 		show_centered_dialog("Failed to set bitmode");
 		return;
 	}
 	Logger::info("Reset done");
-	context.close();
+	transport->close();
 }
 
 void
@@ -240,6 +267,8 @@ void
 JtagServer::child_exited(Glib::Pid pid, int code)
 {
 	Logger::info("OpenOCD exited with code {} (pid {})", code, pid);
+	m_exits->add();
+	m_up->set(0);
 	on_server_exit.emit();
 	m_running = false;
 }
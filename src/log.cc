@@ -26,12 +26,277 @@
  *
  */
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <sys/types.h>
 #include <fmt/format.h>
 #include <log.hh>
+#include <logsink.hh>
 
-void Logger::log(const char *level, const char *fmt, fmt::format_args args)
+/* How long the logging thread sleeps when there is nothing to write */
+#define LOG_IDLE_WAIT		std::chrono::milliseconds(100)
+
+/* Per transfer debug chatter is opt-in */
+std::atomic<int> Logger::m_level(std::max(LOG_LEVEL_INFO, LOG_MIN_LEVEL));
+std::atomic<bool> Logger::m_async(false);
+std::atomic<bool> Logger::m_quit(false);
+std::atomic<unsigned int> Logger::m_writers(0);
+std::atomic<uint64_t> Logger::m_dropped(0);
+std::atomic<size_t> Logger::m_tail(0);
+size_t Logger::m_head = 0;
+std::unique_ptr<Logger::Cell[]> Logger::m_cells;
+std::vector<std::shared_ptr<LogSink>> Logger::m_sinks;
+std::mutex Logger::m_sink_lock;
+std::mutex Logger::m_lock;
+std::condition_variable Logger::m_cond;
+std::thread Logger::m_thread;
+
+void
+Logger::set_level(LogLevel level)
+{
+	m_level = std::max(static_cast<int>(level), LOG_MIN_LEVEL);
+}
+
+LogLevel
+Logger::level()
+{
+	return (static_cast<LogLevel>(m_level.load()));
+}
+
+LogLevel
+Logger::parse_level(const std::string &name)
+{
+	for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_NONE; i++) {
+		if (name == level_name(static_cast<LogLevel>(i)))
+			return (static_cast<LogLevel>(i));
+	}
+
+	throw std::runtime_error(fmt::format("Unknown log level '{}'", name));
+}
+
+const char *
+Logger::level_name(LogLevel level)
+{
+	switch (level) {
+	case LogLevel::DEBUG:
+		return ("debug");
+	case LogLevel::INFO:
+		return ("info");
+	case LogLevel::WARNING:
+		return ("warning");
+	case LogLevel::ERROR:
+		return ("error");
+	default:
+		return ("none");
+	}
+}
+
+void
+Logger::log(LogLevel level, const char *fmt, fmt::format_args args)
+{
+	fmt::memory_buffer buf;
+	LogRecord *record;
+	LogRecord local;
+	Cell *cell = nullptr;
+	size_t pos;
+	size_t seq;
+
+	fmt::vformat_to(buf, fmt, args);
+
+	/* Announced before m_async is checked, see stop() */
+	m_writers++;
+
+	if (m_async) {
+		/* Bounded MPSC queue: claim a cell by bumping the tail */
+		pos = m_tail.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &m_cells[pos & (LOG_QUEUE_SIZE - 1)];
+			seq = cell->seq.load(std::memory_order_acquire);
+
+			if (seq == pos) {
+				if (m_tail.compare_exchange_weak(pos, pos + 1,
+				    std::memory_order_relaxed))
+					break;
+			} else if (static_cast<ssize_t>(seq - pos) < 0) {
+				/* Full, the logging thread is behind */
+				m_dropped++;
+				m_writers--;
+				return;
+			} else
+				pos = m_tail.load(std::memory_order_relaxed);
+		}
+
+		record = &cell->record;
+	} else {
+		m_writers--;
+		record = &local;
+	}
+
+	record->time = std::chrono::system_clock::now();
+	record->thread = thread_id();
+	record->level = level;
+	record->len = std::min(buf.size(), sizeof(record->text));
+	std::memcpy(record->text, buf.data(), record->len);
+
+	if (cell == nullptr) {
+		emit(*record);
+		return;
+	}
+
+	cell->seq.store(pos + 1, std::memory_order_release);
+	m_writers--;
+	m_cond.notify_one();
+}
+
+void
+Logger::add_sink(const std::shared_ptr<LogSink> &sink)
+{
+	std::lock_guard<std::mutex> lock(m_sink_lock);
+
+	m_sinks.push_back(sink);
+}
+
+void
+Logger::clear_sinks()
 {
-	fmt::print("{}: ", level);
-	fmt::vprint(fmt, args);
-	fmt::print("\n");
+	std::lock_guard<std::mutex> lock(m_sink_lock);
+
+	m_sinks.clear();
+}
+
+void
+Logger::start()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	if (m_async)
+		return;
+
+	m_cells = std::make_unique<Cell[]>(LOG_QUEUE_SIZE);
+	for (size_t i = 0; i < LOG_QUEUE_SIZE; i++)
+		m_cells[i].seq = i;
+
+	m_head = 0;
+	m_tail = 0;
+	m_quit = false;
+	m_async = true;
+	m_thread = std::thread(&Logger::worker);
+}
+
+void
+Logger::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		if (!m_async)
+			return;
+
+		m_async = false;
+	}
+
+	/*
+	 * Callers that saw m_async set may still be filling in the cell
+	 * they claimed. Both sides use sequentially consistent accesses,
+	 * so any caller not counted here logs synchronously instead.
+	 */
+	while (m_writers != 0)
+		std::this_thread::yield();
+
+	/* The worker drains whatever is left before exiting */
+	m_quit = true;
+	m_cond.notify_one();
+	m_thread.join();
+}
+
+uint64_t
+Logger::dropped()
+{
+	return (m_dropped);
+}
+
+unsigned int
+Logger::thread_id()
+{
+	static std::atomic<unsigned int> next(0);
+	thread_local unsigned int id = next++;
+
+	return (id);
+}
+
+void
+Logger::emit(const LogRecord &record)
+{
+	static StdoutSink fallback;
+	std::lock_guard<std::mutex> lock(m_sink_lock);
+
+	if (m_sinks.empty()) {
+		fallback.write(record);
+		return;
+	}
+
+	for (auto &i: m_sinks)
+		i->write(record);
+}
+
+/* Single consumer side of the queue, returns false when it is empty */
+bool
+Logger::dequeue()
+{
+	Cell *cell = &m_cells[m_head & (LOG_QUEUE_SIZE - 1)];
+
+	if (cell->seq.load(std::memory_order_acquire) != m_head + 1)
+		return (false);
+
+	emit(cell->record);
+	cell->seq.store(m_head + LOG_QUEUE_SIZE, std::memory_order_release);
+	m_head++;
+	return (true);
+}
+
+void
+Logger::worker()
+{
+	std::unique_lock<std::mutex> lock(m_lock, std::defer_lock);
+	uint64_t reported = m_dropped;
+	uint64_t dropped;
+	LogRecord record;
+	bool running;
+
+	do {
+		running = !m_quit;
+
+		while (dequeue())
+			continue;
+
+		dropped = m_dropped;
+		if (dropped != reported) {
+			record.time = std::chrono::system_clock::now();
+			record.thread = thread_id();
+			record.level = LogLevel::WARNING;
+			record.len = fmt::format_to_n(record.text,
+			    sizeof(record.text), "{} log messages dropped",
+			    dropped - reported).size;
+			emit(record);
+			reported = dropped;
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(m_sink_lock);
+
+			for (auto &i: m_sinks)
+				i->flush();
+
+			if (m_sinks.empty())
+				std::fflush(stdout);
+		}
+
+		if (running) {
+			lock.lock();
+			m_cond.wait_for(lock, LOG_IDLE_WAIT);
+			lock.unlock();
+		}
+	} while (running);
 }
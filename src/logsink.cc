@@ -0,0 +1,185 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <syslog.h>
+#include <fmt/format.h>
+#include <logsink.hh>
+
+std::string
+LogSink::format(const LogRecord &record)
+{
+	static const char *prefixes[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+	std::time_t seconds;
+	struct tm tm;
+	char stamp[32];
+	int millis;
+
+	seconds = std::chrono::system_clock::to_time_t(record.time);
+	millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+	    record.time.time_since_epoch()).count() % 1000;
+
+	::localtime_r(&seconds, &tm);
+	std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+	return (fmt::format("{}.{:03d} [{}] {}: {}\n", stamp, millis,
+	    record.thread, prefixes[static_cast<int>(record.level)],
+	    fmt::string_view(record.text, record.len)));
+}
+
+StdoutSink::StdoutSink(FILE *stream):
+	m_stream(stream)
+{
+}
+
+void
+StdoutSink::write(const LogRecord &record)
+{
+	std::string line = format(record);
+
+	std::fwrite(line.data(), 1, line.size(), m_stream);
+}
+
+void
+StdoutSink::flush()
+{
+	std::fflush(m_stream);
+}
+
+FileSink::FileSink(const std::string &path, size_t max_size, int keep):
+	m_path(path),
+	m_max_size(max_size),
+	m_keep(keep),
+	m_size(0),
+	m_file(nullptr)
+{
+	open();
+}
+
+FileSink::~FileSink()
+{
+	if (m_file != nullptr)
+		std::fclose(m_file);
+}
+
+void
+FileSink::write(const LogRecord &record)
+{
+	std::string line = format(record);
+
+	if (m_file == nullptr)
+		return;
+
+	if (m_size + line.size() > m_max_size)
+		rotate();
+
+	std::fwrite(line.data(), 1, line.size(), m_file);
+	m_size += line.size();
+}
+
+void
+FileSink::flush()
+{
+	if (m_file != nullptr)
+		std::fflush(m_file);
+}
+
+void
+FileSink::open()
+{
+	m_file = std::fopen(m_path.c_str(), "a");
+	if (m_file == nullptr) {
+		throw std::runtime_error(fmt::format("Cannot open {}: {}",
+		    m_path, strerror(errno)));
+	}
+
+	std::fseek(m_file, 0, SEEK_END);
+	m_size = std::ftell(m_file);
+}
+
+/* log -> log.1 -> log.2 ... the oldest one falls off the end */
+void
+FileSink::rotate()
+{
+	std::fclose(m_file);
+	m_file = nullptr;
+
+	for (int i = m_keep - 1; i > 0; i--) {
+		std::rename(fmt::format("{}.{}", m_path, i).c_str(),
+		    fmt::format("{}.{}", m_path, i + 1).c_str());
+	}
+
+	if (m_keep > 0)
+		std::rename(m_path.c_str(), fmt::format("{}.1", m_path).c_str());
+	else
+		std::remove(m_path.c_str());
+
+	try {
+		open();
+	} catch (const std::runtime_error &err) {
+		std::fprintf(stderr, "%s\n", err.what());
+	}
+}
+
+SyslogSink::SyslogSink(const std::string &ident):
+	m_ident(ident)
+{
+	::openlog(m_ident.c_str(), LOG_PID, LOG_DAEMON);
+}
+
+SyslogSink::~SyslogSink()
+{
+	::closelog();
+}
+
+void
+SyslogSink::write(const LogRecord &record)
+{
+	int priority;
+
+	switch (record.level) {
+	case LogLevel::DEBUG:
+		priority = LOG_DEBUG;
+		break;
+	case LogLevel::INFO:
+		priority = LOG_INFO;
+		break;
+	case LogLevel::WARNING:
+		priority = LOG_WARNING;
+		break;
+	default:
+		priority = LOG_ERR;
+		break;
+	}
+
+	::syslog(priority, "[%u] %.*s", record.thread,
+	    static_cast<int>(record.len), record.text);
+}
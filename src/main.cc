@@ -26,6 +26,8 @@
  *
  */
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -34,35 +36,65 @@
 #include <fmt/format.h>
 #include <gtkmm/application.h>
 #include <fstream>
+#include <iterator>
 #include <stdlib.h>
 
 #include <log.hh>
+#include <logsink.hh>
 #include <device.hh>
+#include <ftsim.hh>
 #include <uart.hh>
+#include <capture.hh>
+#include <daemon.hh>
 #include <i2c.hh>
 #include <eeprom/24c.hh>
+#include <eeprom/catalogue.hh>
+#include <fdt.hh>
+#include <boardimages.hh>
 #include <gpio.hh>
+#include <tuning.hh>
 #include <utils.hh>
 #include <mainwindow.hh>
 #include <application.hh>
 #include <nogui.hh>
-#include <ucl.h>
 
 using namespace std;
 
+/* Round trips per latency test setting */
+#define LATENCY_TEST_ROUNDS	100
+
 static const struct option long_options[] = {
+	{ "cached-image", required_argument, nullptr, 'C' },
+	{ "scrollback", required_argument, nullptr, 'B' },
+	{ "delta", no_argument, nullptr, 'D' },
+	{ "eeprom-type", required_argument, nullptr, 'E' },
+	{ "line-format", required_argument, nullptr, 'F' },
+	{ "generate", required_argument, nullptr, 'G' },
+	{ "capture", required_argument, nullptr, 'K' },
+	{ "latency-test", no_argument, nullptr, 'L' },
+	{ "boards", required_argument, nullptr, 'M' },
+	{ "output-dir", required_argument, nullptr, 'O' },
+	{ "export-range", required_argument, nullptr, 'R' },
+	{ "syslog", no_argument, nullptr, 'S' },
+	{ "tune", required_argument, nullptr, 'T' },
+	{ "export-capture", required_argument, nullptr, 'X' },
+	{ "simulate", required_argument, nullptr, 'Z' },
 	{ "baudrate", required_argument, nullptr, 'b' },
 	{ "compile-dts", required_argument, nullptr, 'c' },
 	{ "device", optional_argument, nullptr, 'd' },
+	{ "flow-control", required_argument, nullptr, 'f' },
 	{ "gpio", optional_argument, nullptr, 'g' },
 	{ "help", no_argument, nullptr, 'h' },
 	{ "jtag", required_argument, nullptr, 'j' },
+	{ "capture-tx", no_argument, nullptr, 'k' },
 	{ "list", no_argument, nullptr, 'l' },
+	{ "log-file", required_argument, nullptr, 'o' },
 	{ "passthrough", no_argument, nullptr, 'p' },
 	{ "read-eeprom", no_argument, nullptr, 'r' },
 	{ "script", required_argument, nullptr, 's' },
 	{ "decompile-dts", required_argument, nullptr, 't' },
 	{ "uart", required_argument, nullptr, 'u' },
+	{ "log-level", required_argument, nullptr, 'v' },
 	{ "write-eeprom", no_argument, nullptr, 'w' },
 	{ "config", required_argument, nullptr, 'x' },
 	{ nullptr, 0, nullptr, 0}
@@ -72,19 +104,63 @@ static void
 usage(const std::string &argv0)
 {
 	fmt::print("usage: {:s}\n", argv0);
-	fmt::print("-b:		baud rate for UART port, allowed values: 9600, 19200, 38400, 57600, 115200\n");
+	fmt::print("-B:		bytes of earlier UART output replayed to new clients, default {}\n",
+	    UART_SCROLLBACK);
+	fmt::print("		example: -B 262144\n");
+	fmt::print("-C:		image currently stored in eeprom, used instead of reading it back\n");
+	fmt::print("		with -D; updated after every successful write\n");
+	fmt::print("		example: -C board.cache\n");
+	fmt::print("-D:		with -w or -c, only write (and verify) eeprom pages that changed\n");
+	fmt::print("-E:		eeprom part, default {}, allowed values:", EEPROM_DEFAULT_MODEL);
+	for (const auto &i: EepromModel::all())
+		fmt::print(" {}", i.name);
+	fmt::print("\n");
+	fmt::print("		example: -E 24c256\n");
+	fmt::print("-F:		UART line format: data bits (7, 8), parity (N, O, E, M, S) and\n");
+	fmt::print("		stop bits (1, 1.5, 2), default 8N1\n");
+	fmt::print("		example: -F 7E1\n");
+	fmt::print("-G:		with -M, DTS (or DTB) template to generate eeprom images from\n");
+	fmt::print("		example: -G board.dts -M boards.csv -O images\n");
+	fmt::print("-K:		record everything received on the UART to a capture file, appending\n");
+	fmt::print("		to it if it exists\n");
+	fmt::print("		example: -K soak.cap\n");
+	fmt::print("-L:		measure USB round trip latency on the I2C channel for a range of\n");
+	fmt::print("		latency timer settings\n");
+	fmt::print("-M:		CSV file with one board per row, the header row names the template\n");
+	fmt::print("		properties to set, an \"image\" column names the output file; a\n");
+	fmt::print("		property can be given a type: name:string, name:cells or name:bytes\n");
+	fmt::print("		example: serial,ethaddr-eth0 / 006/2019,00:04:a3:12:34:56\n");
+	fmt::print("-O:		with -G, directory the images are written to, default current\n");
+	fmt::print("-R:		with -X, time range in seconds since the start of the capture\n");
+	fmt::print("		example: -R 3600:3660\n");
+	fmt::print("-S:		send log messages to syslog instead of stdout\n");
+	fmt::print("-T:		USB tuning for a channel (uart, i2c, jtag, gpio), can be repeated\n");
+	fmt::print("		keys: latency (ms), read_chunk, write_chunk (bytes)\n");
+	fmt::print("		example: -T uart:latency=1 -T i2c:latency=1,write_chunk=512\n");
+	fmt::print("-X:		print a capture file as text, one timestamped line per line of output\n");
+	fmt::print("		example: -X soak.cap -R 86400:\n");
+	fmt::print("-Z:		add a simulated FT4232H with this serial, its UART loops TX back to RX,\n");
+	fmt::print("		can be repeated\n");
+	fmt::print("		example: -Z SIM0 -d SIM0 -u 127.0.0.1:2222\n");
+	fmt::print("-b:		baud rate for UART port, any rate up to 12000000 the FT4232H can generate within about 5%\n");
 	fmt::print("		example: -b 115200\n");
 	fmt::print("-c:		compile dts from file and write it to eeprom\n");
 	fmt::print("		example: -c board.dts\n");
 	fmt::print("-d:		serial string of the selected device\n");
 	fmt::print("		example: -d 006/2019\n");
+	fmt::print("-f:		UART flow control: none, rtscts, dtrdsr or xonxoff, default none\n");
+	fmt::print("		example: -f rtscts\n");
 	fmt::print("-g:		set value for gpio pins\n");
 	fmt::print("-h:		this help message\n");
 	fmt::print("-j:		IP address and two TCP port numbers for listening for JTAG communication\n");
 	fmt::print("		cannot be used together with -p option\n");
 	fmt::print("		parameter format: <IP_address>:<gdb_port>:<telnet_port>\n");
 	fmt::print("		example: -j 0.0.0.0:3333:4444\n");
+	fmt::print("-k:		with -K, also record bytes sent to the UART\n");
 	fmt::print("-l:		list connected devices\n");
+	fmt::print("-o:		write log messages to a file, rotated at {} MiB, instead of stdout\n",
+	    LOG_FILE_MAX_SIZE / (1024 * 1024));
+	fmt::print("		example: -o devclient.log\n");
 	fmt::print("-p:		enable JTAG pass-through mode, cannot be used together with -j option\n");
 	fmt::print("-r:		read raw eeprom contents (binary data) and save it to file\n");
 	fmt::print("		example: -r eeprom.img\n");
@@ -93,20 +169,104 @@ usage(const std::string &argv0)
 	fmt::print("		example: -t board.dts\n");
 	fmt::print("-u:		IP address and TCP port number for listening for serial/uart communication\n");
 	fmt::print("		example: -u 0.0.0.0:2222\n");
+	fmt::print("-v:		log level: debug, info, warning, error or none, default info\n");
+	fmt::print("		example: -v debug\n");
 	fmt::print("-w:		write raw contents of file (binary data) to eeprom\n");
 	fmt::print("		example: -w eeprom.img\n");
-	fmt::print("-x:		configuration file name\n");
+	fmt::print("-x:		configuration file name, every device block in it is served\n");
+	fmt::print("		from this process until SIGINT or SIGTERM\n");
 	fmt::print("		example: -w devclient.cfg\n");
 	fmt::print("\nInvocation examples:\n");
 	fmt::print("{:s} -d 006/2019 -u 0.0.0.0:2222 -b 115200 -j 0.0.0.0:3333:4444 -s /tmp/script\n", argv0);
 	fmt::print("{:s} -d 006/2019 -u 0.0.0.0:2222 -b 115200 -p\n", argv0);
 	fmt::print("{:s} -d 006/2019 -w eeprom.img\n", argv0);
+	fmt::print("{:s} -d 006/2019 -D -c board.dts\n", argv0);
 	fmt::print("{:s} -x devclient.cfg\n", argv0);
 }
 
 
+static void
+eeprom_program(Eeprom &eeprom, const std::vector<uint8_t> &data, bool delta,
+    const std::string &cache)
+{
+	std::vector<uint8_t> current;
+	std::ifstream f_in;
+	std::ofstream f_out;
+	size_t pages;
+
+	if (!delta) {
+		eeprom.write(0, data);
+		return;
+	}
+
+	if (!cache.empty()) {
+		f_in.open(cache, ios::in | ios::binary);
+		current.assign(std::istreambuf_iterator<char>(f_in),
+		    std::istreambuf_iterator<char>());
+		f_in.close();
+	}
+
+	pages = eeprom.update(0, data, current.empty() ? nullptr : &current);
+
+	Logger::info("EEPROM: {} page(s) changed", pages);
+
+	if (!cache.empty()) {
+		f_out.open(cache, ios::out | ios::binary | ios::trunc);
+		f_out.write(reinterpret_cast<const char *>(data.data()),
+		    data.size());
+		f_out.close();
+	}
+}
+
+
+/*
+ * Times round trips through the MPSSE bad command echo on the I2C
+ * channel, once waiting for the latency timer to flush the answer and
+ * once with SEND_IMMEDIATE, for a range of latency timer settings.
+ */
+static void
+latency_test(const Device &dev)
+{
+	static const int latencies[] = { 1, 2, 4, 8, 16, 32 };
+	ChannelTuning tuning = ChannelTuning::channel("i2c");
+	I2C i2c(dev, 100000);
+	std::chrono::nanoseconds rtt;
+	std::chrono::nanoseconds min;
+	std::chrono::nanoseconds max;
+	std::chrono::nanoseconds total;
+	int i;
+
+	fmt::print("{:>8} {:>10} {:>10} {:>10} {:>10}\n", "latency", "flush",
+	    "min [us]", "avg [us]", "max [us]");
+
+	for (int latency: latencies) {
+		tuning.latency = latency;
+		i2c.tune(tuning);
+
+		for (bool immediate: { false, true }) {
+			min = std::chrono::nanoseconds::max();
+			max = std::chrono::nanoseconds::zero();
+			total = std::chrono::nanoseconds::zero();
+
+			for (i = 0; i < LATENCY_TEST_ROUNDS; i++) {
+				rtt = i2c.ping(immediate);
+				min = std::min(min, rtt);
+				max = std::max(max, rtt);
+				total += rtt;
+			}
+
+			fmt::print("{:>8} {:>10} {:>10.1f} {:>10.1f} {:>10.1f}\n",
+			    latency, immediate ? "immediate" : "timer",
+			    min.count() / 1000.0,
+			    total.count() / 1000.0 / LATENCY_TEST_ROUNDS,
+			    max.count() / 1000.0);
+		}
+	}
+}
+
+
 int
-uart_maintenance(std::string serial, std::string uart_listen_addr, uint32_t baudrate_value, std::shared_ptr<SerialCmdLine> &serial_cmd)
+uart_maintenance(std::string serial, std::string uart_listen_addr, uint32_t baudrate_value, std::shared_ptr<SerialCmdLine> &serial_cmd, const UartOptions &uart_options)
 {
 	Device dev;
 
@@ -114,12 +274,11 @@ uart_maintenance(std::string serial, std::string uart_listen_addr, uint32_t baud
 		uint16_t port;
 		std::string addr;
 
-		if ((baudrate_value != 9600) &&
-			(baudrate_value != 19200) &&
-			(baudrate_value != 38400) &&
-			(baudrate_value != 57600) &&
-			(baudrate_value != 115200)) {
-			fmt::print("Improper baud rate value: {:d}\n", baudrate_value);
+		BaudRate rate = BaudRate::compute(baudrate_value);
+
+		if (!rate.valid()) {
+			fmt::print("Improper baud rate value: {:d} (nearest possible: {:d})\n",
+			    baudrate_value, rate.actual);
 			exit(0);
 		}
 
@@ -136,7 +295,8 @@ uart_maintenance(std::string serial, std::string uart_listen_addr, uint32_t baud
 		serial_cmd = std::shared_ptr<SerialCmdLine>(new SerialCmdLine(
 			dev,
 			saddr,
-			baudrate_value));
+			baudrate_value,
+			uart_options));
 		serial_cmd->start();
 	}
 
@@ -176,63 +336,142 @@ int jtag_maintenance(std::string serial, std::string jtag, std::string script, s
 }
 
 
-int
-parse_config_file(std::string file_read, std::shared_ptr<SerialCmdLine> &serial_cmd, std::shared_ptr<JtagCmdLine> &jtag_cmd)
+/* Without it, device lookups fall back to a full bus scan each */
+static void
+start_registry()
 {
-	ucl_parser *parser;
-	const ucl_object_t *root, *uart, *jtag, *device, *serial;
-	const ucl_object_t *baud, *uart_ip, *uart_port;
-	const ucl_object_t *jtag_ip, *gdb_port, *telnet_port, *pass_through, *jtag_script;
-	std::string uart_listen_addr;
-	uint32_t baudrate_value;
+	try {
+		DeviceRegistry::instance().start();
+		std::atexit([] { DeviceRegistry::instance().stop(); });
+	} catch (const std::runtime_error &err) {
+		Logger::warning("{}, replugged devices will not be restarted",
+		    err.what());
+	}
+}
 
-	parser = ucl_parser_new(0);
-	if (!ucl_parser_add_file(parser, file_read.c_str()))
-		printf("error loading config file\n");
 
-	root = ucl_parser_get_object(parser);
-	device =  ucl_object_lookup(root, "device");
+/* Renders a capture (or the part given as "from:to" seconds) on stdout */
+static void
+export_capture(const std::string &path, const std::string &range)
+{
+	uint64_t from = 0;
+	uint64_t to = UINT64_MAX;
+	size_t colon;
 
-	serial = ucl_object_lookup(device, "serial");
+	try {
+		CaptureReader reader(path);
 
-	/* parse UART */
-	uart = ucl_object_lookup(device, "uart");
-	baud = ucl_object_lookup(uart, "baudrate");
-	baudrate_value = ucl_object_toint(baud);
-	uart_ip = ucl_object_lookup(uart, "listen_ip");
-	uart_port = ucl_object_lookup(uart, "listen_port");
+		colon = range.find(':');
+		if (!range.empty() && colon == std::string::npos)
+			throw std::runtime_error("Range has to be <from>:<to>");
 
-	/* parse JTAG */
-	jtag = ucl_object_lookup(device, "jtag");
-	jtag_ip = ucl_object_lookup(jtag, "listen_ip");
-	gdb_port = ucl_object_lookup(jtag, "gdb_port");
-	telnet_port = ucl_object_lookup(jtag, "telnet_port");
-	pass_through = ucl_object_lookup(jtag, "pass_through");
-	jtag_script = ucl_object_lookup(jtag, "script");
+		if (colon != std::string::npos && colon > 0)
+			from = std::stod(range.substr(0, colon)) * 1e9;
 
-	if ((pass_through != NULL) && (ucl_object_toint(pass_through)) && (jtag_ip != NULL)) {
-		Logger::error("JTAG server and pass through mode cannot be used together");
-		exit(0);
+		if (colon != std::string::npos && colon + 1 < range.size())
+			to = std::stod(range.substr(colon + 1)) * 1e9;
+
+		reader.export_text(from, to, stdout);
+	} catch (const std::exception &err) {
+		Logger::error("{}", err.what());
+		exit(EX_DATAERR);
 	}
 
-	if (uart != NULL) {
-		char addr[128];
-		std::sprintf(addr, "%s:%lu", ucl_object_tostring(uart_ip), ucl_object_toint(uart_port));
-		uart_listen_addr.assign(addr, strlen(addr));
-		uart_maintenance(ucl_object_tostring(serial), uart_listen_addr, baudrate_value, serial_cmd);
+	exit(0);
+}
+
+/*
+ * Writes an EEPROM image for every row of a CSV file, see BoardImages.
+ * The template is compiled once and each image is patched from it.
+ */
+static void
+generate_images(const std::string &template_path, const std::string &csv_path,
+    const std::string &outdir, const EepromModel &model)
+{
+	std::chrono::steady_clock::time_point start;
+	std::unique_ptr<BoardImages> images;
+	std::string source;
+	std::ifstream f_in;
+	std::ofstream f_out;
+	size_t count;
+
+	start = std::chrono::steady_clock::now();
+
+	try {
+		f_in.open(template_path, ios::in | ios::binary);
+		if (!f_in)
+			throw std::runtime_error(fmt::format("Cannot open {}",
+			    template_path));
+
+		source.assign(std::istreambuf_iterator<char>(f_in),
+		    std::istreambuf_iterator<char>());
+		f_in.close();
+
+		/* Either DTS source or an already compiled blob */
+		if (source.size() >= 4 && static_cast<uint8_t>(source[0]) == 0xd0 &&
+		    static_cast<uint8_t>(source[1]) == 0x0d &&
+		    static_cast<uint8_t>(source[2]) == 0xfe &&
+		    static_cast<uint8_t>(source[3]) == 0xed) {
+			images = std::make_unique<BoardImages>(
+			    DeviceTree::from_dtb(
+			    reinterpret_cast<const uint8_t *>(source.data()),
+			    source.size()), model);
+		} else {
+			images = std::make_unique<BoardImages>(
+			    DeviceTree::from_dts(source), model);
+		}
+
+		f_in.open(csv_path, ios::in);
+		if (!f_in)
+			throw std::runtime_error(fmt::format("Cannot open {}",
+			    csv_path));
+
+		count = images->generate(f_in, csv_path,
+		    [&](const std::string &name,
+		    const std::vector<uint8_t> &image) {
+			f_out.open(outdir + "/" + name,
+			    ios::out | ios::binary | ios::trunc);
+			f_out.write(reinterpret_cast<const char *>(image.data()),
+			    image.size());
+			f_out.close();
+			if (!f_out)
+				throw std::runtime_error(fmt::format(
+				    "Cannot write {}/{}", outdir, name));
+		    });
+	} catch (const std::runtime_error &err) {
+		Logger::error("{}", err.what());
+		exit(EX_DATAERR);
 	}
 
-	if ((jtag != NULL) && (!(ucl_object_toint(pass_through)))) {
-		char jtag2[128];
-		std::string jtag3;
-		std::sprintf(jtag2, "%s:%lu:%lu",
-			     ucl_object_tostring(jtag_ip),
-			     ucl_object_toint(gdb_port), ucl_object_toint(telnet_port));
-		jtag3.assign(jtag2, strlen(jtag2));
-		jtag_maintenance(ucl_object_tostring(serial), jtag2, ucl_object_tostring(jtag_script), jtag_cmd);
+	Logger::info("{} images written to {} in {:.3f} s", count, outdir,
+	    std::chrono::duration<double>(
+	    std::chrono::steady_clock::now() - start).count());
+	exit(0);
+}
+
+/*
+ * Serves every device block of the config file from this process and
+ * exits once the daemon has been told to quit.
+ */
+[[noreturn]] static void
+run_daemon(const std::string &file_read)
+{
+	DaemonConfig config;
+
+	try {
+		config = DaemonConfig::load(file_read);
+	} catch (const std::runtime_error &err) {
+		Logger::error("{}", err.what());
+		exit(EX_CONFIG);
 	}
 
-	return 0;
+	Daemon daemon(config);
+
+	/* Cables that are not plugged in yet are started once they show up */
+	daemon.start();
+	daemon.run();
+	daemon.stop();
+	exit(0);
 }
 
 
@@ -243,11 +482,25 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 	Device dev;
 	std::unique_ptr<Uart> uart;
 	std::string uart_listen_addr;
+	std::string uart_format;
+	std::string uart_flow;
+	UartOptions uart_options;
 	std::string serial;
 	std::string jtag;
 	std::string script;
 	std::string file_read;
 	std::string file_write;
+	std::string file_cache;
+	std::string eeprom_type = EEPROM_DEFAULT_MODEL;
+	std::string log_file;
+	std::string capture_path;
+	std::string export_path;
+	std::string export_range;
+	std::string template_path;
+	std::string boards_path;
+	std::string output_dir = ".";
+	bool capture_tx = false;
+	size_t scrollback = UART_SCROLLBACK;
 	uint8_t gpio_value;
 	uint32_t baudrate_value;
 	std::ofstream f_out;
@@ -258,17 +511,83 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 	bool eeprom_write = false;
 	bool eeprom_compile = false;
 	bool eeprom_decompile = false;
+	bool eeprom_delta = false;
+	bool rtt_test = false;
 	bool gpio = false;
 	bool pass_through = false;
 	bool config = false;
+	bool log_syslog = false;
 	int ch;
 
 	for (;;) {
-		ch = getopt_long(argc, argv, "b:c:d:g:hj:lpr:s:t:u:w:x:", long_options, nullptr);
+		ch = getopt_long(argc, argv, "B:C:DE:F:G:K:LM:O:R:ST:X:Z:b:c:d:f:g:hj:klo:pr:s:t:u:v:w:x:", long_options, nullptr);
 		if (ch == -1)
 			break;
 
 		switch (ch) {
+		case 'B':
+			scrollback = std::stoul(optarg, 0, 10);
+			break;
+		case 'C':
+			eeprom_delta = true;
+			file_cache = optarg;
+			break;
+		case 'D':
+			eeprom_delta = true;
+			break;
+		case 'E':
+			eeprom_type = optarg;
+			try {
+				EepromModel::find(eeprom_type);
+			} catch (const std::runtime_error &err) {
+				Logger::error("{}", err.what());
+				return (EX_USAGE);
+			}
+			break;
+		case 'F':
+			uart_format = optarg;
+			try {
+				uart_options.set_format(uart_format);
+			} catch (const std::runtime_error &err) {
+				Logger::error("{}", err.what());
+				return (EX_USAGE);
+			}
+			break;
+		case 'G':
+			template_path = optarg;
+			break;
+		case 'K':
+			capture_path = optarg;
+			break;
+		case 'L':
+			rtt_test = true;
+			break;
+		case 'M':
+			boards_path = optarg;
+			break;
+		case 'O':
+			output_dir = optarg;
+			break;
+		case 'R':
+			export_range = optarg;
+			break;
+		case 'S':
+			log_syslog = true;
+			break;
+		case 'T':
+			try {
+				ChannelTuning::parse(optarg);
+			} catch (const std::runtime_error &err) {
+				Logger::error("{}", err.what());
+				return (EX_USAGE);
+			}
+			break;
+		case 'X':
+			export_path = optarg;
+			break;
+		case 'Z':
+			FtdiSimulator::attach(optarg);
+			break;
 		case 'b':
 			baudrate_value = std::stoi(optarg, 0, 10);
 			cmdline = true;
@@ -281,6 +600,15 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 			serial = optarg;
 			cmdline = true;
 			break;
+		case 'f':
+			uart_flow = optarg;
+			try {
+				uart_options.set_flow(uart_flow);
+			} catch (const std::runtime_error &err) {
+				Logger::error("{}", err.what());
+				return (EX_USAGE);
+			}
+			break;
 		case 'g':
 			gpio = true;
 			gpio_value = std::stoi(optarg, 0, 16);
@@ -292,9 +620,15 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 			jtag = optarg;
 			cmdline = true;
 			break;
+		case 'k':
+			capture_tx = true;
+			break;
 		case 'l':
 			list = true;
 			break;
+		case 'o':
+			log_file = optarg;
+			break;
 		case 'p':
 			pass_through = true;
 			cmdline = true;
@@ -315,6 +649,14 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 			uart_listen_addr = optarg;
 			cmdline = true;
 			break;
+		case 'v':
+			try {
+				Logger::set_level(Logger::parse_level(optarg));
+			} catch (const std::runtime_error &err) {
+				Logger::error("{}", err.what());
+				return (EX_USAGE);
+			}
+			break;
 		case 'w':
 			eeprom_write = true;
 			file_read = optarg;
@@ -330,12 +672,43 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 		}
 	}
 
-	Gio::init();
+	if (!log_file.empty() || log_syslog) {
+		try {
+			Logger::clear_sinks();
+			if (!log_file.empty())
+				Logger::add_sink(std::make_shared<FileSink>(log_file));
+
+			if (log_syslog)
+				Logger::add_sink(std::make_shared<SyslogSink>());
+		} catch (const std::runtime_error &err) {
+			Logger::clear_sinks();
+			Logger::error("{}", err.what());
+			return (EX_USAGE);
+		}
+	}
 
-	if (config) {
-		parse_config_file(file_read, serial_cmd, jtag_cmd);
+	if (!export_path.empty())
+		export_capture(export_path, export_range);
+
+	if (!template_path.empty() || !boards_path.empty()) {
+		if (template_path.empty() || boards_path.empty()) {
+			Logger::error("Options -G and -M go together");
+			return (EX_USAGE);
+		}
+
+		generate_images(template_path, boards_path, output_dir,
+		    EepromModel::find(eeprom_type));
 	}
 
+	/* Log from here on without holding up the UART and USB threads */
+	Logger::start();
+	std::atexit(Logger::stop);
+
+	Gio::init();
+
+	if (config)
+		run_daemon(file_read);
+
 	if (!jtag.empty() && pass_through) {
 		Logger::error("JTAG options -j and -p cannot be used together");
 		exit(0);
@@ -350,6 +723,12 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 		exit(0);
 	}
 
+	if (rtt_test) {
+		dev = *DeviceEnumerator::find_by_serial(serial);
+		latency_test(dev);
+		exit(0);
+	}
+
 	if (gpio) {
 		dev = *DeviceEnumerator::find_by_serial(serial);
 		Gpio gpio(dev);
@@ -358,84 +737,115 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 	}
 
 	if (eeprom_read) {
+		const EepromModel &model = EepromModel::find(eeprom_type);
 		dev = *DeviceEnumerator::find_by_serial(serial);
-		I2C i2c(dev, 300000);
-		Eeprom24c eeprom(i2c);
+		I2C i2c(dev, model.max_clock);
+		Eeprom24c eeprom(i2c, model);
 		std::vector<uint8_t> data;
-		char rdata[4096];
 
-		eeprom.read(0, 4096, data);
+		eeprom.read(0, model.size, data);
 		f_out.open(file_write, ios::out | ios::binary | ios::trunc);
-		std::copy(data.begin(), data.end(), rdata);
-		f_out.write(rdata, 4096);
+		f_out.write(reinterpret_cast<const char *>(data.data()),
+		    data.size());
 		f_out.close();
 		exit(0);
 	}
 
 	if (eeprom_write) {
+		const EepromModel &model = EepromModel::find(eeprom_type);
 		dev = *DeviceEnumerator::find_by_serial(serial);
-		I2C i2c(dev, 300000);
-		Eeprom24c eeprom(i2c);
-		std::vector<uint8_t> data;
-		char rdata[4096];
+		I2C i2c(dev, model.max_clock);
+		Eeprom24c eeprom(i2c, model);
+		std::vector<uint8_t> data(model.size);
 
 		f_in.open(file_read, ios::in | ios::binary);
-		f_in.read(rdata, 4096);
+		f_in.read(reinterpret_cast<char *>(data.data()), data.size());
+		data.resize(f_in.gcount());
 		f_in.close();
-		for (unsigned int x = 0; x < sizeof(rdata); x++)
-			data.push_back(rdata[x]);
-		eeprom.write(0, data);
+		eeprom_program(eeprom, data, eeprom_delta, file_cache);
 		exit(0);
 	}
 
 	if (eeprom_decompile) {
+		const EepromModel &model = EepromModel::find(eeprom_type);
 		dev = *DeviceEnumerator::find_by_serial(serial);
-		I2C i2c(dev, 300000);
-		Eeprom24c eeprom(i2c);
+		I2C i2c(dev, model.max_clock);
+		Eeprom24c eeprom(i2c, model);
 		std::vector<uint8_t> data;
-		char rdata[4096], fname[256], cmd[256 + 128 + 32];
+		std::string source;
 
-		eeprom.read(0, 4096, data);
+		eeprom.read(0, model.size, data);
 
-		// save contents of eeprom to temporary file
-		std::sprintf(fname, "%s_tmp", file_write.c_str());
-		f_out.open(fname, ios::out | ios::binary | ios::trunc);
-		std::copy(data.begin(), data.end(), rdata);
-		f_out.write(rdata, 4096);
-		f_out.close();
+		try {
+			source = DeviceTree::from_dtb(data.data(),
+			    data.size()).to_dts();
+		} catch (const std::runtime_error &err) {
+			Logger::error("EEPROM: {}", err.what());
+			exit(EX_DATAERR);
+		}
 
-		// dtb decompilation
-		std::sprintf(cmd, "dtc -I dtb -O dts %s -o %s", fname, file_write.c_str());
-		std::system(cmd);
-		std::remove(fname);
+		f_out.open(file_write, ios::out | ios::trunc);
+		f_out << source;
+		f_out.close();
 		exit(0);
 	}
 
 	if (eeprom_compile) {
-		dev = *DeviceEnumerator::find_by_serial(serial);
-		I2C i2c(dev, 300000);
-		Eeprom24c eeprom(i2c);
+		const EepromModel &model = EepromModel::find(eeprom_type);
 		std::vector<uint8_t> data;
-		char rdata[4096], fname[256], cmd[256 + 128 + 32];
-
-		std::sprintf(fname, "%s_tmp", file_read.c_str());
-		// dts compilation
-		std::sprintf(cmd, "dtc -I dts -O dtb %s -o %s", file_read.c_str(), fname);
-		std::system(cmd);
+		std::string source;
 
-		f_in.open(fname, ios::in | ios::binary);
-		f_in.read(rdata, 4096);
+		f_in.open(file_read, ios::in);
+		source.assign(std::istreambuf_iterator<char>(f_in),
+		    std::istreambuf_iterator<char>());
 		f_in.close();
-		for (unsigned int x = 0; x < sizeof(rdata); x++)
-			data.push_back(rdata[x]);
-		std::remove(fname);
 
-		eeprom.write(0, data);
+		/* Compile first, so a typo doesn't cost an EEPROM round trip */
+		try {
+			data = DeviceTree::from_dts(source).to_dtb();
+		} catch (const std::runtime_error &err) {
+			Logger::error("{}: {}", file_read, err.what());
+			exit(EX_DATAERR);
+		}
+
+		if (data.size() > model.size) {
+			Logger::error("{}: {} bytes compiled, a {} holds {}",
+			    file_read, data.size(), model.name, model.size);
+			exit(EX_DATAERR);
+		}
+
+		dev = *DeviceEnumerator::find_by_serial(serial);
+		I2C i2c(dev, model.max_clock);
+		Eeprom24c eeprom(i2c, model);
+
+		eeprom_program(eeprom, data, eeprom_delta, file_cache);
 		exit(0);
 	}
 
-	if (!uart_listen_addr.empty())
-		uart_maintenance(serial, uart_listen_addr, baudrate_value, serial_cmd);
+	/*
+	 * Only the services below outlive a single command, they are
+	 * restarted by the registry when their cable is replugged
+	 */
+	if (!uart_listen_addr.empty() || !jtag.empty())
+		start_registry();
+
+	if (!uart_listen_addr.empty()) {
+		uart_options = UartOptions::for_baudrate(baudrate_value);
+
+		/* Validated while parsing the options */
+		if (!uart_format.empty())
+			uart_options.set_format(uart_format);
+
+		if (!uart_flow.empty())
+			uart_options.set_flow(uart_flow);
+
+		uart_options.scrollback = scrollback;
+		uart_options.capture_path = capture_path;
+		uart_options.capture_tx = capture_tx;
+
+		uart_maintenance(serial, uart_listen_addr, baudrate_value, serial_cmd,
+		    uart_options);
+	}
 
 	if (!jtag.empty())
 		jtag_maintenance(serial, jtag, script, jtag_cmd);
@@ -463,8 +873,13 @@ main(int argc, char *const argv[])
 	cmdline = parse_cmdline(argc, argv, serial_cmd, jtag_cmd);
 
 	if (cmdline == true) {
-		serial_cmd->main_loop->run();
+		/* A JTAG server alone still needs a loop to hear of replugs */
+		if (serial_cmd)
+			serial_cmd->main_loop->run();
+		else if (jtag_cmd && jtag_cmd->m_server)
+			Glib::MainLoop::create()->run();
 	} else {
+		start_registry();
 		return Devclient::Application::instance()->run();
 	}
 }
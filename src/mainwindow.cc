@@ -135,6 +135,7 @@ ProfileTab::clicked()
 	const ucl_object_t *baud, *uart_ip, *uart_port;
 	const ucl_object_t *jtag_ip, *gdb_port, *telnet_port, *jtag_script;
 	const ucl_object_t *gpio, *name0, *name1, *name2, *name3;
+	const ucl_object_t *eeprom, *eeprom_type;
 	std::string uart_listen_addr;
 //	uint32_t baudrate_value;
 
@@ -190,6 +191,10 @@ ProfileTab::clicked()
 	name2 = ucl_object_lookup(gpio, "gpio2");
 	name3 = ucl_object_lookup(gpio, "gpio3");
 
+	/* parse EEPROM */
+	eeprom = ucl_object_lookup(device, "eeprom");
+	eeprom_type = ucl_object_lookup(eeprom, "type");
+
 	/* set UART parameters */
 	m_parent->set_uart_addr(ucl_object_tostring(uart_ip));
 	m_parent->set_uart_port(std::to_string(ucl_object_toint(uart_port)));
@@ -207,6 +212,10 @@ ProfileTab::clicked()
 	m_parent->set_gpio_name(2, ucl_object_tostring(name2));
 	m_parent->set_gpio_name(3, ucl_object_tostring(name3));
 
+	/* set EEPROM parameters */
+	if (eeprom_type != NULL)
+		m_parent->set_eeprom_type(ucl_object_tostring(eeprom_type));
+
 	/* show file name in profile tab */
 	m_entry.get_widget().set_text(filesystem::path(fname).filename().c_str());
 }
@@ -215,7 +224,9 @@ SerialTab::SerialTab(MainWindow *parent, const Device &dev):
     Gtk::Box(Gtk::Orientation::ORIENTATION_VERTICAL),
     m_address_row("Listen address"),
     m_port_row("Listen port"),
-    m_baud_row("Port baud rate"),
+    m_baud_row("Port baud rate", true),
+    m_format_row("Line format"),
+    m_flow_row("Flow control"),
     m_status_row("Status"),
     m_label("Connected clients:"),
     m_clients(1),
@@ -242,7 +253,27 @@ SerialTab::SerialTab(MainWindow *parent, const Device &dev):
 	m_baud_row.get_widget().append("38400");
 	m_baud_row.get_widget().append("57600");
 	m_baud_row.get_widget().append("115200");
-	m_baud_row.get_widget().set_active_text("115200");
+	m_baud_row.get_widget().append("230400");
+	m_baud_row.get_widget().append("460800");
+	m_baud_row.get_widget().append("921600");
+	m_baud_row.get_widget().append("1000000");
+	m_baud_row.get_widget().append("2000000");
+	m_baud_row.get_widget().append("3000000");
+	m_baud_row.get_widget().append("6000000");
+	m_baud_row.get_widget().append("12000000");
+	m_baud_row.get_widget().get_entry()->set_text("115200");
+	m_format_row.get_widget().append("8N1", "8N1");
+	m_format_row.get_widget().append("8E1", "8E1");
+	m_format_row.get_widget().append("8O1", "8O1");
+	m_format_row.get_widget().append("8N2", "8N2");
+	m_format_row.get_widget().append("7E1", "7E1");
+	m_format_row.get_widget().append("7O1", "7O1");
+	m_format_row.get_widget().set_active_id("8N1");
+	m_flow_row.get_widget().append("none", "None");
+	m_flow_row.get_widget().append("rtscts", "RTS/CTS");
+	m_flow_row.get_widget().append("dtrdsr", "DTR/DSR");
+	m_flow_row.get_widget().append("xonxoff", "XON/XOFF");
+	m_flow_row.get_widget().set_active_id("none");
 	m_status_row.get_widget().set_editable(false);
 	m_clients.set_column_title(0, "Client address");
 	m_scroll.add(m_clients);
@@ -266,6 +297,8 @@ SerialTab::SerialTab(MainWindow *parent, const Device &dev):
 	pack_start(m_address_row, false, true);
 	pack_start(m_port_row, false, true);
 	pack_start(m_baud_row, false, true);
+	pack_start(m_format_row, false, true);
+	pack_start(m_flow_row, false, true);
 	pack_start(m_status_row, false, true);
 	pack_start(m_separator, false, true);
 	pack_start(m_label, false, true);
@@ -277,24 +310,36 @@ void
 SerialTab::start_clicked()
 {
 	Glib::RefPtr<Gio::SocketAddress> addr;
+	UartOptions options;
 	int baud;
 
 	if (m_uart)
 		return;
 
-	baud = std::stoi(m_baud_row.get_widget().get_active_text());
+	try {
+		baud = std::stoi(m_baud_row.get_widget().get_active_text());
+	} catch (const std::exception &err) {
+		show_centered_dialog("Error", "Invalid baud rate");
+		return;
+	}
+
+	options = UartOptions::for_baudrate(baud);
+	options.set_format(m_format_row.get_widget().get_active_id());
+	options.set_flow(m_flow_row.get_widget().get_active_id());
+
 	addr = Gio::InetSocketAddress::create(
 	    Gio::InetAddress::create(m_address_row.get_widget().get_text()),
 	    std::stoi(m_port_row.get_widget().get_text()));
 
 	try {
-		m_uart = std::make_shared<Uart>(m_device, addr, baud);
+		m_uart = std::make_shared<Uart>(m_device, addr, baud, options);
 		m_uart->m_connected.connect(sigc::mem_fun(*this,
 		    &SerialTab::client_connected));
 		m_uart->m_disconnected.connect(sigc::mem_fun(*this,
 		    &SerialTab::client_disconnected));
 		m_uart->start();
-		m_status_row.get_widget().set_text("Running");
+		m_status_row.get_widget().set_text(fmt::format(
+		    "Running at {} baud", m_uart->actual_baudrate()));
 	} catch (const std::runtime_error &err) {
 		show_centered_dialog("Error", err.what());
 	}
@@ -389,7 +434,8 @@ void SerialTab::set_port(std::string port)
 
 void SerialTab::set_baud(std::string baud)
 {
-	m_baud_row.get_widget().set_active_text(baud);
+	/* Any rate is allowed, not only the ones in the list */
+	m_baud_row.get_widget().get_entry()->set_text(baud);
 }
 
 void SerialTab::on_port_changed()
@@ -609,24 +655,41 @@ void JtagTab::set_script(std::string script)
 
 EepromTab::EepromTab(MainWindow *parent, const Device &dev):
 	Gtk::Box(Gtk::Orientation::ORIENTATION_VERTICAL),
+	m_model_row("EEPROM type"),
 	m_read("Read"),
 	m_write("Write"),
 	m_save("Save buffer to file"),
+	m_cancel("Cancel"),
+	m_cancelled(false),
+	m_operation(Operation::READ),
+	m_fraction(0),
+	m_pages(0),
+	m_size(0),
 	m_parent(parent),
 	m_device(dev)
 {
 	Pango::FontDescription font("Monospace 9");
 
+	for (const auto &i: EepromModel::all())
+		m_model_row.get_widget().append(i.name);
+
+	m_model_row.get_widget().set_active_text(EEPROM_DEFAULT_MODEL);
+
 	m_textbuffer = Gtk::TextBuffer::create();
 	m_textview.set_buffer(m_textbuffer);
 	m_textview.override_font(font);
 	m_scroll.add(m_textview);
 
+	m_progress.set_show_text(true);
+	m_progress.set_text("Idle");
+
 	m_buttons.set_border_width(5);
 	m_buttons.set_layout(Gtk::ButtonBoxStyle::BUTTONBOX_END);
 	m_buttons.pack_start(m_read);
 	m_buttons.pack_start(m_write);
 	m_buttons.pack_start(m_save);
+	m_buttons.pack_start(m_cancel);
+	m_cancel.set_sensitive(false);
 
 	m_textbuffer->set_text(
 	    "/dts-v1/;\n"
@@ -640,12 +703,40 @@ EepromTab::EepromTab(MainWindow *parent, const Device &dev):
 	    &EepromTab::read_clicked));
 	m_write.signal_clicked().connect(sigc::mem_fun(*this,
 	    &EepromTab::write_clicked));
+	m_cancel.signal_clicked().connect(sigc::mem_fun(*this,
+	    &EepromTab::cancel_clicked));
+	m_progress_signal.connect(sigc::mem_fun(*this,
+	    &EepromTab::worker_progress));
+	m_done_signal.connect(sigc::mem_fun(*this,
+	    &EepromTab::worker_done));
 
 	set_border_width(5);
+	pack_start(m_model_row, false, true);
 	pack_start(m_scroll, true, true);
+	pack_start(m_progress, false, true);
 	pack_start(m_buttons, false, true);
 }
 
+EepromTab::~EepromTab()
+{
+	m_cancelled = true;
+	if (m_worker.joinable())
+		m_worker.join();
+}
+
+void
+EepromTab::set_type(std::string type)
+{
+	m_model_row.get_widget().set_active_text(type);
+}
+
+const EepromModel &
+EepromTab::model()
+{
+	return (EepromModel::find(
+	    m_model_row.get_widget().get_active_text()));
+}
+
 void
 EepromTab::write_clicked()
 {
@@ -666,35 +757,27 @@ EepromTab::write_clicked()
 void
 EepromTab::read_clicked()
 {
-	Eeprom24c eeprom(*m_parent->m_i2c);
-
 	m_textual = std::make_shared<std::string>();
 	m_blob = std::make_shared<std::vector<uint8_t>>();
 	m_dtb = std::make_shared<DTB>(m_textual, m_blob);
 
-	try {
-		eeprom.read(0, 4096, *m_blob);
-		m_dtb->decompile(sigc::mem_fun(*this,
-		    &EepromTab::decompile_done));
-	} catch (const std::runtime_error &err) {
-		Gtk::MessageDialog msg("Read error");
-
-		msg.set_secondary_text(err.what());
-		msg.run();
-	}
+	start_worker(Operation::READ);
 }
 
+void
+EepromTab::cancel_clicked()
+{
+	m_cancelled = true;
+	m_cancel.set_sensitive(false);
+	m_progress.set_text("Cancelling...");
+}
 
 void
 EepromTab::compile_done(bool ok, int size, const std::string &errors)
 {
 	if (ok) {
-		Gtk::MessageDialog dlg(*m_parent, fmt::format(
-		    "Compilation and flashing done (size: {} bytes)", size));
-
-		Eeprom24c eeprom(*m_parent->m_i2c);
-		eeprom.write(0, *m_blob);
-		dlg.run();
+		m_size = size;
+		start_worker(Operation::WRITE);
 	} else {
 		Gtk::MessageDialog dlg(*m_parent, "Compile errors!");
 
@@ -722,6 +805,135 @@ EepromTab::decompile_done(bool ok, int size, const std::string &errors)
 	}
 }
 
+void
+EepromTab::start_worker(Operation op)
+{
+	const EepromModel *eeprom;
+
+	if (m_worker.joinable())
+		return;
+
+	/* Widgets may only be touched here, on the main thread */
+	try {
+		eeprom = &model();
+	} catch (const std::runtime_error &err) {
+		Gtk::MessageDialog msg(op == Operation::READ
+		    ? "Read error" : "Write error");
+
+		msg.set_secondary_text(err.what());
+		msg.run();
+		return;
+	}
+
+	m_operation = op;
+	m_cancelled = false;
+	m_fraction = 0;
+	m_pages = 0;
+	m_error.clear();
+
+	set_busy(true);
+	m_progress.set_fraction(0);
+	m_progress.set_text(op == Operation::READ
+	    ? "Reading EEPROM..." : "Writing EEPROM...");
+
+	m_worker = std::thread(&EepromTab::worker, this, op,
+	    std::cref(*eeprom));
+}
+
+void
+EepromTab::worker(Operation op, const EepromModel &model)
+{
+	try {
+		Eeprom24c eeprom(*m_parent->m_i2c, model);
+
+		eeprom.set_progress([this](size_t done, size_t total) {
+			{
+				std::lock_guard<std::mutex> lock(m_worker_lock);
+				m_fraction = total != 0
+				    ? static_cast<double>(done) / total : 1;
+			}
+
+			m_progress_signal.emit();
+			return (!m_cancelled);
+		});
+
+		if (op == Operation::READ) {
+			eeprom.read(0, eeprom.size(), *m_blob);
+		} else {
+			size_t pages = eeprom.update(0, *m_blob);
+			std::lock_guard<std::mutex> lock(m_worker_lock);
+
+			m_pages = pages;
+		}
+	} catch (const std::runtime_error &err) {
+		std::lock_guard<std::mutex> lock(m_worker_lock);
+
+		m_error = err.what();
+	}
+
+	m_done_signal.emit();
+}
+
+void
+EepromTab::worker_progress()
+{
+	std::lock_guard<std::mutex> lock(m_worker_lock);
+
+	m_progress.set_fraction(m_fraction);
+}
+
+void
+EepromTab::worker_done()
+{
+	m_worker.join();
+	set_busy(false);
+
+	if (m_cancelled) {
+		m_progress.set_text("Cancelled");
+		return;
+	}
+
+	if (!m_error.empty()) {
+		Gtk::MessageDialog msg(m_operation == Operation::READ
+		    ? "Read error" : "Write error");
+
+		m_progress.set_text("Failed");
+		msg.set_secondary_text(m_error);
+		msg.run();
+		return;
+	}
+
+	m_progress.set_fraction(1);
+	m_progress.set_text("Done");
+
+	if (m_operation == Operation::READ) {
+		try {
+			m_dtb->decompile(sigc::mem_fun(*this,
+			    &EepromTab::decompile_done));
+		} catch (const std::runtime_error &err) {
+			Gtk::MessageDialog msg("Read error");
+
+			msg.set_secondary_text(err.what());
+			msg.run();
+		}
+	} else {
+		Gtk::MessageDialog dlg(*m_parent, fmt::format(
+		    "Compilation and flashing done (size: {} bytes, "
+		    "{} page(s) changed)", m_size, m_pages));
+
+		dlg.run();
+	}
+}
+
+void
+EepromTab::set_busy(bool busy)
+{
+	m_read.set_sensitive(!busy);
+	m_write.set_sensitive(!busy);
+	m_model_row.get_widget().set_sensitive(!busy);
+	m_cancel.set_sensitive(busy);
+}
+
 GpioTab::GpioTab(MainWindow *parent, const Device &dev):
     Gtk::Box(Gtk::Orientation::ORIENTATION_VERTICAL),
     m_gpio0_row("GPIO 0"),
@@ -887,7 +1099,7 @@ GpioTab::on_timeout(int param)
 		return true;
 
 	/* read all the GPIO pins */
-	st = m_gpio->m_context.read_pins(rxbuf);
+	st = m_gpio->m_transport->read_pins(rxbuf);
 	if (st != 0) {
 		printf("fail to read st: %d\n", st);
 	}
@@ -1006,3 +1218,8 @@ void MainWindow::set_jtag_script(std::string script)
 {
 	m_jtag_tab.set_script(script);
 }
+
+void MainWindow::set_eeprom_type(std::string type)
+{
+	m_eeprom_tab.set_type(type);
+}
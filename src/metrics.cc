@@ -0,0 +1,497 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <algorithm>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fmt/format.h>
+#include <log.hh>
+#include <metrics.hh>
+
+/* Requests larger than this are not a scrape, drop the connection */
+#define METRICS_REQUEST_MAX	8192
+
+#define BUFSIZE			1024
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+MetricHistogram::MetricHistogram(const std::vector<double> &bounds):
+	m_bounds(bounds),
+	m_counts(new std::atomic<uint64_t>[bounds.size() + 1]),
+	m_sum(0)
+{
+	size_t i;
+
+	std::sort(m_bounds.begin(), m_bounds.end());
+
+	for (i = 0; i <= m_bounds.size(); i++)
+		m_counts[i] = 0;
+}
+
+void
+MetricHistogram::observe(double value)
+{
+	double sum = m_sum.load(std::memory_order_relaxed);
+	size_t i;
+
+	for (i = 0; i < m_bounds.size(); i++) {
+		if (value <= m_bounds[i])
+			break;
+	}
+
+	m_counts[i].fetch_add(1, std::memory_order_relaxed);
+
+	while (!m_sum.compare_exchange_weak(sum, sum + value,
+	    std::memory_order_relaxed))
+		continue;
+}
+
+void
+MetricHistogram::observe_since(std::chrono::steady_clock::time_point start)
+{
+	observe(std::chrono::duration<double>(
+	    std::chrono::steady_clock::now() - start).count());
+}
+
+const std::vector<double> &
+MetricHistogram::bounds() const
+{
+	return (m_bounds);
+}
+
+std::vector<uint64_t>
+MetricHistogram::counts() const
+{
+	std::vector<uint64_t> ret;
+	size_t i;
+
+	for (i = 0; i <= m_bounds.size(); i++)
+		ret.push_back(m_counts[i].load(std::memory_order_relaxed));
+
+	return (ret);
+}
+
+double
+MetricHistogram::sum() const
+{
+	return (m_sum.load(std::memory_order_relaxed));
+}
+
+Metrics &
+Metrics::instance()
+{
+	static Metrics metrics;
+
+	return (metrics);
+}
+
+Metrics::Series &
+Metrics::series(const std::string &name, const std::string &help, Type type,
+    const MetricLabels &labels)
+{
+	auto it = m_families.find(name);
+
+	if (it == m_families.end()) {
+		it = m_families.emplace(name, Family()).first;
+		it->second.type = type;
+		it->second.help = help;
+	} else if (it->second.type != type) {
+		throw std::runtime_error(fmt::format(
+		    "Metric {} registered twice with different types", name));
+	}
+
+	return (it->second.series[labels]);
+}
+
+std::shared_ptr<MetricCounter>
+Metrics::counter(const std::string &name, const std::string &help,
+    const MetricLabels &labels)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	Series &entry = series(name, help, Type::COUNTER, labels);
+
+	if (!entry.counter)
+		entry.counter = std::make_shared<MetricCounter>();
+
+	return (entry.counter);
+}
+
+std::shared_ptr<MetricGauge>
+Metrics::gauge(const std::string &name, const std::string &help,
+    const MetricLabels &labels)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	Series &entry = series(name, help, Type::GAUGE, labels);
+
+	if (!entry.gauge)
+		entry.gauge = std::make_shared<MetricGauge>();
+
+	return (entry.gauge);
+}
+
+std::shared_ptr<MetricHistogram>
+Metrics::histogram(const std::string &name, const std::string &help,
+    const std::vector<double> &bounds, const MetricLabels &labels)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	Series &entry = series(name, help, Type::HISTOGRAM, labels);
+
+	if (!entry.histogram)
+		entry.histogram = std::make_shared<MetricHistogram>(bounds);
+
+	return (entry.histogram);
+}
+
+void
+Metrics::remove(const std::string &name, const MetricLabels &labels)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	auto it = m_families.find(name);
+
+	if (it != m_families.end())
+		it->second.series.erase(labels);
+}
+
+static std::string
+escape_label(const std::string &value)
+{
+	std::string ret;
+
+	for (char c: value) {
+		switch (c) {
+		case '\\':
+			ret += "\\\\";
+			break;
+		case '"':
+			ret += "\\\"";
+			break;
+		case '\n':
+			ret += "\\n";
+			break;
+		default:
+			ret += c;
+		}
+	}
+
+	return (ret);
+}
+
+/* {name="value",...}, with an optional extra label such as le */
+static std::string
+format_labels(const MetricLabels &labels, const std::string &extra = "")
+{
+	std::string ret;
+
+	for (const auto &i: labels) {
+		ret += ret.empty() ? "{" : ",";
+		ret += fmt::format("{}=\"{}\"", i.first, escape_label(i.second));
+	}
+
+	if (!extra.empty())
+		ret += (ret.empty() ? "{" : ",") + extra;
+
+	if (!ret.empty())
+		ret += "}";
+
+	return (ret);
+}
+
+std::string
+Metrics::render() const
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	const char *types[] = { "counter", "gauge", "histogram" };
+	std::vector<uint64_t> counts;
+	std::string ret;
+	uint64_t total;
+	size_t i;
+
+	for (const auto &family: m_families) {
+		const std::string &name = family.first;
+
+		if (family.second.series.empty())
+			continue;
+
+		ret += fmt::format("# HELP {} {}\n", name, family.second.help);
+		ret += fmt::format("# TYPE {} {}\n", name,
+		    types[static_cast<int>(family.second.type)]);
+
+		for (const auto &series: family.second.series) {
+			const MetricLabels &labels = series.first;
+
+			switch (family.second.type) {
+			case Type::COUNTER:
+				ret += fmt::format("{}{} {}\n", name,
+				    format_labels(labels),
+				    series.second.counter->value());
+				break;
+			case Type::GAUGE:
+				ret += fmt::format("{}{} {}\n", name,
+				    format_labels(labels),
+				    series.second.gauge->value());
+				break;
+			case Type::HISTOGRAM:
+				const MetricHistogram &histogram =
+				    *series.second.histogram;
+
+				/* Buckets are cumulative in the exposition */
+				counts = histogram.counts();
+				total = 0;
+
+				for (i = 0; i < counts.size(); i++) {
+					total += counts[i];
+					ret += fmt::format("{}_bucket{} {}\n",
+					    name, format_labels(labels,
+					    i < histogram.bounds().size() ?
+					    fmt::format("le=\"{:g}\"",
+					    histogram.bounds()[i]) :
+					    "le=\"+Inf\""), total);
+				}
+
+				ret += fmt::format("{}_sum{} {:.10g}\n", name,
+				    format_labels(labels), histogram.sum());
+				ret += fmt::format("{}_count{} {}\n", name,
+				    format_labels(labels), total);
+				break;
+			}
+		}
+	}
+
+	return (ret);
+}
+
+MetricsServer::MetricsServer(EventLoop &loop, const struct sockaddr *addr,
+    socklen_t addrlen):
+	m_loop(loop),
+	m_started(false)
+{
+	int one = 1;
+
+	m_listen_fd = ::socket(addr->sa_family, SOCK_STREAM, 0);
+	if (m_listen_fd < 0) {
+		throw std::runtime_error(fmt::format(
+		    "Cannot create socket: {}", strerror(errno)));
+	}
+
+	::setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	::fcntl(m_listen_fd, F_SETFL, ::fcntl(m_listen_fd, F_GETFL) | O_NONBLOCK);
+	::fcntl(m_listen_fd, F_SETFD, FD_CLOEXEC);
+
+	if (::bind(m_listen_fd, addr, addrlen) != 0 ||
+	    ::listen(m_listen_fd, SOMAXCONN) != 0) {
+		std::string err = fmt::format("Cannot listen for metrics: {}",
+		    strerror(errno));
+
+		::close(m_listen_fd);
+		throw std::runtime_error(err);
+	}
+}
+
+MetricsServer::~MetricsServer()
+{
+	stop();
+	::close(m_listen_fd);
+}
+
+void
+MetricsServer::start()
+{
+	if (m_started)
+		return;
+
+	m_loop.add(m_listen_fd, EVENT_READ, [this](uint32_t) {
+		accept_ready();
+	});
+
+	m_started = true;
+}
+
+void
+MetricsServer::stop()
+{
+	if (!m_started)
+		return;
+
+	m_loop.invoke([this] {
+		m_loop.remove(m_listen_fd);
+
+		while (!m_clients.empty())
+			close_client(m_clients.begin()->second);
+	});
+
+	m_started = false;
+}
+
+void
+MetricsServer::accept_ready()
+{
+	std::shared_ptr<Client> client;
+	int fd;
+
+	for (;;) {
+		fd = ::accept(m_listen_fd, nullptr, nullptr);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				Logger::warning("Metrics: accept failed: {}",
+				    strerror(errno));
+			return;
+		}
+
+		::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+		::fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+		client = std::make_shared<Client>();
+		client->fd = fd;
+		client->offset = 0;
+		m_clients[fd] = client;
+		m_loop.add(fd, EVENT_READ, [this, client](uint32_t events) {
+			client_ready(client, events);
+		});
+	}
+}
+
+void
+MetricsServer::client_ready(const std::shared_ptr<Client> &client,
+    uint32_t events)
+{
+	char buffer[BUFSIZE];
+	ssize_t ret;
+
+	if (events & EVENT_WRITE) {
+		if (!send(*client))
+			close_client(client);
+		return;
+	}
+
+	for (;;) {
+		ret = ::recv(client->fd, buffer, sizeof(buffer), 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		if (ret <= 0) {
+			close_client(client);
+			return;
+		}
+
+		client->request.append(buffer, ret);
+		if (client->request.find("\r\n\r\n") != std::string::npos ||
+		    client->request.find("\n\n") != std::string::npos)
+			break;
+
+		if (client->request.size() > METRICS_REQUEST_MAX) {
+			close_client(client);
+			return;
+		}
+	}
+
+	respond(*client);
+	m_loop.modify(client->fd, EVENT_WRITE);
+
+	if (!send(*client))
+		close_client(client);
+}
+
+void
+MetricsServer::respond(Client &client)
+{
+	std::string line = client.request.substr(0,
+	    client.request.find_first_of("\r\n"));
+	std::string method = line.substr(0, line.find(' '));
+	std::string path;
+	std::string status = "200 OK";
+	std::string body;
+	size_t start;
+
+	start = line.find(' ');
+	if (start != std::string::npos) {
+		path = line.substr(start + 1);
+		path = path.substr(0, path.find_first_of(" ?"));
+	}
+
+	if (method != "GET" && method != "HEAD") {
+		status = "405 Method Not Allowed";
+		body = "Only GET is supported\n";
+	} else if (path != "/metrics") {
+		status = "404 Not Found";
+		body = "Metrics are served at /metrics\n";
+	} else
+		body = Metrics::instance().render();
+
+	client.response = fmt::format("HTTP/1.0 {}\r\n"
+	    "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+	    "Content-Length: {}\r\n"
+	    "Connection: close\r\n\r\n", status, body.size());
+
+	if (method != "HEAD")
+		client.response += body;
+}
+
+/* Returns false once the response is out or the client is gone */
+bool
+MetricsServer::send(Client &client)
+{
+	ssize_t ret;
+
+	while (client.offset < client.response.size()) {
+		ret = ::send(client.fd, &client.response[client.offset],
+		    client.response.size() - client.offset, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return (true);
+
+		if (ret < 0)
+			return (false);
+
+		client.offset += ret;
+	}
+
+	return (false);
+}
+
+void
+MetricsServer::close_client(const std::shared_ptr<Client> &client)
+{
+	if (m_clients.erase(client->fd) == 0)
+		return;
+
+	m_loop.remove(client->fd);
+	::close(client->fd);
+}
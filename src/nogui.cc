@@ -1,177 +1,129 @@
 #include <utils.hh>
 #include <nogui.hh>
 #include <log.hh>
+#include <transport.hh>
 
-#define BUFSIZE         4096
+DeviceWatch::DeviceWatch(const std::string &serial, const Callback &callback) :
+    m_serial(serial),
+    m_callback(callback),
+    m_listener(-1),
+    m_delivering(false)
+{
+	m_changed.connect(sigc::mem_fun(*this, &DeviceWatch::changed));
+
+	/* Without the registry running there is simply nothing to report */
+	m_listener = DeviceRegistry::instance().subscribe(
+	    [this](const Device &device, bool present) {
+		if (device.serial != m_serial)
+			return;
+
+		std::lock_guard<std::mutex> lock(m_changes_lock);
+
+		m_changes.emplace_back(device, present);
+		m_changed.emit();
+	    });
+}
 
 
-SerialCmdLine::SerialCmdLine(const Device &device, const Glib::RefPtr<Gio::SocketAddress> &addr, int baudrate) : main_loop(Glib::MainLoop::create())
+DeviceWatch::~DeviceWatch()
 {
-	Glib::RefPtr<Gio::SocketAddress> retaddr;
+	DeviceRegistry::instance().unsubscribe(m_listener);
+}
 
-	m_running = false;
-	m_context.set_interface(INTERFACE_C);
-	m_device = device;
 
+/*
+ * Runs on the main loop. Stopping a JTAG server iterates the main
+ * context, so this can be entered again from the callback; changes
+ * that arrive meanwhile are left for the outer call, in order, so a
+ * replug is never seen before the stop it follows has finished.
+ */
+void
+DeviceWatch::changed()
+{
+	std::vector<std::pair<Device, bool>> changes;
 
-	if (m_context.open(device.vid, device.pid, device.description,
-	    device.serial) != 0) {
-		Logger::error("Failed to open device.");
+	if (m_delivering)
 		return;
-	}
 
-	if (m_context.reset() != 0) {
-		Logger::error("Failed to reset UART channel");
-		return;
-	}
+	m_delivering = true;
 
-	if (m_context.set_bitmode(0xff, BITMODE_RESET) != 0) {
-		Logger::error("Failed to reset bitmode.");
-		return;
-	}
+	for (;;) {
+		{
+			std::lock_guard<std::mutex> lock(m_changes_lock);
 
-	if (m_context.bitbang_disable() != 0) {
-		Logger::error("Failed to set bitbang_disable.");
-		return;
-	}
+			changes.clear();
+			changes.swap(m_changes);
+		}
 
-	if (m_context.set_baud_rate(baudrate) != 0) {
-		Logger::error("Failed to set the baud rate.");
-		return;
-	}
+		if (changes.empty())
+			break;
 
-	try {
-		m_socket_service = Gio::ThreadedSocketService::create(10);
-		m_socket_service->add_address(addr, Gio::SocketType::SOCKET_TYPE_STREAM, Gio::SocketProtocol::SOCKET_PROTOCOL_TCP, retaddr);
-	} catch (const Glib::Exception &err) {
-		throw std::runtime_error(err.what());
+		for (const auto &change: changes)
+			m_callback(change.first, change.second);
 	}
 
-	m_socket_service->signal_run().connect(sigc::mem_fun(*this, &SerialCmdLine::socket_worker));
+	m_delivering = false;
+}
+
 
+SerialCmdLine::SerialCmdLine(const Device &device, const Glib::RefPtr<Gio::SocketAddress> &addr, int baudrate, const UartOptions &options) : main_loop(Glib::MainLoop::create())
+{
 	m_device = device;
 	m_addr = addr;
 	m_baudrate = baudrate;
+	m_options = options;
+	m_watch = std::make_unique<DeviceWatch>(device.serial,
+	    [this](const Device &device, bool present) {
+		device_changed(device, present);
+	    });
+
+	open();
 }
 
 
 void
-SerialCmdLine::start(void)
+SerialCmdLine::open()
 {
-	if (m_uart)
-		return;
-
 	try {
-		m_socket_service->start();
-		m_usb_worker = std::thread(&SerialCmdLine::usb_worker, this);
-		m_running = true;
+		m_uart = std::make_shared<Uart>(m_device, m_addr, m_baudrate,
+		    m_options);
 	} catch (const std::runtime_error &err) {
-		Logger::warning("UART: I/O error: {}", err.what());
-	}
-}
-
-
-bool
-SerialCmdLine::socket_worker(const Glib::RefPtr<Gio::SocketConnection> &conn, const Glib::RefPtr<Glib::Object> &source)
-{
-	UartConnection uartconn;
-	Glib::RefPtr<Gio::InputStream> istream;
-	uint8_t buffer[BUFSIZE];
-	ssize_t ret;
-	int written;
-
-	Logger::info("UART: accepted connection from {}", conn->get_remote_address()->to_string());
-
-	uartconn.m_address = conn->get_remote_address();
-	uartconn.m_address->reference();
-	uartconn.m_cancel = Gio::Cancellable::create();
-	uartconn.m_conn = conn;
-	uartconn.m_ostream = conn->get_output_stream();
-
-	istream = conn->get_input_stream();
-	m_connections.push_back(uartconn);
-	m_connected.emit(uartconn.m_address);
-
-	/* Disable local echo */
-	uartconn.m_ostream->write("\xFF\xFB\x01\xFF\xFB\x03");
-	uartconn.m_ostream->write(fmt::format("==> Connected to {} {} <==\r\n",
-	    m_device.description, m_device.serial));
-
-	for (;;) {
-		try {
-			ret = istream->read(buffer, sizeof(buffer),
-			    uartconn.m_cancel);
-			if (ret <= 0)
-				break;
-		} catch (const Gio::Error &err) {
-			Logger::warning("UART: I/O error: {}", err.what());
-			break;
-		}
-
-		Logger::debug("UART: read {} bytes from socket", ret);
-
-		written = m_context.write(buffer, ret);
-		if (written != ret) {
-			Logger::error("UART: read {} bytes, written {} bytes",
-			    ret, written);
-		}
+		Logger::error("{}", err.what());
+		return;
 	}
 
-	Logger::info("UART: connection from {} ended",
-	    uartconn.m_address->to_string());
-
-	remove_connection(uartconn);
-	return (false);
+	m_uart->m_connected.connect(m_connected.make_slot());
+	m_uart->m_disconnected.connect(m_disconnected.make_slot());
 }
 
 
 void
-SerialCmdLine::remove_connection(const UartConnection &conn)
+SerialCmdLine::device_changed(const Device &device, bool present)
 {
-	auto it = std::find(m_connections.begin(),
-	    m_connections.end(), conn);
-
-	if (it != m_connections.end()) {
-		m_disconnected.emit(conn.m_conn->get_remote_address());
-		m_connections.erase(it);
+	if (!present && m_uart) {
+		Logger::warning("UART: {} disconnected, stopping",
+		    m_device.serial);
+		m_uart.reset();
+	} else if (present && !m_uart) {
+		Logger::info("UART: {} connected, starting", device.serial);
+		m_device = device;
+		open();
+		start();
 	}
 }
 
 
 void
-SerialCmdLine::usb_worker()
+SerialCmdLine::start(void)
 {
-	uint8_t buffer[BUFSIZE];
-	int ret;
-
-	Logger::debug("UART: USB thread started");
+	if (!m_uart)
+		return;
 
-	for (;;) {
-		ret = m_context.read(buffer, sizeof(buffer));
-		if (ret < 0 || !m_running) {
-			fmt::print("ret: {:d}\n", ret);
-			break;
-		}
-		if (ret == 0)
-			continue;
-
-		Logger::debug("read {} bytes from USB", ret);
-
-		for (auto &i: m_connections) {
-			try {
-				i.m_ostream->write(buffer, ret);
-			} catch (const Gio::Error &err) {
-				Logger::warning(
-				    "UART: error sending data to {}: {}",
-				    i.m_conn->get_remote_address()->to_string(),
-				    err.what());
-				remove_connection(i);
-				continue;
-			}
-		}
+	try {
+		m_uart->start();
+	} catch (const std::runtime_error &err) {
+		Logger::warning("UART: I/O error: {}", err.what());
 	}
-
-	Logger::debug("UART: USB thread stopped");
 }
 
 
@@ -190,11 +142,45 @@ JtagCmdLine::JtagCmdLine(const Device &device, Glib::RefPtr<Gio::InetAddress> ad
     m_board_script(board_script),
     m_running(false)
 {
-	m_server = std::make_shared<JtagServer>(device, address, gdb_port, ocd_port, board_script);
+	m_watch = std::make_unique<DeviceWatch>(device.serial,
+	    [this](const Device &device, bool present) {
+		device_changed(device, present);
+	    });
+
+	open();
+}
+
+
+void
+JtagCmdLine::open()
+{
+	m_server = std::make_shared<JtagServer>(m_device, m_address, m_gdb_port, m_ocd_port, m_board_script);
 	m_server->on_output_produced.connect(sigc::mem_fun(*this, &JtagCmdLine::on_output_ready));
 }
 
 
+void
+JtagCmdLine::device_changed(const Device &device, bool present)
+{
+	if (!present && m_server) {
+		Logger::warning("JTAG: {} disconnected, stopping",
+		    m_device.serial);
+		m_server.reset();
+	} else if (present && !m_server) {
+		Logger::info("JTAG: {} connected, starting", device.serial);
+		m_device = device;
+		open();
+
+		try {
+			m_server->start();
+		} catch (const std::exception &err) {
+			Logger::error("JTAG: {}", err.what());
+			m_server.reset();
+		}
+	}
+}
+
+
 JtagCmdLine::JtagCmdLine(const Device &device) :
     m_device(device)
 {
@@ -202,29 +188,33 @@ JtagCmdLine::JtagCmdLine(const Device &device) :
 
 
 void
-JtagCmdLine::bypass(const Device &device)
+JtagCmdLine::bypass(const Device &device, const ChannelTuning &tuning)
 {
-	Ftdi::Context context;
-
-	context.set_interface(INTERFACE_B);
+	std::unique_ptr<Transport> transport = Transport::create(device);
 
-	if (context.open(device.vid, device.pid, device.description,
-	    device.serial) != 0) {
+	if (transport->open(device, INTERFACE_B) != 0) {
 		Logger::error("Failed to open device.");
 		return;
 	}
 
-	if (context.reset() != 0) {
+	if (transport->reset() != 0) {
 		Logger::error("Failed to reset channel");
 		return;
 	}
 
-	if (context.set_bitmode(0xff, BITMODE_RESET) != 0) {
+	try {
+		tuning.apply(*transport, "JTAG");
+	} catch (const std::runtime_error &err) {
+		Logger::error("{}", err.what());
+		return;
+	}
+
+	if (transport->set_bitmode(0xff, BITMODE_RESET) != 0) {
 		Logger::error("Failed to set BITMODE_RESET");
 		return;
 	}
 
-	if (context.set_bitmode(0, BITMODE_BITBANG) != 0)
+	if (transport->set_bitmode(0, BITMODE_BITBANG) != 0)
 	{
 		Logger::error("Failed to set BITMODE_BITBANG");
 		return;
@@ -232,5 +222,5 @@ JtagCmdLine::bypass(const Device &device)
 
 	Logger::info("Bypass mode enabled.");
 
-	context.close();
+	transport->close();
 }
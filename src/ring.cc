@@ -0,0 +1,280 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <ring.hh>
+
+/*
+ * Writes go through two counters: m_reserve is moved forward before
+ * the bytes are stored and m_head after. A reader that checks
+ * m_reserve once it has used its data can tell whether the producer
+ * got to any of those bytes in the meantime.
+ */
+
+ByteRing::ByteRing(size_t capacity):
+	m_head(0),
+	m_reserve(0)
+{
+	size_t size = 1;
+
+	while (size < capacity)
+		size <<= 1;
+
+	m_buffer.resize(size);
+	m_mask = size - 1;
+}
+
+void
+ByteRing::write(const uint8_t *buf, size_t len)
+{
+	uint64_t head;
+	uint8_t *ptr;
+	size_t chunk;
+
+	/* Only the last capacity bytes could ever be read back */
+	if (len > m_buffer.size()) {
+		head = m_head.load(std::memory_order_relaxed);
+		m_reserve.store(head + len, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		m_head.store(head + len - m_buffer.size(),
+		    std::memory_order_release);
+		buf += len - m_buffer.size();
+		len = m_buffer.size();
+	}
+
+	while (len > 0) {
+		chunk = len;
+		ptr = reserve(chunk);
+		std::memcpy(ptr, buf, chunk);
+		commit(chunk);
+		buf += chunk;
+		len -= chunk;
+	}
+}
+
+uint8_t *
+ByteRing::reserve(size_t &len)
+{
+	uint64_t head = m_head.load(std::memory_order_relaxed);
+	size_t offset = head & m_mask;
+
+	len = std::min(len, m_buffer.size() - offset);
+
+	/* Never move the reservation back over a larger earlier one */
+	if (head + len > m_reserve.load(std::memory_order_relaxed)) {
+		m_reserve.store(head + len, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	return (&m_buffer[offset]);
+}
+
+void
+ByteRing::commit(size_t len)
+{
+	if (len == 0)
+		return;
+
+	m_head.store(m_head.load(std::memory_order_relaxed) + len,
+	    std::memory_order_release);
+
+	/* Readers only hold the lock to check the head, never for I/O */
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+	}
+
+	m_cond.notify_all();
+}
+
+uint64_t
+ByteRing::head() const
+{
+	return (m_head.load(std::memory_order_acquire));
+}
+
+size_t
+ByteRing::capacity() const
+{
+	return (m_buffer.size());
+}
+
+bool
+ByteRing::wait(uint64_t cursor, std::chrono::milliseconds timeout)
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+
+	return (m_cond.wait_for(lock, timeout, [&] {
+		return (head() > cursor);
+	}));
+}
+
+void
+ByteRing::wake()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+	}
+
+	m_cond.notify_all();
+}
+
+RingReader::RingReader(ByteRing &ring, size_t history):
+	m_ring(ring),
+	m_cursor(ring.head()),
+	m_lost(0)
+{
+	/* Stay clear of the part the producer may be overwriting */
+	m_cursor -= std::min<uint64_t>({history, m_cursor,
+	    ring.capacity() / 2});
+}
+
+size_t
+RingReader::read(uint8_t *buf, size_t len, size_t &skipped)
+{
+	size_t count = copy(buf, len, skipped);
+
+	m_cursor += count;
+	return (count);
+}
+
+size_t
+RingReader::copy(uint8_t *buf, size_t len, size_t &skipped)
+{
+	uint64_t head;
+	uint64_t reserve;
+	size_t capacity = m_ring.capacity();
+	size_t count;
+	size_t offset;
+	size_t first;
+
+	skipped = 0;
+
+	for (;;) {
+		/* The cursor can be ahead of a write still in progress */
+		head = m_ring.head();
+		if (head <= m_cursor)
+			return (0);
+
+		count = std::min<uint64_t>(len, head - m_cursor);
+		offset = m_cursor & m_ring.m_mask;
+		first = std::min(count, capacity - offset);
+
+		std::memcpy(buf, &m_ring.m_buffer[offset], first);
+		std::memcpy(buf + first, &m_ring.m_buffer[0], count - first);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		reserve = m_ring.m_reserve.load(std::memory_order_relaxed);
+
+		if (reserve - m_cursor <= capacity)
+			return (count);
+
+		skip(reserve, skipped);
+	}
+}
+
+size_t
+RingReader::peek(struct iovec *iov, int &iovcnt, size_t len,
+    size_t &skipped)
+{
+	uint64_t head;
+	uint64_t reserve;
+	size_t capacity = m_ring.capacity();
+	size_t count;
+	size_t offset;
+	size_t first;
+
+	skipped = 0;
+	iovcnt = 0;
+
+	head = m_ring.head();
+	if (head <= m_cursor)
+		return (0);
+
+	/*
+	 * Keep a quarter of the ring between the data handed out and the
+	 * producer, so that it is unlikely to change while it is looked at.
+	 */
+	reserve = m_ring.m_reserve.load(std::memory_order_relaxed);
+	if (reserve - m_cursor > capacity - capacity / 4)
+		skip(reserve, skipped);
+
+	if (head <= m_cursor)
+		return (0);
+
+	count = std::min<uint64_t>(len, head - m_cursor);
+	offset = m_cursor & m_ring.m_mask;
+	first = std::min(count, capacity - offset);
+
+	iov[iovcnt].iov_base = &m_ring.m_buffer[offset];
+	iov[iovcnt].iov_len = first;
+	iovcnt++;
+
+	if (count > first) {
+		iov[iovcnt].iov_base = &m_ring.m_buffer[0];
+		iov[iovcnt].iov_len = count - first;
+		iovcnt++;
+	}
+
+	return (count);
+}
+
+void
+RingReader::consume(size_t len)
+{
+	m_cursor += len;
+}
+
+/*
+ * Lapped: resume half a ring behind the producer so that the next copy
+ * has a chance to finish before it catches up.
+ */
+void
+RingReader::skip(uint64_t reserve, size_t &skipped)
+{
+	uint64_t oldest = reserve - m_ring.capacity() / 2;
+
+	if (oldest <= m_cursor)
+		return;
+
+	skipped += oldest - m_cursor;
+	m_lost += oldest - m_cursor;
+	m_cursor = oldest;
+}
+
+uint64_t
+RingReader::cursor() const
+{
+	return (m_cursor);
+}
+
+uint64_t
+RingReader::lost() const
+{
+	return (m_lost);
+}
@@ -0,0 +1,185 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <ftdi.hpp>
+#include <libusb.h>
+#include <ftsim.hh>
+#include <transport.hh>
+
+std::unique_ptr<Transport>
+Transport::create(const Device &device)
+{
+	if (device.simulated)
+		return (std::make_unique<SimTransport>());
+
+	return (std::make_unique<FtdiTransport>());
+}
+
+int
+FtdiTransport::open(const Device &device, enum ftdi_interface channel)
+{
+	m_context.set_interface(channel);
+	return (m_context.open(device.vid, device.pid, device.description,
+	    device.serial));
+}
+
+int
+FtdiTransport::close()
+{
+	return (m_context.close());
+}
+
+int
+FtdiTransport::reset()
+{
+	return (m_context.reset());
+}
+
+int
+FtdiTransport::set_bitmode(uint8_t mask, uint8_t mode)
+{
+	return (m_context.set_bitmode(mask, mode));
+}
+
+int
+FtdiTransport::bitbang_disable()
+{
+	return (m_context.bitbang_disable());
+}
+
+int
+FtdiTransport::set_baud_rate(int baudrate)
+{
+	return (m_context.set_baud_rate(baudrate));
+}
+
+int
+FtdiTransport::baud_rate()
+{
+	/* libftdi stores the rate the divisor really produces */
+	return (m_context.context()->baudrate);
+}
+
+int
+FtdiTransport::set_line_property(enum ftdi_bits_type bits,
+    enum ftdi_stopbits_type stop, enum ftdi_parity_type parity)
+{
+	return (m_context.set_line_property(bits, stop, parity));
+}
+
+int
+FtdiTransport::set_flow_control(int flow, uint8_t xon, uint8_t xoff)
+{
+	struct ftdi_context *ctx = m_context.context();
+	int ret;
+
+	if (flow != SIO_XON_XOFF_HS)
+		return (m_context.set_flow_control(flow));
+
+	/* libftdi can't pass the XON/XOFF characters, so ask the chip directly */
+	ret = libusb_control_transfer(ctx->usb_dev,
+	    LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE |
+	    LIBUSB_ENDPOINT_OUT, SIO_SET_FLOW_CTRL_REQUEST,
+	    (xoff << 8) | xon, SIO_XON_XOFF_HS | ctx->index,
+	    nullptr, 0, ctx->usb_write_timeout);
+	/* Where libftdi keeps its own, so the next failure replaces it */
+	if (ret < 0) {
+		ctx->error_str = libusb_error_name(ret);
+		return (ret);
+	}
+
+	return (0);
+}
+
+int
+FtdiTransport::set_latency(int latency)
+{
+	return (m_context.set_latency(latency));
+}
+
+int
+FtdiTransport::latency()
+{
+	return (m_context.latency());
+}
+
+int
+FtdiTransport::set_read_chunk_size(int size)
+{
+	return (m_context.set_read_chunk_size(size));
+}
+
+int
+FtdiTransport::read_chunk_size()
+{
+	return (m_context.read_chunk_size());
+}
+
+int
+FtdiTransport::set_write_chunk_size(int size)
+{
+	return (m_context.set_write_chunk_size(size));
+}
+
+int
+FtdiTransport::write_chunk_size()
+{
+	return (m_context.write_chunk_size());
+}
+
+int
+FtdiTransport::write(const uint8_t *buf, size_t len)
+{
+	return (m_context.write(buf, len));
+}
+
+int
+FtdiTransport::read(uint8_t *buf, size_t len)
+{
+	return (m_context.read(buf, len));
+}
+
+int
+FtdiTransport::read_pins(uint8_t *pins)
+{
+	return (m_context.read_pins(pins));
+}
+
+std::string
+FtdiTransport::error_string()
+{
+	return (m_context.error_string());
+}
+
+std::unique_ptr<Receiver>
+FtdiTransport::receiver(ByteRing &ring, size_t depth, size_t chunk,
+    EventLoop *loop)
+{
+	return (std::make_unique<UsbReceiver>(m_context.context(), ring,
+	    depth, chunk, loop));
+}
@@ -0,0 +1,140 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <fmt/format.h>
+#include <log.hh>
+#include <tuning.hh>
+
+static const char *channel_names[] = { "uart", "i2c", "jtag", "gpio" };
+
+void
+ChannelTuning::apply(Transport &transport, const std::string &name) const
+{
+	if (latency >= 0 && transport.set_latency(latency) != 0) {
+		throw std::runtime_error(fmt::format(
+		    "Failed to set {} latency timer: {}", name,
+		    transport.error_string()));
+	}
+
+	if (read_chunk > 0 && transport.set_read_chunk_size(read_chunk) != 0) {
+		throw std::runtime_error(fmt::format(
+		    "Failed to set {} read chunk size: {}", name,
+		    transport.error_string()));
+	}
+
+	if (write_chunk > 0 &&
+	    transport.set_write_chunk_size(write_chunk) != 0) {
+		throw std::runtime_error(fmt::format(
+		    "Failed to set {} write chunk size: {}", name,
+		    transport.error_string()));
+	}
+
+	if (latency >= 0 || read_chunk > 0 || write_chunk > 0) {
+		Logger::debug("{}: latency timer {} ms, read chunk {}, "
+		    "write chunk {}", name, transport.latency(),
+		    transport.read_chunk_size(), transport.write_chunk_size());
+	}
+}
+
+void
+ChannelTuning::set(const std::string &key, int value)
+{
+	if (key == "latency") {
+		if (value < 1 || value > 255) {
+			throw std::runtime_error(fmt::format(
+			    "Latency timer must be 1 to 255 ms, got {}", value));
+		}
+
+		latency = value;
+		return;
+	}
+
+	if (value <= 0) {
+		throw std::runtime_error(fmt::format(
+		    "Chunk size must be positive, got {}", value));
+	}
+
+	if (key == "read_chunk")
+		read_chunk = value;
+	else if (key == "write_chunk")
+		write_chunk = value;
+	else {
+		throw std::runtime_error(fmt::format(
+		    "Unknown tuning parameter '{}'", key));
+	}
+}
+
+ChannelTuning &
+ChannelTuning::channel(const std::string &name)
+{
+	static std::map<std::string, ChannelTuning> channels;
+
+	for (const char *i: channel_names) {
+		if (name == i)
+			return (channels[name]);
+	}
+
+	throw std::runtime_error(fmt::format("Unknown channel '{}'", name));
+}
+
+void
+ChannelTuning::parse(const std::string &spec)
+{
+	std::string::size_type colon = spec.find(':');
+	std::string::size_type equals;
+	std::istringstream items;
+	std::string item;
+	ChannelTuning *tuning;
+
+	if (colon == std::string::npos) {
+		throw std::runtime_error(fmt::format(
+		    "Invalid tuning '{}', expected channel:key=value", spec));
+	}
+
+	tuning = &channel(spec.substr(0, colon));
+	items.str(spec.substr(colon + 1));
+
+	while (std::getline(items, item, ',')) {
+		equals = item.find('=');
+		if (equals == std::string::npos) {
+			throw std::runtime_error(fmt::format(
+			    "Invalid tuning '{}', expected key=value", item));
+		}
+
+		try {
+			tuning->set(item.substr(0, equals),
+			    std::stoi(item.substr(equals + 1)));
+		} catch (const std::logic_error &err) {
+			throw std::runtime_error(fmt::format(
+			    "Invalid value in '{}'", item));
+		}
+	}
+}
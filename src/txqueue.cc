@@ -0,0 +1,202 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <algorithm>
+#include <log.hh>
+#include <txqueue.hh>
+
+TxQueue::TxQueue(const Writer &writer, size_t low, size_t high):
+	m_writer(writer),
+	m_low(low),
+	m_high(std::max(low, high)),
+	m_flush_size(TXQUEUE_FLUSH_SIZE),
+	m_flush_delay(TXQUEUE_FLUSH_DELAY),
+	m_stalled(false),
+	m_running(false),
+	m_written(0),
+	m_writes(0)
+{
+}
+
+TxQueue::~TxQueue()
+{
+	stop();
+}
+
+void
+TxQueue::start()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	if (m_running)
+		return;
+
+	m_running = true;
+	m_thread = std::thread(&TxQueue::worker, this);
+}
+
+void
+TxQueue::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		if (!m_running)
+			return;
+
+		m_running = false;
+	}
+
+	m_cond.notify_all();
+	m_thread.join();
+}
+
+void
+TxQueue::push(const uint8_t *buf, size_t len)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	bool wakeup;
+
+	/* The worker only needs to hear about the start of a batch or its end */
+	wakeup = m_queue.empty() ||
+	    (m_queue.size() < m_flush_size &&
+	    m_queue.size() + len >= m_flush_size);
+
+	if (m_queue.empty())
+		m_oldest = std::chrono::steady_clock::now();
+
+	m_queue.insert(m_queue.end(), buf, buf + len);
+
+	if (!m_stalled && m_queue.size() >= m_high) {
+		m_stalled = true;
+		if (m_pressure)
+			m_pressure(true);
+	}
+
+	if (wakeup)
+		m_cond.notify_all();
+}
+
+void
+TxQueue::set_ready(const Ready &ready)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	m_ready = ready;
+}
+
+void
+TxQueue::set_pressure(const Pressure &pressure)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	m_pressure = pressure;
+}
+
+void
+TxQueue::set_coalesce(size_t flush_size, std::chrono::microseconds delay)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	m_flush_size = std::max<size_t>(flush_size, 1);
+	m_flush_delay = delay;
+	m_cond.notify_all();
+}
+
+size_t
+TxQueue::pending()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	return (m_queue.size());
+}
+
+TxQueueStats
+TxQueue::stats() const
+{
+	TxQueueStats ret;
+
+	ret.bytes = m_written;
+	ret.writes = m_writes;
+	return (ret);
+}
+
+void
+TxQueue::worker()
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+	std::chrono::steady_clock::time_point deadline;
+	std::vector<uint8_t> batch;
+	size_t len;
+	int ret;
+
+	while (m_running) {
+		if (m_queue.empty()) {
+			m_cond.wait(lock);
+			continue;
+		}
+
+		/* Device signalled stop, hold the data until it resumes */
+		if (m_ready && !m_ready()) {
+			m_cond.wait_for(lock, TXQUEUE_READY_POLL);
+			continue;
+		}
+
+		/* Give short writes a moment to pile up into a full packet */
+		if (m_queue.size() < m_flush_size) {
+			deadline = m_oldest + m_flush_delay;
+			if (std::chrono::steady_clock::now() < deadline) {
+				m_cond.wait_until(lock, deadline);
+				continue;
+			}
+		}
+
+		len = std::min(m_queue.size(), static_cast<size_t>(TXQUEUE_BATCH));
+		batch.assign(m_queue.begin(), m_queue.begin() + len);
+		m_queue.erase(m_queue.begin(), m_queue.begin() + len);
+		lock.unlock();
+
+		ret = m_writer(batch.data(), batch.size());
+		m_writes++;
+		if (ret != static_cast<int>(batch.size())) {
+			Logger::error("TX: queued {} bytes, written {} bytes",
+			    batch.size(), ret);
+		}
+
+		if (ret > 0)
+			m_written += ret;
+
+		lock.lock();
+
+		if (m_stalled && m_queue.size() <= m_low) {
+			m_stalled = false;
+			if (m_pressure)
+				m_pressure(false);
+		}
+	}
+}
@@ -26,62 +26,292 @@
  *
  */
 
+#include <algorithm>
+#include <cctype>
 #include <ftdi.hpp>
 #include <log.hh>
 #include <utils.hh>
 #include <uart.hh>
 #include <gtkmm.h>
 
-#define BUFSIZE		4096
+UartOptions
+UartOptions::for_baudrate(int baudrate)
+{
+	return (for_baudrate(baudrate, ChannelTuning::channel("uart")));
+}
 
-Uart::Uart(const Device &device, const Glib::RefPtr<Gio::SocketAddress> &addr,
-    int baudrate)
+UartOptions
+UartOptions::for_baudrate(int baudrate, const ChannelTuning &tuning)
 {
-	Glib::RefPtr<Gio::SocketAddress> retaddr;
+	UartOptions ret;
+	size_t bytes_per_second = std::max(baudrate, 0) / 10;
+
+	/*
+	 * Slow lines are interactive consoles: keep echo snappy with a
+	 * short latency timer and small transfers. Fast lines carry bulk
+	 * streams, where deeper queues of larger transfers keep the chip
+	 * FIFO drained and the ring has to cover a few seconds of data.
+	 */
+	if (baudrate <= 115200) {
+		ret.latency = 4;
+		ret.rx_depth = 4;
+		ret.rx_chunk = 4096;
+	} else if (baudrate <= 1000000) {
+		ret.latency = 2;
+		ret.rx_depth = 8;
+		ret.rx_chunk = 16 * 1024;
+	} else {
+		ret.latency = 1;
+		ret.rx_depth = 16;
+		ret.rx_chunk = 64 * 1024;
+	}
 
-	m_running = false;
-	m_context.set_interface(INTERFACE_C);
-	m_device = device;
+	ret.ring_size = std::max<size_t>(UART_RING_SIZE,
+	    bytes_per_second * UART_RING_SECONDS);
 
-	if (m_context.open(device.vid, device.pid, device.description,
-	    device.serial) != 0) {
-		show_centered_dialog("Failed to open device.");
-		return;
+	/* Reads are the queued bulk-in transfers on this channel */
+	if (tuning.latency >= 0)
+		ret.latency = tuning.latency;
+
+	if (tuning.read_chunk > 0)
+		ret.rx_chunk = tuning.read_chunk;
+
+	ret.write_chunk = tuning.write_chunk;
+	return (ret);
+}
+
+void
+UartOptions::set_format(const std::string &format)
+{
+	std::string stop;
+
+	if (format.size() < 3)
+		throw std::runtime_error(fmt::format(
+		    "Invalid line format '{}'", format));
+
+	switch (format[0]) {
+	case '7':
+		data_bits = BITS_7;
+		break;
+	case '8':
+		data_bits = BITS_8;
+		break;
+	default:
+		throw std::runtime_error(fmt::format(
+		    "Unsupported number of data bits in '{}'", format));
 	}
 
-	if (m_context.reset() != 0) {
-		show_centered_dialog("Failed to reset UART channel");
-		return;
+	switch (std::toupper(format[1])) {
+	case 'N':
+		parity = NONE;
+		break;
+	case 'O':
+		parity = ODD;
+		break;
+	case 'E':
+		parity = EVEN;
+		break;
+	case 'M':
+		parity = MARK;
+		break;
+	case 'S':
+		parity = SPACE;
+		break;
+	default:
+		throw std::runtime_error(fmt::format(
+		    "Unsupported parity in '{}'", format));
 	}
-	
-	if (m_context.set_bitmode(0xff, BITMODE_RESET) != 0) {
-		show_centered_dialog("Failed to reset bitmode.");
-		return;
+
+	stop = format.substr(2);
+	if (stop == "1")
+		stop_bits = STOP_BIT_1;
+	else if (stop == "1.5" || stop == "15")
+		stop_bits = STOP_BIT_15;
+	else if (stop == "2")
+		stop_bits = STOP_BIT_2;
+	else {
+		throw std::runtime_error(fmt::format(
+		    "Unsupported number of stop bits in '{}'", format));
 	}
+}
 
-	if (m_context.bitbang_disable() != 0) {
-		show_centered_dialog("Failed to set bitbang_disable.");
-		return;
+void
+UartOptions::set_flow(const std::string &name)
+{
+	if (name == "none")
+		flow = SIO_DISABLE_FLOW_CTRL;
+	else if (name == "rtscts")
+		flow = SIO_RTS_CTS_HS;
+	else if (name == "dtrdsr")
+		flow = SIO_DTR_DSR_HS;
+	else if (name == "xonxoff")
+		flow = SIO_XON_XOFF_HS;
+	else {
+		throw std::runtime_error(fmt::format(
+		    "Unknown flow control '{}'", name));
 	}
+}
 
-	if (m_context.set_baud_rate(baudrate) != 0) {
-		show_centered_dialog("Failed to set the baud rate.");
-		return;
+std::string
+UartOptions::format_name() const
+{
+	const char *parities = "NOEMS";
+	const char *stops[] = { "1", "1.5", "2" };
+
+	return (fmt::format("{}{}{}", static_cast<int>(data_bits),
+	    parities[parity], stops[stop_bits]));
+}
+
+std::string
+UartOptions::flow_name() const
+{
+	switch (flow) {
+	case SIO_RTS_CTS_HS:
+		return ("rtscts");
+	case SIO_DTR_DSR_HS:
+		return ("dtrdsr");
+	case SIO_XON_XOFF_HS:
+		return ("xonxoff");
+	default:
+		return ("none");
+	}
+}
+
+static Glib::RefPtr<Gio::SocketAddress>
+client_address(const ConsoleClient &client)
+{
+	return (Gio::SocketAddress::create(
+	    const_cast<struct sockaddr_storage *>(&client.m_address),
+	    client.m_address_len));
+}
+
+Uart::Uart(const Device &device, const Glib::RefPtr<Gio::SocketAddress> &addr,
+    int baudrate, const UartOptions &options, std::shared_ptr<EventLoop> loop):
+	m_options(options),
+	m_loop(loop),
+	m_own_loop(loop == nullptr),
+	m_ring(std::max(options.ring_size, options.scrollback * 2))
+{
+	struct sockaddr_storage native;
+	BaudRate rate = BaudRate::compute(baudrate);
+	MetricLabels usb_labels;
+	Metrics *metrics;
+
+	m_running = false;
+	m_transport = Transport::create(device);
+	m_device = device;
+
+	if (!rate.valid()) {
+		throw std::runtime_error(fmt::format(
+		    "Unsupported baud rate {} (nearest possible is {})",
+		    baudrate, rate.actual));
 	}
 
+	if (m_transport->open(device, INTERFACE_C) != 0)
+		throw std::runtime_error("Failed to open device.");
+
+	if (m_transport->reset() != 0)
+		throw std::runtime_error("Failed to reset UART channel");
+
+	if (m_transport->set_bitmode(0xff, BITMODE_RESET) != 0)
+		throw std::runtime_error("Failed to reset bitmode.");
+
+	if (m_transport->bitbang_disable() != 0)
+		throw std::runtime_error("Failed to set bitbang_disable.");
+
+	if (m_transport->set_baud_rate(baudrate) != 0)
+		throw std::runtime_error("Failed to set the baud rate.");
+
+	if (m_transport->set_line_property(m_options.data_bits,
+	    m_options.stop_bits, m_options.parity) != 0)
+		throw std::runtime_error("Failed to set the line properties.");
+
+	set_flow_control();
+
+	if (m_transport->set_latency(m_options.latency) != 0)
+		throw std::runtime_error("Failed to set the latency timer.");
+
+	if (m_options.write_chunk > 0 &&
+	    m_transport->set_write_chunk_size(m_options.write_chunk) != 0)
+		throw std::runtime_error("Failed to set the write chunk size.");
+
+	m_actual_baudrate = m_transport->baud_rate();
+	Logger::info("UART: requested {} baud, running at {} baud ({:+.2f}%), "
+	    "{}, flow control {}, latency timer {} ms", baudrate,
+	    m_actual_baudrate, rate.error() * 100, m_options.format_name(),
+	    m_options.flow_name(), m_options.latency);
+
 	try {
-		m_socket_service = Gio::ThreadedSocketService::create(10);
-		m_socket_service->add_address(
-		    addr,
-		    Gio::SocketType::SOCKET_TYPE_STREAM,
-		    Gio::SocketProtocol::SOCKET_PROTOCOL_TCP,
-		    retaddr);
+		addr->to_native(&native, sizeof(native));
 	} catch (const Glib::Exception &err) {
 		throw std::runtime_error(err.what());
 	}
 
-	m_socket_service->signal_run().connect(sigc::mem_fun(*this,
-	    &Uart::socket_worker));
+	if (m_own_loop)
+		m_loop = std::make_shared<EventLoop>();
+
+	m_server = std::make_unique<ConsoleServer>(*m_loop, m_ring,
+	    reinterpret_cast<struct sockaddr *>(&native),
+	    addr->get_native_size());
+
+	m_server->set_scrollback(m_options.scrollback);
+	m_server->set_metrics({ { "serial", m_device.serial } });
+
+	metrics = &Metrics::instance();
+	usb_labels = { { "serial", m_device.serial }, { "channel", "uart" } };
+	m_rx_metrics.read_sizes = metrics->histogram("devclient_usb_read_bytes",
+	    "Payload bytes per completed USB read", METRICS_SIZE_BUCKETS,
+	    usb_labels);
+	m_rx_metrics.overruns = metrics->counter("devclient_uart_overruns_total",
+	    "USB packets flagged with an FTDI receive FIFO overrun",
+	    { { "serial", m_device.serial } });
+	m_rx_metrics.dropped = metrics->counter(
+	    "devclient_uart_dropped_bytes_total",
+	    "Console bytes lost with failed USB reads",
+	    { { "serial", m_device.serial } });
+	m_tx_bytes = metrics->counter("devclient_uart_tx_bytes_total",
+	    "Bytes written to the UART from its clients",
+	    { { "serial", m_device.serial } });
+	m_write_errors = metrics->counter("devclient_usb_write_errors_total",
+	    "USB writes that failed or came up short", usb_labels);
+	m_write_time = metrics->histogram("devclient_usb_write_seconds",
+	    "Time spent in one USB write", METRICS_LATENCY_BUCKETS, usb_labels);
+
+	/* Disable local echo */
+	m_server->set_greeting(fmt::format(
+	    "\xFF\xFB\x01\xFF\xFB\x03==> Connected to {} {} <==\r\n",
+	    m_device.description, m_device.serial));
+
+	if (!m_options.capture_path.empty()) {
+		m_capture = std::make_unique<CaptureWriter>(
+		    m_options.capture_path, m_ring);
+	}
+
+	m_tx = std::make_unique<TxQueue>([this](const uint8_t *buf, size_t len) {
+		return (write(buf, len));
+	}, UART_TX_LOW_WATER, UART_TX_HIGH_WATER);
+
+	m_tx->set_coalesce(m_options.tx_flush_size, m_options.tx_flush_delay);
+	m_tx->set_ready([this] { return (tx_ready()); });
+
+	/* Stop reading client sockets while the chip can't keep up */
+	m_tx->set_pressure([this](bool stalled) {
+		Logger::debug("UART: transmit queue {}",
+		    stalled ? "full, pausing clients" : "drained");
+		m_server->pause_input(stalled);
+	});
+
+	m_server->m_input = [this](const uint8_t *buf, size_t len) {
+		client_input(buf, len);
+	};
+
+	m_server->m_connected = [this](const ConsoleClient &client) {
+		m_connected.emit(client_address(client));
+	};
+
+	m_server->m_disconnected = [this](const ConsoleClient &client) {
+		m_disconnected.emit(client_address(client));
+	};
 
 	Logger::info("UART: listening on {}", addr->to_string());
 }
@@ -97,14 +327,38 @@ Uart::start()
 	if (m_running)
 		return;
 
+	m_running = true;
+
 	try {
-		m_socket_service->start();
-		m_usb_worker = std::thread(&Uart::usb_worker, this);
+		if (m_own_loop)
+			m_loop->start();
+
+		m_server->start();
+
+		if (m_capture)
+			m_capture->start();
+
+		/*
+		 * A standalone UART keeps USB completions on a thread of
+		 * their own, next to a shared loop they take no thread.
+		 */
+		m_receiver = m_transport->receiver(m_ring, m_options.rx_depth,
+		    m_options.rx_chunk, m_own_loop ? nullptr : m_loop.get());
+		m_receiver->set_notify([this] { m_server->notify(); });
+		m_receiver->set_metrics(m_rx_metrics);
+		m_receiver->start();
+		m_tx->start();
 	} catch (const std::exception &err) {
+		m_running = false;
+		m_tx->stop();
+		m_receiver.reset();
+		if (m_capture)
+			m_capture->stop();
+
+		m_server->stop();
 		throw std::runtime_error(err.what());
 	}
 
-	m_running = true;
 	Logger::debug("UART: started");
 }
 
@@ -114,115 +368,107 @@ Uart::stop()
 	if (!m_running)
 		return;
 
-	for (auto &i: m_connections)
-		i.m_cancel->cancel();
-
 	m_running = false;
-	m_socket_service->stop();
-	m_socket_service->close();
-	m_context.close();
-	m_usb_worker.join();
+	m_server->stop();
+	m_tx->stop();
+	m_receiver.reset();
+	if (m_capture)
+		m_capture->stop();
+
+	m_transport->close();
+
+	if (m_own_loop)
+		m_loop->stop();
+
 	Logger::debug("UART: stopped");
 }
 
 void
-Uart::usb_worker()
+Uart::set_lag_policy(RingLagPolicy policy)
 {
-	uint8_t buffer[BUFSIZE];
-	int ret;
+	m_server->set_lag_policy(policy);
+}
 
-	Logger::debug("UART: USB thread started");
-
-	for (;;) {
-		ret = m_context.read(buffer, sizeof(buffer));
-		if (ret < 0 || !m_running)
-			break;
-
-		if (ret == 0)
-			continue;
-
-		Logger::debug("read {} bytes from USB", ret);
-
-		for (auto &i: m_connections) {
-			try {
-				i.m_ostream->write(buffer, ret);
-			} catch (const Gio::Error &err) {
-				Logger::warning(
-				    "UART: error sending data to {}: {}",
-				    i.m_conn->get_remote_address()->to_string(),
-				    err.what());
-				remove_connection(i);
-				continue;
-			}
-		}
-	}
+int
+Uart::actual_baudrate() const
+{
+	return (m_actual_baudrate);
+}
 
-	Logger::debug("UART: USB thread stopped");
+UsbReceiverStats
+Uart::rx_stats() const
+{
+	if (!m_receiver)
+		return (UsbReceiverStats());
+
+	return (m_receiver->stats());
 }
 
-bool
-Uart::socket_worker(const Glib::RefPtr<Gio::SocketConnection> &conn,
-    const Glib::RefPtr<Glib::Object> &source)
+TxQueueStats
+Uart::tx_stats() const
+{
+	return (m_tx->stats());
+}
+
+void
+Uart::client_input(const uint8_t *buf, size_t len)
 {
-	UartConnection uartconn;
-	Glib::RefPtr<Gio::InputStream> istream;
-	uint8_t buffer[BUFSIZE];
-	ssize_t ret;
-	int written;
+	m_tx->push(buf, len);
+}
+
+void
+Uart::set_flow_control()
+{
+	if (m_transport->set_flow_control(m_options.flow, UART_XON,
+	    UART_XOFF) != 0) {
+		throw std::runtime_error(fmt::format(
+		    "Failed to set flow control: {}",
+		    m_transport->error_string()));
+	}
+}
 
-	Logger::info("UART: accepted connection from {}",
-	    conn->get_remote_address()->to_string());
+/* Runs on the transmit queue thread */
+int
+Uart::write(const uint8_t *buf, size_t len)
+{
+	std::chrono::steady_clock::time_point start;
+	int ret;
 
-	uartconn.m_address = conn->get_remote_address();
-	uartconn.m_address->reference();
-	uartconn.m_cancel = Gio::Cancellable::create();
-	uartconn.m_conn = conn;
-	uartconn.m_ostream = conn->get_output_stream();
+	if (m_capture && m_options.capture_tx)
+		m_capture->write_tx(buf, len);
 
-	istream = conn->get_input_stream();
-	m_connections.push_back(uartconn);
-	m_connected.emit(uartconn.m_address);
+	start = std::chrono::steady_clock::now();
+	ret = m_transport->write(buf, len);
+	m_write_time->observe_since(start);
 
-	/* Disable local echo */
-	uartconn.m_ostream->write("\xFF\xFB\x01\xFF\xFB\x03");
-	uartconn.m_ostream->write(fmt::format("==> Connected to {} {} <==\r\n",
-	    m_device.description, m_device.serial));
+	if (ret != static_cast<int>(len))
+		m_write_errors->add();
 
-	for (;;) {
-		try {
-			ret = istream->read(buffer, sizeof(buffer),
-			    uartconn.m_cancel);
-			if (ret <= 0)
-				break;
-		} catch (const Gio::Error &err) {
-			Logger::warning("UART: I/O error: {}", err.what());
-			break;
-		}
-
-		Logger::debug("UART: read {} bytes from socket", ret);
-
-		written = m_context.write(buffer, ret);
-		if (written != ret) {
-			Logger::error("UART: read {} bytes, written {} bytes",
-			    ret, written);
-		}
-	}
-	
-	Logger::info("UART: connection from {} ended",
-	    uartconn.m_address->to_string());
+	if (ret > 0)
+		m_tx_bytes->add(ret);
 
-	remove_connection(uartconn);
-	return (false);
+	return (ret);
 }
 
-void
-Uart::remove_connection(const UartConnection &conn)
+/*
+ * With hardware handshake the chip itself stops sending while CTS (DSR)
+ * is deasserted. Holding writes back until it is asserted again keeps
+ * the blocking USB write from timing out while the target is busy.
+ */
+bool
+Uart::tx_ready() const
 {
-	auto it = std::find(m_connections.begin(),
-	    m_connections.end(), conn);
+	uint8_t status;
 
-	if (it != m_connections.end()) {
-		m_disconnected.emit(conn.m_conn->get_remote_address());
-		m_connections.erase(it);
-	}
+	if (m_options.flow != SIO_RTS_CTS_HS && m_options.flow != SIO_DTR_DSR_HS)
+		return (true);
+
+	if (!m_receiver)
+		return (false);
+
+	status = m_receiver->modem_status();
+	if (m_options.flow == SIO_RTS_CTS_HS)
+		return (status & USBRX_STATUS_CTS);
+
+	return (status & USBRX_STATUS_DSR);
 }
@@ -0,0 +1,401 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdexcept>
+#include <cstring>
+#include <poll.h>
+#include <fmt/format.h>
+#include <log.hh>
+#include <usbrx.hh>
+
+/* Don't warn about FIFO overruns more often than this */
+#define USBRX_WARNING_INTERVAL	std::chrono::seconds(1)
+
+UsbReceiver::UsbReceiver(struct ftdi_context *ctx, ByteRing &ring,
+    size_t depth, size_t chunk, EventLoop *loop):
+	m_ctx(ctx),
+	m_ring(ring),
+	m_depth(std::max<size_t>(depth, 1)),
+	m_loop(loop),
+	m_attached(false),
+	m_running(false),
+	m_inflight(0),
+	m_bytes(0),
+	m_completed(0),
+	m_overruns(0),
+	m_failed(0),
+	m_dropped(0),
+	m_modem_status(0)
+{
+	size_t packet = ctx->max_packet_size;
+
+	/* Transfers must hold whole packets, each with its status bytes */
+	m_chunk = std::max(packet, chunk - chunk % packet);
+}
+
+UsbReceiver::~UsbReceiver()
+{
+	stop();
+}
+
+void
+UsbReceiver::start()
+{
+	struct libusb_transfer *transfer;
+	size_t i;
+	int ret;
+
+	if (m_running)
+		return;
+
+	m_running = true;
+	m_buffers.resize(m_depth);
+
+	for (i = 0; i < m_depth; i++) {
+		transfer = libusb_alloc_transfer(0);
+		if (transfer == nullptr) {
+			stop();
+			throw std::runtime_error(
+			    "Cannot allocate USB transfer");
+		}
+
+		m_buffers[i].resize(m_chunk);
+		libusb_fill_bulk_transfer(transfer, m_ctx->usb_dev,
+		    m_ctx->out_ep, m_buffers[i].data(), m_chunk,
+		    &UsbReceiver::transfer_done, this, 0);
+		m_transfers.push_back(transfer);
+
+		ret = libusb_submit_transfer(transfer);
+		if (ret != LIBUSB_SUCCESS) {
+			stop();
+			throw std::runtime_error(fmt::format(
+			    "Cannot submit USB transfer: {}",
+			    libusb_error_name(ret)));
+		}
+
+		m_inflight++;
+	}
+
+	if (!attach())
+		m_thread = std::thread(&UsbReceiver::event_worker, this);
+
+	Logger::debug("USB RX: {} transfers of {} bytes in flight{}",
+	    m_depth, m_chunk, m_attached ? " on a shared event loop" : "");
+}
+
+void
+UsbReceiver::stop()
+{
+	if (!m_running && m_transfers.empty())
+		return;
+
+	m_running = false;
+
+	/*
+	 * On a shared loop, handle_events() may be running on the loop
+	 * thread right now, and remove() does not wait for it. Cancel,
+	 * unwatch and reap there instead, so that no handler is left
+	 * touching this receiver once stop() returns.
+	 */
+	if (m_attached) {
+		m_loop->invoke([this] {
+			for (auto &i: m_transfers)
+				libusb_cancel_transfer(i);
+
+			detach();
+			event_worker();
+		});
+	} else {
+		for (auto &i: m_transfers)
+			libusb_cancel_transfer(i);
+
+		/* With no thread running, reap the cancelled transfers here */
+		if (m_thread.joinable())
+			m_thread.join();
+		else
+			event_worker();
+	}
+
+	for (auto &i: m_transfers)
+		libusb_free_transfer(i);
+
+	m_transfers.clear();
+	m_buffers.clear();
+
+	Logger::info("USB RX: {} bytes in {} transfers, {} overruns, "
+	    "{} failed transfers, {} bytes dropped", m_bytes, m_completed,
+	    m_overruns, m_failed, m_dropped);
+}
+
+void
+UsbReceiver::set_notify(const std::function<void()> &notify)
+{
+	m_notify = notify;
+}
+
+UsbReceiverStats
+UsbReceiver::stats() const
+{
+	UsbReceiverStats ret;
+
+	ret.bytes = m_bytes;
+	ret.transfers = m_completed;
+	ret.overruns = m_overruns;
+	ret.failed = m_failed;
+	ret.dropped = m_dropped;
+	return (ret);
+}
+
+uint8_t
+UsbReceiver::modem_status() const
+{
+	return (m_modem_status);
+}
+
+void LIBUSB_CALL
+UsbReceiver::transfer_done(struct libusb_transfer *transfer)
+{
+	UsbReceiver *self = static_cast<UsbReceiver *>(transfer->user_data);
+
+	self->completed(transfer);
+}
+
+void
+UsbReceiver::completed(struct libusb_transfer *transfer)
+{
+	size_t len;
+	int ret;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		m_completed++;
+		len = unpack(transfer->buffer, transfer->actual_length);
+		if (m_metrics.read_sizes)
+			m_metrics.read_sizes->observe(len);
+
+		if (len > 0) {
+			m_ring.write(transfer->buffer, len);
+			m_bytes += len;
+
+			if (m_notify)
+				m_notify();
+		}
+		break;
+
+	case LIBUSB_TRANSFER_CANCELLED:
+		m_inflight--;
+		return;
+
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		Logger::error("USB RX: device disconnected");
+		m_running = false;
+		m_inflight--;
+		return;
+
+	default:
+		m_failed++;
+		m_dropped += transfer->actual_length;
+		if (m_metrics.dropped)
+			m_metrics.dropped->add(transfer->actual_length);
+
+		Logger::warning("USB RX: transfer failed with status {}",
+		    transfer->status);
+		break;
+	}
+
+	if (!m_running) {
+		m_inflight--;
+		return;
+	}
+
+	ret = libusb_submit_transfer(transfer);
+	if (ret != LIBUSB_SUCCESS) {
+		Logger::error("USB RX: cannot resubmit transfer: {}",
+		    libusb_error_name(ret));
+		m_inflight--;
+	}
+}
+
+/*
+ * Strips the two status bytes FTDI prepends to every packet, compacting
+ * the payload to the front of the buffer. Returns the payload length.
+ */
+size_t
+UsbReceiver::unpack(uint8_t *buf, size_t len)
+{
+	size_t packet = m_ctx->max_packet_size;
+	size_t offset;
+	size_t chunk;
+	size_t out = 0;
+	bool overrun = false;
+
+	for (offset = 0; offset < len; offset += packet) {
+		chunk = std::min(packet, len - offset);
+		if (chunk < 2)
+			break;
+
+		m_modem_status = buf[offset];
+		if (buf[offset + 1] & USBRX_STATUS_OE) {
+			m_overruns++;
+			overrun = true;
+			if (m_metrics.overruns)
+				m_metrics.overruns->add();
+		}
+
+		std::memmove(buf + out, buf + offset + 2, chunk - 2);
+		out += chunk - 2;
+	}
+
+	if (overrun &&
+	    std::chrono::steady_clock::now() - m_last_warning >
+	    USBRX_WARNING_INTERVAL) {
+		m_last_warning = std::chrono::steady_clock::now();
+		Logger::warning("USB RX: FTDI FIFO overrun, data lost "
+		    "({} overruns so far)", m_overruns);
+	}
+
+	return (out);
+}
+
+/*
+ * Hands the libusb file descriptors to the event loop. Only possible
+ * where libusb needs no timeouts of its own handled (timerfd on Linux).
+ */
+bool
+UsbReceiver::attach()
+{
+	const struct libusb_pollfd **fds;
+
+	if (m_loop == nullptr || !libusb_pollfds_handle_timeouts(m_ctx->usb_ctx))
+		return (false);
+
+	fds = libusb_get_pollfds(m_ctx->usb_ctx);
+	if (fds == nullptr)
+		return (false);
+
+	m_attached = true;
+	libusb_set_pollfd_notifiers(m_ctx->usb_ctx, &UsbReceiver::pollfd_added,
+	    &UsbReceiver::pollfd_removed, this);
+
+	for (size_t i = 0; fds[i] != nullptr; i++)
+		watch(fds[i]->fd, fds[i]->events);
+
+	libusb_free_pollfds(fds);
+	return (true);
+}
+
+/* Only called on the loop thread, see stop() */
+void
+UsbReceiver::detach()
+{
+	const struct libusb_pollfd **fds;
+
+	if (!m_attached)
+		return;
+
+	libusb_set_pollfd_notifiers(m_ctx->usb_ctx, nullptr, nullptr, nullptr);
+
+	fds = libusb_get_pollfds(m_ctx->usb_ctx);
+	if (fds != nullptr) {
+		for (size_t i = 0; fds[i] != nullptr; i++)
+			m_loop->remove(fds[i]->fd);
+
+		libusb_free_pollfds(fds);
+	}
+
+	m_attached = false;
+}
+
+void
+UsbReceiver::watch(int fd, short events)
+{
+	uint32_t mask = 0;
+
+	/* usbfs signals completed transfers as writable */
+	if (events & POLLIN)
+		mask |= EVENT_READ;
+
+	if (events & POLLOUT)
+		mask |= EVENT_WRITE;
+
+	try {
+		m_loop->add(fd, mask, [this](uint32_t) { handle_events(); });
+	} catch (const std::runtime_error &err) {
+		Logger::error("USB RX: {}", err.what());
+	}
+}
+
+void LIBUSB_CALL
+UsbReceiver::pollfd_added(int fd, short events, void *arg)
+{
+	static_cast<UsbReceiver *>(arg)->watch(fd, events);
+}
+
+void LIBUSB_CALL
+UsbReceiver::pollfd_removed(int fd, void *arg)
+{
+	static_cast<UsbReceiver *>(arg)->m_loop->remove(fd);
+}
+
+void
+UsbReceiver::handle_events()
+{
+	struct timeval tv = { 0, 0 };
+	int ret;
+
+	ret = libusb_handle_events_timeout_completed(m_ctx->usb_ctx, &tv,
+	    nullptr);
+	if (ret != LIBUSB_SUCCESS && ret != LIBUSB_ERROR_INTERRUPTED) {
+		Logger::error("USB RX: event handling failed: {}",
+		    libusb_error_name(ret));
+	}
+}
+
+void
+UsbReceiver::event_worker()
+{
+	struct timeval tv;
+	int ret;
+
+	Logger::debug("USB RX: event thread started");
+
+	while (m_inflight > 0) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+
+		ret = libusb_handle_events_timeout_completed(m_ctx->usb_ctx,
+		    &tv, nullptr);
+		if (ret != LIBUSB_SUCCESS && ret != LIBUSB_ERROR_INTERRUPTED) {
+			Logger::error("USB RX: event handling failed: {}",
+			    libusb_error_name(ret));
+			break;
+		}
+	}
+
+	Logger::debug("USB RX: event thread stopped");
+}